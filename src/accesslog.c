@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "headers.h"
+#include "logging.h"
+
+enum accessLogFormat strtoaccesslogformat(const char* string) {
+	if (strcasecmp(string, "combined") == 0) {
+		return ACCESS_LOG_COMBINED;
+	} else if (strcasecmp(string, "clf") == 0) {
+		return ACCESS_LOG_CLF;
+	} else if (strcasecmp(string, "json") == 0) {
+		return ACCESS_LOG_JSON;
+	} else if (strcasecmp(string, "timing") == 0) {
+		return ACCESS_LOG_TIMING;
+	} else {
+		return ACCESS_LOG_UNKNOWN;
+	}
+}
+
+struct line {
+	char* buffer;
+	size_t size;
+	size_t length;
+};
+
+static void append(struct line* line, const char* format, ...) {
+	if (line->length >= line->size - 1)
+		return;
+
+	va_list argptr;
+	va_start(argptr, format);
+	int tmp = vsnprintf(line->buffer + line->length, line->size - line->length, format, argptr);
+	va_end(argptr);
+
+	if (tmp < 0)
+		return;
+
+	line->length += tmp;
+	if (line->length >= line->size)
+		line->length = line->size - 1;
+}
+
+static void appendChar(struct line* line, char c) {
+	if (line->length >= line->size - 1)
+		return;
+
+	line->buffer[line->length++] = c;
+	line->buffer[line->length] = '\0';
+}
+
+/*
+ * Client supplied values (uri, user agent, ...) must not be able to break the log format.
+ * JSON gets standard string escapes; CLF gets apache-style \xHH escapes.
+ */
+static void appendEscaped(struct line* line, const char* string, bool json) {
+	if (string == NULL)
+		string = "";
+
+	for (; *string != '\0'; string++) {
+		unsigned char c = *string;
+
+		if (c == '"' || c == '\\') {
+			appendChar(line, '\\');
+			appendChar(line, c);
+		} else if (c < 0x20 || c == 0x7f) {
+			if (json)
+				append(line, "\\u%04x", c);
+			else
+				append(line, "\\x%02x", c);
+		} else {
+			appendChar(line, c);
+		}
+	}
+}
+
+static void appendDuration(struct line* line, const char* key, long duration, bool json) {
+	if (json) {
+		append(line, ",\"%s\":%ld", key, duration);
+	} else {
+		append(line, " %s=%ld", key, duration);
+	}
+}
+
+int accesslog_format(enum accessLogFormat format, struct accessLogEntry* entry, char* buffer, size_t size) {
+	struct line line = {
+		.buffer = buffer,
+		.size = size,
+		.length = 0
+	};
+	buffer[0] = '\0';
+
+	struct tm tm;
+	localtime_r(&(entry->time), &tm);
+	char timeString[64];
+
+	if (format == ACCESS_LOG_JSON) {
+		strftime(timeString, sizeof(timeString), "%Y-%m-%dT%H:%M:%S%z", &tm);
+
+		append(&line, "{\"time\":\"%s\",\"remote_addr\":\"", timeString);
+		appendEscaped(&line, entry->remoteAddr, true);
+		append(&line, "\",\"method\":\"%s\",\"uri\":\"", methodString(entry->metaData));
+		appendEscaped(&line, entry->metaData.uri, true);
+		append(&line, "\",\"protocol\":\"%s\",\"status\":%d", protocolString(entry->metaData), entry->statusCode);
+		append(&line, ",\"bytes_sent\":%zu,\"body_bytes\":%zu", entry->headerBytes + entry->bodyBytes, entry->bodyBytes);
+		append(&line, ",\"referer\":\"");
+		appendEscaped(&line, entry->referer, true);
+		append(&line, "\",\"user_agent\":\"");
+		appendEscaped(&line, entry->userAgent, true);
+		append(&line, "\",\"tls\":%s,\"keepalive_reuse\":%d", entry->tls ? "true" : "false", entry->keepAliveReuse);
+		appendDuration(&line, "header_parse_us", entry->headerParseTime, true);
+		appendDuration(&line, "ttfb_us", entry->timeToFirstByte, true);
+		appendDuration(&line, "handler_us", entry->handlerTime, true);
+		appendDuration(&line, "total_us", entry->totalTime, true);
+		appendChar(&line, '}');
+
+		return line.length;
+	}
+
+	strftime(timeString, sizeof(timeString), "%d/%b/%Y:%H:%M:%S %z", &tm);
+
+	append(&line, "%s - - [%s] \"%s ", entry->remoteAddr, timeString, methodString(entry->metaData));
+	appendEscaped(&line, entry->metaData.uri, false);
+	append(&line, " %s\" %d ", protocolString(entry->metaData), entry->statusCode);
+	if (entry->bodyBytes == 0) {
+		appendChar(&line, '-');
+	} else {
+		append(&line, "%zu", entry->bodyBytes);
+	}
+
+	if (format == ACCESS_LOG_CLF)
+		return line.length;
+
+	append(&line, " \"");
+	appendEscaped(&line, entry->referer == NULL ? "-" : entry->referer, false);
+	append(&line, "\" \"");
+	appendEscaped(&line, entry->userAgent == NULL ? "-" : entry->userAgent, false);
+	appendChar(&line, '"');
+
+	if (format == ACCESS_LOG_COMBINED)
+		return line.length;
+
+	append(&line, " sent=%zu tls=%d reuse=%d", entry->headerBytes + entry->bodyBytes, entry->tls ? 1 : 0, entry->keepAliveReuse);
+	appendDuration(&line, "parse_us", entry->headerParseTime, false);
+	appendDuration(&line, "ttfb_us", entry->timeToFirstByte, false);
+	appendDuration(&line, "handler_us", entry->handlerTime, false);
+	appendDuration(&line, "total_us", entry->totalTime, false);
+
+	return line.length;
+}
+
+void accesslog_write(enum accessLogFormat format, struct accessLogEntry* entry) {
+	if (!isLogging(HTTP_ACCESS))
+		return;
+
+	char buffer[ACCESS_LOG_LINE_LENGTH];
+	accesslog_format(format, entry, buffer, ACCESS_LOG_LINE_LENGTH);
+
+	logging(HTTP_ACCESS, "%s", buffer);
+}
@@ -0,0 +1,46 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "misc.h"
+
+enum accessLogFormat {
+	ACCESS_LOG_UNKNOWN = -1,
+	ACCESS_LOG_COMBINED = 0,
+	ACCESS_LOG_CLF = 1,
+	ACCESS_LOG_JSON = 2,
+	// combined with the timing breakdown appended
+	ACCESS_LOG_TIMING = 3
+};
+
+#define DEFAULT_ACCESS_LOG_FORMAT (ACCESS_LOG_COMBINED)
+
+#define ACCESS_LOG_LINE_LENGTH (4096)
+
+struct accessLogEntry {
+	struct metaData metaData;
+	const char* remoteAddr;
+	const char* referer;
+	const char* userAgent;
+	int statusCode;
+	size_t headerBytes;
+	size_t bodyBytes;
+	// all durations in microseconds; -1 if unknown
+	long headerParseTime;
+	long timeToFirstByte;
+	long handlerTime;
+	long totalTime;
+	bool tls;
+	int keepAliveReuse;
+	time_t time;
+};
+
+enum accessLogFormat strtoaccesslogformat(const char* string);
+
+int accesslog_format(enum accessLogFormat format, struct accessLogEntry* entry, char* buffer, size_t size);
+void accesslog_write(enum accessLogFormat format, struct accessLogEntry* entry);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+#include "admission.h"
+#include "logging.h"
+
+struct peerCount {
+	char addr[INET6_ADDRSTRLEN + 1];
+	int count;
+	struct peerCount* next;
+};
+
+static struct peerCount* buckets[ADMISSION_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct peerCount** getBucket(const char* addr) {
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (const char* c = addr; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+
+	return &(buckets[hash % ADMISSION_BUCKETS]);
+}
+
+// has to be called with the lock held
+static struct peerCount** findPeer(const char* addr) {
+	struct peerCount** pointer = getBucket(addr);
+	while (*pointer != NULL && strcmp((*pointer)->addr, addr) != 0)
+		pointer = &((*pointer)->next);
+	return pointer;
+}
+
+bool admission_addPeer(const char* addr, int max) {
+	bool admitted = true;
+
+	pthread_mutex_lock(&lock);
+	struct peerCount** pointer = findPeer(addr);
+	if (*pointer == NULL) {
+		struct peerCount* peer = malloc(sizeof(struct peerCount));
+		if (peer == NULL) {
+			// don't turn clients away because we are short on memory
+			error("admission: couldn't allocate peer: %s", strerror(errno));
+		} else {
+			strncpy(peer->addr, addr, INET6_ADDRSTRLEN);
+			peer->addr[INET6_ADDRSTRLEN] = '\0';
+			peer->count = 1;
+			peer->next = NULL;
+			*pointer = peer;
+		}
+	} else if (max > 0 && (*pointer)->count >= max) {
+		admitted = false;
+	} else {
+		(*pointer)->count++;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return admitted;
+}
+
+void admission_removePeer(const char* addr) {
+	pthread_mutex_lock(&lock);
+	struct peerCount** pointer = findPeer(addr);
+	struct peerCount* peer = *pointer;
+	if (peer != NULL && --(peer->count) <= 0) {
+		*pointer = peer->next;
+		free(peer);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int admission_peerConnections(const char* addr) {
+	pthread_mutex_lock(&lock);
+	struct peerCount* peer = *findPeer(addr);
+	int count = peer != NULL ? peer->count : 0;
+	pthread_mutex_unlock(&lock);
+
+	return count;
+}
+
+void codel_init(struct codel* codel, long targetMs, long intervalMs) {
+	*codel = (struct codel) {
+		.target = targetMs * 1000,
+		.interval = intervalMs * 1000,
+		.dropping = false,
+		.firstAbove = 0,
+		.dropNext = 0,
+		.count = 0,
+		.lastCount = 0
+	};
+}
+
+static long squareRoot(long value) {
+	long root = value;
+	long next = (root + 1) / 2;
+	while (next < root) {
+		root = next;
+		next = (root + value / root) / 2;
+	}
+	return root;
+}
+
+// the next shed is interval / sqrt(count) after the last one; the root is scaled by 1024 to keep the fraction
+static long controlLaw(struct codel* codel, long time) {
+	return time + codel->interval * 1024 / squareRoot((long) codel->count << 20);
+}
+
+bool codel_shouldShed(struct codel* codel, long sojourn, long now) {
+	bool aboveTarget = false;
+	if (sojourn < codel->target) {
+		codel->firstAbove = 0;
+	} else if (codel->firstAbove == 0) {
+		codel->firstAbove = now + codel->interval;
+	} else if (now >= codel->firstAbove) {
+		aboveTarget = true;
+	}
+
+	if (codel->dropping) {
+		if (!aboveTarget) {
+			codel->dropping = false;
+			return false;
+		}
+		if (now < codel->dropNext)
+			return false;
+
+		codel->count++;
+		codel->dropNext = controlLaw(codel, codel->dropNext);
+		return true;
+	}
+
+	if (!aboveTarget)
+		return false;
+
+	codel->dropping = true;
+	// if the last episode was recent its rate is a better start than 1
+	int delta = codel->count - codel->lastCount;
+	if (delta > 1 && now - codel->dropNext < 16 * codel->interval)
+		codel->count = delta;
+	else
+		codel->count = 1;
+	codel->lastCount = codel->count;
+	codel->dropNext = controlLaw(codel, now);
+
+	return true;
+}
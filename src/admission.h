@@ -0,0 +1,47 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+
+/*
+ * Admission control: connections per peer address and a CoDel controller
+ * that decides which requests waiting for a handler are shed.
+ */
+
+#define ADMISSION_BUCKETS (1024)
+
+// ms a request may wait for a handler before CoDel starts shedding
+#define DEFAULT_SHED_TARGET (50)
+// ms the wait has to stay above the target
+#define DEFAULT_SHED_INTERVAL (500)
+
+/*
+ * Counts a connection of addr unless it already has max connections (0: no limit).
+ * Returns true if it was counted; every counted connection has to be removed again.
+ */
+bool admission_addPeer(const char* addr, int max);
+void admission_removePeer(const char* addr);
+int admission_peerConnections(const char* addr);
+
+/*
+ * CoDel (RFC 8289) applied to the handler queue: once every request leaving the queue
+ * has waited longer than target for at least interval, requests are shed at a rate that
+ * grows with the square root of the number shed until the wait drops below target again.
+ * Times are in µs.
+ */
+struct codel {
+	long target;
+	long interval;
+	bool dropping;
+	// when the wait has been above target for an interval; 0 if it isn't above target
+	long firstAbove;
+	long dropNext;
+	int count;
+	int lastCount;
+};
+
+void codel_init(struct codel* codel, long targetMs, long intervalMs);
+// for every request that leaves the queue; returns true if it should be shed
+bool codel_shouldShed(struct codel* codel, long sojourn, long now);
+
+#endif
@@ -3,8 +3,16 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 
 #include "cgi.h"
 #include "misc.h"
@@ -13,244 +21,651 @@
 #include "status.h"
 #include "logging.h"
 #include "headers.h"
+#include "networking.h"
 #define EXIT_EXEC_FAILED (255)
 
-static inline void setEnvStatic(const char* envname, const char* value) {
-	if (setenv(envname, value, true) < 0)
-		exit(EXIT_EXEC_FAILED);
-}
+extern char** environ;
 
-static inline void setEnvFromHeader(struct headers* headers, const char* envname, const char* headerKey) {
+static inline int setEnvFromHeader(struct headers* env, struct headers* headers, const char* envname, const char* headerKey) {
 	const char* tmp = headers_get(headers, headerKey);
-	setEnvStatic(envname, tmp == NULL ? "" : tmp);
+	return headers_mod(env, envname, tmp == NULL ? "" : tmp);
 }
 
-void cgiHandler(struct request request, struct response response) {
-	struct cgiSettings* settings = (struct cgiSettings*) request.userData.ptr;
-	const char* documentRoot = settings->documentRoot;
+/*
+ * Collects the CGI/1.1 meta-variables for a request as key-value pairs.
+ * Shared by the CGI and the FastCGI handler.
+ */
+int cgi_buildEnvironment(struct headers* env, struct request request, const char* documentRoot) {
+	struct headers* headers = request.headers;
+
+	int tmp = 0;
+	#define CHECKED(call) if ((tmp = (call)) < 0) return tmp;
+
+	CHECKED(headers_mod(env, "GATEWAY_INTERFACE", "CGI/1.1"));
+	CHECKED(headers_mod(env, "DOCUMENT_ROOT", documentRoot));
+	CHECKED(headers_mod(env, "HTTPS", request.bind.ssl ? "on" : "off"));
+	CHECKED(headers_mod(env, "QUERY_STRING", request.metaData.queryString));
+	CHECKED(headers_mod(env, "REQUEST_METHOD", methodString(request.metaData)));
+	CHECKED(headers_mod(env, "REQUEST_URI", request.metaData.uri));
+	CHECKED(headers_mod(env, "REMOTE_ADDR", request.peer.addr));
+	CHECKED(headers_mod(env, "REMOTE_HOST", request.peer.name == NULL ? "" : request.peer.name));
+	CHECKED(headers_mod(env, "REMOTE_PORT", request.peer.portStr));
+	CHECKED(headers_mod(env, "SCRIPT_NAME", request.metaData.path));
+	CHECKED(headers_mod(env, "SERVER_PROTOCOL", protocolString(request.metaData)));
+
+	CHECKED(headers_mod(env, "SERVER_NAME", "")); // TODO maybe bind addr?
+	CHECKED(headers_mod(env, "SERVER_ADMIN", "")); // TODO
+	CHECKED(headers_mod(env, "SERVER_ADDR", "")); // TODO
+	CHECKED(headers_mod(env, "SERVER_PORT", "")); // TODO
+	CHECKED(headers_mod(env, "SERVER_SIGNATURE", "")); // TODO
+	CHECKED(headers_mod(env, "SERVER_SOFTWARE", "")); // TODO
+	
+	CHECKED(headers_mod(env, "REDIRECT_REMOTE_USER", "")); // TODO not implemented
+	CHECKED(headers_mod(env, "REMOTE_USER", "")); // TODO not implemented
+
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_ACCEPT_CHARSET", "Accept-Charset"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_ACCEPT_ENCODING", "Accept-Encoding"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_ACCEPT_LANGUAGE", "Accept-Language"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_CONNECTION", "Accept-Connection"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_ACCEPT", "Accept"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_HOST", "Host"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_USER_AGENT", "User-Agent"));
+	CHECKED(setEnvFromHeader(env, headers, "HTTP_COOKIE", "Cookie"));
+	CHECKED(setEnvFromHeader(env, headers, "CONTENT_TYPE", "Content-Type"));
+	CHECKED(setEnvFromHeader(env, headers, "CONTENT_LENGTH", "Content-Length"));
+
+	#undef CHECKED
+
+	return 0;
+}
 
-	char* path = normalizePath(request, response, documentRoot);
-	if (path == NULL)
-		return;
+/*
+ * Turns the environment into an envp array for exec.
+ * Pointers and strings share one allocation; free the result with free().
+ * Variables of the server environment are passed on unless overridden.
+ */
+char** cgi_buildEnvp(struct headers* env) {
+	size_t number = env->number;
+	size_t size = 0;
+
+	for (int i = 0; i < env->number; i++) {
+		size += strlen(env->headers[i].key) + 1 + strlen(env->headers[i].value) + 1;
+	}
+	for (char** var = environ; *var != NULL; var++) {
+		number++;
+		size += strlen(*var) + 1;
+	}
 
+	char** envp = malloc((number + 1) * sizeof(char*) + size);
+	if (envp == NULL)
+		return NULL;
+
+	char* arena = (char*) (envp + number + 1);
+	size_t index = 0;
+
+	for (int i = 0; i < env->number; i++) {
+		envp[index++] = arena;
+		arena = stpcpy(arena, env->headers[i].key);
+		*(arena++) = '=';
+		arena = stpcpy(arena, env->headers[i].value) + 1;
+	}
+
+	for (char** var = environ; *var != NULL; var++) {
+		const char* equals = strchr(*var, '=');
+		if (equals == NULL)
+			continue;
+
+		bool overridden = false;
+		for (int i = 0; i < env->number; i++) {
+			const char* key = env->headers[i].key;
+			if (strlen(key) == (size_t) (equals - *var) && strncmp(key, *var, equals - *var) == 0) {
+				overridden = true;
+				break;
+			}
+		}
+		if (overridden)
+			continue;
+
+		envp[index++] = arena;
+		arena = stpcpy(arena, *var) + 1;
+	}
+
+	envp[index] = NULL;
+
+	return envp;
+}
+
+/*
+ * Starts a script without fork(); posix_spawn doesn't copy the page tables of the server.
+ * stdinFd and stdoutFd become fd 0 and 1 of the child (-1 to inherit).
+ * Everything above stderr is closed. If envp is NULL the server environment is used.
+ * Returns 0 or an error number.
+ */
+int cgi_spawn(const char* path, int stdinFd, int stdoutFd, char** envp, pid_t* pid) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+
+	int tmp = posix_spawn_file_actions_init(&actions);
+	if (tmp != 0)
+		return tmp;
+
+	tmp = posix_spawnattr_init(&attributes);
+	if (tmp != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return tmp;
+	}
+
+	if (stdinFd >= 0)
+		tmp = posix_spawn_file_actions_adddup2(&actions, stdinFd, 0);
+	if (tmp == 0 && stdoutFd >= 0)
+		tmp = posix_spawn_file_actions_adddup2(&actions, stdoutFd, 1);
+	// don't leak client connections into the script
+	if (tmp == 0)
+		tmp = posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+
+	// server threads block some signals; the script gets a clean mask
+	sigset_t mask;
+	sigemptyset(&mask);
+	if (tmp == 0)
+		tmp = posix_spawnattr_setsigmask(&attributes, &mask);
+	if (tmp == 0)
+		tmp = posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+	char* argv[] = { (char*) path, NULL };
+	if (tmp == 0)
+		tmp = posix_spawn(pid, path, &actions, &attributes, argv, envp != NULL ? envp : environ);
+
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+
+	return tmp;
+}
+
+/*
+ * Parses the complete header lines in the buffer; offset is where the next line starts.
+ * Returns 1 once the header block is complete (the body starts at offset),
+ * 0 if more has to be read and -1 if the header block is malformed.
+ */
+static int parseHeaders(struct headers* headers, struct cgiBuffer* buffer) {
+	char* newline;
+	while((newline = memchr(buffer->data + buffer->offset, '\n', buffer->length - buffer->offset)) != NULL) {
+		size_t lineStart = buffer->offset;
+		size_t lineEnd = newline - buffer->data;
+		buffer->offset = lineEnd + 1;
+
+		if (lineEnd > lineStart && buffer->data[lineEnd - 1] == '\r')
+			lineEnd--;
+
+		if (lineEnd == lineStart)
+			return 1;
+
+		buffer->data[lineEnd] = '\0';
+
+		if (headers_parse(headers, buffer->data + lineStart, lineEnd - lineStart) < 0) {
+			debug("cgi: error parsing header: '%s'", buffer->data + lineStart);
+			return -1;
+		}
+	}
+
+	// keep the incomplete line; the headers are copied already
+	memmove(buffer->data, buffer->data + buffer->offset, buffer->length - buffer->offset);
+	buffer->length -= buffer->offset;
+	buffer->offset = 0;
+
+	if (buffer->length == CGI_BUFFER_SIZE) {
+		debug("cgi: header line too long");
+		return -1;
+	}
+
+	return 0;
+}
+
+// removes the Status header; statusCode is 200 without one. Returns -1 if it is malformed.
+static int takeStatus(struct headers* headers, int* statusCode) {
+	*statusCode = 200;
+
+	const char* statusLine = headers_get(headers, "Status");
+	if (statusLine == NULL)
+		return 0;
+
+	char* endptr;
+	*statusCode = strtol(statusLine, &endptr, 10);
+
+	if ((*statusCode < 100) || (*statusCode > 600)) {
+		error("cgi: malformed status code: %s", statusLine);
+		return -1;
+	}
+
+	headers_remove(headers, "Status");
+	return 0;
+}
+
+/*
+ * Reads the header block of a CGI response from fd in blocks.
+ * The Status header is removed and returned as statusCode.
+ * Body bytes that were read along with the headers stay in the buffer (offset to length).
+ * Returns 0 if the header block was read completely, -1 otherwise.
+ */
+int cgi_readHeaders(int fd, struct headers* headers, int* statusCode, struct cgiBuffer* buffer) {
+	buffer->length = 0;
+	buffer->offset = 0;
+
+	int result;
+	while((result = parseHeaders(headers, buffer)) == 0) {
+		ssize_t tmp = read(fd, buffer->data + buffer->length, CGI_BUFFER_SIZE - buffer->length);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp <= 0)
+			break;
+
+		buffer->length += tmp;
+	}
+
+	if (result < 0) {
+		error("cgi: response malformed");
+	}
+
+	if (takeStatus(headers, statusCode) < 0)
+		return -1;
+
+	return result == 1 ? 0 : -1;
+}
+
+/*
+ * Writes what is left in the buffer and relays the rest of the body
+ * on the calling thread.
+ */
+size_t cgi_forwardBody(struct cgiBuffer* buffer, int readFd, int writeFd) {
+	size_t total = buffer->length - buffer->offset;
+
+	// writeFd might be the socket; it is non-blocking
+	if (writeAll(writeFd, buffer->data + buffer->offset, total, networking_connectionTimeout()) < 0) {
+		debug("cgi: couldn't write body: %s", strerror(errno));
+		return 0;
+	}
+	buffer->offset = buffer->length;
+
+	return total + fileCopy(readFd, writeFd);
+}
+
+// 0 if path is a script that can be run, the status to answer with otherwise
+static int checkScript(const char* path) {
 	if (access(path, F_OK | X_OK) < 0) {
-		free(path);
-		
 		switch(errno) {
 			case EACCES:
 				warn("cgi: file is not executable");
-				status(request, response, 403);
-				return;
+				return 403;
 			default:
 				// this should not happen
 				error("cgi: Couldn't access file: %s", strerror(errno));
-				status(request, response, 500);
-				return;
+				return 500;
 		}
 	}
 
 	struct stat statObj;
 	if (stat(path, &statObj) < 0) {
-		free(path);
-
 		error("cgi: Couldn't stat file: %s", strerror(errno));
-		status(request, response, 500);		
-		return;
+		return 500;
 	}
 
 	if (!S_ISREG(statObj.st_mode)) {
-		free(path);
-		
 		error("cgi: Not a regular file");
-		status(request, response, 403);
-		return;
+		return 403;
 	}
 
+	return 0;
+}
 
-	int pipefd[2];
+/*
+ * A running script. Its output is read while the request body is written,
+ * so a script that answers before it read everything can't block on a full pipe.
+ */
+struct script {
+	// our ends of the pipes; input is -1 once it is closed
+	int input;
+	int output;
+	// both pipes; the coroutine waits for one fd
+	int epollfd;
+	// what is left of the last piece of the request body
+	char body[CGI_BUFFER_SIZE];
+	size_t bodyOffset;
+	size_t bodyLength;
+	struct cgiBuffer buffer;
+};
+
+static void closeInput(struct script* script) {
+	epoll_ctl(script->epollfd, EPOLL_CTL_DEL, script->input, NULL);
+	close(script->input);
+	script->input = -1;
+}
 
-	if (pipe(&(pipefd[0])) < 0) {
-		error("cgi: failed to create pipe: %s", strerror(errno));
-		status(request, response, 500);		
+/*
+ * Writes the request body until the pipe is full. Stdin is closed at the end of the body
+ * or once the script closed its end. Returns -1 if the client is gone.
+ */
+static int feedInput(struct script* script, struct request* request, struct coroutineResponse response) {
+	while (script->input >= 0) {
+		if (script->bodyOffset == script->bodyLength) {
+			ssize_t length = response.read(script->body, CGI_BUFFER_SIZE, request);
+			if (length < 0)
+				return -1;
+			if (length == 0) {
+				closeInput(script);
+				break;
+			}
+			script->bodyOffset = 0;
+			script->bodyLength = length;
+		}
 
-		free(path);
-		return;
+		ssize_t tmp = write(script->input, script->body + script->bodyOffset, script->bodyLength - script->bodyOffset);
+		if (tmp >= 0) {
+			script->bodyOffset += tmp;
+		} else if (errno == EAGAIN) {
+			break;
+		} else if (errno == EPIPE) {
+			debug("cgi: script doesn't read the request body");
+			closeInput(script);
+		} else if (errno != EINTR) {
+			error("cgi: couldn't write request body: %s", strerror(errno));
+			closeInput(script);
+		}
 	}
 
-	pid_t pid = fork();
-	if (pid < 0) {
-		error("cgi: failed to fork: %s", strerror(errno));
-		status(request, response, 500);
-	} else if (pid == 0) {
-		// child
-		// logging is thread-only
-		// so no logging from here on out.
-			
-		close(pipefd[0]);
-
-		if (dup2(request.fd, 0) < 0) {
-			exit(EXIT_EXEC_FAILED);
+	return 0;
+}
+
+/*
+ * Feeds the request body to the script and sends its response. The rest of the output
+ * is relayed once the body is written. Returns -1 if the script has to be stopped.
+ */
+static int runScript(struct script* script, struct request* request, struct coroutineResponse response) {
+	struct cgiBuffer* buffer = &(script->buffer);
+	buffer->length = 0;
+	buffer->offset = 0;
+
+	struct headers headers = headers_create();
+	bool headerSent = false;
+	int result = 0;
+
+	while (true) {
+		if (feedInput(script, request, response) < 0) {
+			result = -1;
+			break;
 		}
-		if (dup2(pipefd[1], 1) < 0) {
-			exit(EXIT_EXEC_FAILED);
+		if (headerSent && script->input < 0) {
+			if (response.relay(script->output, request) < 0)
+				result = -1;
+			break;
 		}
 
-		struct headers* headers = request.headers;
-
-		setEnvStatic("GATEWAY_INTERFACE", "CGI/1.1");
-		setEnvStatic("DOCUMENT_ROOT", documentRoot);
-		setEnvStatic("HTTPS", request.bind.ssl ? "on" : "off");
-		setEnvStatic("QUERY_STRING", request.metaData.queryString);
-		setEnvStatic("REQUEST_METHOD", methodString(request.metaData));
-		setEnvStatic("REQUEST_URI", request.metaData.uri);
-		setEnvStatic("REMOTE_ADDR", request.peer.addr);
-		setEnvStatic("REMOTE_HOST", request.peer.name);
-		setEnvStatic("REMOTE_PORT", request.peer.portStr);
-		setEnvStatic("SCRIPT_NAME", request.metaData.path);
-		setEnvStatic("SERVER_PROTOCOL", protocolString(request.metaData));
-
-		setEnvStatic("SERVER_NAME", ""); // TODO maybe bind addr?
-		setEnvStatic("SERVER_ADMIN", ""); // TODO
-		setEnvStatic("SERVER_ADDR", ""); // TODO
-		setEnvStatic("SERVER_PORT", ""); // TODO
-		setEnvStatic("SERVER_SIGNATURE", ""); // TODO
-		setEnvStatic("SERVER_SOFTWARE", ""); // TODO
-		
-		setEnvStatic("REDIRECT_REMOTE_USER", ""); // TODO not implemented
-		setEnvStatic("REMOTE_USER", ""); // TODO not implemented
-
-		setEnvFromHeader(headers, "HTTP_ACCEPT_CHARSET", "Accept-Charset");
-		setEnvFromHeader(headers, "HTTP_ACCEPT_ENCODING", "Accept-Encoding");
-		setEnvFromHeader(headers, "HTTP_ACCEPT_LANGUAGE", "Accept-Language");
-		setEnvFromHeader(headers, "HTTP_CONNECTION", "Accept-Connection");
-		setEnvFromHeader(headers, "HTTP_ACCEPT", "Accept");
-		setEnvFromHeader(headers, "HTTP_HOST", "Host");
-		setEnvFromHeader(headers, "HTTP_USER_AGENT", "User-Agent");
-		setEnvFromHeader(headers, "HTTP_COOKIE", "Cookie");
-		setEnvFromHeader(headers, "CONTENT_TYPE", "Content-Type");
-		setEnvFromHeader(headers, "CONTENT_LENGTH", "Content-Length");
-		
-		execl(path, path, NULL);
-
-		exit(EXIT_EXEC_FAILED);
-	} else {
-		// this is the parent, but the child can't talk for itself
-		info("cgi: child started successfully");
-
-		close(pipefd[1]);
-		
-		#define LOCAL_BUFFER_LENGTH (512)
-
-		char buffer[LOCAL_BUFFER_LENGTH];
-		int bufferIndex = 0;
-
-		bool wasLineEnd = false;
-		bool finished = false;
-
-		struct headers headers = headers_create();
-
-		char c;
-		while((read(pipefd[0], &c, 1)) > 0) {
-			bool malformed = false;
-
-			if (bufferIndex >= LOCAL_BUFFER_LENGTH - 1)
-				malformed = true;
-			else if (c == '\r')
-				continue;
-			else if (c == '\n') {
-				if (wasLineEnd) {
-					finished = true;
-					break;
-				}
-
-				buffer[bufferIndex] = '\0';
-
-				int tmp = headers_parse(&headers, &(buffer[0]), bufferIndex);
-				if (tmp < 0) {
-					debug("cgi: error parsing header: '%s'", buffer);
-					malformed = true;
-				}
-
-				bufferIndex = 0;
-
-				wasLineEnd = true;
-			} else {
-				wasLineEnd = false;
-
-				buffer[bufferIndex++] = c;
+		// the body goes out as it comes; the header is collected first
+		char* data = headerSent ? buffer->data : buffer->data + buffer->length;
+		size_t length = headerSent ? CGI_BUFFER_SIZE : CGI_BUFFER_SIZE - buffer->length;
+
+		ssize_t tmp = read(script->output, data, length);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0 && errno == EAGAIN) {
+			// if the body isn't written yet the script might wait for it
+			if (response.wait(script->input >= 0 ? script->epollfd : script->output, POLLIN, request) < 0) {
+				result = -1;
+				break;
 			}
+			continue;
+		}
+		if (tmp < 0)
+			debug("cgi: couldn't read output: %s", strerror(errno));
+		if (tmp <= 0) {
+			if (!headerSent) {
+				error("cgi: error while reading header");
+				status_send(request, response.sendResponse, 500);
+				result = -1;
+			}
+			break;
+		}
 
-			if (malformed) {
-				error("cgi: response malformed");
-
-				finished = false;
-				break; 
+		if (headerSent) {
+			struct iovec body = {
+				.iov_base = data,
+				.iov_len = tmp
+			};
+			if (response.write(&body, 1, request) < 0) {
+				result = -1;
+				break;
 			}
+			continue;
 		}
 
-		int statusCode = 200;
+		buffer->length += tmp;
 
-		const char* statusLine = headers_get(&headers, "Status");
-		if (statusLine != NULL) {
-			char* endptr;
+		int parsed = parseHeaders(&headers, buffer);
+		if (parsed == 0)
+			continue;
 
-			statusCode = strtol(statusLine, &endptr, 10);
+		int statusCode;
+		if (takeStatus(&headers, &statusCode) < 0 || parsed < 0) {
+			error("cgi: response malformed");
+			status_send(request, response.sendResponse, 500);
+			result = -1;
+			break;
+		}
 
-			if ((statusCode < 100) || (statusCode > 600)) {
-				error("cgi: malformed status code: %s", statusLine);
-				finished = false;
-			} else {
-				headers_remove(&headers, "Status");
-			}
+		if (response.sendHeader(statusCode, &headers, request) < 0) {
+			result = -1;
+			break;
+		}
+		headerSent = true;
+
+		struct iovec body = {
+			.iov_base = buffer->data + buffer->offset,
+			.iov_len = buffer->length - buffer->offset
+		};
+		if (response.write(&body, 1, request) < 0) {
+			result = -1;
+			break;
 		}
+	}
+
+	headers_free(&headers);
+
+	return result;
+}
 
-		if (!finished) {
-			error("cgi: error while reading header");
+/*
+ * Collects a script that got SIGTERM but didn't exit yet. It runs on its own
+ * thread so that a script ignoring the signal can't block the reactor; after
+ * CGI_KILL_GRACE it is killed.
+ */
+static void* lateReaper(void* data) {
+	pid_t pid = (pid_t) (intptr_t) data;
+
+	int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	struct pollfd pollfd = {
+		.fd = pidfd,
+		.events = POLLIN
+	};
+	if (pidfd < 0 || poll(&pollfd, 1, CGI_KILL_GRACE) <= 0) {
+		debug("cgi: child %d didn't exit after SIGTERM; killing it", pid);
+		kill(pid, SIGKILL);
+	}
+	if (pidfd >= 0)
+		close(pidfd);
 
-			kill(pid, SIGTERM);
-			waitpid(pid, &statusCode, 0);
+	waitpid(pid, NULL, 0);
 
-			close(pipefd[0]);
+	return NULL;
+}
 
-			status(request, response, 500);
-			
-			free(path);
-			headers_free(&headers);
-			
-			return;
+/*
+ * Collects the script. If it is still running it is waited for with a pidfd;
+ * it is terminated if that isn't possible or the client is gone. A terminated
+ * script that didn't exit yet is left to lateReaper.
+ */
+static void reap(pid_t pid, bool aborted, struct request* request, struct coroutineResponse response) {
+	int statusCode;
+
+	pid_t tmp = waitpid(pid, &statusCode, WNOHANG);
+	if (tmp == 0 && !aborted) {
+		int pidfd = syscall(SYS_pidfd_open, pid, 0);
+		if (pidfd < 0 || response.wait(pidfd, POLLIN, request) < 0) {
+			aborted = true;
+		} else {
+			// the pidfd is readable; this doesn't block
+			tmp = waitpid(pid, &statusCode, 0);
 		}
+		if (pidfd >= 0)
+			close(pidfd);
+	}
 
-		int fd = response.sendHeader(statusCode, &headers, &request);
+	if (tmp == 0 && aborted) {
+		kill(pid, SIGTERM);
+		tmp = waitpid(pid, &statusCode, WNOHANG);
+	}
+	if (tmp == 0) {
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+		pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+		pthread_t thread;
+		if (pthread_create(&thread, &attributes, &lateReaper, (void*) (intptr_t) pid) != 0) {
+			error("cgi: couldn't start reaper thread; killing child");
+			kill(pid, SIGKILL);
+			waitpid(pid, NULL, 0);
+		}
+		pthread_attr_destroy(&attributes);
+		return;
+	}
 
-		headers_free(&headers);
+	if (tmp < 0) {
+		error("cgi: error while waiting for child: %s", strerror(errno));
+		return;
+	}
+	if (!WIFEXITED(statusCode)) {
+		debug("cgi: child was terminated");
+		return;
+	}
 
-		free(path);
+	statusCode = WEXITSTATUS(statusCode);
+
+	if (statusCode == EXIT_EXEC_FAILED) {
+		error("cgi: child exit code indicates that exec failed");
+	}
 
-		pthread_t copyThread;
+	debug("cgi: child returned with status %d", statusCode);
+}
 
-		startCopyThread(pipefd[0], fd, true, &copyThread);
+void cgiCoroutine(struct request request, struct coroutineResponse response) {
+	struct cgiSettings* settings = (struct cgiSettings*) request.userData.ptr;
+	const char* documentRoot = settings->documentRoot;
 
-		if (waitpid(pid, &statusCode, 0) < 1) {
-			error("cgi: error while waiting for child: %s", strerror(errno));
-			status(request, response, 500);
+	int code;
+	char* path = resolvePath(&request, documentRoot, &code);
+	if (path == NULL) {
+		sendPathError(&request, response.sendResponse, code);
+		return;
+	}
 
-			pthread_cancel(copyThread);
+	code = checkScript(path);
+	if (code != 0) {
+		free(path);
+		status_send(&request, response.sendResponse, code);
+		return;
+	}
 
-			return;
-		}
+	struct headers env = headers_create();
+	char** envp = NULL;
+	// the stack of a coroutine is small
+	struct script* script = malloc(sizeof(struct script));
+	if (script == NULL || cgi_buildEnvironment(&env, request, documentRoot) < 0 || (envp = cgi_buildEnvp(&env)) == NULL) {
+		error("cgi: couldn't allocate environment: %s", strerror(errno));
+		status_send(&request, response.sendResponse, 500);
 
-		// WIFEXISTED has to be true
-		statusCode = WEXITSTATUS(statusCode);
+		headers_free(&env);
+		free(script);
+		free(path);
+		return;
+	}
+	headers_free(&env);
 
-		if (statusCode == EXIT_EXEC_FAILED) {
-			error("cgi: child exit code indicates that exec failed");
-			status(request, response, 500);
-		}
+	int input[2];
+	int output[2];
+
+	if (pipe2(input, O_CLOEXEC) < 0) {
+		error("cgi: failed to create pipe: %s", strerror(errno));
+		status_send(&request, response.sendResponse, 500);
 
-		debug("cgi: fork returned with status %d", statusCode);
+		free(envp);
+		free(script);
+		free(path);
+		return;
+	}
+	if (pipe2(output, O_CLOEXEC) < 0) {
+		error("cgi: failed to create pipe: %s", strerror(errno));
+		status_send(&request, response.sendResponse, 500);
 
-		pthread_join(copyThread, NULL);
+		close(input[0]);
+		close(input[1]);
+		free(envp);
+		free(script);
+		free(path);
+		return;
+	}
 
+	// only our ends; the script gets blocking ones
+	fcntl(input[1], F_SETFL, O_NONBLOCK);
+	fcntl(output[0], F_SETFL, O_NONBLOCK);
+
+	script->input = input[1];
+	script->output = output[0];
+	script->bodyOffset = 0;
+	script->bodyLength = 0;
+
+	script->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event inputEvent = {
+		.events = EPOLLOUT,
+		.data.fd = input[1]
+	};
+	struct epoll_event outputEvent = {
+		.events = EPOLLIN,
+		.data.fd = output[0]
+	};
+	pid_t pid;
+	int tmp = 0;
+	if (script->epollfd < 0 || epoll_ctl(script->epollfd, EPOLL_CTL_ADD, input[1], &inputEvent) < 0 || epoll_ctl(script->epollfd, EPOLL_CTL_ADD, output[0], &outputEvent) < 0)
+		tmp = errno;
+	if (tmp == 0)
+		tmp = cgi_spawn(path, input[0], output[1], envp, &pid);
+
+	free(envp);
+	close(input[0]);
+	close(output[1]);
+
+	if (tmp != 0) {
+		error("cgi: failed to start %s: %s", path, strerror(tmp));
+		status_send(&request, response.sendResponse, 500);
+
+		if (script->epollfd >= 0)
+			close(script->epollfd);
+		close(input[1]);
+		close(output[0]);
+		free(script);
+		free(path);
 		return;
 	}
+
+	info("cgi: child started successfully");
+	free(path);
+
+	bool aborted = runScript(script, &request, response) < 0;
+
+	if (script->input >= 0)
+		close(script->input);
+	close(script->output);
+	close(script->epollfd);
+	free(script);
+
+	reap(pid, aborted, &request, response);
+}
+
+void cgiHandler(struct request request, struct response response) {
+	runCoroutineHandler(&cgiCoroutine, request, response);
 }
@@ -1,6 +1,8 @@
 #ifndef CGI_H
 #define CGI_H
 
+#include <sys/types.h>
+
 #include "misc.h"
 
 #define CGI_HANDLER_NO (1)
@@ -9,6 +11,26 @@ struct cgiSettings {
 	const char* documentRoot;
 };
 
+// read size for CGI responses; a single header line has to fit
+#define CGI_BUFFER_SIZE (8192)
+
+// in ms; how long a script that got SIGTERM has before it is killed
+#define CGI_KILL_GRACE (1000)
+
+struct cgiBuffer {
+	char data[CGI_BUFFER_SIZE];
+	size_t length;
+	size_t offset;
+};
+
 void cgiHandler(struct request, struct response);
+// cgiHandler as a coroutine (see coroutine_t)
+void cgiCoroutine(struct request, struct coroutineResponse);
+
+int cgi_buildEnvironment(struct headers* env, struct request request, const char* documentRoot);
+char** cgi_buildEnvp(struct headers* env);
+int cgi_spawn(const char* path, int stdinFd, int stdoutFd, char** envp, pid_t* pid);
+int cgi_readHeaders(int fd, struct headers* headers, int* statusCode, struct cgiBuffer* buffer);
+size_t cgi_forwardBody(struct cgiBuffer* buffer, int readFd, int writeFd);
 
 #endif
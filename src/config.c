@@ -11,6 +11,8 @@
 #include "networking.h"
 #include "misc.h"
 #include "status.h"
+#include "resolver.h"
+#include "routing.h"
 
 #ifdef SSL_SUPPORT
 #include "ssl.h"
@@ -52,14 +54,32 @@ struct config* config_parse(FILE* file) {
 	config->nrBinds = 0;
 	config->binds = NULL;
 	config->logging.accessLogfile = NULL;
+	config->logging.accessLogFormat = DEFAULT_ACCESS_LOG_FORMAT;
 	config->logging.serverLogfile = NULL;
 	config->logging.serverVerbosity = CONFIG_DEFAULT_LOGLEVEL;
+	config->metrics.sharedMemory = NULL;
+	config->server.drainTimeout = DEFAULT_DRAIN_TIMEOUT;
+	config->server.maxConnections = DEFAULT_MAX_CONNECTIONS;
+	config->server.maxConnectionsPerPeer = DEFAULT_MAX_CONNECTIONS_PER_PEER;
+	config->server.maxHandlers = DEFAULT_MAX_HANDLERS;
+	config->server.shedTarget = DEFAULT_SHED_TARGET;
+	config->server.shedInterval = DEFAULT_SHED_INTERVAL;
+	config->server.rateLimit = (struct rateLimit) {};
+	config->server.headerTimeout = DEFAULT_HEADER_TIMEOUT;
+	config->server.minReceiveRate = DEFAULT_MIN_RECEIVE_RATE;
+	config->server.maxHeaderSize = DEFAULT_MAX_HEADER_SIZE;
+	config->server.maxHeaders = DEFAULT_MAX_HEADERS;
+	config->server.minSendRate = DEFAULT_MIN_SEND_RATE;
+	config->server.responseBuffer = DEFAULT_RESPONSE_BUFFER;
+	config->server.responseBufferTotal = DEFAULT_RESPONSE_BUFFER_TOTAL;
 
 
 	#define ROOT (0)
 	#define BIND_VALUE (10)
 	#define BIND_BRACKETS_OPEN (11)
 	#define BIND_CONTENT (12)
+	#define BIND_NUMBER_EQUALS (13)
+	#define BIND_NUMBER_VALUE (14)
 	#define SSL_BRACKETS_OPEN (130)
 	#define SSL_CONTENT (131)
 	#define SSL_KEY_EQUALS (132)
@@ -72,6 +92,11 @@ struct config* config_parse(FILE* file) {
 	#define SITE_HOST_VALUE (143)
 	#define SITE_ROOT_EQUALS (144)
 	#define SITE_ROOT_VALUE (145)
+	#define SITE_MIME_EQUALS (146)
+	#define SITE_MIME_VALUE (147)
+	#define SITE_ERROR_STATUS (148)
+	#define SITE_ERROR_EQUALS (149)
+	#define SITE_ERROR_VALUE (150)
 	#define HANDLER_VALUE (1460)
 	#define HANDLER_BRACKETS_OPEN (1461)
 	#define HANDLER_CONTENT (1462)
@@ -79,6 +104,8 @@ struct config* config_parse(FILE* file) {
 	#define TYPE_VALUE (1464)
 	#define INDEX_EQUALS (1465)
 	#define INDEX_VALUE (1466)
+	#define HANDLER_NUMBER_EQUALS (1467)
+	#define HANDLER_NUMBER_VALUE (1468)
 	#define LOGGING_BRACKETS_OPEN (20)
 	#define LOGGING_CONTENT (21)
 	#define LOGGING_ACCESS_FILE_EQUALS (22)
@@ -87,11 +114,22 @@ struct config* config_parse(FILE* file) {
 	#define LOGGING_SERVER_FILE_VALUE (25)
 	#define LOGGING_SERVER_VERBOSITY_EQUALS (26)
 	#define LOGGING_SERVER_VERBOSITY_VALUE (27)
+	#define LOGGING_ACCESS_FORMAT_EQUALS (28)
+	#define LOGGING_ACCESS_FORMAT_VALUE (29)
+	#define METRICS_BRACKETS_OPEN (30)
+	#define METRICS_CONTENT (31)
+	#define METRICS_SHM_EQUALS (32)
+	#define METRICS_SHM_VALUE (33)
+	#define SERVER_BRACKETS_OPEN (40)
+	#define SERVER_CONTENT (41)
+	#define SERVER_NUMBER_EQUALS (42)
+	#define SERVER_NUMBER_VALUE (43)
 	int state = ROOT;
 
 	struct config_bind* currentBind = NULL;
 	struct config_site* currentSite = NULL;
 	struct config_handler* currentHandler = NULL;
+	long* currentNumber = NULL;
 
 	char currentToken[MAX_TOKEN_LENGTH];
 	int currentTokenLength = 0;
@@ -140,6 +178,9 @@ struct config* config_parse(FILE* file) {
 						currentBind->sites = NULL;
 						currentBind->addr = NULL;
 						currentBind->port = NULL;
+						currentBind->maxBodySize = DEFAULT_MAX_BODY_SIZE;
+						currentBind->resolveTimeout = RESOLVER_DEFAULT_WAIT;
+						currentBind->routes = NULL;
 
 						#ifdef SSL_SUPPORT
 						currentBind->ssl = NULL;
@@ -148,6 +189,10 @@ struct config* config_parse(FILE* file) {
 						state = BIND_VALUE;
 					} else if (strcmp(currentToken, "logging") == 0) {
 						state = LOGGING_BRACKETS_OPEN;
+					} else if (strcmp(currentToken, "metrics") == 0) {
+						state = METRICS_BRACKETS_OPEN;
+					} else if (strcmp(currentToken, "server") == 0) {
+						state = SERVER_BRACKETS_OPEN;
 					} else {
 						error("config: Unexpected token '%s' on line %d.", currentToken, currentLine);
 						freeEverything(toFree, toFreeLength);
@@ -228,10 +273,21 @@ struct config* config_parse(FILE* file) {
 						currentSite->nrHandlers = 0;
 						currentSite->handlers = NULL;
 						currentSite->documentRoot = NULL;
+						currentSite->mimeFile = NULL;
+						currentSite->mimeTypes = NULL;
+						currentSite->nrErrorPages = 0;
+						currentSite->errorPages = NULL;
+						currentSite->statusPages = NULL;
 
 						state = SITE_BRACKETS_OPEN;
 					} else if (strcmp(currentToken, "}") == 0) {
 						state = ROOT;
+					} else if (strcmp(currentToken, "maxbodysize") == 0) {
+						currentNumber = &(currentBind->maxBodySize);
+						state = BIND_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "resolvetimeout") == 0) {
+						currentNumber = &(currentBind->resolveTimeout);
+						state = BIND_NUMBER_EQUALS;
 					} else if (strcmp(currentToken, "ssl") == 0) {						
 						#ifdef SSL_SUPPORT
 							if (currentBind->ssl != NULL) {
@@ -362,7 +418,11 @@ struct config* config_parse(FILE* file) {
 
 						currentHandler->dir = NULL;
 						currentHandler->type = -1;
+						currentHandler->rateLimit = (struct rateLimit) {};
+						currentHandler->statusPages = NULL;
 						currentHandler->handler = NULL;
+						currentHandler->reactor = NULL;
+						currentHandler->coroutine = NULL;
 
 						memset(&(currentHandler->settings), 0, sizeof(union config_handler_settings));
 
@@ -371,6 +431,10 @@ struct config* config_parse(FILE* file) {
 						state = SITE_HOST_EQUALS;
 					} else if (strcmp(currentToken, "root") == 0) {
 						state = SITE_ROOT_EQUALS;
+					} else if (strcmp(currentToken, "mime") == 0) {
+						state = SITE_MIME_EQUALS;
+					} else if (strcmp(currentToken, "errorpage") == 0) {
+						state = SITE_ERROR_STATUS;
 					} else if (strcmp(currentToken, "}") == 0) {
 						state = BIND_CONTENT;
 					} else {
@@ -428,6 +492,72 @@ struct config* config_parse(FILE* file) {
 					
 					currentSite->documentRoot = tmp;
 
+					state = SITE_CONTENT;
+					break;
+				case SITE_MIME_EQUALS:
+					if (strcmp(currentToken, "=") != 0) {
+						error("config: Unexpected token '%s' on line %d. '=' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					state = SITE_MIME_VALUE;
+					break;
+				case SITE_MIME_VALUE:
+					tmp = strdup(currentToken);
+					if (tmp == NULL) {
+						error("config: error cloning mime file string");
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					replaceOrAdd(toFree, &toFreeLength, currentSite->mimeFile, tmp);
+
+					currentSite->mimeFile = tmp;
+
+					state = SITE_CONTENT;
+					break;
+				case SITE_ERROR_STATUS: ;
+					char* end;
+					long errorStatus = strtol(currentToken, &end, 10);
+					if (*end != '\0' || errorStatus < 100 || errorStatus >= STATUS_CODES) {
+						error("config: Invalid status code '%s' on line %d.", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+
+					struct config_errorPage* errorPages = realloc(currentSite->errorPages, ++currentSite->nrErrorPages * sizeof(struct config_errorPage));
+					if (errorPages == NULL) {
+						error("config: error allocating error page array");
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					replaceOrAdd(toFree, &toFreeLength, currentSite->errorPages, errorPages);
+					currentSite->errorPages = errorPages;
+					currentSite->errorPages[currentSite->nrErrorPages - 1] = (struct config_errorPage) {
+						.status = errorStatus,
+						.file = NULL
+					};
+
+					state = SITE_ERROR_EQUALS;
+					break;
+				case SITE_ERROR_EQUALS:
+					if (strcmp(currentToken, "=") != 0) {
+						error("config: Unexpected token '%s' on line %d. '=' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					state = SITE_ERROR_VALUE;
+					break;
+				case SITE_ERROR_VALUE:
+					tmp = strdup(currentToken);
+					if (tmp == NULL) {
+						error("config: error cloning error page string");
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					replaceOrAdd(toFree, &toFreeLength, NULL, tmp);
+
+					currentSite->errorPages[currentSite->nrErrorPages - 1].file = tmp;
+
 					state = SITE_CONTENT;
 					break;
 				case HANDLER_VALUE:
@@ -454,6 +584,49 @@ struct config* config_parse(FILE* file) {
 						state = TYPE_EQUALS;
 					} else if (strcmp(currentToken, "index") == 0) {
 						state = INDEX_EQUALS;
+					} else if (strcmp(currentToken, "minworkers") == 0 || strcmp(currentToken, "maxworkers") == 0 
+						|| strcmp(currentToken, "idletimeout") == 0 || strcmp(currentToken, "queuetimeout") == 0) {
+						if (currentHandler->type != FASTCGI_HANDLER_NO) {
+							error("config: unexpected '%s' on line %d; this is not a fastcgi handler", currentToken, currentLine);
+							freeEverything(toFree, toFreeLength);
+							return NULL;
+						}
+
+						struct fastcgiSettings* settings = &(currentHandler->settings.fastcgiSettings);
+
+						if (strcmp(currentToken, "minworkers") == 0) {
+							currentNumber = &(settings->minWorkers);
+						} else if (strcmp(currentToken, "maxworkers") == 0) {
+							currentNumber = &(settings->maxWorkers);
+						} else if (strcmp(currentToken, "idletimeout") == 0) {
+							currentNumber = &(settings->idleTimeout);
+						} else {
+							currentNumber = &(settings->queueTimeout);
+						}
+
+						state = HANDLER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "listing") == 0 || strcmp(currentToken, "listingpagesize") == 0) {
+						if (currentHandler->type != FILE_HANDLER_NO) {
+							error("config: unexpected '%s' on line %d; this is not a file handler", currentToken, currentLine);
+							freeEverything(toFree, toFreeLength);
+							return NULL;
+						}
+
+						struct fileSettings* settings = &(currentHandler->settings.fileSettings);
+
+						if (strcmp(currentToken, "listing") == 0) {
+							currentNumber = &(settings->listing);
+						} else {
+							currentNumber = &(settings->listingPageSize);
+						}
+
+						state = HANDLER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "ratelimit") == 0) {
+						currentNumber = &(currentHandler->rateLimit.rate);
+						state = HANDLER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "ratelimitburst") == 0) {
+						currentNumber = &(currentHandler->rateLimit.burst);
+						state = HANDLER_NUMBER_EQUALS;
 					} else if (strcmp(currentToken, "}") == 0) {
 						state = SITE_CONTENT;
 					} else {
@@ -475,6 +648,16 @@ struct config* config_parse(FILE* file) {
 						currentHandler->type = FILE_HANDLER_NO;
 					} else if (strcmp(currentToken, "cgi") == 0) {
 						currentHandler->type = CGI_HANDLER_NO;
+					} else if (strcmp(currentToken, "metrics") == 0) {
+						currentHandler->type = METRICS_HANDLER_NO;
+					} else if (strcmp(currentToken, "fastcgi") == 0) {
+						currentHandler->type = FASTCGI_HANDLER_NO;
+
+						struct fastcgiSettings* settings = &(currentHandler->settings.fastcgiSettings);
+						settings->minWorkers = FASTCGI_DEFAULT_MIN_WORKERS;
+						settings->maxWorkers = FASTCGI_DEFAULT_MAX_WORKERS;
+						settings->idleTimeout = FASTCGI_DEFAULT_IDLE_TIMEOUT;
+						settings->queueTimeout = FASTCGI_DEFAULT_QUEUE_TIMEOUT;
 					} else {
 						error("config: Unknown handler type '%s' on line %d.", currentToken, currentLine);
 						freeEverything(toFree, toFreeLength);
@@ -521,6 +704,37 @@ struct config* config_parse(FILE* file) {
 
 					state = HANDLER_CONTENT;
 					break;
+				case BIND_NUMBER_EQUALS:
+				case HANDLER_NUMBER_EQUALS:
+				case SERVER_NUMBER_EQUALS:
+					if (strcmp(currentToken, "=") != 0) {
+						error("config: Unexpected token '%s' on line %d. '=' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					// the value state follows the equals state
+					state++;
+					break;
+				case BIND_NUMBER_VALUE:
+				case HANDLER_NUMBER_VALUE:
+				case SERVER_NUMBER_VALUE: ;
+					char* endptr;
+					long number = strtol(currentToken, &endptr, 10);
+					if (*endptr != '\0' || number < 0) {
+						error("config: '%s' on line %d is not a valid number", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+
+					*currentNumber = number;
+
+					if (state == BIND_NUMBER_VALUE)
+						state = BIND_CONTENT;
+					else if (state == HANDLER_NUMBER_VALUE)
+						state = HANDLER_CONTENT;
+					else
+						state = SERVER_CONTENT;
+					break;
 				case LOGGING_BRACKETS_OPEN:
 					if (strcmp(currentToken, "{") != 0) {
 						error("config: Unexpected token '%s' on line %d. '{' expected", currentToken, currentLine);
@@ -537,6 +751,8 @@ struct config* config_parse(FILE* file) {
 						state = LOGGING_SERVER_FILE_EQUALS;
 					} else if (strcmp(currentToken, "verbosity") == 0) {
 						state = LOGGING_SERVER_VERBOSITY_EQUALS;
+					} else if (strcmp(currentToken, "format") == 0) {
+						state = LOGGING_ACCESS_FORMAT_EQUALS;
 					} else if (strcmp(currentToken, "}") == 0) {
 						state = ROOT;
 					} else {
@@ -599,6 +815,131 @@ struct config* config_parse(FILE* file) {
 					}
 					state = LOGGING_CONTENT;
 					break;
+				case LOGGING_ACCESS_FORMAT_EQUALS:
+					if (strcmp(currentToken, "=") != 0) {
+						error("config: Unexpected token '%s' on line %d. '=' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					state = LOGGING_ACCESS_FORMAT_VALUE;
+					break;
+				case LOGGING_ACCESS_FORMAT_VALUE:
+					config->logging.accessLogFormat = strtoaccesslogformat(currentToken);
+
+					if (config->logging.accessLogFormat == ACCESS_LOG_UNKNOWN) {
+						error("config: Unknown access log format '%s' on line %d.", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					state = LOGGING_CONTENT;
+					break;
+				case METRICS_BRACKETS_OPEN:
+					if (strcmp(currentToken, "{") != 0) {
+						error("config: Unexpected token '%s' on line %d. '{' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+
+					state = METRICS_CONTENT;
+					break;
+				case METRICS_CONTENT:
+					if (strcmp(currentToken, "shm") == 0) {
+						state = METRICS_SHM_EQUALS;
+					} else if (strcmp(currentToken, "}") == 0) {
+						state = ROOT;
+					} else {
+						error("config: Unknown property '%s' on line %d.", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					break;
+				case METRICS_SHM_EQUALS:
+					if (strcmp(currentToken, "=") != 0) {
+						error("config: Unexpected token '%s' on line %d. '=' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					state = METRICS_SHM_VALUE;
+					break;
+				case METRICS_SHM_VALUE:
+					if (currentToken[0] != '/') {
+						error("config: shared memory name has to start with '/' on line %d.", currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+
+					config->metrics.sharedMemory = strdup(currentToken);
+					if (config->metrics.sharedMemory == NULL) {
+						error("config: error cloning shared memory name");
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+
+					state = METRICS_CONTENT;
+					break;
+				case SERVER_BRACKETS_OPEN:
+					if (strcmp(currentToken, "{") != 0) {
+						error("config: Unexpected token '%s' on line %d. '{' expected", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+
+					state = SERVER_CONTENT;
+					break;
+				case SERVER_CONTENT:
+					if (strcmp(currentToken, "draintimeout") == 0) {
+						currentNumber = &(config->server.drainTimeout);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "maxconnections") == 0) {
+						currentNumber = &(config->server.maxConnections);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "maxperip") == 0) {
+						currentNumber = &(config->server.maxConnectionsPerPeer);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "maxhandlers") == 0) {
+						currentNumber = &(config->server.maxHandlers);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "shedtarget") == 0) {
+						currentNumber = &(config->server.shedTarget);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "shedinterval") == 0) {
+						currentNumber = &(config->server.shedInterval);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "ratelimit") == 0) {
+						currentNumber = &(config->server.rateLimit.rate);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "ratelimitburst") == 0) {
+						currentNumber = &(config->server.rateLimit.burst);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "headertimeout") == 0) {
+						currentNumber = &(config->server.headerTimeout);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "minrecvrate") == 0) {
+						currentNumber = &(config->server.minReceiveRate);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "maxheadersize") == 0) {
+						currentNumber = &(config->server.maxHeaderSize);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "maxheaders") == 0) {
+						currentNumber = &(config->server.maxHeaders);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "minsendrate") == 0) {
+						currentNumber = &(config->server.minSendRate);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "responsebuffer") == 0) {
+						currentNumber = &(config->server.responseBuffer);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "responsebuffertotal") == 0) {
+						currentNumber = &(config->server.responseBufferTotal);
+						state = SERVER_NUMBER_EQUALS;
+					} else if (strcmp(currentToken, "}") == 0) {
+						state = ROOT;
+					} else {
+						error("config: Unknown property '%s' on line %d.", currentToken, currentLine);
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+					break;
 				default:
 					assert(false);
 			}
@@ -653,20 +994,66 @@ struct config* config_parse(FILE* file) {
 				return NULL;
 			}
 
+			if (currentSite->mimeFile != NULL) {
+				currentSite->mimeTypes = mime_create();
+				if (currentSite->mimeTypes == NULL || mime_load(currentSite->mimeTypes, currentSite->mimeFile) < 0) {
+					error("config: couldn't load mime types from %s", currentSite->mimeFile);
+					mime_destroy(currentSite->mimeTypes);
+					currentSite->mimeTypes = NULL;
+					freeEverything(toFree, toFreeLength);
+					return NULL;
+				}
+			}
+
+			if (currentSite->nrErrorPages > 0) {
+				currentSite->statusPages = status_createPages();
+				if (currentSite->statusPages == NULL) {
+					error("config: couldn't allocate error pages");
+					freeEverything(toFree, toFreeLength);
+					return NULL;
+				}
+				for (int k = 0; k < currentSite->nrErrorPages; k++) {
+					if (status_loadPage(currentSite->statusPages, currentSite->errorPages[k].status, currentSite->errorPages[k].file) < 0) {
+						error("config: couldn't load error page %s", currentSite->errorPages[k].file);
+						status_destroyPages(currentSite->statusPages);
+						currentSite->statusPages = NULL;
+						freeEverything(toFree, toFreeLength);
+						return NULL;
+					}
+				}
+			}
+
 			for (int k = 0; k < currentSite->nrHandlers; k++) {
 				currentHandler = currentSite->handlers[k];
+				currentHandler->statusPages = currentSite->statusPages;
 
 				switch(currentHandler->type) {
 					case FILE_HANDLER_NO: ;
 						struct fileSettings* fileSettings = &(currentHandler->settings.fileSettings);
 						currentHandler->handler = &fileHandler;
+						currentHandler->reactor = &fileReactor;
 						fileSettings->documentRoot = documentRoot;
+						fileSettings->mimeTypes = currentSite->mimeTypes;
 						break;
 					case CGI_HANDLER_NO: ;
 						struct cgiSettings* cgiSettings = &(currentHandler->settings.cgiSettings);
 						currentHandler->handler = &cgiHandler;
+						currentHandler->coroutine = &cgiCoroutine;
 						cgiSettings->documentRoot = documentRoot;
 						break;
+					case METRICS_HANDLER_NO:
+						currentHandler->handler = &metricsHandler;
+						break;
+					case FASTCGI_HANDLER_NO: ;
+						struct fastcgiSettings* fastcgiSettings = &(currentHandler->settings.fastcgiSettings);
+						if (fastcgiSettings->maxWorkers < 1 || fastcgiSettings->minWorkers > fastcgiSettings->maxWorkers) {
+							error("config: fastcgi worker limits invalid for %s:%s", currentBind->addr, currentBind->port);
+							freeEverything(toFree, toFreeLength);
+							return NULL;
+						}
+						currentHandler->handler = &fastcgiHandler;
+						fastcgiSettings->documentRoot = documentRoot;
+						break;
 					default:
 						error("config: unknown handler for %s:%s", currentBind->addr, currentBind->port);
 						freeEverything(toFree, toFreeLength);
@@ -679,6 +1066,52 @@ struct config* config_parse(FILE* file) {
 	return config;
 }
 
+// CGI scripts get REMOTE_HOST
+static bool needsPeerNames(struct config_bind* bind) {
+	for (int i = 0; i < bind->nrSites; i++) {
+		for (int j = 0; j < bind->sites[i]->nrHandlers; j++) {
+			int type = bind->sites[i]->handlers[j]->type;
+			if (type == CGI_HANDLER_NO || type == FASTCGI_HANDLER_NO)
+				return true;
+		}
+	}
+	return false;
+}
+
+static struct routes* compileRoutes(struct config_bind* bind) {
+	struct routes* routes = routes_create(bind->nrSites);
+	if (routes == NULL) {
+		error("config: couldn't allocate routing table: %s", strerror(errno));
+		return NULL;
+	}
+
+	for (int i = 0; i < bind->nrSites; i++) {
+		struct config_site* site = bind->sites[i];
+
+		if (site->nrHostnames == 0 && routes_addHost(routes, i, "*") < 0) {
+			routes_destroy(routes);
+			return NULL;
+		}
+		for (int j = 0; j < site->nrHostnames; j++) {
+			if (routes_addHost(routes, i, site->hostnames[j]) < 0) {
+				error("config: couldn't add hostname %s to routing table of %s:%s", site->hostnames[j], bind->addr, bind->port);
+				routes_destroy(routes);
+				return NULL;
+			}
+		}
+
+		for (int j = 0; j < site->nrHandlers; j++) {
+			if (routes_addHandler(routes, i, site->handlers[j]->dir, site->handlers[j]) < 0) {
+				error("config: couldn't add handler %s to routing table of %s:%s", site->handlers[j]->dir, bind->addr, bind->port);
+				routes_destroy(routes);
+				return NULL;
+			}
+		}
+	}
+
+	return routes;
+}
+
 struct networkingConfig* config_getNetworkingConfig(struct config* config, struct networkingConfig* networkingConfig) {
 	struct bind* binds = malloc(config->nrBinds * sizeof(struct bind));
 	if (binds == NULL) {
@@ -687,11 +1120,22 @@ struct networkingConfig* config_getNetworkingConfig(struct config* config, struc
 	}
 
 	for (int i = 0; i < config->nrBinds; i++) {
+		if (config->binds[i]->routes == NULL) {
+			config->binds[i]->routes = compileRoutes(config->binds[i]);
+			if (config->binds[i]->routes == NULL) {
+				free(binds);
+				return NULL;
+			}
+		}
+
 		binds[i] = (struct bind) {
 			.address = config->binds[i]->addr,
 			.port = config->binds[i]->port,
+			.maxBodySize = config->binds[i]->maxBodySize,
+			.resolvePeers = needsPeerNames(config->binds[i]),
+			.resolveTimeout = config->binds[i]->resolveTimeout,
 			.settings = {
-				.ptr = config
+				.ptr = config->binds[i]->routes
 			},
 			#ifdef SSL_SUPPORT
 				.ssl = (config->binds[i]->ssl != NULL),
@@ -706,14 +1150,31 @@ struct networkingConfig* config_getNetworkingConfig(struct config* config, struc
 		.number = config->nrBinds,
 		.binds = binds
 	};
-	networkingConfig->maxConnections = DEFAULT_MAX_CONNECTIONS;
+	networkingConfig->maxConnections = config->server.maxConnections;
+	networkingConfig->maxConnectionsPerPeer = config->server.maxConnectionsPerPeer;
+	networkingConfig->maxHandlers = config->server.maxHandlers;
+	networkingConfig->shedTarget = config->server.shedTarget;
+	networkingConfig->shedInterval = config->server.shedInterval;
+	networkingConfig->rateLimit = config->server.rateLimit;
+	networkingConfig->headerTimeout = config->server.headerTimeout;
+	networkingConfig->minReceiveRate = config->server.minReceiveRate;
+	networkingConfig->maxHeaderSize = config->server.maxHeaderSize;
+	networkingConfig->maxHeaders = config->server.maxHeaders;
+	networkingConfig->minSendRate = config->server.minSendRate;
+	networkingConfig->responseBuffer = config->server.responseBuffer;
+	networkingConfig->responseBufferTotal = config->server.responseBufferTotal;
 	networkingConfig->connectionTimeout = DEFAULT_CONNECTION_TIMEOUT;
 	networkingConfig->getHandler = &config_getHandler;
 	networkingConfig->defaultHeaders = headers_create();
+	networkingConfig->accessLogFormat = config->logging.accessLogFormat;
 
 	return networkingConfig;
 }
 
+int config_setMetrics(struct config* config) {
+	return metrics_init(config->metrics.sharedMemory);
+}
+
 void config_setLogging(struct config* config) {
 	setLogging(stdout, config->logging.serverVerbosity, true);
 
@@ -739,86 +1200,36 @@ void config_setLogging(struct config* config) {
 }
 
 struct handler config_getHandler(struct metaData metaData, const char* host, struct bind* bind) {
-	struct config* config = (struct config*) (bind->settings.ptr);
+	struct routes* routes = (struct routes*) (bind->settings.ptr);
 	struct handler handler = {};
 
-	struct config_bind* config_bind = NULL;
-
-	for (int i = 0; i < config->nrBinds; i++) {
-		if (strcmp(config->binds[i]->addr, bind->address) == 0 && strcmp(config->binds[i]->port, bind->port) == 0) {
-			config_bind = config->binds[i];
-			break;
-		}
-	}
-
-	if (config_bind == NULL) {
-		error("config: this bind does not exist: %s:%s", bind->address, bind->port);
-		handler.handler = status500;
-		return handler;
-	}
-
-	bool isWildcard = false;
-	struct config_site* config_site = NULL;
-
-	for (int i = 0; i < config_bind->nrSites; i++) {
-		if (config_bind->sites[i]->nrHostnames == 0) {
-			if (config_site != NULL && !isWildcard)
-				continue;
-
-			config_site = config_bind->sites[i];
-			isWildcard = true;
-			continue;
-		}
-
-		for (int j = 0; j < config_bind->sites[i]->nrHostnames; j++) {
-			if (strcmp(host, config_bind->sites[i]->hostnames[j]) == 0) {
-				config_site = config_bind->sites[i];
-				break;
-			}
-			if (strcmp(config_bind->sites[i]->hostnames[j], "*") == 0) {
-				if (config_site != NULL && !isWildcard)
-					continue;
-
-				config_site = config_bind->sites[i];
-				isWildcard = true;
-				break;
-			}
-		}
-
-		if (config_site != NULL)
-			break;
-	}
-	
-	if (config_site == NULL) {
-		error("config: the site '%s' does not exist for bind %s:%s", host, bind->address, bind->port);
+	int site = routes_findSite(routes, host);
+	if (site < 0) {
+		error("config: the site '%s' does not exist for bind %s:%s", host == NULL ? "" : host, bind->address, bind->port);
+		metrics_requestHandler(-1);
 		handler.handler = status500;
+		handler.reactor = &status500Reactor;
 		return handler;
 	}
 
-	int matchLength = 0;
-	struct config_handler* config_handler = NULL;	
-
-	for (int i = 0; i < config_site->nrHandlers; i++) {
-		char* dir = config_site->handlers[i]->dir;
-		int dirLength = strlen(dir);
-		if (dirLength <= matchLength)
-			continue;
-
-		if (isInDir(metaData.path, dir)) {
-			matchLength = dirLength;
-			config_handler = config_site->handlers[i];
-		}		
-	}
-
+	struct config_handler* config_handler = routes_findHandler(routes, site, metaData.path);
 	if (config_handler == NULL) {
 		error("config: no handler for %s on %s:%s", metaData.uri, bind->address, bind->port);
+		metrics_requestHandler(-1);
 		handler.handler = status500;
+		handler.reactor = &status500Reactor;
 		return handler;
 	}
 
+	metrics_requestHandler(config_handler->type);
+
 	handler.handler = config_handler->handler;
+	handler.reactor = config_handler->reactor;
+	handler.coroutine = config_handler->coroutine;
 	handler.data.ptr = &(config_handler->settings);
-
+	if (config_handler->rateLimit.rate > 0)
+		handler.rateLimit = &(config_handler->rateLimit);
+	handler.statusPages = config_handler->statusPages;
 
 	return handler;
 }
@@ -836,6 +1247,7 @@ void config_destroy(struct config* config) {
 
 		free(currentBind->addr);
 		free(currentBind->port);
+		routes_destroy(currentBind->routes);
 
 		#ifdef SSL_SUPPORT
 			if (currentBind->ssl != NULL) {
@@ -851,6 +1263,15 @@ void config_destroy(struct config* config) {
 			if (currentSite->documentRoot != NULL)
 				free(currentSite->documentRoot);
 
+			free(currentSite->mimeFile);
+			mime_destroy(currentSite->mimeTypes);
+
+			for (int k = 0; k < currentSite->nrErrorPages; k++) {
+				free(currentSite->errorPages[k].file);
+			}
+			free(currentSite->errorPages);
+			status_destroyPages(currentSite->statusPages);
+
 			for (int k = 0; k < currentSite->nrHostnames; k++) {
 				if (currentSite->hostnames[k] != NULL)
 					free(currentSite->hostnames[k]);
@@ -879,6 +1300,10 @@ void config_destroy(struct config* config) {
 					case CGI_HANDLER_NO: ;
 						//struct cgiSettings cgiSettings = currentHandler->settings.cgiSettings;
 	
+						break;
+					case FASTCGI_HANDLER_NO:
+						// the pools outlive the config
+						fastcgi_retire(&(currentHandler->settings.fastcgiSettings));
 						break;
 					default:
 						break;
@@ -896,5 +1321,7 @@ void config_destroy(struct config* config) {
 	}
 	if (config->binds != NULL)
 		free(config->binds);
+	if (config->metrics.sharedMemory != NULL)
+		free(config->metrics.sharedMemory);
 	free(config);
 }
@@ -7,19 +7,32 @@
 #include "misc.h"
 #include "files.h"
 #include "cgi.h"
+#include "fastcgi.h"
+#include "metrics.h"
 #include "logging.h"
+#include "accesslog.h"
+#include "routing.h"
+#include "admission.h"
+#include "mime.h"
+#include "status.h"
 
 #ifdef SSL_SUPPORT
 	#include "ssl.h"
 #endif
 
 #define CONFIG_DEFAULT_LOGLEVEL (DEFAULT_LOGLEVEL)
+// ms running requests get on shutdown
+#define DEFAULT_DRAIN_TIMEOUT (30000)
 
 struct config {
 	int nrBinds;
 	struct config_bind {
 		char* addr;
 		char* port;
+		long maxBodySize;
+		long resolveTimeout;
+		// compiled by config_getNetworkingConfig()
+		struct routes* routes;
 		
 		#ifdef SSL_SUPPORT
 			struct ssl_settings* ssl;
@@ -30,29 +43,74 @@ struct config {
 			int nrHostnames;
 			char** hostnames;
 			char* documentRoot;
+			// mime.types file of the site; loaded into mimeTypes when the config is parsed
+			char* mimeFile;
+			struct mimeTypes* mimeTypes;
+			// custom error pages; loaded into statusPages when the config is parsed
+			int nrErrorPages;
+			struct config_errorPage {
+				int status;
+				char* file;
+			}* errorPages;
+			struct statusPages* statusPages;
 			int nrHandlers;
 			struct config_handler {
 				char* dir;
 				int type;
 				handler_t handler;
+				// NULL if the handler only runs on a thread
+				const struct reactorHandler* reactor;
+				// NULL if the handler doesn't run as a coroutine
+				coroutine_t coroutine;
+				// per peer; applies to the requests of this handler only
+				struct rateLimit rateLimit;
+				// of the site
+				const struct statusPages* statusPages;
 				union config_handler_settings {
 					struct fileSettings fileSettings;
 					struct cgiSettings cgiSettings;
+					struct fastcgiSettings fastcgiSettings;
 				} settings;
 			} **handlers;
 		} **sites;
 	} **binds;
 	struct config_logging {
 		char* accessLogfile;
+		enum accessLogFormat accessLogFormat;
 		char* serverLogfile;
 		loglevel_t serverVerbosity;
 	} logging;
+	struct config_metrics {
+		char* sharedMemory;
+	} metrics;
+	struct config_server {
+		long drainTimeout;
+		// 0 means no limit
+		long maxConnections;
+		long maxConnectionsPerPeer;
+		long maxHandlers;
+		// 0 turns shedding off
+		long shedTarget;
+		long shedInterval;
+		// per peer; applies to every request
+		struct rateLimit rateLimit;
+		// slow clients; 0 turns each of them off
+		long headerTimeout;
+		long minReceiveRate;
+		long maxHeaderSize;
+		long maxHeaders;
+		long minSendRate;
+		long responseBuffer;
+		long responseBufferTotal;
+	} server;
 };
 
 /*
 config format
 
 bind [addr]:[port] {
+	maxbodysize = 1048576
+	resolvetimeout = 1000
 	ssl {
 		key = file
 		cert = certfile
@@ -60,18 +118,49 @@ bind [addr]:[port] {
 	site {
 		hostname|alias = "[host]"
 		root = "/"
+		mime = "/etc/mime.types"
+		errorpage 404 = "/404.html"
 		handler "/" {
-			type = cgi|file
+			type = cgi|fastcgi|file|metrics
 			index = "index.html"
 			index = "index.htm"
+			listing = 0
+			listingpagesize = 0
+			minworkers = 1
+			maxworkers = 4
+			idletimeout = 60000
+			queuetimeout = 5000
+			ratelimit = 10
+			ratelimitburst = 20
 		}
 	}
 }
 logging {
 	access = file
+	format = combined|clf|json
 	server = file
 	verboseity = debug|info|warn|error
 }
+metrics {
+	shm = /name
+}
+server {
+	draintimeout = 30000
+	maxconnections = 1024
+	maxperip = 0
+	maxhandlers = 256
+	shedtarget = 50
+	shedinterval = 500
+	ratelimit = 0
+	ratelimitburst = 0
+	headertimeout = 10000
+	minrecvrate = 100
+	maxheadersize = 16384
+	maxheaders = 100
+	minsendrate = 100
+	responsebuffer = 0
+	responsebuffertotal = 67108864
+}
 
 
 */
@@ -80,6 +169,7 @@ struct config* config_parse(FILE* file);
 
 struct networkingConfig* config_getNetworkingConfig(struct config* config, struct networkingConfig* networkingConfig);
 void config_setLogging(struct config* config);
+int config_setMetrics(struct config* config);
 struct handler config_getHandler(struct metaData metaData, const char* host, struct bind* bind);
 
 void config_destroy(struct config* config);
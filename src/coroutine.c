@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include <sys/mman.h>
+
+#include "coroutine.h"
+#include "logging.h"
+
+struct coroutine {
+	ucontext_t context;
+	// where coroutine_yield goes back to
+	ucontext_t caller;
+	// the guard page is in front of it
+	char* mapping;
+	size_t mappingSize;
+	coroutineFunction_t function;
+	void* data;
+	bool done;
+	struct coroutine* nextFree;
+};
+
+static __thread struct coroutine* current = NULL;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct coroutine* pool = NULL;
+static int pooled = 0;
+
+static void trampoline() {
+	struct coroutine* coroutine = current;
+
+	coroutine->function(coroutine->data);
+
+	coroutine->done = true;
+	// uc_link isn't used; the context is made again for the next coroutine on this stack
+	swapcontext(&(coroutine->context), &(coroutine->caller));
+}
+
+static struct coroutine* allocate() {
+	pthread_mutex_lock(&poolLock);
+	struct coroutine* coroutine = pool;
+	if (coroutine != NULL) {
+		pool = coroutine->nextFree;
+		pooled--;
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	if (coroutine != NULL)
+		return coroutine;
+
+	coroutine = malloc(sizeof(struct coroutine));
+	if (coroutine == NULL)
+		return NULL;
+
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	coroutine->mappingSize = COROUTINE_STACK_SIZE + pageSize;
+	coroutine->mapping = mmap(NULL, coroutine->mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (coroutine->mapping == MAP_FAILED) {
+		error("coroutine: couldn't map stack: %s", strerror(errno));
+		free(coroutine);
+		return NULL;
+	}
+	// stacks grow down; an overflow hits the guard page instead of the heap
+	if (mprotect(coroutine->mapping, pageSize, PROT_NONE) < 0) {
+		error("coroutine: couldn't protect guard page: %s", strerror(errno));
+		munmap(coroutine->mapping, coroutine->mappingSize);
+		free(coroutine);
+		return NULL;
+	}
+
+	return coroutine;
+}
+
+struct coroutine* coroutine_create(coroutineFunction_t function, void* data) {
+	struct coroutine* coroutine = allocate();
+	if (coroutine == NULL)
+		return NULL;
+
+	if (getcontext(&(coroutine->context)) < 0) {
+		error("coroutine: getcontext: %s", strerror(errno));
+		coroutine_destroy(coroutine);
+		return NULL;
+	}
+
+	size_t guard = coroutine->mappingSize - COROUTINE_STACK_SIZE;
+	coroutine->context.uc_stack.ss_sp = coroutine->mapping + guard;
+	coroutine->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+	coroutine->context.uc_link = NULL;
+	makecontext(&(coroutine->context), trampoline, 0);
+
+	coroutine->function = function;
+	coroutine->data = data;
+	coroutine->done = false;
+	coroutine->nextFree = NULL;
+
+	return coroutine;
+}
+
+void coroutine_destroy(struct coroutine* coroutine) {
+	pthread_mutex_lock(&poolLock);
+	bool keep = pooled < COROUTINE_POOL_SIZE;
+	if (keep) {
+		coroutine->nextFree = pool;
+		pool = coroutine;
+		pooled++;
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	if (!keep) {
+		munmap(coroutine->mapping, coroutine->mappingSize);
+		free(coroutine);
+	}
+}
+
+bool coroutine_resume(struct coroutine* coroutine) {
+	if (coroutine->done)
+		return true;
+
+	// coroutines can resume other coroutines
+	struct coroutine* previous = current;
+	current = coroutine;
+	swapcontext(&(coroutine->caller), &(coroutine->context));
+	current = previous;
+
+	return coroutine->done;
+}
+
+void coroutine_yield() {
+	struct coroutine* coroutine = current;
+	if (coroutine == NULL) {
+		error("coroutine: yield outside of a coroutine");
+		return;
+	}
+
+	swapcontext(&(coroutine->context), &(coroutine->caller));
+}
+
+struct coroutine* coroutine_current() {
+	return current;
+}
@@ -0,0 +1,32 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <stdbool.h>
+
+/*
+ * Stackful coroutines (ucontext). A coroutine runs on the thread that resumes it
+ * until it yields or returns; it must not be resumed by two threads at once.
+ * The stacks are small and have a guard page; freed ones are kept for the next coroutine.
+ */
+
+#define COROUTINE_STACK_SIZE (64 * 1024)
+// stacks that are kept once their coroutine is destroyed
+#define COROUTINE_POOL_SIZE (1024)
+
+struct coroutine;
+
+typedef void (*coroutineFunction_t)(void* data);
+
+struct coroutine* coroutine_create(coroutineFunction_t function, void* data);
+// only once it returned (or if it never ran)
+void coroutine_destroy(struct coroutine* coroutine);
+
+// runs the coroutine until it yields or returns; returns true once it returned
+bool coroutine_resume(struct coroutine* coroutine);
+// back to coroutine_resume; only in a coroutine
+void coroutine_yield();
+
+// the coroutine that runs on this thread; NULL if there is none
+struct coroutine* coroutine_current();
+
+#endif
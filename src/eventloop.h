@@ -0,0 +1,76 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Completion based event loop for the reactor thread.
+ * The epoll backend emulates completions; the io_uring backend (make uring) uses the ring directly.
+ *
+ * Except for eventloop_wakeup, eventloop_writev and eventloop_splice all functions
+ * have to be called from the thread that calls eventloop_wait.
+ */
+
+#define EVENTLOOP_MAX_EVENTS (64)
+// provided receive buffers (io_uring)
+#define EVENTLOOP_BUFFERS (256)
+// max number of iovecs for eventloop_writev
+#define EVENTLOOP_MAX_IOV (8)
+
+enum eventType {
+	EVENT_ACCEPT,
+	EVENT_READ,
+	EVENT_WAKEUP,
+	EVENT_POLL
+};
+
+struct event {
+	enum eventType type;
+	// as given to eventloop_accept, eventloop_read or eventloop_poll
+	void* data;
+	// EVENT_ACCEPT: the new fd; EVENT_READ: bytes read (0 on EOF); EVENT_POLL: the poll events; -errno on error
+	int result;
+	// EVENT_POLL: the fd that is ready
+	int fd;
+	// EVENT_READ: the data; has to be given back with eventloop_release
+	char* buffer;
+	int bufferId;
+};
+
+struct eventLoop;
+
+struct eventLoop* eventloop_create(size_t bufferSize);
+void eventloop_destroy(struct eventLoop* loop);
+const char* eventloop_backend();
+
+// one EVENT_ACCEPT per new connection until the listening socket is closed
+int eventloop_accept(struct eventLoop* loop, int fd, void* data);
+// stops accepting; the socket can be closed afterwards (events that were already under way have NULL as data)
+void eventloop_unaccept(struct eventLoop* loop, int fd);
+// one EVENT_READ as soon as data arrives; has to be armed again for more
+int eventloop_read(struct eventLoop* loop, int fd, void* data);
+// one EVENT_POLL once fd is ready for events (POLLIN or POLLOUT); a read can be pending on the same fd
+int eventloop_poll(struct eventLoop* loop, int fd, short events, void* data);
+// the pending read and poll complete with -ECANCELED (or with data if they were faster)
+int eventloop_cancel(struct eventLoop* loop, int fd, void* data);
+// has to be called before an fd with a finished read is closed
+void eventloop_forget(struct eventLoop* loop, int fd);
+void eventloop_release(struct eventLoop* loop, struct event* event);
+
+// makes eventloop_wait return an EVENT_WAKEUP; can be called from any thread
+void eventloop_wakeup(struct eventLoop* loop);
+
+// returns the number of events; 0 on timeout (in ms; -1 for none)
+int eventloop_wait(struct eventLoop* loop, struct event* events, int max, int timeout);
+
+/*
+ * Blocking I/O for handler threads; they use the loop that was created first (if any).
+ * Both return the number of bytes written or -1; they give up after timeout ms without progress.
+ */
+ssize_t eventloop_writev(int fd, const struct iovec* iov, int count, int timeout);
+// in or out has to be a pipe; otherwise pipefd is used in between (and has to be empty)
+ssize_t eventloop_splice(int in, int out, const int pipefd[2], size_t length, int timeout);
+
+#endif
@@ -0,0 +1,435 @@
+#ifndef IO_URING
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "eventloop.h"
+#include "logging.h"
+#include "util.h"
+
+enum watchType {
+	WATCH_NONE,
+	WATCH_ACCEPT,
+	WATCH_READ
+};
+
+struct watch {
+	enum watchType type;
+	void* data;
+	// of a pending poll; 0 if there is none
+	uint32_t pollEvents;
+	void* pollData;
+	// registered with epoll; reads and polls are oneshot so they stay registered when they are done
+	bool registered;
+};
+
+struct eventLoop {
+	int epollfd;
+	int wakeupfd;
+	size_t bufferSize;
+	// one buffer per event; they are only used until eventloop_release
+	char* buffers;
+	bool bufferUsed[EVENTLOOP_MAX_EVENTS];
+	// indexed by fd
+	struct watch* watches;
+	int numberOfWatches;
+	// completions that didn't come from epoll (cancelled reads)
+	struct event pending[EVENTLOOP_MAX_EVENTS];
+	int numberOfPending;
+};
+
+struct eventLoop* eventloop_create(size_t bufferSize) {
+	struct eventLoop* loop = malloc(sizeof(struct eventLoop));
+	if (loop == NULL)
+		return NULL;
+
+	*loop = (struct eventLoop) {
+		.bufferSize = bufferSize,
+		.watches = NULL,
+		.numberOfWatches = 0,
+		.numberOfPending = 0
+	};
+
+	loop->buffers = malloc(EVENTLOOP_MAX_EVENTS * bufferSize);
+	if (loop->buffers == NULL) {
+		free(loop);
+		return NULL;
+	}
+
+	loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epollfd < 0) {
+		error("eventloop: epoll_create1: %s", strerror(errno));
+		free(loop->buffers);
+		free(loop);
+		return NULL;
+	}
+
+	loop->wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakeupfd < 0) {
+		error("eventloop: eventfd: %s", strerror(errno));
+		close(loop->epollfd);
+		free(loop->buffers);
+		free(loop);
+		return NULL;
+	}
+
+	struct epoll_event event = {
+		.events = EPOLLIN,
+		.data.fd = loop->wakeupfd
+	};
+	if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->wakeupfd, &event) < 0) {
+		error("eventloop: couldn't watch wakeup fd: %s", strerror(errno));
+		eventloop_destroy(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+void eventloop_destroy(struct eventLoop* loop) {
+	close(loop->wakeupfd);
+	close(loop->epollfd);
+	free(loop->watches);
+	free(loop->buffers);
+	free(loop);
+}
+
+const char* eventloop_backend() {
+	return "epoll";
+}
+
+static struct watch* getWatch(struct eventLoop* loop, int fd) {
+	if (fd >= loop->numberOfWatches) {
+		int number = loop->numberOfWatches == 0 ? 1024 : loop->numberOfWatches;
+		while (number <= fd)
+			number *= 2;
+
+		struct watch* watches = realloc(loop->watches, number * sizeof(struct watch));
+		if (watches == NULL)
+			return NULL;
+
+		memset(watches + loop->numberOfWatches, 0, (number - loop->numberOfWatches) * sizeof(struct watch));
+		loop->watches = watches;
+		loop->numberOfWatches = number;
+	}
+
+	return &(loop->watches[fd]);
+}
+
+// what a read or poll waits for; accepts are level triggered instead
+static uint32_t interest(struct watch* watch) {
+	uint32_t events = watch->pollEvents;
+	if (watch->type == WATCH_READ)
+		events |= EPOLLIN | EPOLLRDHUP;
+	return events | EPOLLONESHOT;
+}
+
+static int arm(struct eventLoop* loop, int fd, struct watch* watch, uint32_t events) {
+	struct epoll_event event = {
+		.events = events,
+		.data.fd = fd
+	};
+
+	int tmp;
+	if (watch->registered) {
+		tmp = epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, fd, &event);
+		if (tmp < 0 && errno == ENOENT) {
+			// the fd was closed and reused in the meantime
+			tmp = epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, fd, &event);
+		}
+	} else {
+		tmp = epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, fd, &event);
+		if (tmp < 0 && errno == EEXIST)
+			tmp = epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, fd, &event);
+	}
+	if (tmp < 0)
+		return -1;
+
+	watch->registered = true;
+
+	return 0;
+}
+
+static int watch(struct eventLoop* loop, int fd, enum watchType type, void* data) {
+	struct watch* watch = getWatch(loop, fd);
+	if (watch == NULL)
+		return -1;
+
+	enum watchType oldType = watch->type;
+	void* oldData = watch->data;
+	watch->type = type;
+	watch->data = data;
+
+	// level triggered; connections that don't fit in one batch are reported again
+	if (arm(loop, fd, watch, type == WATCH_ACCEPT ? EPOLLIN : interest(watch)) < 0) {
+		watch->type = oldType;
+		watch->data = oldData;
+		return -1;
+	}
+
+	return 0;
+}
+
+int eventloop_accept(struct eventLoop* loop, int fd, void* data) {
+	return watch(loop, fd, WATCH_ACCEPT, data);
+}
+
+void eventloop_unaccept(struct eventLoop* loop, int fd) {
+	eventloop_forget(loop, fd);
+}
+
+int eventloop_read(struct eventLoop* loop, int fd, void* data) {
+	return watch(loop, fd, WATCH_READ, data);
+}
+
+int eventloop_poll(struct eventLoop* loop, int fd, short events, void* data) {
+	struct watch* watch = getWatch(loop, fd);
+	if (watch == NULL)
+		return -1;
+	if (watch->type == WATCH_ACCEPT) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	watch->pollEvents = events & (POLLIN | POLLOUT);
+	watch->pollData = data;
+
+	if (arm(loop, fd, watch, interest(watch)) < 0) {
+		watch->pollEvents = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+int eventloop_cancel(struct eventLoop* loop, int fd, void* data) {
+	struct watch* watch = getWatch(loop, fd);
+	bool read = watch != NULL && watch->type == WATCH_READ && watch->data == data;
+	bool poll = watch != NULL && watch->pollEvents != 0 && watch->pollData == data;
+	if (!read && !poll) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (loop->numberOfPending + read + poll > EVENTLOOP_MAX_EVENTS) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (read) {
+		watch->type = WATCH_NONE;
+		loop->pending[loop->numberOfPending++] = (struct event) {
+			.type = EVENT_READ,
+			.data = data,
+			.result = -ECANCELED,
+			.buffer = NULL,
+			.bufferId = -1
+		};
+	}
+	if (poll) {
+		watch->pollEvents = 0;
+		loop->pending[loop->numberOfPending++] = (struct event) {
+			.type = EVENT_POLL,
+			.data = data,
+			.result = -ECANCELED,
+			.fd = fd,
+			.buffer = NULL,
+			.bufferId = -1
+		};
+	}
+
+	if (watch->type == WATCH_NONE && watch->pollEvents == 0) {
+		epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, fd, NULL);
+		watch->registered = false;
+	} else {
+		arm(loop, fd, watch, interest(watch));
+	}
+
+	return 0;
+}
+
+void eventloop_forget(struct eventLoop* loop, int fd) {
+	if (fd < 0 || fd >= loop->numberOfWatches)
+		return;
+
+	struct watch* watch = &(loop->watches[fd]);
+	if (watch->registered)
+		epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, fd, NULL);
+
+	*watch = (struct watch) {
+		.type = WATCH_NONE
+	};
+}
+
+void eventloop_release(struct eventLoop* loop, struct event* event) {
+	if (event->bufferId >= 0)
+		loop->bufferUsed[event->bufferId] = false;
+	event->buffer = NULL;
+	event->bufferId = -1;
+}
+
+void eventloop_wakeup(struct eventLoop* loop) {
+	uint64_t one = 1;
+	// if the counter is full there is already a wakeup pending
+	write(loop->wakeupfd, &one, sizeof(one));
+}
+
+static int getBuffer(struct eventLoop* loop) {
+	for (int i = 0; i < EVENTLOOP_MAX_EVENTS; i++) {
+		if (!loop->bufferUsed[i]) {
+			loop->bufferUsed[i] = true;
+			return i;
+		}
+	}
+	return -1;
+}
+
+int eventloop_wait(struct eventLoop* loop, struct event* events, int max, int timeout) {
+	if (max > EVENTLOOP_MAX_EVENTS)
+		max = EVENTLOOP_MAX_EVENTS;
+
+	int number = 0;
+	while (number < max && loop->numberOfPending > 0) {
+		events[number++] = loop->pending[--(loop->numberOfPending)];
+	}
+	if (number > 0)
+		return number;
+
+	struct epoll_event epollEvents[EVENTLOOP_MAX_EVENTS];
+	int tmp = epoll_wait(loop->epollfd, epollEvents, max, timeout);
+	if (tmp < 0) {
+		if (errno == EINTR)
+			return 0;
+		return -1;
+	}
+
+	for (int i = 0; i < tmp; i++) {
+		int fd = epollEvents[i].data.fd;
+
+		if (fd == loop->wakeupfd) {
+			if (number >= max) {
+				// level triggered; reported again next time
+				continue;
+			}
+
+			uint64_t value;
+			read(loop->wakeupfd, &value, sizeof(value));
+
+			events[number++] = (struct event) {
+				.type = EVENT_WAKEUP,
+				.bufferId = -1
+			};
+			continue;
+		}
+
+		struct watch* watch = getWatch(loop, fd);
+		if (watch == NULL)
+			continue;
+
+		if (watch->type == WATCH_ACCEPT) {
+			// drain the backlog; one event per connection but every other epoll event needs a slot as well
+			int reserved = tmp - i - 1;
+			while (number < max - reserved) {
+				int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (client < 0 && errno == EINTR)
+					continue;
+				if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					break;
+
+				events[number++] = (struct event) {
+					.type = EVENT_ACCEPT,
+					.data = watch->data,
+					.result = client < 0 ? -errno : client,
+					.bufferId = -1
+				};
+
+				if (client < 0)
+					break;
+			}
+			continue;
+		}
+
+		// the fd is disabled until it is armed again (oneshot); whatever isn't reported now stays armed
+		uint32_t ready = epollEvents[i].events;
+
+		if (watch->pollEvents != 0 && (ready & (watch->pollEvents | EPOLLERR | EPOLLHUP)) && number < max) {
+			events[number++] = (struct event) {
+				.type = EVENT_POLL,
+				.data = watch->pollData,
+				.result = ready & (watch->pollEvents | EPOLLERR | EPOLLHUP),
+				.fd = fd,
+				.bufferId = -1
+			};
+			watch->pollEvents = 0;
+		}
+
+		if (watch->type == WATCH_READ && (ready & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && number < max) {
+			// all buffers might still be in use; then it is reported next time
+			int bufferId = getBuffer(loop);
+			if (bufferId >= 0) {
+				char* buffer = loop->buffers + bufferId * loop->bufferSize;
+
+				ssize_t result;
+				do {
+					result = read(fd, buffer, loop->bufferSize);
+				} while (result < 0 && errno == EINTR);
+
+				if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					// spurious; wait for the next one
+					loop->bufferUsed[bufferId] = false;
+				} else {
+					watch->type = WATCH_NONE;
+
+					if (result <= 0) {
+						loop->bufferUsed[bufferId] = false;
+						bufferId = -1;
+						buffer = NULL;
+					}
+
+					events[number++] = (struct event) {
+						.type = EVENT_READ,
+						.data = watch->data,
+						.result = result < 0 ? -errno : result,
+						.buffer = buffer,
+						.bufferId = bufferId
+					};
+				}
+			}
+		}
+
+		if (watch->type == WATCH_READ || watch->pollEvents != 0)
+			arm(loop, fd, watch, interest(watch));
+	}
+
+	return number;
+}
+
+ssize_t eventloop_writev(int fd, const struct iovec* iov, int count, int timeout) {
+	return writevAll(fd, iov, count, timeout);
+}
+
+ssize_t eventloop_splice(int in, int out, const int pipefd[2], size_t length, int timeout) {
+	if (pipefd == NULL)
+		return spliceSome(in, out, length, timeout);
+
+	ssize_t tmp = spliceSome(in, pipefd[1], length, timeout);
+	if (tmp <= 0)
+		return tmp;
+
+	// the pipe has to be empty afterwards
+	if (spliceAll(pipefd[0], out, tmp, timeout) != tmp)
+		return -1;
+
+	return tmp;
+}
+
+#endif
@@ -0,0 +1,958 @@
+#ifdef IO_URING
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <linux/io_uring.h>
+
+#include "eventloop.h"
+#include "logging.h"
+#include "util.h"
+
+#define RING_ENTRIES (4096)
+#define COMPLETION_ENTRIES (16384)
+#define BUFFER_GROUP (0)
+
+/*
+ * The lower bits of the user data say what a completion is about.
+ * Accepts and reads carry the fd; operations of handler threads a pointer to their part.
+ */
+#define TAG_ACCEPT (0x1)
+#define TAG_READ (0x2)
+#define TAG_WAKEUP (0x3)
+#define TAG_PART (0x4)
+#define TAG_IGNORE (0x5)
+#define TAG_POLL (0x6)
+#define TAG_MASK (0x7)
+#define TAG_SHIFT (3)
+
+// per fd
+struct slot {
+	void* data;
+	// of a pending poll
+	void* pollData;
+	// -1: unknown; recv only works on sockets, everything else is polled and read
+	signed char socket;
+};
+
+struct operation;
+
+// one submission of an operation
+struct part {
+	struct operation* operation;
+	int result;
+};
+
+enum operationType {
+	OPERATION_WRITE,
+	OPERATION_SPLICE
+};
+
+/*
+ * I/O of a handler thread; lives on its stack until the reactor marks it done.
+ */
+struct operation {
+	enum operationType type;
+	int fd;
+	bool socket;
+	const struct iovec* iov;
+	int count;
+	int in;
+	int out;
+	const int* pipefd;
+	size_t length;
+	struct part parts[EVENTLOOP_MAX_IOV];
+	int numberOfParts;
+	int pending;
+	bool done;
+	bool cancelled;
+	pthread_cond_t finished;
+	struct operation* next;
+	struct operation* nextCancel;
+};
+
+struct eventLoop {
+	int ringfd;
+	int wakeupfd;
+
+	struct {
+		unsigned* head;
+		unsigned* tail;
+		unsigned mask;
+		unsigned entries;
+		unsigned* array;
+		struct io_uring_sqe* sqes;
+		// filled but not yet submitted
+		unsigned unsubmitted;
+		void* ring;
+		size_t ringSize;
+		size_t sqesSize;
+	} sq;
+
+	struct {
+		unsigned* head;
+		unsigned* tail;
+		unsigned mask;
+		struct io_uring_cqe* cqes;
+		void* ring;
+		size_t ringSize;
+	} cq;
+
+	// provided buffers for reads
+	struct io_uring_buf_ring* bufferRing;
+	size_t bufferRingSize;
+	char* buffers;
+	size_t bufferSize;
+	unsigned short bufferTail;
+
+	struct slot* slots;
+	int numberOfSlots;
+
+	// operations of handler threads
+	pthread_mutex_t lock;
+	struct operation* submitQueue;
+	struct operation* cancelQueue;
+};
+
+// used for the operations of handler threads
+static struct eventLoop* defaultLoop = NULL;
+
+static inline int uringSetup(unsigned entries, struct io_uring_params* params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+	return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static inline int uringRegister(int fd, unsigned opcode, void* arg, unsigned number) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, number);
+}
+
+static void submit(struct eventLoop* loop) {
+	while (loop->sq.unsubmitted > 0) {
+		int tmp = uringEnter(loop->ringfd, loop->sq.unsubmitted, 0, 0, NULL, 0);
+		if (tmp < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			error("eventloop: io_uring_enter: %s", strerror(errno));
+			return;
+		}
+		loop->sq.unsubmitted -= tmp;
+	}
+}
+
+static struct io_uring_sqe* getSqe(struct eventLoop* loop) {
+	unsigned tail = *(loop->sq.tail);
+	if (tail - __atomic_load_n(loop->sq.head, __ATOMIC_ACQUIRE) >= loop->sq.entries) {
+		submit(loop);
+		if (tail - __atomic_load_n(loop->sq.head, __ATOMIC_ACQUIRE) >= loop->sq.entries)
+			return NULL;
+	}
+
+	unsigned index = tail & loop->sq.mask;
+	struct io_uring_sqe* sqe = &(loop->sq.sqes[index]);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	loop->sq.array[index] = index;
+
+	__atomic_store_n(loop->sq.tail, tail + 1, __ATOMIC_RELEASE);
+	loop->sq.unsubmitted++;
+
+	return sqe;
+}
+
+static void provideBuffer(struct eventLoop* loop, int id) {
+	struct io_uring_buf* buffer = &(loop->bufferRing->bufs[loop->bufferTail & (EVENTLOOP_BUFFERS - 1)]);
+	buffer->addr = (uint64_t) (uintptr_t) (loop->buffers + id * loop->bufferSize);
+	buffer->len = loop->bufferSize;
+	buffer->bid = id;
+
+	loop->bufferTail++;
+	__atomic_store_n(&(loop->bufferRing->tail), loop->bufferTail, __ATOMIC_RELEASE);
+}
+
+static int armWakeup(struct eventLoop* loop) {
+	struct io_uring_sqe* sqe = getSqe(loop);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->wakeupfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = TAG_WAKEUP;
+
+	return 0;
+}
+
+struct eventLoop* eventloop_create(size_t bufferSize) {
+	struct eventLoop* loop = malloc(sizeof(struct eventLoop));
+	if (loop == NULL)
+		return NULL;
+
+	*loop = (struct eventLoop) {
+		.ringfd = -1,
+		.wakeupfd = -1,
+		.bufferSize = bufferSize,
+		.slots = NULL,
+		.numberOfSlots = 0,
+		.submitQueue = NULL,
+		.cancelQueue = NULL
+	};
+	pthread_mutex_init(&(loop->lock), NULL);
+
+	struct io_uring_params params = {
+		.flags = IORING_SETUP_CQSIZE,
+		.cq_entries = COMPLETION_ENTRIES
+	};
+	loop->ringfd = uringSetup(RING_ENTRIES, &params);
+	if (loop->ringfd < 0) {
+		error("eventloop: io_uring_setup: %s", strerror(errno));
+		free(loop);
+		return NULL;
+	}
+
+	if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+		error("eventloop: kernel too old for the io_uring backend");
+		close(loop->ringfd);
+		free(loop);
+		return NULL;
+	}
+
+	loop->sq.ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	loop->cq.ringSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (loop->cq.ringSize > loop->sq.ringSize)
+			loop->sq.ringSize = loop->cq.ringSize;
+		loop->cq.ringSize = loop->sq.ringSize;
+	}
+
+	loop->sq.ring = mmap(NULL, loop->sq.ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ringfd, IORING_OFF_SQ_RING);
+	if (loop->sq.ring == MAP_FAILED) {
+		error("eventloop: couldn't map submission queue: %s", strerror(errno));
+		close(loop->ringfd);
+		free(loop);
+		return NULL;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		loop->cq.ring = loop->sq.ring;
+	} else {
+		loop->cq.ring = mmap(NULL, loop->cq.ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ringfd, IORING_OFF_CQ_RING);
+		if (loop->cq.ring == MAP_FAILED) {
+			error("eventloop: couldn't map completion queue: %s", strerror(errno));
+			munmap(loop->sq.ring, loop->sq.ringSize);
+			close(loop->ringfd);
+			free(loop);
+			return NULL;
+		}
+	}
+
+	loop->sq.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	loop->sq.sqes = mmap(NULL, loop->sq.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->ringfd, IORING_OFF_SQES);
+	if (loop->sq.sqes == MAP_FAILED) {
+		error("eventloop: couldn't map submission entries: %s", strerror(errno));
+		eventloop_destroy(loop);
+		return NULL;
+	}
+
+	char* sq = (char*) loop->sq.ring;
+	loop->sq.head = (unsigned*) (sq + params.sq_off.head);
+	loop->sq.tail = (unsigned*) (sq + params.sq_off.tail);
+	loop->sq.mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+	loop->sq.entries = *(unsigned*) (sq + params.sq_off.ring_entries);
+	loop->sq.array = (unsigned*) (sq + params.sq_off.array);
+	loop->sq.unsubmitted = 0;
+
+	char* cq = (char*) loop->cq.ring;
+	loop->cq.head = (unsigned*) (cq + params.cq_off.head);
+	loop->cq.tail = (unsigned*) (cq + params.cq_off.tail);
+	loop->cq.mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+	loop->cq.cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	// provided buffer ring; the kernel picks a buffer once data arrives
+	loop->bufferRingSize = EVENTLOOP_BUFFERS * sizeof(struct io_uring_buf);
+	loop->bufferRing = mmap(NULL, loop->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	loop->buffers = malloc(EVENTLOOP_BUFFERS * bufferSize);
+	if (loop->bufferRing == MAP_FAILED || loop->buffers == NULL) {
+		error("eventloop: couldn't allocate receive buffers: %s", strerror(errno));
+		if (loop->bufferRing == MAP_FAILED)
+			loop->bufferRing = NULL;
+		eventloop_destroy(loop);
+		return NULL;
+	}
+
+	struct io_uring_buf_reg registration = {
+		.ring_addr = (uint64_t) (uintptr_t) loop->bufferRing,
+		.ring_entries = EVENTLOOP_BUFFERS,
+		.bgid = BUFFER_GROUP
+	};
+	if (uringRegister(loop->ringfd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+		error("eventloop: couldn't register buffer ring: %s", strerror(errno));
+		eventloop_destroy(loop);
+		return NULL;
+	}
+
+	loop->bufferTail = 0;
+	for (int i = 0; i < EVENTLOOP_BUFFERS; i++) {
+		provideBuffer(loop, i);
+	}
+
+	loop->wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wakeupfd < 0 || armWakeup(loop) < 0) {
+		error("eventloop: couldn't set up wakeup fd: %s", strerror(errno));
+		eventloop_destroy(loop);
+		return NULL;
+	}
+	submit(loop);
+
+	if (defaultLoop == NULL)
+		defaultLoop = loop;
+
+	return loop;
+}
+
+void eventloop_destroy(struct eventLoop* loop) {
+	if (defaultLoop == loop)
+		defaultLoop = NULL;
+
+	if (loop->wakeupfd >= 0)
+		close(loop->wakeupfd);
+	if (loop->sq.sqes != NULL && loop->sq.sqes != MAP_FAILED)
+		munmap(loop->sq.sqes, loop->sq.sqesSize);
+	if (loop->cq.ring != NULL && loop->cq.ring != loop->sq.ring)
+		munmap(loop->cq.ring, loop->cq.ringSize);
+	if (loop->sq.ring != NULL)
+		munmap(loop->sq.ring, loop->sq.ringSize);
+	close(loop->ringfd);
+
+	if (loop->bufferRing != NULL)
+		munmap(loop->bufferRing, loop->bufferRingSize);
+	free(loop->buffers);
+	free(loop->slots);
+
+	pthread_mutex_destroy(&(loop->lock));
+	free(loop);
+}
+
+const char* eventloop_backend() {
+	return "io_uring";
+}
+
+static struct slot* getSlot(struct eventLoop* loop, int fd) {
+	if (fd >= loop->numberOfSlots) {
+		int number = loop->numberOfSlots == 0 ? 1024 : loop->numberOfSlots;
+		while (number <= fd)
+			number *= 2;
+
+		struct slot* slots = realloc(loop->slots, number * sizeof(struct slot));
+		if (slots == NULL)
+			return NULL;
+
+		for (int i = loop->numberOfSlots; i < number; i++) {
+			slots[i] = (struct slot) {
+				.data = NULL,
+				.pollData = NULL,
+				.socket = -1
+			};
+		}
+		loop->slots = slots;
+		loop->numberOfSlots = number;
+	}
+
+	return &(loop->slots[fd]);
+}
+
+static int armAccept(struct eventLoop* loop, int fd) {
+	struct io_uring_sqe* sqe = getSqe(loop);
+	if (sqe == NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = ((uint64_t) fd << TAG_SHIFT) | TAG_ACCEPT;
+
+	return 0;
+}
+
+int eventloop_accept(struct eventLoop* loop, int fd, void* data) {
+	struct slot* slot = getSlot(loop, fd);
+	if (slot == NULL)
+		return -1;
+	slot->data = data;
+
+	if (armAccept(loop, fd) < 0)
+		return -1;
+
+	submit(loop);
+	return 0;
+}
+
+void eventloop_unaccept(struct eventLoop* loop, int fd) {
+	// the ring keeps the socket open as long as the multishot accept is pending
+	eventloop_cancel(loop, fd, NULL);
+	eventloop_forget(loop, fd);
+}
+
+int eventloop_read(struct eventLoop* loop, int fd, void* data) {
+	struct slot* slot = getSlot(loop, fd);
+	if (slot == NULL)
+		return -1;
+	slot->data = data;
+
+	if (slot->socket < 0) {
+		struct stat stat;
+		slot->socket = fstat(fd, &stat) == 0 && S_ISSOCK(stat.st_mode);
+	}
+
+	if (slot->socket) {
+		struct io_uring_sqe* sqe = getSqe(loop);
+		if (sqe == NULL) {
+			errno = EBUSY;
+			return -1;
+		}
+
+		// the socket is non-blocking, but recv on the ring waits anyway
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->len = loop->bufferSize;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->user_data = ((uint64_t) fd << TAG_SHIFT) | TAG_READ;
+	} else {
+		// reads of non-blocking pipes fail right away; wait for data first
+		struct io_uring_sqe* poll = getSqe(loop);
+		if (poll == NULL) {
+			errno = EBUSY;
+			return -1;
+		}
+		poll->opcode = IORING_OP_POLL_ADD;
+		poll->fd = fd;
+		poll->poll32_events = POLLIN;
+		poll->flags = IOSQE_IO_LINK;
+		poll->user_data = TAG_IGNORE;
+
+		struct io_uring_sqe* sqe = getSqe(loop);
+		if (sqe == NULL) {
+			// the poll is already queued; this cancels it
+			errno = EBUSY;
+			return -1;
+		}
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->off = (uint64_t) -1;
+		sqe->len = loop->bufferSize;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->user_data = ((uint64_t) fd << TAG_SHIFT) | TAG_READ;
+	}
+
+	return 0;
+}
+
+int eventloop_poll(struct eventLoop* loop, int fd, short events, void* data) {
+	struct slot* slot = getSlot(loop, fd);
+	if (slot == NULL)
+		return -1;
+
+	struct io_uring_sqe* sqe = getSqe(loop);
+	if (sqe == NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	slot->pollData = data;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events & (POLLIN | POLLOUT);
+	sqe->user_data = ((uint64_t) fd << TAG_SHIFT) | TAG_POLL;
+
+	return 0;
+}
+
+int eventloop_cancel(struct eventLoop* loop, int fd, void* data) {
+	struct io_uring_sqe* sqe = getSqe(loop);
+	if (sqe == NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = TAG_IGNORE;
+
+	submit(loop);
+	return 0;
+}
+
+void eventloop_forget(struct eventLoop* loop, int fd) {
+	if (fd < 0 || fd >= loop->numberOfSlots)
+		return;
+
+	// the number might be used for something else next time
+	loop->slots[fd] = (struct slot) {
+		.data = NULL,
+		.pollData = NULL,
+		.socket = -1
+	};
+}
+
+void eventloop_release(struct eventLoop* loop, struct event* event) {
+	if (event->bufferId >= 0)
+		provideBuffer(loop, event->bufferId);
+	event->buffer = NULL;
+	event->bufferId = -1;
+}
+
+void eventloop_wakeup(struct eventLoop* loop) {
+	uint64_t one = 1;
+	// if the counter is full there is already a wakeup pending
+	write(loop->wakeupfd, &one, sizeof(one));
+}
+
+static void submitOperation(struct eventLoop* loop, struct operation* operation) {
+	int number = operation->type == OPERATION_WRITE ? operation->count : (operation->pipefd != NULL ? 2 : 1);
+
+	struct io_uring_sqe* sqes[EVENTLOOP_MAX_IOV];
+	for (int i = 0; i < number; i++) {
+		sqes[i] = getSqe(loop);
+		if (sqes[i] == NULL) {
+			// that is what the ring does with the rest of a broken chain as well
+			for (int j = i; j < number; j++) {
+				operation->parts[j].result = -ECANCELED;
+			}
+			number = i;
+			break;
+		}
+	}
+
+	operation->numberOfParts = operation->type == OPERATION_WRITE ? operation->count : (operation->pipefd != NULL ? 2 : 1);
+	operation->pending = number;
+
+	if (number == 0) {
+		operation->done = true;
+		pthread_cond_broadcast(&(operation->finished));
+		return;
+	}
+
+	for (int i = 0; i < number; i++) {
+		struct io_uring_sqe* sqe = sqes[i];
+		struct part* part = &(operation->parts[i]);
+		part->operation = operation;
+
+		if (operation->type == OPERATION_WRITE) {
+			// linked: the next one only starts once this one is complete
+			if (operation->socket) {
+				sqe->opcode = IORING_OP_SEND;
+				// without it a short send completes normally and the next part goes out behind it
+				sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			} else {
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->off = (uint64_t) -1;
+			}
+			sqe->fd = operation->fd;
+			sqe->addr = (uint64_t) (uintptr_t) operation->iov[i].iov_base;
+			sqe->len = operation->iov[i].iov_len;
+		} else {
+			// file -> pipe -> socket if neither side is a pipe
+			sqe->opcode = IORING_OP_SPLICE;
+			sqe->splice_fd_in = i == 0 ? operation->in : operation->pipefd[0];
+			sqe->splice_off_in = (uint64_t) -1;
+			sqe->fd = (i == 0 && operation->pipefd != NULL) ? operation->pipefd[1] : operation->out;
+			sqe->off = (uint64_t) -1;
+			sqe->len = operation->length;
+			sqe->splice_flags = SPLICE_F_MOVE;
+		}
+
+		if (i < number - 1)
+			sqe->flags |= IOSQE_IO_LINK;
+
+		sqe->user_data = (uint64_t) (uintptr_t) part | TAG_PART;
+	}
+}
+
+static void cancelOperation(struct eventLoop* loop, struct operation* operation) {
+	for (int i = 0; i < operation->pending; i++) {
+		struct io_uring_sqe* sqe = getSqe(loop);
+		if (sqe == NULL)
+			return;
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t) (uintptr_t) &(operation->parts[i]) | TAG_PART;
+		sqe->user_data = TAG_IGNORE;
+	}
+}
+
+// hands the queued operations of handler threads to the ring
+static void processOperations(struct eventLoop* loop) {
+	pthread_mutex_lock(&(loop->lock));
+
+	for (struct operation* operation = loop->submitQueue; operation != NULL; operation = operation->next) {
+		submitOperation(loop, operation);
+	}
+	loop->submitQueue = NULL;
+
+	for (struct operation* operation = loop->cancelQueue; operation != NULL; operation = operation->nextCancel) {
+		if (!operation->done)
+			cancelOperation(loop, operation);
+	}
+	loop->cancelQueue = NULL;
+
+	pthread_mutex_unlock(&(loop->lock));
+}
+
+static void completePart(struct eventLoop* loop, struct part* part, int result) {
+	struct operation* operation = part->operation;
+
+	pthread_mutex_lock(&(loop->lock));
+	part->result = result;
+	operation->pending--;
+	if (operation->pending == 0) {
+		// the handler thread might be gone as soon as it sees this
+		struct operation** next = &(loop->cancelQueue);
+		while (*next != NULL) {
+			if (*next == operation) {
+				*next = operation->nextCancel;
+				break;
+			}
+			next = &((*next)->nextCancel);
+		}
+
+		operation->done = true;
+		pthread_cond_broadcast(&(operation->finished));
+	}
+	pthread_mutex_unlock(&(loop->lock));
+}
+
+int eventloop_wait(struct eventLoop* loop, struct event* events, int max, int timeout) {
+	unsigned head = *(loop->cq.head);
+
+	if (head == __atomic_load_n(loop->cq.tail, __ATOMIC_ACQUIRE)) {
+		struct __kernel_timespec time = {
+			.tv_sec = timeout / 1000,
+			.tv_nsec = (timeout % 1000) * 1000000L
+		};
+		struct io_uring_getevents_arg arg = {
+			.ts = timeout < 0 ? 0 : (uint64_t) (uintptr_t) &time
+		};
+
+		// submit and wait in one go
+		int tmp = uringEnter(loop->ringfd, loop->sq.unsubmitted, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (tmp < 0) {
+			if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+				return -1;
+		} else {
+			loop->sq.unsubmitted -= tmp;
+		}
+	} else {
+		submit(loop);
+	}
+
+	int number = 0;
+	unsigned tail = __atomic_load_n(loop->cq.tail, __ATOMIC_ACQUIRE);
+	while (head != tail && number < max) {
+		struct io_uring_cqe* cqe = &(loop->cq.cqes[head & loop->cq.mask]);
+		uint64_t userData = cqe->user_data;
+		int result = cqe->res;
+		unsigned flags = cqe->flags;
+		head++;
+
+		int fd = userData >> TAG_SHIFT;
+
+		switch (userData & TAG_MASK) {
+			case TAG_ACCEPT: {
+				struct slot* slot = getSlot(loop, fd);
+				if (slot == NULL)
+					break;
+
+				if (!(flags & IORING_CQE_F_MORE) && slot->data != NULL && result != -EBADF && result != -EINVAL && result != -ECANCELED) {
+					// multishot accept ends on errors (e.g. too many open files); start over
+					armAccept(loop, fd);
+				}
+
+				events[number++] = (struct event) {
+					.type = EVENT_ACCEPT,
+					.data = slot->data,
+					.result = result,
+					.bufferId = -1
+				};
+				break;
+			}
+			case TAG_READ: {
+				struct slot* slot = getSlot(loop, fd);
+				if (slot == NULL)
+					break;
+
+				if (result == -ENOBUFS) {
+					// all buffers were in use; they are given back before the next wait
+					eventloop_read(loop, fd, slot->data);
+					break;
+				}
+
+				int bufferId = -1;
+				char* buffer = NULL;
+				if (flags & IORING_CQE_F_BUFFER) {
+					bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+					buffer = loop->buffers + bufferId * loop->bufferSize;
+					if (result <= 0) {
+						provideBuffer(loop, bufferId);
+						bufferId = -1;
+						buffer = NULL;
+					}
+				}
+
+				events[number++] = (struct event) {
+					.type = EVENT_READ,
+					.data = slot->data,
+					.result = result,
+					.buffer = buffer,
+					.bufferId = bufferId
+				};
+				break;
+			}
+			case TAG_POLL: {
+				struct slot* slot = getSlot(loop, fd);
+				if (slot == NULL)
+					break;
+
+				events[number++] = (struct event) {
+					.type = EVENT_POLL,
+					.data = slot->pollData,
+					.result = result,
+					.fd = fd,
+					.bufferId = -1
+				};
+				break;
+			}
+			case TAG_WAKEUP: {
+				uint64_t value;
+				read(loop->wakeupfd, &value, sizeof(value));
+
+				if (!(flags & IORING_CQE_F_MORE))
+					armWakeup(loop);
+
+				processOperations(loop);
+
+				events[number++] = (struct event) {
+					.type = EVENT_WAKEUP,
+					.bufferId = -1
+				};
+				break;
+			}
+			case TAG_PART:
+				completePart(loop, (struct part*) (uintptr_t) (userData & ~((uint64_t) TAG_MASK)), result);
+				break;
+			default:
+				// cancellations and polls in front of reads
+				break;
+		}
+	}
+
+	__atomic_store_n(loop->cq.head, head, __ATOMIC_RELEASE);
+
+	return number;
+}
+
+static void abandonOperation(void* _operation) {
+	struct operation* operation = (struct operation*) _operation;
+	struct eventLoop* loop = defaultLoop;
+
+	// the ring must not write to the stack of this thread once it is gone
+	if (!operation->done) {
+		if (!operation->cancelled) {
+			operation->cancelled = true;
+			operation->nextCancel = loop->cancelQueue;
+			loop->cancelQueue = operation;
+			eventloop_wakeup(loop);
+		}
+		while (!operation->done)
+			pthread_cond_wait(&(operation->finished), &(loop->lock));
+	}
+
+	pthread_mutex_unlock(&(loop->lock));
+	pthread_cond_destroy(&(operation->finished));
+}
+
+/*
+ * Runs an operation on the ring and waits for it.
+ * If there is no progress within timeout ms it is cancelled.
+ */
+static void runOperation(struct eventLoop* loop, struct operation* operation, int timeout) {
+	operation->done = false;
+	operation->cancelled = false;
+	operation->next = NULL;
+	operation->nextCancel = NULL;
+	pthread_cond_init(&(operation->finished), NULL);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&(loop->lock));
+	pthread_cleanup_push(&abandonOperation, operation);
+
+	// keep the order of the operations of this thread
+	struct operation** last = &(loop->submitQueue);
+	while (*last != NULL)
+		last = &((*last)->next);
+	*last = operation;
+	eventloop_wakeup(loop);
+
+	while (!operation->done) {
+		if (timeout < 0 || operation->cancelled) {
+			pthread_cond_wait(&(operation->finished), &(loop->lock));
+		} else if (pthread_cond_timedwait(&(operation->finished), &(loop->lock), &deadline) == ETIMEDOUT && !operation->done) {
+			operation->cancelled = true;
+			operation->nextCancel = loop->cancelQueue;
+			loop->cancelQueue = operation;
+			eventloop_wakeup(loop);
+		}
+	}
+
+	pthread_cleanup_pop(1);
+}
+
+static bool isSocket(int fd) {
+	struct stat stat;
+	return fstat(fd, &stat) == 0 && S_ISSOCK(stat.st_mode);
+}
+
+ssize_t eventloop_writev(int fd, const struct iovec* iov, int count, int timeout) {
+	struct eventLoop* loop = defaultLoop;
+	if (loop == NULL)
+		return writevAll(fd, iov, count, timeout);
+
+	if (count > EVENTLOOP_MAX_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct iovec vector[EVENTLOOP_MAX_IOV];
+	memcpy(vector, iov, count * sizeof(struct iovec));
+
+	struct operation operation = {
+		.type = OPERATION_WRITE,
+		.fd = fd,
+		.socket = isSocket(fd),
+		.iov = vector,
+		.count = count
+	};
+
+	ssize_t total = 0;
+	int index = 0;
+	while (index < count) {
+		operation.iov = vector + index;
+		operation.count = count - index;
+		runOperation(loop, &operation, timeout);
+
+		// a short write (or send; see MSG_WAITALL) ends the chain; the rest is cancelled
+		int result = 0;
+		int i;
+		for (i = 0; i < operation.numberOfParts; i++) {
+			result = operation.parts[i].result;
+			if (result < 0)
+				break;
+
+			total += result;
+			if (result < vector[index + i].iov_len) {
+				vector[index + i].iov_base = (char*) vector[index + i].iov_base + result;
+				vector[index + i].iov_len -= result;
+				break;
+			}
+		}
+		index += i;
+
+		if (index < count && result < 0) {
+			if (result == -EINTR || result == -ECANCELED) {
+				if (operation.cancelled) {
+					errno = ETIMEDOUT;
+					return -1;
+				}
+				continue;
+			}
+			if (result == -EAGAIN && waitForFd(fd, POLLOUT, timeout) == 0)
+				continue;
+
+			errno = -result;
+			return -1;
+		}
+	}
+
+	return total;
+}
+
+ssize_t eventloop_splice(int in, int out, const int pipefd[2], size_t length, int timeout) {
+	struct eventLoop* loop = defaultLoop;
+	if (loop == NULL) {
+		if (pipefd == NULL)
+			return spliceSome(in, out, length, timeout);
+
+		ssize_t tmp = spliceSome(in, pipefd[1], length, timeout);
+		if (tmp > 0 && spliceAll(pipefd[0], out, tmp, timeout) != tmp)
+			return -1;
+		return tmp;
+	}
+
+	struct operation operation = {
+		.type = OPERATION_SPLICE,
+		.in = in,
+		.out = out,
+		.pipefd = pipefd,
+		.length = length
+	};
+
+	while (true) {
+		runOperation(loop, &operation, timeout);
+
+		int result = operation.parts[0].result;
+		if (result == -EAGAIN) {
+			if (waitForFd(in, POLLIN, timeout) == 0 && waitForFd(pipefd != NULL ? pipefd[1] : out, POLLOUT, timeout) == 0)
+				continue;
+			return -1;
+		}
+		if (result == -EINTR && !operation.cancelled)
+			continue;
+		if (result < 0) {
+			errno = operation.cancelled ? ETIMEDOUT : -result;
+			return -1;
+		}
+
+		if (pipefd == NULL || result == 0)
+			return result;
+
+		// the pipe has to be empty afterwards; a short splice breaks the chain
+		int moved = operation.parts[1].result;
+		if (moved < 0)
+			moved = 0;
+		if (moved < result && spliceAll(pipefd[0], out, result - moved, timeout) != result - moved)
+			return -1;
+
+		return result;
+	}
+}
+
+#endif
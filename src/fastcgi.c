@@ -0,0 +1,1142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#include "fastcgi.h"
+#include "cgi.h"
+#include "misc.h"
+#include "util.h"
+#include "files.h"
+#include "status.h"
+#include "signals.h"
+#include "logging.h"
+#include "headers.h"
+
+// size of STDIN and PARAMS records we send
+#define FASTCGI_RECORD_CHUNK (8192)
+
+enum slotState {
+	SLOT_FREE, SLOT_ACTIVE, SLOT_ABANDONED
+};
+
+/*
+ * One slot per request id on a worker connection (request id = index + 1).
+ * A slot is free again once the handler is done with it and the worker
+ * has ended the request (or died).
+ */
+struct fastcgiSlot {
+	enum slotState state;
+	// the reader thread writes the STDOUT stream of the request here
+	int fd;
+	bool ended;
+	int appStatus;
+	// STDOUT the handler didn't take yet; only the reader thread uses these
+	char* pending;
+	size_t pendingLength;
+	size_t pendingSize;
+	// END_REQUEST arrived while output was pending; the request ends once it is written
+	bool endPending;
+	int pendingStatus;
+};
+
+struct fastcgiPool;
+
+struct fastcgiWorker {
+	struct fastcgiPool* pool;
+	pid_t pid;
+	int fd;
+	// records must not be split, but records of different requests may interleave
+	pthread_mutex_t writeLock;
+	pthread_t reader;
+	int capacity;
+	int active;
+	bool dead;
+	struct timespec lastUsed;
+	struct fastcgiSlot slots[FASTCGI_MAX_MULTIPLEX];
+};
+
+struct fastcgiPool {
+	char* path;
+	// the handler the pool belongs to; NULL once its config is gone (see fastcgi_retire)
+	const struct fastcgiSettings* owner;
+	// a copy; the config might be freed while the pool is still used
+	struct fastcgiSettings settings;
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	int nrWorkers;
+	// workers that are currently starting; they count towards maxWorkers
+	int spawning;
+	// handlers that got the pool from getPool and aren't done yet; guarded by poolsLock
+	int users;
+	struct fastcgiWorker** workers;
+	struct fastcgiPool* next;
+};
+
+struct fastcgiRequest {
+	struct fastcgiPool* pool;
+	struct fastcgiWorker* worker;
+	int requestId;
+	int fd;
+	char* params;
+	size_t paramsLength;
+};
+
+// pools are prepended by getPool and only removed by the reaper, so the reaper can walk the list without the lock
+static pthread_mutex_t poolsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct fastcgiPool* pools = NULL;
+// the timer might fire again before the last run is done
+static pthread_mutex_t reaperLock = PTHREAD_MUTEX_INITIALIZER;
+static timer_t reaperTimer = TIMER_NULL;
+static int nextSocketId = 0;
+
+static int readAll(int fd, void* buffer, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t tmp = read(fd, ((char*) buffer) + done, length - done);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (tmp == 0)
+			return -1;
+		done += tmp;
+	}
+	return 0;
+}
+
+static int sendAll(int fd, const void* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t tmp = send(fd, buffer, length, MSG_NOSIGNAL);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buffer = ((const char*) buffer) + tmp;
+		length -= tmp;
+	}
+	return 0;
+}
+
+static void setHeader(struct fastcgiHeader* header, int type, int requestId, size_t length) {
+	*header = (struct fastcgiHeader) {
+		.version = FCGI_VERSION_1,
+		.type = type,
+		.requestIdB1 = (requestId >> 8) & 0xff,
+		.requestIdB0 = requestId & 0xff,
+		.contentLengthB1 = (length >> 8) & 0xff,
+		.contentLengthB0 = length & 0xff,
+		.paddingLength = 0,
+		.reserved = 0
+	};
+}
+
+/*
+ * Sends content as one or more records of the given type.
+ * An empty content results in one empty record (end of stream).
+ */
+static int writeRecords(int fd, pthread_mutex_t* lock, int type, int requestId, const char* content, size_t length) {
+	char buffer[FCGI_HEADER_LEN + FASTCGI_RECORD_CHUNK];
+
+	do {
+		size_t chunk = length > FASTCGI_RECORD_CHUNK ? FASTCGI_RECORD_CHUNK : length;
+
+		setHeader((struct fastcgiHeader*) buffer, type, requestId, chunk);
+		if (chunk > 0)
+			memcpy(buffer + FCGI_HEADER_LEN, content, chunk);
+
+		// don't get cancelled while holding the write lock
+		int oldState;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+		if (lock != NULL)
+			pthread_mutex_lock(lock);
+		int tmp = sendAll(fd, buffer, FCGI_HEADER_LEN + chunk);
+		if (lock != NULL)
+			pthread_mutex_unlock(lock);
+		pthread_setcancelstate(oldState, NULL);
+
+		if (tmp < 0)
+			return -1;
+
+		content += chunk;
+		length -= chunk;
+	} while (length > 0);
+
+	return 0;
+}
+
+static size_t encodeLength(unsigned char* buffer, size_t length) {
+	if (length < 0x80) {
+		buffer[0] = length;
+		return 1;
+	}
+
+	buffer[0] = ((length >> 24) & 0x7f) | 0x80;
+	buffer[1] = (length >> 16) & 0xff;
+	buffer[2] = (length >> 8) & 0xff;
+	buffer[3] = length & 0xff;
+	return 4;
+}
+
+static int decodeLength(const unsigned char* buffer, size_t length, size_t* index, size_t* value) {
+	if (*index >= length)
+		return -1;
+
+	if (buffer[*index] < 0x80) {
+		*value = buffer[(*index)++];
+		return 0;
+	}
+
+	if (*index + 4 > length)
+		return -1;
+
+	*value = ((size_t) (buffer[*index] & 0x7f) << 24) | (buffer[*index + 1] << 16) | (buffer[*index + 2] << 8) | buffer[*index + 3];
+	*index += 4;
+	return 0;
+}
+
+static char* encodeParams(struct headers* params, size_t* length) {
+	size_t total = 0;
+	for (int i = 0; i < params->number; i++) {
+		size_t keyLength = strlen(params->headers[i].key);
+		size_t valueLength = strlen(params->headers[i].value);
+		total += (keyLength < 0x80 ? 1 : 4) + (valueLength < 0x80 ? 1 : 4) + keyLength + valueLength;
+	}
+
+	unsigned char* buffer = malloc(total + 1);
+	if (buffer == NULL)
+		return NULL;
+
+	size_t index = 0;
+	for (int i = 0; i < params->number; i++) {
+		size_t keyLength = strlen(params->headers[i].key);
+		size_t valueLength = strlen(params->headers[i].value);
+
+		index += encodeLength(buffer + index, keyLength);
+		index += encodeLength(buffer + index, valueLength);
+		memcpy(buffer + index, params->headers[i].key, keyLength);
+		index += keyLength;
+		memcpy(buffer + index, params->headers[i].value, valueLength);
+		index += valueLength;
+	}
+
+	*length = total;
+	return (char*) buffer;
+}
+
+static long timespecElapsedMs(struct timespec since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+/*
+ * Asks a new worker whether it can multiplex requests on one connection.
+ * Workers that don't answer in time are treated as single request workers.
+ */
+static int handshake(int fd) {
+	unsigned char query[64];
+	size_t queryLength = 0;
+	const char* names[] = { FCGI_MAX_REQS, FCGI_MPXS_CONNS };
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		size_t nameLength = strlen(names[i]);
+		queryLength += encodeLength(query + queryLength, nameLength);
+		queryLength += encodeLength(query + queryLength, 0);
+		memcpy(query + queryLength, names[i], nameLength);
+		queryLength += nameLength;
+	}
+
+	if (writeRecords(fd, NULL, FCGI_GET_VALUES, FCGI_NULL_REQUEST_ID, (char*) query, queryLength) < 0)
+		return -1;
+
+	struct pollfd pollfd = {
+		.fd = fd,
+		.events = POLLIN
+	};
+	int tmp = poll(&pollfd, 1, FASTCGI_HANDSHAKE_TIMEOUT);
+	if (tmp < 0)
+		return -1;
+	if (tmp == 0) {
+		// the answer (if any) will be ignored by the reader thread
+		debug("fastcgi: worker didn't answer FCGI_GET_VALUES");
+		return 1;
+	}
+
+	struct fastcgiHeader header;
+	unsigned char content[FCGI_MAX_CONTENT_LEN + 0xff];
+	if (readAll(fd, &header, FCGI_HEADER_LEN) < 0)
+		return -1;
+	size_t length = (header.contentLengthB1 << 8) | header.contentLengthB0;
+	if (readAll(fd, content, length + header.paddingLength) < 0)
+		return -1;
+
+	if (header.type != FCGI_GET_VALUES_RESULT)
+		return 1;
+
+	long maxRequests = 1;
+	bool multiplex = false;
+
+	size_t index = 0;
+	while (index < length) {
+		size_t nameLength, valueLength;
+		if (decodeLength(content, length, &index, &nameLength) < 0)
+			break;
+		if (decodeLength(content, length, &index, &valueLength) < 0)
+			break;
+		if (index + nameLength + valueLength > length)
+			break;
+
+		char value[32];
+		snprintf(value, sizeof(value), "%.*s", (int) valueLength, content + index + nameLength);
+
+		if (nameLength == strlen(FCGI_MAX_REQS) && memcmp(content + index, FCGI_MAX_REQS, nameLength) == 0) {
+			maxRequests = strtol(value, NULL, 10);
+		} else if (nameLength == strlen(FCGI_MPXS_CONNS) && memcmp(content + index, FCGI_MPXS_CONNS, nameLength) == 0) {
+			multiplex = strtol(value, NULL, 10) != 0;
+		}
+
+		index += nameLength + valueLength;
+	}
+
+	if (!multiplex || maxRequests < 1)
+		return 1;
+
+	return maxRequests > FASTCGI_MAX_MULTIPLEX ? FASTCGI_MAX_MULTIPLEX : maxRequests;
+}
+
+// pool has to be locked
+static void freeSlot(struct fastcgiWorker* worker, struct fastcgiSlot* slot) {
+	slot->state = SLOT_FREE;
+	worker->active--;
+	clock_gettime(CLOCK_MONOTONIC, &(worker->lastUsed));
+
+	pthread_cond_signal(&(worker->pool->available));
+}
+
+// pool has to be locked
+static void endRequest(struct fastcgiWorker* worker, struct fastcgiSlot* slot, int appStatus) {
+	if (slot->fd >= 0) {
+		close(slot->fd);
+		slot->fd = -1;
+	}
+	free(slot->pending);
+	slot->pending = NULL;
+	slot->pendingLength = 0;
+	slot->pendingSize = 0;
+	slot->endPending = false;
+	slot->ended = true;
+	slot->appStatus = appStatus;
+
+	if (slot->state == SLOT_ABANDONED)
+		freeSlot(worker, slot);
+}
+
+/*
+ * Writes as much of the pending output of the slot as the handler takes without blocking.
+ * The output is dropped if the handler is gone. Only called by the reader thread.
+ */
+static void flushSlot(struct fastcgiWorker* worker, struct fastcgiSlot* slot) {
+	size_t done = 0;
+	while (done < slot->pendingLength) {
+		ssize_t tmp = send(slot->fd, slot->pending + done, slot->pendingLength - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				done = slot->pendingLength;
+			break;
+		}
+		done += tmp;
+	}
+
+	memmove(slot->pending, slot->pending + done, slot->pendingLength - done);
+	slot->pendingLength -= done;
+
+	if (slot->pendingLength == 0 && slot->endPending) {
+		pthread_mutex_lock(&(worker->pool->lock));
+		endRequest(worker, slot, slot->pendingStatus);
+		pthread_mutex_unlock(&(worker->pool->lock));
+	}
+}
+
+/*
+ * Hands STDOUT content to the handler. What it doesn't take right away is kept, so the
+ * worker can go on with other requests (or this one) while the handler is busy, e.g.
+ * still sending the request body. Only called by the reader thread.
+ */
+static void queueOutput(struct fastcgiWorker* worker, struct fastcgiSlot* slot, const char* content, size_t length) {
+	if (slot->pendingLength + length > slot->pendingSize) {
+		char* pending = realloc(slot->pending, slot->pendingLength + length);
+		if (pending == NULL) {
+			error("fastcgi: couldn't allocate output buffer: %s", strerror(errno));
+			return;
+		}
+		slot->pending = pending;
+		slot->pendingSize = slot->pendingLength + length;
+	}
+
+	memcpy(slot->pending + slot->pendingLength, content, length);
+	slot->pendingLength += length;
+
+	flushSlot(worker, slot);
+}
+
+/*
+ * Demultiplexes the records of one worker connection.
+ */
+static void* readerThread(void* data) {
+	struct fastcgiWorker* worker = (struct fastcgiWorker*) data;
+	struct fastcgiPool* pool = worker->pool;
+
+	struct fastcgiHeader header;
+	char content[FCGI_MAX_CONTENT_LEN + 0xff + 1];
+
+	while (true) {
+		// output handlers didn't take yet is written as soon as they read
+		struct pollfd fds[1 + FASTCGI_MAX_MULTIPLEX];
+		struct fastcgiSlot* waiting[1 + FASTCGI_MAX_MULTIPLEX];
+		int number = 1;
+		bool full = false;
+		for (int i = 0; i < worker->capacity; i++) {
+			struct fastcgiSlot* slot = &(worker->slots[i]);
+			if (slot->pendingLength == 0)
+				continue;
+			if (slot->pendingLength >= FASTCGI_MAX_PENDING)
+				full = true;
+			waiting[number] = slot;
+			fds[number++] = (struct pollfd) {
+				.fd = slot->fd,
+				.events = POLLOUT
+			};
+		}
+		// no flow control in FastCGI; a handler that doesn't read stalls the worker eventually
+		fds[0] = (struct pollfd) {
+			.fd = full ? -1 : worker->fd,
+			.events = POLLIN
+		};
+
+		if (poll(fds, number, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error("fastcgi: poll failed: %s", strerror(errno));
+			break;
+		}
+
+		for (int i = 1; i < number; i++) {
+			if (fds[i].revents != 0)
+				flushSlot(worker, waiting[i]);
+		}
+
+		if (fds[0].revents == 0)
+			continue;
+
+		if (readAll(worker->fd, &header, FCGI_HEADER_LEN) < 0)
+			break;
+
+		size_t length = (header.contentLengthB1 << 8) | header.contentLengthB0;
+		int requestId = (header.requestIdB1 << 8) | header.requestIdB0;
+
+		if (readAll(worker->fd, content, length + header.paddingLength) < 0)
+			break;
+
+		struct fastcgiSlot* slot = NULL;
+		if (requestId >= 1 && requestId <= worker->capacity)
+			slot = &(worker->slots[requestId - 1]);
+
+		switch(header.type) {
+			case FCGI_STDOUT:
+				// the slot fd is only closed by this thread
+				// if the handler is gone the send fails; that's fine
+				if (slot != NULL && slot->fd >= 0 && length > 0)
+					queueOutput(worker, slot, content, length);
+				break;
+			case FCGI_STDERR:
+				while (length > 0 && (content[length - 1] == '\n' || content[length - 1] == '\r'))
+					length--;
+				content[length] = '\0';
+				if (length > 0)
+					warn("fastcgi: %s: %s", pool->path, content);
+				break;
+			case FCGI_END_REQUEST:
+				if (slot == NULL)
+					break;
+
+				int appStatus = 0;
+				if (length >= 4) {
+					unsigned char* body = (unsigned char*) content;
+					appStatus = (body[0] << 24) | (body[1] << 16) | (body[2] << 8) | body[3];
+				}
+
+				if (slot->pendingLength > 0) {
+					// the handler gets EOF once it has the rest (see flushSlot)
+					slot->endPending = true;
+					slot->pendingStatus = appStatus;
+					break;
+				}
+
+				pthread_mutex_lock(&(pool->lock));
+				endRequest(worker, slot, appStatus);
+				pthread_mutex_unlock(&(pool->lock));
+				break;
+			default:
+				debug("fastcgi: ignoring record of type %d", header.type);
+				break;
+		}
+	}
+
+	debug("fastcgi: connection to worker %d closed", worker->pid);
+
+	pthread_mutex_lock(&(pool->lock));
+	worker->dead = true;
+	for (int i = 0; i < worker->capacity; i++) {
+		if (worker->slots[i].state != SLOT_FREE && !worker->slots[i].ended)
+			endRequest(worker, &(worker->slots[i]), -1);
+	}
+	pthread_cond_broadcast(&(pool->available));
+	pthread_mutex_unlock(&(pool->lock));
+
+	return NULL;
+}
+
+static void stopWorker(struct fastcgiWorker* worker) {
+	pthread_join(worker->reader, NULL);
+	close(worker->fd);
+
+	// give the worker a moment to exit on its own
+	int status;
+	int tmp = 0;
+	for (int i = 0; i < 10 && (tmp = waitpid(worker->pid, &status, WNOHANG)) == 0; i++) {
+		usleep(10000);
+	}
+	if (tmp == 0) {
+		warn("fastcgi: worker %d didn't terminate; killing it", worker->pid);
+		kill(worker->pid, SIGKILL);
+		waitpid(worker->pid, &status, 0);
+	}
+
+	pthread_mutex_destroy(&(worker->writeLock));
+	free(worker);
+}
+
+/*
+ * The worker gets a listening unix socket as fd 0 (FCGI_LISTENSOCK_FILENO).
+ * It is spawned like a CGI script, so it doesn't inherit client connections.
+ * We use the abstract namespace, so there is no file to clean up.
+ */
+static struct fastcgiWorker* spawnWorker(struct fastcgiPool* pool) {
+	struct sockaddr_un address = {
+		.sun_family = AF_UNIX
+	};
+	int id = __atomic_fetch_add(&nextSocketId, 1, __ATOMIC_RELAXED);
+	int nameLength = snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1, "cfloor-fastcgi-%d-%d", getpid(), id);
+	socklen_t addressLength = offsetof(struct sockaddr_un, sun_path) + 1 + nameLength;
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		error("fastcgi: couldn't create socket: %s", strerror(errno));
+		return NULL;
+	}
+
+	if (bind(listenFd, (struct sockaddr*) &address, addressLength) < 0 || listen(listenFd, 1) < 0) {
+		error("fastcgi: couldn't set up worker socket: %s", strerror(errno));
+		close(listenFd);
+		return NULL;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		error("fastcgi: couldn't create socket: %s", strerror(errno));
+		close(listenFd);
+		return NULL;
+	}
+
+	// the backlog takes the connection until the worker accepts
+	if (connect(fd, (struct sockaddr*) &address, addressLength) < 0) {
+		error("fastcgi: couldn't connect to worker socket: %s", strerror(errno));
+		close(fd);
+		close(listenFd);
+		return NULL;
+	}
+
+	pid_t pid;
+	int tmp = cgi_spawn(pool->path, listenFd, -1, NULL, &pid);
+	if (tmp != 0) {
+		error("fastcgi: failed to start %s: %s", pool->path, strerror(tmp));
+		close(fd);
+		close(listenFd);
+		return NULL;
+	}
+
+	close(listenFd);
+
+	int capacity = handshake(fd);
+	if (capacity < 0) {
+		error("fastcgi: worker %s (%d) failed to start", pool->path, pid);
+		close(fd);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return NULL;
+	}
+
+	struct fastcgiWorker* worker = malloc(sizeof(struct fastcgiWorker));
+	if (worker == NULL) {
+		error("fastcgi: couldn't allocate for worker: %s", strerror(errno));
+		close(fd);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return NULL;
+	}
+
+	worker->pool = pool;
+	worker->pid = pid;
+	worker->fd = fd;
+	worker->capacity = capacity;
+	worker->active = 0;
+	worker->dead = false;
+	clock_gettime(CLOCK_MONOTONIC, &(worker->lastUsed));
+	for (int i = 0; i < FASTCGI_MAX_MULTIPLEX; i++) {
+		worker->slots[i] = (struct fastcgiSlot) {
+			.state = SLOT_FREE,
+			.fd = -1,
+			.ended = true,
+			.appStatus = 0
+		};
+	}
+	pthread_mutex_init(&(worker->writeLock), NULL);
+
+	if (pthread_create(&(worker->reader), NULL, &readerThread, worker) != 0) {
+		error("fastcgi: couldn't start reader thread");
+		close(fd);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		pthread_mutex_destroy(&(worker->writeLock));
+		free(worker);
+		return NULL;
+	}
+
+	info("fastcgi: started worker %d for %s (%d concurrent requests)", pid, pool->path, capacity);
+
+	return worker;
+}
+
+/*
+ * Spawns a worker without holding the pool lock; the lock has to be held on entry.
+ */
+static struct fastcgiWorker* growPool(struct fastcgiPool* pool) {
+	int oldState;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+
+	pool->spawning++;
+	pthread_mutex_unlock(&(pool->lock));
+
+	struct fastcgiWorker* worker = spawnWorker(pool);
+
+	pthread_mutex_lock(&(pool->lock));
+	pool->spawning--;
+
+	if (worker != NULL) {
+		pool->workers[pool->nrWorkers++] = worker;
+	}
+
+	pthread_setcancelstate(oldState, NULL);
+
+	return worker;
+}
+
+static void reapPool(struct fastcgiPool* pool) {
+	const struct fastcgiSettings* settings = &(pool->settings);
+
+	struct fastcgiWorker* stopped[settings->maxWorkers];
+	int nrStopped = 0;
+
+	pthread_mutex_lock(&(pool->lock));
+
+	int alive = 0;
+	for (int i = 0; i < pool->nrWorkers; i++) {
+		if (!pool->workers[i]->dead)
+			alive++;
+	}
+
+	for (int i = pool->nrWorkers - 1; i >= 0; i--) {
+		struct fastcgiWorker* worker = pool->workers[i];
+
+		if (!worker->dead && worker->active == 0 && alive > settings->minWorkers && timespecElapsedMs(worker->lastUsed) > settings->idleTimeout) {
+			info("fastcgi: stopping idle worker %d", worker->pid);
+
+			kill(worker->pid, SIGTERM);
+			// the reader thread notices and marks the worker dead
+			shutdown(worker->fd, SHUT_RDWR);
+			alive--;
+			continue;
+		}
+
+		if (worker->dead && worker->active == 0) {
+			pool->workers[i] = pool->workers[--(pool->nrWorkers)];
+			stopped[nrStopped++] = worker;
+		}
+	}
+
+	if (nrStopped > 0)
+		pthread_cond_broadcast(&(pool->available));
+
+	// workers that are being started by request threads count as well; workers has room for maxWorkers only
+	if (alive + pool->spawning < settings->minWorkers && pool->nrWorkers + pool->spawning < settings->maxWorkers) {
+		growPool(pool);
+	}
+
+	pthread_mutex_unlock(&(pool->lock));
+
+	for (int i = 0; i < nrStopped; i++) {
+		stopWorker(stopped[i]);
+	}
+}
+
+/*
+ * Pools of an old config (see fastcgi_retire) are freed once their last worker stopped
+ * and no handler uses them anymore.
+ */
+static void freeRetiredPools() {
+	pthread_mutex_lock(&poolsLock);
+
+	struct fastcgiPool** link = &pools;
+	while (*link != NULL) {
+		struct fastcgiPool* pool = *link;
+
+		pthread_mutex_lock(&(pool->lock));
+		bool unused = pool->owner == NULL && pool->users == 0 && pool->nrWorkers == 0 && pool->spawning == 0;
+		pthread_mutex_unlock(&(pool->lock));
+
+		if (!unused) {
+			link = &(pool->next);
+			continue;
+		}
+
+		*link = pool->next;
+
+		debug("fastcgi: freeing retired pool of %s", pool->path);
+		pthread_mutex_destroy(&(pool->lock));
+		pthread_cond_destroy(&(pool->available));
+		free(pool->path);
+		free(pool->workers);
+		free(pool);
+	}
+
+	pthread_mutex_unlock(&poolsLock);
+}
+
+static void reaper() {
+	if (pthread_mutex_trylock(&reaperLock) != 0)
+		return;
+
+	pthread_mutex_lock(&poolsLock);
+	struct fastcgiPool* pool = pools;
+	pthread_mutex_unlock(&poolsLock);
+
+	for (; pool != NULL; pool = pool->next) {
+		reapPool(pool);
+	}
+
+	freeRetiredPools();
+
+	pthread_mutex_unlock(&reaperLock);
+}
+
+static struct fastcgiPool* getPool(const char* path, const struct fastcgiSettings* settings) {
+	pthread_mutex_lock(&poolsLock);
+
+	struct fastcgiPool* pool = pools;
+	for (; pool != NULL; pool = pool->next) {
+		if (pool->owner == settings && strcmp(pool->path, path) == 0)
+			break;
+	}
+
+	if (pool != NULL) {
+		pool->users++;
+		pthread_mutex_unlock(&poolsLock);
+		return pool;
+	}
+
+	pool = malloc(sizeof(struct fastcgiPool));
+	if (pool == NULL) {
+		error("fastcgi: couldn't allocate for pool: %s", strerror(errno));
+		pthread_mutex_unlock(&poolsLock);
+		return NULL;
+	}
+
+	pool->path = strdup(path);
+	pool->workers = malloc(settings->maxWorkers * sizeof(struct fastcgiWorker*));
+	if (pool->path == NULL || pool->workers == NULL) {
+		error("fastcgi: couldn't allocate for pool: %s", strerror(errno));
+		free(pool->path);
+		free(pool->workers);
+		free(pool);
+		pthread_mutex_unlock(&poolsLock);
+		return NULL;
+	}
+
+	pool->owner = settings;
+	pool->settings = *settings;
+	// belongs to the config
+	pool->settings.documentRoot = NULL;
+	pool->nrWorkers = 0;
+	pool->spawning = 0;
+	pool->users = 1;
+	pthread_mutex_init(&(pool->lock), NULL);
+	pthread_cond_init(&(pool->available), NULL);
+
+	pool->next = pools;
+	pools = pool;
+
+	if (reaperTimer == TIMER_NULL) {
+		reaperTimer = timer_createThreadTimer(&reaper);
+		if (reaperTimer == TIMER_NULL) {
+			error("fastcgi: couldn't create reaper timer; idle workers will not be stopped");
+		} else {
+			timer_startInterval(reaperTimer, FASTCGI_REAPER_INTERVAL);
+		}
+	}
+
+	pthread_mutex_unlock(&poolsLock);
+
+	return pool;
+}
+
+// the handler is done with the pool
+static void releasePool(struct fastcgiPool* pool) {
+	pthread_mutex_lock(&poolsLock);
+	pool->users--;
+	pthread_mutex_unlock(&poolsLock);
+}
+
+static void unlockPool(void* data) {
+	pthread_mutex_unlock(&(((struct fastcgiPool*) data)->lock));
+}
+
+/*
+ * Returns 0 if a slot was acquired, -1 if the queue timeout hit
+ * and -2 if no worker could be started.
+ */
+static int acquireSlot(struct fastcgiRequest* request) {
+	struct fastcgiPool* pool = request->pool;
+	const struct fastcgiSettings* settings = &(pool->settings);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += settings->queueTimeout / 1000;
+	deadline.tv_nsec += (settings->queueTimeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	int result = -1;
+
+	pthread_mutex_lock(&(pool->lock));
+	pthread_cleanup_push(&unlockPool, pool);
+
+	while (true) {
+		// least busy worker first
+		struct fastcgiWorker* worker = NULL;
+		for (int i = 0; i < pool->nrWorkers; i++) {
+			struct fastcgiWorker* candidate = pool->workers[i];
+			if (candidate->dead || candidate->active >= candidate->capacity)
+				continue;
+			if (worker == NULL || candidate->active < worker->active)
+				worker = candidate;
+		}
+
+		if (worker != NULL) {
+			for (int i = 0; i < worker->capacity; i++) {
+				struct fastcgiSlot* slot = &(worker->slots[i]);
+				if (slot->state != SLOT_FREE)
+					continue;
+
+				slot->state = SLOT_ACTIVE;
+				slot->ended = false;
+				slot->endPending = false;
+				slot->fd = -1;
+				worker->active++;
+
+				request->worker = worker;
+				request->requestId = i + 1;
+				break;
+			}
+
+			result = 0;
+			break;
+		}
+
+		if (pool->nrWorkers + pool->spawning < settings->maxWorkers) {
+			if (growPool(pool) == NULL) {
+				result = -2;
+				break;
+			}
+			continue;
+		}
+
+		if (pthread_cond_timedwait(&(pool->available), &(pool->lock), &deadline) == ETIMEDOUT) {
+			result = -1;
+			break;
+		}
+	}
+
+	pthread_cleanup_pop(1);
+
+	return result;
+}
+
+static void releaseSlot(struct fastcgiRequest* request) {
+	struct fastcgiPool* pool = request->pool;
+	struct fastcgiWorker* worker = request->worker;
+	struct fastcgiSlot* slot = &(worker->slots[request->requestId - 1]);
+
+	bool abort = false;
+
+	pthread_mutex_lock(&(pool->lock));
+	if (slot->ended) {
+		debug("fastcgi: request %d on worker %d finished with status %d", request->requestId, worker->pid, slot->appStatus);
+		freeSlot(worker, slot);
+	} else {
+		// the id stays in use until the worker confirms the abort
+		slot->state = SLOT_ABANDONED;
+		abort = true;
+	}
+	pthread_mutex_unlock(&(pool->lock));
+
+	if (abort) {
+		debug("fastcgi: aborting request %d on worker %d", request->requestId, worker->pid);
+		writeRecords(worker->fd, &(worker->writeLock), FCGI_ABORT_REQUEST, request->requestId, NULL, 0);
+	}
+}
+
+static void cleanupRequest(void* data) {
+	struct fastcgiRequest* request = (struct fastcgiRequest*) data;
+
+	if (request->fd >= 0)
+		close(request->fd);
+
+	if (request->worker != NULL)
+		releaseSlot(request);
+
+	free(request->params);
+
+	if (request->pool != NULL)
+		releasePool(request->pool);
+}
+
+/*
+ * Hands the write end of pair to the reader thread. Fails if the worker died since the slot
+ * was acquired; the reader thread ended the slot then and would never close the fd.
+ */
+static int attachSlot(struct fastcgiRequest* request, int pair[2]) {
+	struct fastcgiPool* pool = request->pool;
+	struct fastcgiSlot* slot = &(request->worker->slots[request->requestId - 1]);
+
+	request->fd = pair[0];
+
+	pthread_mutex_lock(&(pool->lock));
+	bool gone = request->worker->dead || slot->ended;
+	if (!gone)
+		slot->fd = pair[1];
+	pthread_mutex_unlock(&(pool->lock));
+
+	if (gone) {
+		close(pair[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int forwardBody(struct fastcgiRequest* fastcgiRequest, struct request request) {
+	struct fastcgiWorker* worker = fastcgiRequest->worker;
+
+	// the request body is already decoded; it ends with EOF
+	char buffer[FASTCGI_RECORD_CHUNK];
+	while (true) {
+		ssize_t tmp = read(request.fd, buffer, FASTCGI_RECORD_CHUNK);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			error("fastcgi: couldn't read request body: %s", strerror(errno));
+			return -1;
+		}
+		if (tmp == 0)
+			break;
+
+		if (writeRecords(worker->fd, &(worker->writeLock), FCGI_STDIN, fastcgiRequest->requestId, buffer, tmp) < 0)
+			return -1;
+	}
+
+	return writeRecords(worker->fd, &(worker->writeLock), FCGI_STDIN, fastcgiRequest->requestId, NULL, 0);
+}
+
+static int sendRequest(struct fastcgiRequest* fastcgiRequest, struct request request) {
+	struct fastcgiWorker* worker = fastcgiRequest->worker;
+	int requestId = fastcgiRequest->requestId;
+
+	unsigned char begin[8] = {
+		0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0
+	};
+
+	if (writeRecords(worker->fd, &(worker->writeLock), FCGI_BEGIN_REQUEST, requestId, (char*) begin, sizeof(begin)) < 0)
+		return -1;
+
+	if (fastcgiRequest->paramsLength > 0) {
+		if (writeRecords(worker->fd, &(worker->writeLock), FCGI_PARAMS, requestId, fastcgiRequest->params, fastcgiRequest->paramsLength) < 0)
+			return -1;
+	}
+	if (writeRecords(worker->fd, &(worker->writeLock), FCGI_PARAMS, requestId, NULL, 0) < 0)
+		return -1;
+
+	return forwardBody(fastcgiRequest, request);
+}
+
+void fastcgiHandler(struct request request, struct response response) {
+	struct fastcgiSettings* settings = (struct fastcgiSettings*) request.userData.ptr;
+	const char* documentRoot = settings->documentRoot;
+
+	char* path = normalizePath(request, response, documentRoot);
+	if (path == NULL)
+		return;
+
+	if (access(path, F_OK | X_OK) < 0) {
+		free(path);
+
+		switch(errno) {
+			case EACCES:
+				warn("fastcgi: file is not executable");
+				status(request, response, 403);
+				return;
+			default:
+				error("fastcgi: Couldn't access file: %s", strerror(errno));
+				status(request, response, 500);
+				return;
+		}
+	}
+
+	struct stat statObj;
+	if (stat(path, &statObj) < 0 || !S_ISREG(statObj.st_mode)) {
+		free(path);
+
+		error("fastcgi: Not a regular file");
+		status(request, response, 403);
+		return;
+	}
+
+	struct fastcgiRequest fastcgiRequest = {
+		.pool = getPool(path, settings),
+		.worker = NULL,
+		.requestId = 0,
+		.fd = -1,
+		.params = NULL,
+		.paramsLength = 0
+	};
+
+	struct headers env = headers_create();
+	if (fastcgiRequest.pool == NULL
+		|| cgi_buildEnvironment(&env, request, documentRoot) < 0
+		|| headers_mod(&env, "SCRIPT_FILENAME", path) < 0
+		|| (fastcgiRequest.params = encodeParams(&env, &(fastcgiRequest.paramsLength))) == NULL
+	) {
+		error("fastcgi: couldn't prepare request");
+		status(request, response, 500);
+
+		if (fastcgiRequest.pool != NULL)
+			releasePool(fastcgiRequest.pool);
+		headers_free(&env);
+		free(path);
+		return;
+	}
+
+	headers_free(&env);
+	free(path);
+
+	// the pool is released here as well; acquireSlot might wait
+	pthread_cleanup_push(&cleanupRequest, &fastcgiRequest);
+
+	int tmp = acquireSlot(&fastcgiRequest);
+	int pair[2];
+	if (tmp == -1) {
+		warn("fastcgi: all workers busy; rejecting request");
+		status(request, response, 503);
+	} else if (tmp < 0) {
+		status(request, response, 502);
+	} else if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		error("fastcgi: couldn't create socket pair: %s", strerror(errno));
+		status(request, response, 500);
+	} else if (attachSlot(&fastcgiRequest, pair) < 0) {
+		error("fastcgi: worker %d died before the request was sent", fastcgiRequest.worker->pid);
+		status(request, response, 502);
+	} else {
+		struct headers headers = headers_create();
+		struct cgiBuffer buffer;
+		int statusCode;
+
+		if (sendRequest(&fastcgiRequest, request) < 0) {
+			error("fastcgi: couldn't send request to worker %d", fastcgiRequest.worker->pid);
+			status(request, response, 502);
+		} else if (cgi_readHeaders(fastcgiRequest.fd, &headers, &statusCode, &buffer) < 0) {
+			error("fastcgi: error while reading header");
+			status(request, response, 502);
+		} else {
+			int fd = response.sendHeader(statusCode, &headers, &request);
+			if (fd >= 0) {
+				cgi_forwardBody(&buffer, fastcgiRequest.fd, fd);
+				close(fd);
+			}
+		}
+
+		headers_free(&headers);
+	}
+
+	pthread_cleanup_pop(1);
+}
+
+/*
+ * The settings are about to be freed (e.g. the config was reloaded). Their pools don't get new
+ * requests anymore; the workers are stopped once they are idle and the pools are freed after that.
+ */
+void fastcgi_retire(const struct fastcgiSettings* settings) {
+	pthread_mutex_lock(&poolsLock);
+	for (struct fastcgiPool* pool = pools; pool != NULL; pool = pool->next) {
+		if (pool->owner != settings)
+			continue;
+
+		pthread_mutex_lock(&(pool->lock));
+		pool->owner = NULL;
+		pool->settings.minWorkers = 0;
+		pool->settings.idleTimeout = 0;
+		pthread_mutex_unlock(&(pool->lock));
+	}
+	pthread_mutex_unlock(&poolsLock);
+}
+
+/*
+ * Called on shutdown. Workers would otherwise wait for connections forever.
+ */
+void fastcgi_destroy() {
+	if (reaperTimer != TIMER_NULL) {
+		timer_stop(reaperTimer);
+	}
+
+	pthread_mutex_lock(&poolsLock);
+	for (struct fastcgiPool* pool = pools; pool != NULL; pool = pool->next) {
+		for (int i = 0; i < pool->nrWorkers; i++) {
+			kill(pool->workers[i]->pid, SIGTERM);
+		}
+	}
+	pthread_mutex_unlock(&poolsLock);
+}
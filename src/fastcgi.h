@@ -0,0 +1,80 @@
+#ifndef FASTCGI_H
+#define FASTCGI_H
+
+#include "misc.h"
+
+#define FASTCGI_HANDLER_NO (3)
+
+#define FASTCGI_DEFAULT_MIN_WORKERS (1)
+#define FASTCGI_DEFAULT_MAX_WORKERS (4)
+// in ms
+#define FASTCGI_DEFAULT_IDLE_TIMEOUT (60000)
+#define FASTCGI_DEFAULT_QUEUE_TIMEOUT (5000)
+
+// upper limit for concurrent requests on one worker connection
+#define FASTCGI_MAX_MULTIPLEX (16)
+// output of one request that is kept while its handler doesn't take it; beyond that the whole worker waits
+#define FASTCGI_MAX_PENDING (4 * 1024 * 1024)
+
+// how long a new worker gets to answer FCGI_GET_VALUES (in ms)
+#define FASTCGI_HANDSHAKE_TIMEOUT (1000)
+#define FASTCGI_REAPER_INTERVAL (1000)
+
+/*
+ * FastCGI 1.0 wire format
+ */
+#define FCGI_VERSION_1 (1)
+#define FCGI_HEADER_LEN (8)
+#define FCGI_MAX_CONTENT_LEN (0xffff)
+
+#define FCGI_BEGIN_REQUEST (1)
+#define FCGI_ABORT_REQUEST (2)
+#define FCGI_END_REQUEST (3)
+#define FCGI_PARAMS (4)
+#define FCGI_STDIN (5)
+#define FCGI_STDOUT (6)
+#define FCGI_STDERR (7)
+#define FCGI_DATA (8)
+#define FCGI_GET_VALUES (9)
+#define FCGI_GET_VALUES_RESULT (10)
+#define FCGI_UNKNOWN_TYPE (11)
+
+#define FCGI_NULL_REQUEST_ID (0)
+
+#define FCGI_RESPONDER (1)
+#define FCGI_KEEP_CONN (1)
+
+#define FCGI_REQUEST_COMPLETE (0)
+#define FCGI_CANT_MPX_CONN (1)
+#define FCGI_OVERLOADED (2)
+#define FCGI_UNKNOWN_ROLE (3)
+
+#define FCGI_MAX_CONNS "FCGI_MAX_CONNS"
+#define FCGI_MAX_REQS "FCGI_MAX_REQS"
+#define FCGI_MPXS_CONNS "FCGI_MPXS_CONNS"
+
+struct fastcgiHeader {
+	unsigned char version;
+	unsigned char type;
+	unsigned char requestIdB1;
+	unsigned char requestIdB0;
+	unsigned char contentLengthB1;
+	unsigned char contentLengthB0;
+	unsigned char paddingLength;
+	unsigned char reserved;
+};
+
+struct fastcgiSettings {
+	const char* documentRoot;
+	long minWorkers;
+	long maxWorkers;
+	long idleTimeout;
+	long queueTimeout;
+};
+
+void fastcgiHandler(struct request, struct response);
+
+void fastcgi_retire(const struct fastcgiSettings* settings);
+void fastcgi_destroy();
+
+#endif
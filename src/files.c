@@ -8,7 +8,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
+#include <sys/uio.h>
 
 #include "files.h"
 #include "misc.h"
@@ -16,240 +16,280 @@
 #include "logging.h"
 #include "status.h"
 #include "mime.h"
+#include "listing.h"
 
 
-int scandirFiler(const struct dirent* entry) {
-	if (strcmp(entry->d_name, "..") == 0)
+// the page of a listing from a query string like "page=2"; 1 if there is none
+static long getPageNumber(const char* queryString) {
+	if (queryString == NULL)
 		return 1;
-	if (strncmp(entry->d_name, ".", 1) == 0)
-		return 0;
+
+	for (const char* c = queryString; c != NULL; c = strchr(c, '&')) {
+		if (*c == '&')
+			c++;
+		if (strncmp(c, "page=", 5) == 0)
+			return strtol(c + 5, NULL, 10);
+	}
+
 	return 1;
 }
 
-int scandirSort(const struct dirent** a, const struct dirent** b) {
-	if ((*a)->d_type == DT_DIR && (*b)->d_type != DT_DIR)
-		return -1; 
-	if ((*a)->d_type != DT_DIR && (*b)->d_type == DT_DIR)
-		return 1;
+// the answer to paths outside of the document root
+static int sendNotAnIdiot(struct request* request, sendResponse_t sendResponse) {
+	static const char* text = "Status 400\nYou know... I'm not an idiot...\n";
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Type", "text/plain");
+	struct iovec body = {
+		.iov_base = (void*) text,
+		.iov_len = strlen(text)
+	};
+	int result = sendResponse(400, &headers, &body, 1, request);
+	headers_free(&headers);
 
-	return strcmp((*a)->d_name, (*b)->d_name); 
+	return result;
 }
 
-void freeDirent(struct dirent** list, int number) {
-	if (list == NULL || number == 0)
-		return;
+void fuckyouHandler(struct request request, struct response response) {
+	sendNotAnIdiot(&request, response.sendResponse);
+}
 
-	for(int i = 0; i < number; i++) {
-		free(list[i]);
-	}
-	free(list);
+int sendPathError(struct request* request, sendResponse_t sendResponse, int status) {
+	if (status == 400)
+		return sendNotAnIdiot(request, sendResponse);
+
+	return status_send(request, sendResponse, status);
 }
 
-int showIndex(int fd, const char* path, const char* documentRoot) {
-	// TODO check for htmml entities
+static enum reactorResult sendError(struct request* request, struct reactorResponse response, int status) {
+	return sendPathError(request, response.sendResponse, status) < 0 ? REACTOR_ERROR : REACTOR_DONE;
+}
 
-	const char* relative = path + strlen(documentRoot);
+/*
+ * The first index file in the directory path that is a regular file; NULL if there is none.
+ * statObj is set to the stat of the file.
+ */
+static char* findIndex(const struct fileSettings* settings, const char* path, struct stat* statObj) {
+	struct stat statObjFile;
+
+	for (int i = 0; i < settings->indexfiles.number; i++) {
+		char* filepath = malloc(strlen(path) + 1 + strlen(settings->indexfiles.files[i]) + 1);
+		if (filepath == NULL) {
+			error("files: Couldn't allocate memory for index file check: %s", strerror(errno));
+			warn("files: ignoring");
+			continue;
+		}
+		strcpy(filepath, path);
+		strcat(filepath, "/");
+		strcat(filepath, settings->indexfiles.files[i]);
 
-	struct dirent** list;
-	int number = scandir(path, &list, &scandirFiler, &scandirSort);
+		debug("files: searching for index: %s", filepath);
 
-	if (number < 0) {
-		error("files: Couldn't read dir: %s", strerror(errno));
-		return -1;
+		if (access(filepath, F_OK | R_OK) == 0 && stat(filepath, &statObjFile) == 0) {
+			if (S_ISREG(statObjFile.st_mode)) {
+				debug("files: found index file: %s", filepath);
+				*statObj = statObjFile;
+				return filepath;
+			}
+		}
+		free(filepath);
 	}
 
-	FILE* stream = fdopen(fd, "w");
-	if (stream == NULL) {
-		freeDirent(list, number);
-		error("files: Couldn't get stream from fd: %s", strerror(errno));
-		return -1;
-	}
+	return NULL;
+}
 
-	fprintf(stream, "<!DOCTYPE html>\n");
-	fprintf(stream, "<html>\n");
-	fprintf(stream, "	<head>\n");
-	fprintf(stream, "		<title>Index of %s/</title>\n", relative);
-	fprintf(stream, "	</head>\n");
-	fprintf(stream, "	<body>\n");
-	fprintf(stream, "		<h1>Index of %s/</h1>\n", relative);
-	fprintf(stream, "		<table>\n");
-	fprintf(stream, "			<tr>\n");
-	fprintf(stream, "				<th>Type</th>\n");
-	fprintf(stream, "				<th>File</th>\n");
-	fprintf(stream, "			</tr>\n");
-
-	for(int i = 0; i < number; i++) {
-		struct dirent* entry = list[i];
-		if (strcmp(entry->d_name, "..") == 0 && strcmp(relative, "") == 0)
+struct fileState {
+	int fd;
+	off_t offset;
+	off_t size;
+};
+
+// reads the next part of the file into buffer (FILE_CHUNK_SIZE bytes); returns its length or -1
+static ssize_t readChunk(struct fileState* state, char* buffer) {
+	size_t length = state->size - state->offset;
+	if (length > FILE_CHUNK_SIZE)
+		length = FILE_CHUNK_SIZE;
+
+	while (true) {
+		ssize_t tmp = pread(state->fd, buffer, length, state->offset);
+		if (tmp < 0 && errno == EINTR)
 			continue;
-		fprintf(stream, "			<tr>\n");
-		fprintf(stream, "				<td>%s</td>\n", (entry->d_type == DT_DIR) ? "D" : "");
-		fprintf(stream, "				<td><a href='%s/%s'>%s</a></td>\n", relative, entry->d_name, entry->d_name);
-		fprintf(stream, "			</tr>\n");
+		if (tmp <= 0) {
+			// the length is already announced
+			error("files: Couldn't read file: %s", tmp < 0 ? strerror(errno) : "file got shorter");
+			return -1;
+		}
+
+		state->offset += tmp;
+		return tmp;
 	}
-	
-	fprintf(stream, "		<table>\n");
-	fprintf(stream, "	</body>\n");
-	fprintf(stream, "</html>\n");
+}
 
-	fclose(stream);
+static enum reactorResult sendListing(struct request* request, struct reactorResponse response, const char* path, const struct stat* statObj) {
+	struct fileSettings* settings = (struct fileSettings*) request->userData.ptr;
 
-	freeDirent(list, number);
+	struct listingPage page;
+	if (listing_get(path, statObj, path + strlen(settings->documentRoot), getPageNumber(request->metaData.queryString), settings->listingPageSize, &page) < 0)
+		return sendError(request, response, 500);
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Type", "text/html; charset=utf-8");
+	struct iovec body = {
+		.iov_base = (void*) page.html,
+		.iov_len = page.length
+	};
+	int result = response.sendResponse(200, &headers, &body, 1, request);
+	headers_free(&headers);
+	listing_release(&page);
 
-	return 0;
+	return result < 0 ? REACTOR_ERROR : REACTOR_DONE;
 }
 
+static enum reactorResult sendFile(struct request* request, struct reactorResponse response, const char* path, const struct stat* statObj) {
+	struct fileSettings* settings = (struct fileSettings*) request->userData.ptr;
+
+	struct fileState* state = malloc(sizeof(struct fileState));
+	if (state == NULL) {
+		error("files: Couldn't allocate file state: %s", strerror(errno));
+		return sendError(request, response, 500);
+	}
+	*state = (struct fileState) {
+		.fd = open(path, O_RDONLY | O_CLOEXEC),
+		.offset = 0,
+		.size = statObj->st_size
+	};
+	if (state->fd < 0) {
+		free(state);
+		return sendError(request, response, 500);
+	}
+	// onComplete closes it
+	request->state = state;
+
+	char buffer[FILE_CHUNK_SIZE];
+	struct iovec body = {
+		.iov_base = buffer,
+		.iov_len = 0
+	};
+	if (state->size > 0) {
+		ssize_t length = readChunk(state, buffer);
+		if (length < 0)
+			return sendError(request, response, 500);
+		body.iov_len = length;
+	}
+
+	char length[24];
+	snprintf(length, sizeof(length), "%lld", (long long) state->size);
 
-void fuckyouHandler(struct request request, struct response response) {
 	struct headers headers = headers_create();
-	headers_mod(&headers, "Content-Type", "text/plain");
-	int fd = response.sendHeader(400, &headers, &request);
+	headers_mod(&headers, "Content-Type", mime_lookup(settings->mimeTypes, path));
+	headers_mod(&headers, "Content-Length", length);
+	int result = response.sendResponse(200, &headers, &body, 1, request);
 	headers_free(&headers);
 
-	FILE* stream = fdopen(fd, "w");
-	if (stream == NULL) {
-		error("files: Couldn't get stream from fd: %s", strerror(errno));
-		return;
-	}
-
-	fprintf(stream, "Status 400\nYou know... I'm not an idiot...\n");
+	if (result < 0)
+		return REACTOR_ERROR;
 
-	fclose(stream);
+	return state->offset < state->size ? REACTOR_MORE : REACTOR_DONE;
 }
 
-void fileHandler(struct request request, struct response response) {
-	struct fileSettings* settings = (struct fileSettings*) request.userData.ptr;
-	const char* documentRoot = settings->documentRoot;
-	bool indexes = settings->index;
+static enum reactorResult fileRequest(struct request* request, struct reactorResponse response) {
+	struct fileSettings* settings = (struct fileSettings*) request->userData.ptr;
 
-	char* path = normalizePath(request, response, documentRoot);
+	int status;
+	char* path = resolvePath(request, settings->documentRoot, &status);
 	if (path == NULL)
-		return;
+		return sendError(request, response, status);
 
-	struct stat statObj, statObjFile;
+	struct stat statObj;
 	if (stat(path, &statObj) < 0) {
 		free(path);
 
 		error("files: Couldn't stat file: %s", strerror(errno));
-		status(request, response, 500);		
-		return;
+		return sendError(request, response, 500);
 	}
 
-	bool done = false;
-	bool overrideStat = false;
-
 	if (S_ISDIR(statObj.st_mode)) {
-		// TODO check for index files
-
-		char* filepath = NULL;
-		for (int i = 0; i < settings->indexfiles.number; i++) {
-			filepath = malloc(strlen(path) + 1 + strlen(settings->indexfiles.files[i]) + 1);
-			if (filepath == NULL) {
-				error("files: Couldn't allocate memory for index file check: %s", strerror(errno));
-				warn("files: ignoring");
-				continue;
+		char* filepath = findIndex(settings, path, &statObj);
+		if (filepath == NULL) {
+			enum reactorResult result;
+			if (settings->listing != 0) {
+				result = sendListing(request, response, path, &statObj);
+			} else {
+				result = sendError(request, response, 403);
 			}
-			strcpy(filepath, path);
-			strcat(filepath, "/");
-			strcat(filepath, settings->indexfiles.files[i]);
-
-			debug("files: searching for index: %s", filepath);
-
-			if (access(filepath, F_OK | R_OK) == 0 && stat(filepath, &statObjFile) == 0) {
-				if (S_ISREG(statObjFile.st_mode)) {
-					break;
-				}
-			}
-			free(filepath);
-			filepath = NULL;
-		}
-
-		if (filepath != NULL) {
-			debug("files: found index file: %s", filepath);
-			overrideStat = true;
 			free(path);
-			path = filepath;
-			statObj = statObjFile;
-		} else {
-
-			if (!indexes) {
-				free(path);
-				status(request, response, 403);
-				return;
-			}
-
-			struct headers headers = headers_create();
-			headers_mod(&headers, "Content-Type", "text/html; charset=utf-8");
-			int fd = response.sendHeader(200, &headers, &request);
-			headers_free(&headers);
-
-			if (showIndex(fd, path, documentRoot) < 0) {
-				// TODO error
-			}
-		
-			done = true;
+			return result;
 		}
+
+		free(path);
+		path = filepath;
 	}
 
-	if (S_ISREG(statObj.st_mode) || overrideStat) {
-		int filefd = open(path, O_RDONLY);
-		if (filefd < 0) {
-			free(path);
-			status(request, response, 500);
-			return;
-		}
+	enum reactorResult result;
+	if (S_ISREG(statObj.st_mode)) {
+		result = sendFile(request, response, path, &statObj);
+	} else {
+		result = sendError(request, response, 500);
+	}
+	free(path);
 
-		off_t size = statObj.st_size;
-		int length = strlenOfNumber(size);
-		char* tmp = malloc(length + 1);
-		if (tmp == NULL) {
-			free(path);
-			close(filefd);
-			error("files: Couldn't allocate for content length: %s", strerror(errno));
-			status(request, response, 500);
-			return;
-		}
-		snprintf(tmp, length + 1, "%ld", size);
+	return result;
+}
 
-		struct headers headers = headers_create();
-		headers_mod(&headers, "Content-Type", getMineFromFileName(path));
-		headers_mod(&headers, "Content-Length", tmp);
-		free(tmp);
+static enum reactorResult fileWritable(struct request* request, struct reactorResponse response) {
+	struct fileState* state = (struct fileState*) request->state;
 
-		int sockfd = response.sendHeader(200, &headers, &request);
-		headers_free(&headers);
+	char buffer[FILE_CHUNK_SIZE];
+	ssize_t length = readChunk(state, buffer);
+	if (length < 0)
+		return REACTOR_ERROR;
 
-		char c;
+	struct iovec body = {
+		.iov_base = buffer,
+		.iov_len = length
+	};
+	if (response.sendBody(&body, 1, request) < 0)
+		return REACTOR_ERROR;
 
-		while(read(filefd, &c, 1))
-			write(sockfd, &c, 1);
+	return state->offset < state->size ? REACTOR_MORE : REACTOR_DONE;
+}
 
-		close(filefd);
-		close(sockfd);
+static void fileComplete(struct request* request, bool sent) {
+	struct fileState* state = (struct fileState*) request->state;
+	if (state == NULL)
+		return;
 
-		done = true;	
-	}
+	close(state->fd);
+	free(state);
+	request->state = NULL;
+}
 
-	if (!done) {
-		status(request, response, 500);
-	}
+const struct reactorHandler fileReactor = {
+	.onRequest = fileRequest,
+	.onWritable = fileWritable,
+	.onComplete = fileComplete
+};
 
-	free(path);
+void fileHandler(struct request request, struct response response) {
+	runReactorHandler(&fileReactor, request, response);
 }
 
-char* normalizePath(struct request request, struct response response, const char* documentRoot) {
+/*
+ * The file the request is for; NULL if there is none and *status is what to answer with.
+ */
+char* resolvePath(const struct request* request, const char* documentRoot, int* status) {
 	if (documentRoot == NULL) {
 		error("files: No document root given.");
-		status(request, response, 500);
+		*status = 500;
 		return NULL;
 	}
 
-	char* path = request.metaData.path;
+	char* path = request->metaData.path;
 
 	char* tmp = malloc(strlen(path) + 1 + strlen(documentRoot) + 1);
 	if (tmp == NULL) {
 		error("files: Couldn't malloc for path construction: %s", strerror(errno));
-		status(request, response, 500);
+		*status = 500;
 		return NULL;
 	}
 	strcpy(tmp, documentRoot);
@@ -260,18 +300,18 @@ char* normalizePath(struct request request, struct response response, const char
 		free(tmp);
 		switch(errno) {
 			case EACCES:
-				status(request, response, 403);
+				*status = 403;
 				return NULL;
 			case ENOENT:
 			case ENOTDIR:
-				status(request, response, 404);
+				*status = 404;
 				return NULL;
 			default:
 				warn("files: Couldn't get constructed realpath: %s", strerror(errno));
-				status(request, response, 500);
+				*status = 500;
 				return NULL;
 		}
-		status(request, response, 500);
+		*status = 500;
 		return NULL;
 	}
 	free(tmp);
@@ -281,7 +321,7 @@ char* normalizePath(struct request request, struct response response, const char
 	if (strncmp(documentRoot, path, strlen(documentRoot)) != 0) {
 		free(path);
 		warn("files: Requested path not in document root.");
-		fuckyouHandler(request, response);
+		*status = 400;
 
 		return NULL;
 	}
@@ -291,18 +331,32 @@ char* normalizePath(struct request request, struct response response, const char
 		
 		switch(errno) {
 			case EACCES:
-				status(request, response, 403);
+				*status = 403;
 				return NULL;
 			case ENOENT:
 			case ENOTDIR:
-				status(request, response, 404);
+				*status = 404;
 				return NULL;
 			default:
 				warn("files: Couldn't access file: %s", strerror(errno));
-				status(request, response, 500);
+				*status = 500;
 				return NULL;
 		}
 	}
 
 	return path;
 }
+
+char* normalizePath(struct request request, struct response response, const char* documentRoot) {
+	int code;
+	char* path = resolvePath(&request, documentRoot, &code);
+	if (path == NULL) {
+		if (code == 400) {
+			fuckyouHandler(request, response);
+		} else {
+			status(request, response, code);
+		}
+	}
+
+	return path;
+}
@@ -5,12 +5,21 @@
 
 #include "files.h"
 #include "misc.h"
+#include "mime.h"
 
 #define FILE_HANDLER_NO (0)
 
+// bytes of a file that are read and queued at once
+#define FILE_CHUNK_SIZE (32768)
+
 struct fileSettings {
 	const char* documentRoot;
-	bool index;
+	// of the site; NULL if there are only the built-in types
+	const struct mimeTypes* mimeTypes;
+	// show the entries of directories without index file; 0 or 1
+	long listing;
+	// entries per page of a listing; 0 shows all
+	long listingPageSize;
 	struct {
 		int number;
 		char** files;
@@ -18,7 +27,13 @@ struct fileSettings {
 };
 
 void fileHandler(struct request request, struct response response);
+// fileHandler on the reactor (see struct reactorHandler)
+extern const struct reactorHandler fileReactor;
 
 char* normalizePath(struct request request, struct response response, const char* documentRoot);
+// normalizePath for handlers that answer themselves; NULL if there is no file and *status is what to answer with
+char* resolvePath(const struct request* request, const char* documentRoot, int* status);
+// the answer to a status of resolvePath
+int sendPathError(struct request* request, sendResponse_t sendResponse, int status);
 
 #endif
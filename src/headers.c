@@ -173,10 +173,14 @@ void headers_free(struct headers* headers) {
 	headers->number = 0;
 }
 
-void headers_dump(struct headers* headers, FILE* stream) {
+int headers_dump(struct headers* headers, FILE* stream) {
+	int total = 0;
 	for (int i = 0; i < headers->number; i++) {
-		fprintf(stream, "%s: %s\r\n", headers->headers[i].key, headers->headers[i].value);
+		int tmp = fprintf(stream, "%s: %s\r\n", headers->headers[i].key, headers->headers[i].value);
+		if (tmp > 0)
+			total += tmp;
 	}
+	return total;
 }
 
 int headers_metadata(struct metaData* metaData, char* header) {
@@ -231,6 +235,8 @@ int headers_metadata(struct metaData* metaData, char* header) {
 		protocol = HTTP10;
 	else if (strcmp(_protocol, "HTTP/1.1") == 0)
 		protocol = HTTP11;
+	else if (strcmp(_protocol, "HTTP/2.0") == 0)
+		protocol = HTTP20;
 	else
 		return HEADERS_PARSE_ERROR;
 
@@ -295,6 +301,8 @@ const char* protocolString(struct metaData metaData) {
 			return "HTTP/1.0";
 		case HTTP11:
 			return "HTTP/1.1";
+		case HTTP20:
+			return "HTTP/2.0";
 		default:
 			return NULL;
 	}
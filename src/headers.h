@@ -26,7 +26,7 @@ int headers_remove(struct headers* headers, const char* key);
 int headers_mod(struct headers* headers, const char* key, const char* value);
 int headers_parse(struct headers* headers, const char* currentHeader, size_t length);
 void headers_free(struct headers* headers);
-void headers_dump(struct headers* headers, FILE* stream);
+int headers_dump(struct headers* headers, FILE* stream);
 
 int headers_metadata(struct metaData* metaData, char* header);
 
@@ -0,0 +1,483 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "hpack.h"
+#include "logging.h"
+
+static const struct {
+	const char* name;
+	const char* value;
+} staticTable[HPACK_STATIC_TABLE_LENGTH + 1] = {
+	{ NULL, NULL },
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+/*
+ * The HPACK Huffman code is canonical: the code lengths are all that's
+ * needed to reconstruct it. Symbol 256 is EOS.
+ */
+#define HUFFMAN_SYMBOLS (257)
+#define HUFFMAN_MAX_LENGTH (30)
+#define HUFFMAN_EOS (256)
+
+static const unsigned char huffmanLengths[HUFFMAN_SYMBOLS] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+static struct {
+	// symbols ordered by code
+	unsigned short symbols[HUFFMAN_SYMBOLS];
+	uint32_t firstCode[HUFFMAN_MAX_LENGTH + 1];
+	int firstIndex[HUFFMAN_MAX_LENGTH + 1];
+	int count[HUFFMAN_MAX_LENGTH + 1];
+} huffman;
+
+static pthread_once_t huffmanOnce = PTHREAD_ONCE_INIT;
+
+static void huffmanInit() {
+	int index = 0;
+	for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+		huffman.firstIndex[length] = index;
+		for (int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+			if (huffmanLengths[symbol] == length)
+				huffman.symbols[index++] = symbol;
+		}
+		huffman.count[length] = index - huffman.firstIndex[length];
+	}
+
+	uint32_t code = 0;
+	for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+		huffman.firstCode[length] = code;
+		code = (code + huffman.count[length]) << 1;
+	}
+}
+
+// returns the length of the decoded string or -1
+static long huffmanDecode(const unsigned char* input, size_t length, char* output) {
+	pthread_once(&huffmanOnce, &huffmanInit);
+
+	long result = 0;
+	uint32_t code = 0;
+	int bits = 0;
+
+	for (size_t i = 0; i < length; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			code = (code << 1) | ((input[i] >> bit) & 1);
+			bits++;
+
+			if (bits > HUFFMAN_MAX_LENGTH)
+				return -1;
+
+			if (code >= huffman.firstCode[bits] && code - huffman.firstCode[bits] < huffman.count[bits]) {
+				int symbol = huffman.symbols[huffman.firstIndex[bits] + code - huffman.firstCode[bits]];
+				if (symbol == HUFFMAN_EOS)
+					return -1;
+
+				output[result++] = symbol;
+				code = 0;
+				bits = 0;
+			}
+		}
+	}
+
+	// padding has to be the most significant bits of EOS (all ones)
+	if (bits > 7 || code != (1u << bits) - 1)
+		return -1;
+
+	return result;
+}
+
+struct hpackTable hpack_createTable(size_t limit) {
+	return (struct hpackTable) {
+		.entries = NULL,
+		.number = 0,
+		.capacity = 0,
+		.size = 0,
+		.maxSize = limit,
+		.limit = limit
+	};
+}
+
+static inline size_t entrySize(const char* name, const char* value) {
+	return strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+}
+
+static void evict(struct hpackTable* table, size_t maxSize) {
+	int evicted = 0;
+	while (evicted < table->number && table->size > maxSize) {
+		struct hpackEntry* entry = &(table->entries[evicted]);
+		table->size -= entrySize(entry->name, entry->value);
+		free(entry->name);
+		free(entry->value);
+		evicted++;
+	}
+
+	if (evicted == 0)
+		return;
+
+	table->number -= evicted;
+	memmove(table->entries, table->entries + evicted, table->number * sizeof(struct hpackEntry));
+}
+
+void hpack_freeTable(struct hpackTable* table) {
+	evict(table, 0);
+	free(table->entries);
+	table->entries = NULL;
+	table->capacity = 0;
+}
+
+// takes ownership of name and value
+static int addEntry(struct hpackTable* table, char* name, char* value) {
+	size_t size = entrySize(name, value);
+
+	if (size > table->maxSize) {
+		// an entry larger than the table empties it
+		evict(table, 0);
+		free(name);
+		free(value);
+		return HPACK_SUCCESS;
+	}
+
+	evict(table, table->maxSize - size);
+
+	if (table->number == table->capacity) {
+		int capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+		struct hpackEntry* tmp = realloc(table->entries, capacity * sizeof(struct hpackEntry));
+		if (tmp == NULL) {
+			free(name);
+			free(value);
+			return HPACK_ALLOC_ERROR;
+		}
+		table->entries = tmp;
+		table->capacity = capacity;
+	}
+
+	table->entries[table->number++] = (struct hpackEntry) {
+		.name = name,
+		.value = value
+	};
+	table->size += size;
+
+	return HPACK_SUCCESS;
+}
+
+static int lookup(struct hpackTable* table, size_t index, const char** name, const char** value) {
+	if (index == 0)
+		return HPACK_DECODE_ERROR;
+
+	if (index <= HPACK_STATIC_TABLE_LENGTH) {
+		*name = staticTable[index].name;
+		*value = staticTable[index].value;
+		return HPACK_SUCCESS;
+	}
+
+	index -= HPACK_STATIC_TABLE_LENGTH + 1;
+	if (index >= table->number)
+		return HPACK_DECODE_ERROR;
+
+	struct hpackEntry* entry = &(table->entries[table->number - 1 - index]);
+	*name = entry->name;
+	*value = entry->value;
+
+	return HPACK_SUCCESS;
+}
+
+static int decodeInteger(const unsigned char** position, const unsigned char* end, int prefix, size_t* result) {
+	if (*position >= end)
+		return HPACK_DECODE_ERROR;
+
+	size_t mask = (1 << prefix) - 1;
+	size_t value = *((*position)++) & mask;
+
+	if (value == mask) {
+		int shift = 0;
+		unsigned char byte;
+		do {
+			if (*position >= end || shift > 28)
+				return HPACK_DECODE_ERROR;
+
+			byte = *((*position)++);
+			value += (size_t) (byte & 0x7f) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+	}
+
+	*result = value;
+
+	return HPACK_SUCCESS;
+}
+
+static int decodeString(const unsigned char** position, const unsigned char* end, char** result) {
+	if (*position >= end)
+		return HPACK_DECODE_ERROR;
+
+	bool huffmanCoded = **position & 0x80;
+
+	size_t length;
+	if (decodeInteger(position, end, 7, &length) < 0)
+		return HPACK_DECODE_ERROR;
+	if (length > end - *position || length > HPACK_MAX_STRING_LENGTH)
+		return HPACK_DECODE_ERROR;
+
+	// the shortest huffman code has 5 bits
+	char* string = malloc((huffmanCoded ? length * 8 / 5 : length) + 1);
+	if (string == NULL)
+		return HPACK_ALLOC_ERROR;
+
+	long stringLength = length;
+	if (huffmanCoded) {
+		stringLength = huffmanDecode(*position, length, string);
+		if (stringLength < 0) {
+			free(string);
+			return HPACK_DECODE_ERROR;
+		}
+	} else {
+		memcpy(string, *position, length);
+	}
+	string[stringLength] = '\0';
+	*position += length;
+
+	// we can't handle embedded null bytes
+	if (strlen(string) != stringLength) {
+		free(string);
+		return HPACK_DECODE_ERROR;
+	}
+
+	*result = string;
+
+	return HPACK_SUCCESS;
+}
+
+int hpack_decode(struct hpackTable* table, const unsigned char* block, size_t length, hpackCallback_t callback, void* data) {
+	const unsigned char* position = block;
+	const unsigned char* end = block + length;
+
+	while (position < end) {
+		unsigned char first = *position;
+		size_t index;
+		int tmp;
+
+		if (first & 0x80) {
+			// indexed header field
+			if (decodeInteger(&position, end, 7, &index) < 0)
+				return HPACK_DECODE_ERROR;
+
+			const char* name;
+			const char* value;
+			if (lookup(table, index, &name, &value) < 0)
+				return HPACK_DECODE_ERROR;
+
+			if (callback(name, value, data) != 0)
+				return HPACK_DECODE_ERROR;
+
+			continue;
+		}
+
+		if ((first & 0xe0) == 0x20) {
+			// dynamic table size update
+			if (decodeInteger(&position, end, 5, &index) < 0)
+				return HPACK_DECODE_ERROR;
+			if (index > table->limit)
+				return HPACK_DECODE_ERROR;
+
+			table->maxSize = index;
+			evict(table, table->maxSize);
+
+			continue;
+		}
+
+		// literal header field; with incremental indexing, without indexing or never indexed
+		bool indexing = (first & 0xc0) == 0x40;
+		if (decodeInteger(&position, end, indexing ? 6 : 4, &index) < 0)
+			return HPACK_DECODE_ERROR;
+
+		char* name = NULL;
+		char* value = NULL;
+
+		if (index == 0) {
+			tmp = decodeString(&position, end, &name);
+			if (tmp < 0)
+				return tmp;
+		} else {
+			const char* tableName;
+			const char* tableValue;
+			if (lookup(table, index, &tableName, &tableValue) < 0)
+				return HPACK_DECODE_ERROR;
+
+			// the entry might be evicted by the one we're about to add
+			name = strdup(tableName);
+			if (name == NULL)
+				return HPACK_ALLOC_ERROR;
+		}
+
+		tmp = decodeString(&position, end, &value);
+		if (tmp < 0) {
+			free(name);
+			return tmp;
+		}
+
+		if (callback(name, value, data) != 0) {
+			free(name);
+			free(value);
+			return HPACK_DECODE_ERROR;
+		}
+
+		if (indexing) {
+			tmp = addEntry(table, name, value);
+			if (tmp < 0)
+				return tmp;
+		} else {
+			free(name);
+			free(value);
+		}
+	}
+
+	return HPACK_SUCCESS;
+}
+
+static void encodeInteger(FILE* stream, unsigned char flags, int prefix, size_t value) {
+	size_t mask = (1 << prefix) - 1;
+
+	if (value < mask) {
+		fputc(flags | value, stream);
+		return;
+	}
+
+	fputc(flags | mask, stream);
+	value -= mask;
+	while (value >= 0x80) {
+		fputc((value & 0x7f) | 0x80, stream);
+		value >>= 7;
+	}
+	fputc(value, stream);
+}
+
+// plain strings; huffman coding is not worth the effort on our side
+static void encodeString(FILE* stream, const char* string, bool lowercase) {
+	size_t length = strlen(string);
+
+	encodeInteger(stream, 0x00, 7, length);
+	for (size_t i = 0; i < length; i++) {
+		fputc(lowercase ? tolower(string[i]) : string[i], stream);
+	}
+}
+
+int hpack_encodeStatus(FILE* stream, int statusCode) {
+	char value[4];
+	snprintf(value, sizeof(value), "%03d", statusCode);
+
+	for (int i = 1; i <= HPACK_STATIC_TABLE_LENGTH; i++) {
+		if (strcmp(staticTable[i].name, ":status") == 0 && strcmp(staticTable[i].value, value) == 0) {
+			encodeInteger(stream, 0x80, 7, i);
+			return ferror(stream) ? -1 : 0;
+		}
+	}
+
+	// literal without indexing; name from the static table
+	encodeInteger(stream, 0x00, 4, 8);
+	encodeString(stream, value, false);
+
+	return ferror(stream) ? -1 : 0;
+}
+
+/*
+ * Literal without indexing; we never touch the peer's dynamic table.
+ * The name is lowercased as HTTP/2 requires.
+ */
+int hpack_encode(FILE* stream, const char* name, const char* value) {
+	int index = 0;
+	for (int i = 1; i <= HPACK_STATIC_TABLE_LENGTH; i++) {
+		if (strcasecmp(staticTable[i].name, name) == 0) {
+			index = i;
+			break;
+		}
+	}
+
+	encodeInteger(stream, 0x00, 4, index);
+	if (index == 0)
+		encodeString(stream, name, true);
+	encodeString(stream, value, false);
+
+	return ferror(stream) ? -1 : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541)
+ */
+
+#define HPACK_SUCCESS (0)
+#define HPACK_DECODE_ERROR (-1)
+#define HPACK_ALLOC_ERROR (-2)
+
+#define HPACK_STATIC_TABLE_LENGTH (61)
+#define HPACK_DEFAULT_TABLE_SIZE (4096)
+// per entry overhead as defined by the RFC
+#define HPACK_ENTRY_OVERHEAD (32)
+
+#define HPACK_MAX_STRING_LENGTH (65536)
+
+struct hpackEntry {
+	char* name;
+	char* value;
+};
+
+// dynamic table; the newest entry is the last one
+struct hpackTable {
+	struct hpackEntry* entries;
+	int number;
+	int capacity;
+	size_t size;
+	size_t maxSize;
+	// upper limit for table size updates (SETTINGS_HEADER_TABLE_SIZE)
+	size_t limit;
+};
+
+// called for every decoded header field; a non-zero return value aborts decoding
+typedef int (*hpackCallback_t)(const char* name, const char* value, void* data);
+
+struct hpackTable hpack_createTable(size_t limit);
+void hpack_freeTable(struct hpackTable* table);
+
+int hpack_decode(struct hpackTable* table, const unsigned char* block, size_t length, hpackCallback_t callback, void* data);
+
+int hpack_encodeStatus(FILE* stream, int statusCode);
+int hpack_encode(FILE* stream, const char* name, const char* value);
+
+#endif
@@ -0,0 +1,1503 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "http2.h"
+#include "hpack.h"
+#include "logging.h"
+#include "status.h"
+#include "metrics.h"
+#include "util.h"
+
+static inline struct timespec getTime() {
+	struct timespec time;
+
+	// no need to check result; none of the errors can happen
+	clock_gettime(TIMING_CLOCK, &time);
+
+	return time;
+}
+
+// returns -1 if one of the timestamps was never taken
+static inline long timespecSpanUs(struct timespec start, struct timespec end) {
+	if ((start.tv_sec == 0 && start.tv_nsec == 0) || (end.tv_sec == 0 && end.tv_nsec == 0))
+		return -1;
+
+	return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static void unlockMutex(void* mutex) {
+	pthread_mutex_unlock((pthread_mutex_t*) mutex);
+}
+
+static inline uint32_t readUint32(const unsigned char* buffer) {
+	return ((uint32_t) buffer[0] << 24) | ((uint32_t) buffer[1] << 16) | ((uint32_t) buffer[2] << 8) | buffer[3];
+}
+
+static inline void writeUint32(unsigned char* buffer, uint32_t value) {
+	buffer[0] = (value >> 24) & 0xff;
+	buffer[1] = (value >> 16) & 0xff;
+	buffer[2] = (value >> 8) & 0xff;
+	buffer[3] = value & 0xff;
+}
+
+/*
+ * Sends a frame; the caller reserves HTTP2_FRAME_HEADER_LENGTH bytes in front of the payload.
+ */
+static int sendFrame(struct http2Session* session, int type, int flags, uint32_t streamId, unsigned char* frame, size_t length) {
+	frame[0] = (length >> 16) & 0xff;
+	frame[1] = (length >> 8) & 0xff;
+	frame[2] = length & 0xff;
+	frame[3] = type;
+	frame[4] = flags;
+	writeUint32(frame + 5, streamId & HTTP2_MAX_WINDOW_SIZE);
+
+	int result = -1;
+
+	pthread_mutex_lock(&(session->writeLock));
+	pthread_cleanup_push(&unlockMutex, &(session->writeLock));
+	if (!session->broken) {
+		result = writeAll(session->connection->writefd, (char*) frame, HTTP2_FRAME_HEADER_LENGTH + length, session->config->connectionTimeout);
+		if (result < 0) {
+			warn("http2: couldn't send frame: %s", strerror(errno));
+			session->broken = true;
+
+			// wake up the session thread
+			shutdown(session->connection->readfd, SHUT_RDWR);
+		}
+	}
+	pthread_cleanup_pop(1);
+
+	return result;
+}
+
+static int sendWindowUpdate(struct http2Session* session, uint32_t streamId, uint32_t increment) {
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + 4];
+	writeUint32(frame + HTTP2_FRAME_HEADER_LENGTH, increment);
+	return sendFrame(session, HTTP2_WINDOW_UPDATE, 0, streamId, frame, 4);
+}
+
+static int sendRstStream(struct http2Session* session, uint32_t streamId, uint32_t errorCode) {
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + 4];
+	writeUint32(frame + HTTP2_FRAME_HEADER_LENGTH, errorCode);
+	return sendFrame(session, HTTP2_RST_STREAM, 0, streamId, frame, 4);
+}
+
+static int sendGoaway(struct http2Session* session, uint32_t lastStreamId, uint32_t errorCode) {
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + 8];
+	writeUint32(frame + HTTP2_FRAME_HEADER_LENGTH, lastStreamId);
+	writeUint32(frame + HTTP2_FRAME_HEADER_LENGTH + 4, errorCode);
+	return sendFrame(session, HTTP2_GOAWAY, 0, 0, frame, 8);
+}
+
+static int sendSettings(struct http2Session* session) {
+	const struct {
+		uint16_t id;
+		uint32_t value;
+	} settings[] = {
+		{ HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_MAX_CONCURRENT_STREAMS },
+		{ HTTP2_SETTINGS_INITIAL_WINDOW_SIZE, HTTP2_INITIAL_WINDOW_SIZE },
+		{ HTTP2_SETTINGS_MAX_FRAME_SIZE, HTTP2_MAX_FRAME_SIZE },
+		{ HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE, HTTP2_MAX_HEADER_BLOCK }
+	};
+	#define NUMBER_OF_SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + NUMBER_OF_SETTINGS * 6];
+	unsigned char* position = frame + HTTP2_FRAME_HEADER_LENGTH;
+	for (int i = 0; i < NUMBER_OF_SETTINGS; i++) {
+		position[0] = (settings[i].id >> 8) & 0xff;
+		position[1] = settings[i].id & 0xff;
+		writeUint32(position + 2, settings[i].value);
+		position += 6;
+	}
+
+	return sendFrame(session, HTTP2_SETTINGS, 0, 0, frame, NUMBER_OF_SETTINGS * 6);
+}
+
+/*
+ * Sends a header block; splits it into CONTINUATION frames if necessary.
+ */
+static int sendHeaderBlock(struct http2Session* session, uint32_t streamId, const char* block, size_t length, bool endStream) {
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + HTTP2_MAX_FRAME_SIZE];
+
+	// nobody must get between the frames of one header block
+	int result = 0;
+	pthread_mutex_lock(&(session->writeLock));
+	pthread_cleanup_push(&unlockMutex, &(session->writeLock));
+
+	int type = HTTP2_HEADERS;
+	do {
+		size_t size = length > HTTP2_MAX_FRAME_SIZE ? HTTP2_MAX_FRAME_SIZE : length;
+		int flags = size == length ? HTTP2_FLAG_END_HEADERS : 0;
+		if (type == HTTP2_HEADERS && endStream)
+			flags |= HTTP2_FLAG_END_STREAM;
+
+		frame[0] = (size >> 16) & 0xff;
+		frame[1] = (size >> 8) & 0xff;
+		frame[2] = size & 0xff;
+		frame[3] = type;
+		frame[4] = flags;
+		writeUint32(frame + 5, streamId);
+		memcpy(frame + HTTP2_FRAME_HEADER_LENGTH, block, size);
+
+		if (session->broken || writeAll(session->connection->writefd, (char*) frame, HTTP2_FRAME_HEADER_LENGTH + size, session->config->connectionTimeout) < 0) {
+			if (!session->broken) {
+				warn("http2: couldn't send headers: %s", strerror(errno));
+				session->broken = true;
+				shutdown(session->connection->readfd, SHUT_RDWR);
+			}
+			result = -1;
+			break;
+		}
+
+		block += size;
+		length -= size;
+		type = HTTP2_CONTINUATION;
+	} while (length > 0);
+
+	pthread_cleanup_pop(1);
+
+	return result;
+}
+
+static struct http2Stream* findStream(struct http2Session* session, uint32_t id) {
+	for (struct http2Stream* stream = session->streams; stream != NULL; stream = stream->next) {
+		if (stream->id == id)
+			return stream;
+	}
+	return NULL;
+}
+
+static void freeStream(struct http2Stream* stream) {
+	if (stream->bodyReadfd >= 0)
+		close(stream->bodyReadfd);
+	if (stream->bodyWritefd >= 0)
+		close(stream->bodyWritefd);
+
+	if (stream->bodyBuffer != NULL)
+		free(stream->bodyBuffer);
+
+	if (stream->metaData.path != NULL)
+		free(stream->metaData.path);
+	if (stream->metaData.queryString != NULL)
+		free(stream->metaData.queryString);
+	if (stream->metaData.uri != NULL)
+		free(stream->metaData.uri);
+
+	headers_free(&(stream->headers));
+
+	free(stream);
+}
+
+/*
+ * Waits for a thread of a stream; cancels it if it doesn't finish in time.
+ */
+static void joinThread(pthread_t* thread, bool force) {
+	if (*thread == PTHREAD_NULL)
+		return;
+
+	if (force) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += HTTP2_HANDLER_TIMEOUT;
+
+		if (pthread_timedjoin_np(*thread, NULL, &deadline) == 0) {
+			*thread = PTHREAD_NULL;
+			return;
+		}
+
+		error("http2: Timeout of handler.");
+		pthread_cancel(*thread);
+	}
+
+	pthread_join(*thread, NULL);
+	*thread = PTHREAD_NULL;
+}
+
+static void reapStreams(struct http2Session* session) {
+	pthread_mutex_lock(&(session->lock));
+	struct http2Stream* stream = session->done;
+	session->done = NULL;
+	pthread_mutex_unlock(&(session->lock));
+
+	while (stream != NULL) {
+		struct http2Stream* next = stream->next;
+
+		joinThread(&(stream->threads.response), false);
+		joinThread(&(stream->threads.encoder), false);
+		joinThread(&(stream->threads.body), false);
+		freeStream(stream);
+
+		stream = next;
+	}
+}
+
+/*
+ * Has to be called once the handler returned and the response is sent.
+ */
+static void finishStream(struct http2Stream* stream) {
+	struct http2Session* session = stream->session;
+	struct connection* connection = session->connection;
+
+	if (stream->response.statusCode != 0) {
+		struct exchangeTiming* timing = &(stream->timing);
+		struct timespec completed = getTime();
+
+		metrics_requestCompleted(stream->response.statusCode, timespecSpanUs(timing->requestStart, completed), stream->response.headerBytes + stream->response.bodyBytes);
+
+		if (isLogging(HTTP_ACCESS)) {
+			struct accessLogEntry entry = {
+				.metaData = stream->metaData,
+				.remoteAddr = connection->peer.addr,
+				.referer = headers_get(&(stream->headers), "Referer"),
+				.userAgent = headers_get(&(stream->headers), "User-Agent"),
+				.statusCode = stream->response.statusCode,
+				.headerBytes = stream->response.headerBytes,
+				.bodyBytes = stream->response.bodyBytes,
+				.headerParseTime = timespecSpanUs(timing->requestStart, timing->headersEnd),
+				.timeToFirstByte = timespecSpanUs(timing->requestStart, timing->firstByte),
+				.handlerTime = timespecSpanUs(timing->handlerStart, timing->handlerEnd),
+				.totalTime = timespecSpanUs(timing->requestStart, completed),
+				.tls = connection->bind->ssl,
+				.keepAliveReuse = stream->number - 1,
+				.time = completed.tv_sec
+			};
+
+			accesslog_write(session->config->accessLogFormat, &entry);
+		}
+	}
+
+	pthread_mutex_lock(&(session->lock));
+	bool stillSending = !stream->remoteClosed && !stream->reset;
+	stream->reset = true;
+
+	struct http2Stream* previous = NULL;
+	for (struct http2Stream* current = session->streams; current != NULL; current = current->next) {
+		if (current == stream) {
+			if (previous == NULL) {
+				session->streams = stream->next;
+			} else {
+				previous->next = stream->next;
+			}
+			break;
+		}
+		previous = current;
+	}
+	stream->next = session->done;
+	session->done = stream;
+	session->active--;
+
+	// the session only waits for this stream
+	if (session->goaway && session->active == 0 && session->wakeupfd >= 0)
+		eventfd_write(session->wakeupfd, 1);
+
+	pthread_cond_broadcast(&(session->changed));
+	pthread_mutex_unlock(&(session->lock));
+
+	if (stillSending) {
+		// the response is complete; the rest of the request body is not needed
+		sendRstStream(session, stream->id, HTTP2_NO_ERROR);
+	}
+}
+
+struct relayData {
+	struct http2Stream* stream;
+	int readfd;
+};
+
+/*
+ * This thread turns the output of the handler into DATA frames.
+ */
+void* http2RelayThread(void* _data) {
+	struct relayData* data = (struct relayData*) _data;
+	struct http2Stream* stream = data->stream;
+	struct http2Session* session = stream->session;
+	int readfd = data->readfd;
+	free(data);
+
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + HTTP2_MAX_FRAME_SIZE];
+	unsigned char* payload = frame + HTTP2_FRAME_HEADER_LENGTH;
+
+	// once the stream is gone the output of the handler is discarded
+	bool discard = false;
+
+	ssize_t tmp;
+	while ((tmp = read(readfd, payload, HTTP2_MAX_FRAME_SIZE)) != 0) {
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (discard)
+			continue;
+
+		size_t offset = 0;
+		while (offset < tmp) {
+			pthread_mutex_lock(&(session->lock));
+			pthread_cleanup_push(&unlockMutex, &(session->lock));
+			while (!stream->reset && !session->closing && (stream->sendWindow <= 0 || session->sendWindow <= 0))
+				pthread_cond_wait(&(session->changed), &(session->lock));
+			pthread_cleanup_pop(0);
+
+			if (stream->reset || session->closing) {
+				pthread_mutex_unlock(&(session->lock));
+				discard = true;
+				break;
+			}
+
+			size_t size = tmp - offset;
+			if (size > stream->sendWindow)
+				size = stream->sendWindow;
+			if (size > session->sendWindow)
+				size = session->sendWindow;
+			if (size > session->peerMaxFrameSize)
+				size = session->peerMaxFrameSize;
+			stream->sendWindow -= size;
+			session->sendWindow -= size;
+			pthread_mutex_unlock(&(session->lock));
+
+			// the part in front of the payload is already sent; reuse it for the frame header
+			if (sendFrame(session, HTTP2_DATA, 0, stream->id, payload + offset - HTTP2_FRAME_HEADER_LENGTH, size) < 0) {
+				discard = true;
+				break;
+			}
+
+			offset += size;
+			stream->response.bodyBytes += size;
+		}
+	}
+
+	close(readfd);
+
+	if (!discard) {
+		pthread_mutex_lock(&(session->lock));
+		discard = stream->reset;
+		pthread_mutex_unlock(&(session->lock));
+
+		if (!discard)
+			sendFrame(session, HTTP2_DATA, HTTP2_FLAG_END_STREAM, stream->id, frame, 0);
+	}
+
+	// wait for the handler to return
+	pthread_mutex_lock(&(session->lock));
+	pthread_cleanup_push(&unlockMutex, &(session->lock));
+	while (!stream->handlerDone)
+		pthread_cond_wait(&(session->changed), &(session->lock));
+	pthread_cleanup_pop(1);
+
+	finishStream(stream);
+
+	return NULL;
+}
+
+int http2_sendHeader(int statusCode, struct headers* headers, struct request* request) {
+	debug("http2: sending headers");
+
+	struct http2Stream* stream = (struct http2Stream*) request->_private;
+	struct http2Session* session = stream->session;
+
+	struct headers defaultHeaders = session->config->defaultHeaders;
+
+	for(int i = 0; i < defaultHeaders.number; i++) {
+		headers_mod(headers, defaultHeaders.headers[i].key, defaultHeaders.headers[i].value);
+	}
+
+	// connection specific headers are not allowed
+	headers_remove(headers, "Connection");
+	headers_remove(headers, "Keep-Alive");
+	headers_remove(headers, "Transfer-Encoding");
+
+	char* block = NULL;
+	size_t length = 0;
+	FILE* stream_ = open_memstream(&block, &length);
+	if (stream_ == NULL) {
+		error("http2: sendHeader: open_memstream: %s", strerror(errno));
+		return -1;
+	}
+
+	hpack_encodeStatus(stream_, statusCode);
+	for (int i = 0; i < headers->number; i++) {
+		hpack_encode(stream_, headers->headers[i].key, headers->headers[i].value);
+	}
+	fclose(stream_);
+
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		free(block);
+		error("http2: couldn't create pipe for response: %s", strerror(errno));
+		return -1;
+	}
+
+	struct relayData* data = malloc(sizeof(struct relayData));
+	if (data == NULL) {
+		free(block);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		error("http2: relay data: malloc: %s", strerror(errno));
+		return -1;
+	}
+	*data = (struct relayData) {
+		.stream = stream,
+		.readfd = pipefd[0]
+	};
+
+	pthread_mutex_lock(&(session->lock));
+	bool reset = stream->reset;
+	pthread_mutex_unlock(&(session->lock));
+
+	if (reset || sendHeaderBlock(session, stream->id, block, length, false) < 0) {
+		free(block);
+		free(data);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+	free(block);
+
+	stream->headersSent = true;
+	stream->timing.firstByte = getTime();
+	stream->response.statusCode = statusCode;
+	stream->response.headerBytes = length;
+
+	if (pthread_create(&(stream->threads.encoder), NULL, &http2RelayThread, data) != 0) {
+		stream->threads.encoder = PTHREAD_NULL;
+		free(data);
+		close(pipefd[0]);
+		close(pipefd[1]);
+
+		error("http2: Couldn't start relay thread.");
+		sendRstStream(session, stream->id, HTTP2_INTERNAL_ERROR);
+		return -1;
+	}
+
+	return pipefd[1];
+}
+
+// the body goes through the relay thread like any other
+int http2_sendResponse(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request) {
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += body[i].iov_len;
+	}
+
+	char contentLength[24];
+	snprintf(contentLength, sizeof(contentLength), "%zu", length);
+	headers_mod(headers, "Content-Length", contentLength);
+
+	int fd = http2_sendHeader(statusCode, headers, request);
+	if (fd < 0)
+		return -1;
+
+	int result = 0;
+	if (writevAll(fd, body, count, -1) < 0)
+		result = -1;
+	close(fd);
+
+	return result;
+}
+
+/*
+ * This thread moves the request body from the DATA frames to the handler.
+ * The client's window is only reopened for data the handler got.
+ */
+void* http2BodyThread(void* data) {
+	struct http2Stream* stream = (struct http2Stream*) data;
+	struct http2Session* session = stream->session;
+
+	char chunk[HTTP2_MAX_FRAME_SIZE];
+
+	while (true) {
+		pthread_mutex_lock(&(session->lock));
+		pthread_cleanup_push(&unlockMutex, &(session->lock));
+		while (stream->bodyLength == 0 && !stream->remoteClosed && !stream->reset && !session->closing)
+			pthread_cond_wait(&(session->changed), &(session->lock));
+		pthread_cleanup_pop(0);
+
+		if (stream->bodyLength == 0) {
+			pthread_mutex_unlock(&(session->lock));
+			break;
+		}
+
+		size_t length = stream->bodyLength > sizeof(chunk) ? sizeof(chunk) : stream->bodyLength;
+		memcpy(chunk, stream->bodyBuffer, length);
+		memmove(stream->bodyBuffer, stream->bodyBuffer + length, stream->bodyLength - length);
+		stream->bodyLength -= length;
+		pthread_mutex_unlock(&(session->lock));
+
+		if (stream->bodyWritefd >= 0 && writeAll(stream->bodyWritefd, chunk, length, -1) < 0) {
+			// the handler is not interested in the rest
+			close(stream->bodyWritefd);
+			stream->bodyWritefd = -1;
+		}
+
+		pthread_mutex_lock(&(session->lock));
+		bool open = !stream->remoteClosed && !stream->reset;
+		if (open)
+			stream->receiveWindow += length;
+		pthread_mutex_unlock(&(session->lock));
+
+		if (open)
+			sendWindowUpdate(session, stream->id, length);
+	}
+
+	// EOF for the handler
+	if (stream->bodyWritefd >= 0) {
+		close(stream->bodyWritefd);
+		stream->bodyWritefd = -1;
+	}
+
+	return NULL;
+}
+
+/*
+ * This thread calls the handler.
+ */
+void* http2HandlerThread(void* data) {
+	struct http2Stream* stream = (struct http2Stream*) data;
+	struct http2Session* session = stream->session;
+	struct connection* connection = session->connection;
+
+	debug("http2: calling response handler");
+
+	const char* expect = headers_get(&(stream->headers), "Expect");
+	if (expect != NULL && strcasecmp(expect, "100-continue") == 0 && !stream->remoteClosed) {
+		char block[8];
+		size_t length = 0;
+		FILE* stream_ = fmemopen(block, sizeof(block), "w");
+		if (stream_ != NULL) {
+			hpack_encodeStatus(stream_, 100);
+			length = ftell(stream_);
+			fclose(stream_);
+			sendHeaderBlock(session, stream->id, block, length, false);
+		}
+	}
+
+	stream->timing.handlerStart = getTime();
+
+	stream->threads.handler.handler((struct request) {
+		.metaData = stream->metaData,
+		.headers = &(stream->headers),
+		.fd = stream->bodyReadfd,
+		.peer = connection->peer,
+		.userData = stream->threads.handler.data,
+		.statusPages = stream->threads.handler.statusPages,
+		._private = stream
+	}, (struct response) {
+		.sendHeader = http2_sendHeader,
+		.sendResponse = http2_sendResponse
+	});
+
+	stream->timing.handlerEnd = getTime();
+
+	debug("http2: response handler returned");
+
+	// the body thread discards whatever is left
+	close(stream->bodyReadfd);
+	stream->bodyReadfd = -1;
+
+	if (!stream->headersSent) {
+		warn("http2: handler didn't respond on stream %u", stream->id);
+		sendRstStream(session, stream->id, HTTP2_INTERNAL_ERROR);
+	}
+
+	pthread_mutex_lock(&(session->lock));
+	if (!stream->headersSent)
+		stream->reset = true;
+	stream->handlerDone = true;
+	pthread_cond_broadcast(&(session->changed));
+	pthread_mutex_unlock(&(session->lock));
+
+	if (!stream->headersSent) {
+		// otherwise the relay thread finishes the stream once everything is sent
+		finishStream(stream);
+	}
+
+	return NULL;
+}
+
+struct headerContext {
+	struct http2Stream* stream;
+	char* method;
+	char* path;
+	char* scheme;
+	char* authority;
+	bool regular;
+	bool malformed;
+	bool allocError;
+};
+
+static int setPseudoHeader(char** field, const char* value) {
+	if (*field != NULL)
+		return -1;
+
+	*field = strdup(value);
+	return *field == NULL ? HEADERS_ALLOC_ERROR : 0;
+}
+
+/*
+ * HTTP/2 field names are lowercase; the handlers expect the usual spelling.
+ */
+static void canonicalName(char* name) {
+	bool upper = true;
+	for (; *name != '\0'; name++) {
+		if (upper)
+			*name = toupper(*name);
+		upper = *name == '-';
+	}
+}
+
+static int onHeader(const char* name, const char* value, void* data) {
+	struct headerContext* context = (struct headerContext*) data;
+
+	// trailers and refused streams are only decoded to keep the table in sync
+	if (context->stream == NULL || context->malformed)
+		return 0;
+
+	int tmp = 0;
+
+	if (name[0] == ':') {
+		if (context->regular) {
+			context->malformed = true;
+			return 0;
+		}
+
+		if (strcmp(name, ":method") == 0) {
+			tmp = setPseudoHeader(&(context->method), value);
+		} else if (strcmp(name, ":path") == 0) {
+			tmp = setPseudoHeader(&(context->path), value);
+		} else if (strcmp(name, ":scheme") == 0) {
+			tmp = setPseudoHeader(&(context->scheme), value);
+		} else if (strcmp(name, ":authority") == 0) {
+			tmp = setPseudoHeader(&(context->authority), value);
+		} else {
+			tmp = -1;
+		}
+	} else {
+		context->regular = true;
+
+		for (const char* c = name; *c != '\0'; c++) {
+			if (isupper(*c)) {
+				context->malformed = true;
+				return 0;
+			}
+		}
+
+		if (strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 ||
+			strcmp(name, "proxy-connection") == 0 || strcmp(name, "transfer-encoding") == 0 ||
+			strcmp(name, "upgrade") == 0 || (strcmp(name, "te") == 0 && strcmp(value, "trailers") != 0)) {
+			context->malformed = true;
+			return 0;
+		}
+
+		char* key = strdup(name);
+		if (key == NULL) {
+			context->allocError = true;
+			return -1;
+		}
+		canonicalName(key);
+
+		struct headers* headers = &(context->stream->headers);
+		const char* existing = headers_get(headers, key);
+		if (existing == NULL) {
+			tmp = headers_mod(headers, key, value);
+		} else {
+			// fields with the same name are combined; cookies are split into crumbs
+			const char* separator = strcmp(key, "Cookie") == 0 ? "; " : ", ";
+			char* combined = malloc(strlen(existing) + strlen(separator) + strlen(value) + 1);
+			if (combined == NULL) {
+				tmp = HEADERS_ALLOC_ERROR;
+			} else {
+				strcpy(combined, existing);
+				strcat(combined, separator);
+				strcat(combined, value);
+				tmp = headers_mod(headers, key, combined);
+				free(combined);
+			}
+		}
+
+		free(key);
+	}
+
+	if (tmp == HEADERS_ALLOC_ERROR) {
+		context->allocError = true;
+		return -1;
+	}
+	if (tmp < 0)
+		context->malformed = true;
+
+	return 0;
+}
+
+/*
+ * Turns the pseudo headers into the meta data the handlers know.
+ */
+static int buildMetaData(struct http2Stream* stream, struct headerContext* context) {
+	if (context->method == NULL || context->path == NULL || context->scheme == NULL)
+		return HEADERS_PARSE_ERROR;
+
+	if (strchr(context->path, ' ') != NULL || context->path[0] != '/')
+		return HEADERS_PARSE_ERROR;
+
+	char* line = malloc(strlen(context->method) + 1 + strlen(context->path) + 1 + strlen("HTTP/2.0") + 1);
+	if (line == NULL)
+		return HEADERS_ALLOC_ERROR;
+
+	sprintf(line, "%s %s HTTP/2.0", context->method, context->path);
+	int tmp = headers_metadata(&(stream->metaData), line);
+	free(line);
+
+	if (tmp < 0)
+		return tmp;
+
+	if (context->authority != NULL && headers_get(&(stream->headers), "Host") == NULL) {
+		if (headers_mod(&(stream->headers), "Host", context->authority) < 0)
+			return HEADERS_ALLOC_ERROR;
+	}
+
+	return HEADERS_SUCCESS;
+}
+
+static void freeContext(struct headerContext* context) {
+	free(context->method);
+	free(context->path);
+	free(context->scheme);
+	free(context->authority);
+}
+
+// returns the connection error code or -1
+static int startStream(struct http2Session* session, struct http2Stream* stream, bool endStream) {
+	struct connection* connection = session->connection;
+
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		error("http2: couldn't create pipe for request body: %s", strerror(errno));
+		return HTTP2_INTERNAL_ERROR;
+	}
+	stream->bodyReadfd = pipefd[0];
+	stream->bodyWritefd = pipefd[1];
+
+	if (endStream) {
+		// the handler just gets EOF
+		close(stream->bodyWritefd);
+		stream->bodyWritefd = -1;
+		stream->remoteClosed = true;
+	} else {
+		stream->bodyBuffer = malloc(HTTP2_INITIAL_WINDOW_SIZE);
+		if (stream->bodyBuffer == NULL) {
+			error("http2: couldn't allocate body buffer: %s", strerror(errno));
+			return HTTP2_INTERNAL_ERROR;
+		}
+	}
+
+	long maxBodySize = connection->bind->maxBodySize;
+	const char* contentLength = headers_get(&(stream->headers), "Content-Length");
+	if (maxBodySize > 0 && contentLength != NULL && strtoll(contentLength, NULL, 10) > maxBodySize)
+		stream->status = 413;
+
+	struct handler handler;
+	if (stream->status != 0) {
+		metrics_requestHandler(-1);
+		handler = (struct handler) {
+			.handler = statusHandler,
+			.data = {
+				.integer = stream->status
+			}
+		};
+	} else {
+		handler = session->config->getHandler(stream->metaData, headers_get(&(stream->headers), "Host"), connection->bind);
+
+		// streams don't take the fast path of HTTP/1; both limits are checked here
+		handler = networking_limitHandler(handler, &(session->config->rateLimit), connection->peer.addr);
+	}
+
+	if (handler.handler == NULL) {
+		handler.handler = status500;
+		handler.data.ptr = NULL;
+	}
+
+	stream->threads.handler = handler;
+
+	pthread_mutex_lock(&(session->lock));
+	stream->next = session->streams;
+	session->streams = stream;
+	session->active++;
+	stream->number = ++(session->requests);
+	pthread_mutex_unlock(&(session->lock));
+
+	if (!endStream) {
+		if (pthread_create(&(stream->threads.body), NULL, &http2BodyThread, stream) != 0) {
+			stream->threads.body = PTHREAD_NULL;
+			error("http2: Couldn't start request body thread.");
+
+			close(stream->bodyWritefd);
+			stream->bodyWritefd = -1;
+		}
+	}
+
+	if (pthread_create(&(stream->threads.response), NULL, &http2HandlerThread, stream) != 0) {
+		stream->threads.response = PTHREAD_NULL;
+		error("http2: Couldn't start handler thread.");
+
+		sendRstStream(session, stream->id, HTTP2_INTERNAL_ERROR);
+
+		pthread_mutex_lock(&(session->lock));
+		stream->handlerDone = true;
+		pthread_mutex_unlock(&(session->lock));
+		finishStream(stream);
+	}
+
+	return -1;
+}
+
+// returns the connection error code or -1
+static int processHeaderBlock(struct http2Session* session, uint32_t id, const unsigned char* block, size_t length, bool endStream, struct timespec requestStart) {
+	struct headerContext context = {};
+
+	pthread_mutex_lock(&(session->lock));
+	struct http2Stream* existing = findStream(session, id);
+	pthread_mutex_unlock(&(session->lock));
+
+	if (existing != NULL || id <= session->lastStreamId || (id % 2) == 0) {
+		// trailers or a stream we don't know (anymore)
+		if (hpack_decode(&(session->decoder), block, length, &onHeader, &context) < 0)
+			return HTTP2_COMPRESSION_ERROR;
+
+		if (existing == NULL) {
+			if ((id % 2) == 0)
+				return HTTP2_PROTOCOL_ERROR;
+
+			sendRstStream(session, id, HTTP2_STREAM_CLOSED);
+			return -1;
+		}
+
+		pthread_mutex_lock(&(session->lock));
+		bool remoteClosed = existing->remoteClosed;
+		if (endStream)
+			existing->remoteClosed = true;
+		pthread_cond_broadcast(&(session->changed));
+		pthread_mutex_unlock(&(session->lock));
+
+		if (remoteClosed || !endStream)
+			return HTTP2_PROTOCOL_ERROR;
+
+		return -1;
+	}
+
+	session->lastStreamId = id;
+
+	struct http2Stream* stream = malloc(sizeof(struct http2Stream));
+	if (stream == NULL) {
+		error("http2: couldn't allocate stream: %s", strerror(errno));
+		return HTTP2_INTERNAL_ERROR;
+	}
+
+	*stream = (struct http2Stream) {
+		.session = session,
+		.next = NULL,
+		.id = id,
+		.metaData = {
+			.path = NULL,
+			.queryString = NULL,
+			.uri = NULL
+		},
+		.headers = headers_create(),
+		.timing = {
+			.requestStart = requestStart,
+			.headersEnd = getTime()
+		},
+		.threads = {
+			.request = PTHREAD_NULL,
+			.response = PTHREAD_NULL,
+			.encoder = PTHREAD_NULL,
+			.body = PTHREAD_NULL
+		},
+		.bodyReadfd = -1,
+		.bodyWritefd = -1,
+		.bodyBuffer = NULL,
+		.receiveWindow = HTTP2_INITIAL_WINDOW_SIZE,
+		.sendWindow = session->peerInitialWindow
+	};
+
+	context.stream = stream;
+	int tmp = hpack_decode(&(session->decoder), block, length, &onHeader, &context);
+	if (tmp < 0 && !context.allocError) {
+		freeContext(&context);
+		freeStream(stream);
+		return HTTP2_COMPRESSION_ERROR;
+	}
+
+	if (context.allocError) {
+		freeContext(&context);
+		freeStream(stream);
+		return HTTP2_INTERNAL_ERROR;
+	}
+
+	if (!context.malformed) {
+		tmp = buildMetaData(stream, &context);
+		if (tmp == HEADERS_ALLOC_ERROR) {
+			freeContext(&context);
+			freeStream(stream);
+			return HTTP2_INTERNAL_ERROR;
+		}
+		context.malformed = tmp < 0;
+	}
+	freeContext(&context);
+
+	if (context.malformed) {
+		warn("http2: malformed request on stream %u", id);
+		freeStream(stream);
+		sendRstStream(session, id, HTTP2_PROTOCOL_ERROR);
+		return -1;
+	}
+
+	pthread_mutex_lock(&(session->lock));
+	bool refuse = session->goaway || session->active >= HTTP2_MAX_CONCURRENT_STREAMS;
+	pthread_mutex_unlock(&(session->lock));
+
+	if (refuse) {
+		freeStream(stream);
+		sendRstStream(session, id, HTTP2_REFUSED_STREAM);
+		return -1;
+	}
+
+	return startStream(session, stream, endStream);
+}
+
+// returns the connection error code or -1
+static int processData(struct http2Session* session, uint32_t id, int flags, unsigned char* payload, size_t length) {
+	if (id == 0)
+		return HTTP2_PROTOCOL_ERROR;
+
+	// flow control covers the padding as well
+	session->receiveWindow -= length;
+	if (session->receiveWindow < 0)
+		return HTTP2_FLOW_CONTROL_ERROR;
+	if (length > 0) {
+		// other streams must not starve because of a slow handler
+		sendWindowUpdate(session, 0, length);
+		session->receiveWindow += length;
+	}
+
+	size_t padding = 0;
+	if (flags & HTTP2_FLAG_PADDED) {
+		if (length < 1 || payload[0] >= length)
+			return HTTP2_PROTOCOL_ERROR;
+		padding = payload[0] + 1;
+	}
+
+	pthread_mutex_lock(&(session->lock));
+	struct http2Stream* stream = findStream(session, id);
+	if (stream == NULL || stream->remoteClosed || stream->reset) {
+		pthread_mutex_unlock(&(session->lock));
+
+		if (id > session->lastStreamId)
+			return HTTP2_PROTOCOL_ERROR;
+
+		sendRstStream(session, id, HTTP2_STREAM_CLOSED);
+		return -1;
+	}
+
+	stream->receiveWindow -= length;
+	if (stream->receiveWindow < 0) {
+		stream->reset = true;
+		pthread_cond_broadcast(&(session->changed));
+		pthread_mutex_unlock(&(session->lock));
+
+		sendRstStream(session, id, HTTP2_FLOW_CONTROL_ERROR);
+		return -1;
+	}
+
+	size_t dataLength = length - padding;
+
+	long maxBodySize = session->connection->bind->maxBodySize;
+	if (maxBodySize > 0 && stream->bodyReceived + dataLength > maxBodySize) {
+		warn("http2: request body exceeds %ld bytes", maxBodySize);
+		stream->reset = true;
+		pthread_cond_broadcast(&(session->changed));
+		pthread_mutex_unlock(&(session->lock));
+
+		sendRstStream(session, id, HTTP2_CANCEL);
+		return -1;
+	}
+
+	unsigned char* data = payload + (padding > 0 ? 1 : 0);
+	memcpy(stream->bodyBuffer + stream->bodyLength, data, dataLength);
+	stream->bodyLength += dataLength;
+	stream->bodyReceived += dataLength;
+
+	// the padding is not handed to the handler; give the window back right away
+	stream->receiveWindow += length - dataLength;
+	size_t returned = length - dataLength;
+
+	if (flags & HTTP2_FLAG_END_STREAM)
+		stream->remoteClosed = true;
+
+	pthread_cond_broadcast(&(session->changed));
+	bool open = !stream->remoteClosed;
+	pthread_mutex_unlock(&(session->lock));
+
+	if (returned > 0 && open)
+		sendWindowUpdate(session, id, returned);
+
+	return -1;
+}
+
+// returns the connection error code or -1
+static int processSettings(struct http2Session* session, int flags, const unsigned char* payload, size_t length) {
+	if (flags & HTTP2_FLAG_ACK)
+		return length == 0 ? -1 : HTTP2_FRAME_SIZE_ERROR;
+
+	if (length % 6 != 0)
+		return HTTP2_FRAME_SIZE_ERROR;
+
+	for (size_t i = 0; i < length; i += 6) {
+		int id = (payload[i] << 8) | payload[i + 1];
+		uint32_t value = readUint32(payload + i + 2);
+
+		switch(id) {
+			case HTTP2_SETTINGS_ENABLE_PUSH:
+				if (value > 1)
+					return HTTP2_PROTOCOL_ERROR;
+				break;
+			case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+				if (value > HTTP2_MAX_WINDOW_SIZE)
+					return HTTP2_FLOW_CONTROL_ERROR;
+
+				pthread_mutex_lock(&(session->lock));
+				long delta = (long) value - session->peerInitialWindow;
+				session->peerInitialWindow = value;
+				for (struct http2Stream* stream = session->streams; stream != NULL; stream = stream->next) {
+					stream->sendWindow += delta;
+				}
+				pthread_cond_broadcast(&(session->changed));
+				pthread_mutex_unlock(&(session->lock));
+				break;
+			case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+				if (value < HTTP2_MAX_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE_LIMIT)
+					return HTTP2_PROTOCOL_ERROR;
+
+				// we never send more than we accept
+				session->peerMaxFrameSize = value > HTTP2_MAX_FRAME_SIZE ? HTTP2_MAX_FRAME_SIZE : value;
+				break;
+			default:
+				// we don't use the peer's dynamic table and don't push
+				break;
+		}
+	}
+
+	session->settingsReceived = true;
+
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH];
+	sendFrame(session, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, frame, 0);
+
+	return -1;
+}
+
+// returns the connection error code or -1
+static int processWindowUpdate(struct http2Session* session, uint32_t id, const unsigned char* payload, size_t length) {
+	if (length != 4)
+		return HTTP2_FRAME_SIZE_ERROR;
+
+	uint32_t increment = readUint32(payload) & HTTP2_MAX_WINDOW_SIZE;
+
+	pthread_mutex_lock(&(session->lock));
+
+	int result = -1;
+	if (id == 0) {
+		if (increment == 0 || session->sendWindow + increment > HTTP2_MAX_WINDOW_SIZE) {
+			result = increment == 0 ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR;
+		} else {
+			session->sendWindow += increment;
+		}
+	} else {
+		struct http2Stream* stream = findStream(session, id);
+		if (stream == NULL) {
+			// probably already closed
+		} else if (increment == 0 || stream->sendWindow + increment > HTTP2_MAX_WINDOW_SIZE) {
+			stream->reset = true;
+			pthread_mutex_unlock(&(session->lock));
+
+			sendRstStream(session, id, increment == 0 ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR);
+
+			pthread_mutex_lock(&(session->lock));
+		} else {
+			stream->sendWindow += increment;
+		}
+	}
+
+	pthread_cond_broadcast(&(session->changed));
+	pthread_mutex_unlock(&(session->lock));
+
+	return result;
+}
+
+// returns the connection error code or -1
+static int processRstStream(struct http2Session* session, uint32_t id, const unsigned char* payload, size_t length) {
+	if (length != 4)
+		return HTTP2_FRAME_SIZE_ERROR;
+	if (id == 0 || id > session->lastStreamId)
+		return HTTP2_PROTOCOL_ERROR;
+
+	debug("http2: stream %u reset by peer: %u", id, readUint32(payload));
+
+	pthread_mutex_lock(&(session->lock));
+	struct http2Stream* stream = findStream(session, id);
+	if (stream != NULL)
+		stream->reset = true;
+	pthread_cond_broadcast(&(session->changed));
+	pthread_mutex_unlock(&(session->lock));
+
+	return -1;
+}
+
+/*
+ * Waits until the connection is readable. If the server drains, the peer gets GOAWAY;
+ * after GOAWAY the session ends as soon as no stream is active anymore.
+ * Returns -1 with ETIMEDOUT if the session is done or idle for too long.
+ */
+static int waitForInput(struct http2Session* session) {
+	struct pollfd fds[3] = {
+		{ .fd = session->connection->readfd, .events = POLLIN },
+		{ .fd = session->goawaySent ? -1 : networking_drainfd(), .events = POLLIN },
+		{ .fd = session->wakeupfd, .events = POLLIN }
+	};
+
+	int tmp;
+	do {
+		tmp = poll(fds, 3, session->config->connectionTimeout);
+	} while (tmp < 0 && errno == EINTR);
+
+	if (tmp < 0)
+		return -1;
+
+	if (fds[1].revents & POLLIN) {
+		debug("http2: server drains; sending GOAWAY");
+		pthread_mutex_lock(&(session->lock));
+		session->goaway = true;
+		pthread_mutex_unlock(&(session->lock));
+
+		session->goawaySent = true;
+		sendGoaway(session, session->lastStreamId, HTTP2_NO_ERROR);
+	}
+
+	pthread_mutex_lock(&(session->lock));
+	bool idle = session->active == 0;
+	bool done = idle && session->goaway;
+	pthread_mutex_unlock(&(session->lock));
+
+	if (done || (tmp == 0 && idle)) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads exactly length bytes; data the data handler already received is used first.
+ * The timeout only applies if there are no active streams.
+ */
+static int readExact(struct http2Session* session, void* buffer, size_t length) {
+	struct connection* connection = session->connection;
+	char* position = (char*) buffer;
+
+	while (length > 0) {
+		size_t buffered = connection->bufferLength - connection->bufferOffset;
+		if (buffered > 0) {
+			if (buffered > length)
+				buffered = length;
+			memcpy(position, connection->buffer + connection->bufferOffset, buffered);
+			connection->bufferOffset += buffered;
+			position += buffered;
+			length -= buffered;
+			continue;
+		}
+
+		ssize_t tmp = read(connection->readfd, connection->buffer, RECEIVE_BUFFER_SIZE);
+		if (tmp > 0) {
+			metrics_add(METRIC_BYTES_IN, tmp);
+			connection->bufferOffset = 0;
+			connection->bufferLength = tmp;
+			continue;
+		}
+
+		if (tmp == 0) {
+			debug("http2: connection ended");
+			errno = 0;
+			return -1;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		if (waitForInput(session) < 0)
+			return -1;
+
+		reapStreams(session);
+	}
+
+	return 0;
+}
+
+/*
+ * Reads and dispatches frames until the connection ends.
+ * Returns the error code for GOAWAY or -1 if the connection is just gone.
+ */
+static int readFrames(struct http2Session* session) {
+	unsigned char header[HTTP2_FRAME_HEADER_LENGTH];
+	unsigned char payload[HTTP2_MAX_FRAME_SIZE];
+
+	while (true) {
+		reapStreams(session);
+
+		if (readExact(session, header, HTTP2_FRAME_HEADER_LENGTH) < 0) {
+			if (errno == ETIMEDOUT) {
+				debug("http2: connection idle");
+				return HTTP2_NO_ERROR;
+			}
+			return -1;
+		}
+
+		struct timespec frameStart = getTime();
+
+		size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+		int type = header[3];
+		int flags = header[4];
+		uint32_t id = readUint32(header + 5) & HTTP2_MAX_WINDOW_SIZE;
+
+		if (length > HTTP2_MAX_FRAME_SIZE)
+			return HTTP2_FRAME_SIZE_ERROR;
+
+		if (readExact(session, payload, length) < 0)
+			return -1;
+
+		if (!session->settingsReceived && type != HTTP2_SETTINGS)
+			return HTTP2_PROTOCOL_ERROR;
+
+		if (session->headerBlock != NULL && (type != HTTP2_CONTINUATION || id != session->headerStream))
+			return HTTP2_PROTOCOL_ERROR;
+
+		int result = -1;
+
+		switch(type) {
+			case HTTP2_DATA:
+				result = processData(session, id, flags, payload, length);
+				break;
+			case HTTP2_HEADERS: {
+				if (id == 0)
+					return HTTP2_PROTOCOL_ERROR;
+
+				unsigned char* block = payload;
+				size_t blockLength = length;
+
+				if (flags & HTTP2_FLAG_PADDED) {
+					if (blockLength < 1 || block[0] >= blockLength)
+						return HTTP2_PROTOCOL_ERROR;
+					blockLength -= block[0] + 1;
+					block++;
+				}
+				if (flags & HTTP2_FLAG_PRIORITY) {
+					if (blockLength < 5)
+						return HTTP2_PROTOCOL_ERROR;
+					if ((readUint32(block) & HTTP2_MAX_WINDOW_SIZE) == id)
+						return HTTP2_PROTOCOL_ERROR;
+					block += 5;
+					blockLength -= 5;
+				}
+
+				bool endStream = flags & HTTP2_FLAG_END_STREAM;
+
+				if (flags & HTTP2_FLAG_END_HEADERS) {
+					result = processHeaderBlock(session, id, block, blockLength, endStream, frameStart);
+					break;
+				}
+
+				session->headerBlock = malloc(blockLength > 0 ? blockLength : 1);
+				if (session->headerBlock == NULL)
+					return HTTP2_INTERNAL_ERROR;
+				memcpy(session->headerBlock, block, blockLength);
+				session->headerBlockLength = blockLength;
+				session->headerStream = id;
+				session->headerEndStream = endStream;
+				break;
+			}
+			case HTTP2_CONTINUATION: {
+				if (session->headerBlock == NULL)
+					return HTTP2_PROTOCOL_ERROR;
+				if (session->headerBlockLength + length > HTTP2_MAX_HEADER_BLOCK)
+					return HTTP2_ENHANCE_YOUR_CALM;
+
+				unsigned char* tmp = realloc(session->headerBlock, session->headerBlockLength + length + 1);
+				if (tmp == NULL)
+					return HTTP2_INTERNAL_ERROR;
+				memcpy(tmp + session->headerBlockLength, payload, length);
+				session->headerBlock = tmp;
+				session->headerBlockLength += length;
+
+				if (flags & HTTP2_FLAG_END_HEADERS) {
+					unsigned char* block = session->headerBlock;
+					session->headerBlock = NULL;
+					result = processHeaderBlock(session, id, block, session->headerBlockLength, session->headerEndStream, frameStart);
+					free(block);
+				}
+				break;
+			}
+			case HTTP2_PRIORITY:
+				if (id == 0)
+					return HTTP2_PROTOCOL_ERROR;
+				if (length != 5)
+					sendRstStream(session, id, HTTP2_FRAME_SIZE_ERROR);
+				// we don't prioritize
+				break;
+			case HTTP2_RST_STREAM:
+				result = processRstStream(session, id, payload, length);
+				break;
+			case HTTP2_SETTINGS:
+				if (id != 0)
+					return HTTP2_PROTOCOL_ERROR;
+				result = processSettings(session, flags, payload, length);
+				break;
+			case HTTP2_PUSH_PROMISE:
+				// clients can't push
+				return HTTP2_PROTOCOL_ERROR;
+			case HTTP2_PING:
+				if (id != 0)
+					return HTTP2_PROTOCOL_ERROR;
+				if (length != 8)
+					return HTTP2_FRAME_SIZE_ERROR;
+				if (!(flags & HTTP2_FLAG_ACK)) {
+					unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + 8];
+					memcpy(frame + HTTP2_FRAME_HEADER_LENGTH, payload, 8);
+					sendFrame(session, HTTP2_PING, HTTP2_FLAG_ACK, 0, frame, 8);
+				}
+				break;
+			case HTTP2_GOAWAY:
+				if (id != 0)
+					return HTTP2_PROTOCOL_ERROR;
+				if (length < 8)
+					return HTTP2_FRAME_SIZE_ERROR;
+
+				debug("http2: peer sent GOAWAY: %u", readUint32(payload + 4));
+
+				pthread_mutex_lock(&(session->lock));
+				session->goaway = true;
+				bool idle = session->active == 0;
+				pthread_mutex_unlock(&(session->lock));
+
+				if (idle)
+					return HTTP2_NO_ERROR;
+				break;
+			case HTTP2_WINDOW_UPDATE:
+				result = processWindowUpdate(session, id, payload, length);
+				break;
+			default:
+				// unknown frame types must be ignored
+				break;
+		}
+
+		if (result >= 0)
+			return result;
+	}
+}
+
+void http2_serve(struct connection* connection, struct networkingConfig* config) {
+	debug("http2: starting session");
+
+	struct http2Session session = {
+		.connection = connection,
+		.config = config,
+		.broken = false,
+		.decoder = hpack_createTable(HPACK_DEFAULT_TABLE_SIZE),
+		.streams = NULL,
+		.done = NULL,
+		.active = 0,
+		.requests = 0,
+		.lastStreamId = 0,
+		.sendWindow = HTTP2_INITIAL_WINDOW_SIZE,
+		.receiveWindow = HTTP2_INITIAL_WINDOW_SIZE,
+		.peerInitialWindow = HTTP2_INITIAL_WINDOW_SIZE,
+		.peerMaxFrameSize = HTTP2_MAX_FRAME_SIZE,
+		.settingsReceived = false,
+		.goaway = false,
+		.goawaySent = false,
+		.closing = false,
+		.wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+		.headerBlock = NULL
+	};
+	pthread_mutex_init(&(session.lock), NULL);
+	pthread_cond_init(&(session.changed), NULL);
+	pthread_mutex_init(&(session.writeLock), NULL);
+
+	char preface[sizeof(HTTP2_PREFACE_REST) - 1];
+	int errorCode = -1;
+
+	if (readExact(&session, preface, sizeof(preface)) < 0 || memcmp(preface, HTTP2_PREFACE_REST, sizeof(preface)) != 0) {
+		warn("http2: invalid connection preface");
+	} else if (sendSettings(&session) >= 0) {
+		errorCode = readFrames(&session);
+	}
+
+	if (session.headerBlock != NULL)
+		free(session.headerBlock);
+
+	if (errorCode > 0) {
+		warn("http2: connection error %d", errorCode);
+		sendGoaway(&session, session.lastStreamId, errorCode);
+	} else if (errorCode == HTTP2_NO_ERROR && !session.goawaySent) {
+		sendGoaway(&session, session.lastStreamId, errorCode);
+	}
+
+	// give running handlers the chance to finish their responses
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += HTTP2_HANDLER_TIMEOUT;
+
+	pthread_mutex_lock(&(session.lock));
+	if (errorCode > 0)
+		session.closing = true;
+	pthread_cond_broadcast(&(session.changed));
+	while (session.active > 0) {
+		if (pthread_cond_timedwait(&(session.changed), &(session.lock), &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	// whatever is still running gets cancelled
+	session.closing = true;
+	pthread_cond_broadcast(&(session.changed));
+	struct http2Stream* stream = session.streams;
+	session.streams = NULL;
+	pthread_mutex_unlock(&(session.lock));
+
+	while (stream != NULL) {
+		struct http2Stream* next = stream->next;
+
+		joinThread(&(stream->threads.response), true);
+		joinThread(&(stream->threads.encoder), true);
+		joinThread(&(stream->threads.body), true);
+
+		stream = next;
+	}
+
+	reapStreams(&session);
+
+	hpack_freeTable(&(session.decoder));
+	if (session.wakeupfd >= 0)
+		close(session.wakeupfd);
+	pthread_mutex_destroy(&(session.lock));
+	pthread_cond_destroy(&(session.changed));
+	pthread_mutex_destroy(&(session.writeLock));
+
+	debug("http2: session ended");
+}
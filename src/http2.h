@@ -0,0 +1,139 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "networking.h"
+#include "hpack.h"
+
+/*
+ * The client preface looks like a request line followed by an empty line.
+ * The data handler recognizes the line; the session reads the rest.
+ */
+#define HTTP2_PREFACE_LINE "PRI * HTTP/2.0"
+#define HTTP2_PREFACE_REST "\r\nSM\r\n\r\n"
+
+#define HTTP2_FRAME_HEADER_LENGTH (9)
+
+#define HTTP2_DATA (0x0)
+#define HTTP2_HEADERS (0x1)
+#define HTTP2_PRIORITY (0x2)
+#define HTTP2_RST_STREAM (0x3)
+#define HTTP2_SETTINGS (0x4)
+#define HTTP2_PUSH_PROMISE (0x5)
+#define HTTP2_PING (0x6)
+#define HTTP2_GOAWAY (0x7)
+#define HTTP2_WINDOW_UPDATE (0x8)
+#define HTTP2_CONTINUATION (0x9)
+
+#define HTTP2_FLAG_END_STREAM (0x1)
+#define HTTP2_FLAG_ACK (0x1)
+#define HTTP2_FLAG_END_HEADERS (0x4)
+#define HTTP2_FLAG_PADDED (0x8)
+#define HTTP2_FLAG_PRIORITY (0x20)
+
+#define HTTP2_SETTINGS_HEADER_TABLE_SIZE (0x1)
+#define HTTP2_SETTINGS_ENABLE_PUSH (0x2)
+#define HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS (0x3)
+#define HTTP2_SETTINGS_INITIAL_WINDOW_SIZE (0x4)
+#define HTTP2_SETTINGS_MAX_FRAME_SIZE (0x5)
+#define HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE (0x6)
+
+#define HTTP2_NO_ERROR (0x0)
+#define HTTP2_PROTOCOL_ERROR (0x1)
+#define HTTP2_INTERNAL_ERROR (0x2)
+#define HTTP2_FLOW_CONTROL_ERROR (0x3)
+#define HTTP2_SETTINGS_TIMEOUT (0x4)
+#define HTTP2_STREAM_CLOSED (0x5)
+#define HTTP2_FRAME_SIZE_ERROR (0x6)
+#define HTTP2_REFUSED_STREAM (0x7)
+#define HTTP2_CANCEL (0x8)
+#define HTTP2_COMPRESSION_ERROR (0x9)
+#define HTTP2_ENHANCE_YOUR_CALM (0xb)
+
+// largest frame payload we accept and send
+#define HTTP2_MAX_FRAME_SIZE (16384)
+#define HTTP2_MAX_FRAME_SIZE_LIMIT (16777215)
+#define HTTP2_INITIAL_WINDOW_SIZE (65535)
+#define HTTP2_MAX_WINDOW_SIZE (0x7fffffff)
+#define HTTP2_MAX_CONCURRENT_STREAMS (32)
+// compressed; including CONTINUATION frames
+#define HTTP2_MAX_HEADER_BLOCK (65536)
+
+// in s; same as the handler timeout for HTTP/1
+#define HTTP2_HANDLER_TIMEOUT (30)
+
+struct http2Session;
+
+struct http2Stream {
+	struct http2Session* session;
+	struct http2Stream* next;
+	uint32_t id;
+	// position on the connection (starting at 1)
+	int number;
+	struct metaData metaData;
+	struct headers headers;
+	struct exchangeTiming timing;
+	// response: handler thread; encoder: DATA frames; body: request body
+	struct threads threads;
+	// request body; the body thread moves it from the buffer into the pipe
+	int bodyReadfd;
+	int bodyWritefd;
+	char* bodyBuffer;
+	size_t bodyLength;
+	size_t bodyReceived;
+	long receiveWindow;
+	long sendWindow;
+	// status code to answer with instead of calling the handler; 0 otherwise
+	int status;
+	bool remoteClosed;
+	bool headersSent;
+	bool handlerDone;
+	bool reset;
+	struct {
+		int statusCode;
+		size_t headerBytes;
+		size_t bodyBytes;
+	} response;
+};
+
+struct http2Session {
+	struct connection* connection;
+	struct networkingConfig* config;
+	pthread_mutex_t lock;
+	// signaled on window updates, new body data and finished streams
+	pthread_cond_t changed;
+	// frames must not be interleaved
+	pthread_mutex_t writeLock;
+	bool broken;
+	struct hpackTable decoder;
+	struct http2Stream* streams;
+	// finished streams whose threads have to be joined
+	struct http2Stream* done;
+	int active;
+	int requests;
+	uint32_t lastStreamId;
+	long sendWindow;
+	long receiveWindow;
+	long peerInitialWindow;
+	size_t peerMaxFrameSize;
+	bool settingsReceived;
+	// no new streams; set by GOAWAY in either direction
+	bool goaway;
+	// we sent GOAWAY because the server drains
+	bool goawaySent;
+	bool closing;
+	// signaled once the last stream finished after GOAWAY
+	int wakeupfd;
+	// header block that is continued in CONTINUATION frames
+	unsigned char* headerBlock;
+	size_t headerBlockLength;
+	uint32_t headerStream;
+	bool headerEndStream;
+};
+
+void http2_serve(struct connection* connection, struct networkingConfig* config);
+
+#endif
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "listing.h"
+#include "logging.h"
+#include "metrics.h"
+
+#define BUCKETS (LISTING_CACHE_SIZE * 2)
+#define DENTS_BUFFER_SIZE (32 * 1024)
+
+struct entry {
+	// offset in names until all entries are read
+	size_t offset;
+	const char* name;
+	bool isDir;
+};
+
+struct listing {
+	char* path;
+	char* relative;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+
+	char* names;
+	struct entry* entries;
+	size_t nrEntries;
+	// the whole page; NULL until somebody asks for it
+	char* html;
+	size_t htmlLength;
+	size_t memory;
+
+	int references;
+	bool cached;
+	struct listing* nextInBucket;
+	// LRU list; most recently used first
+	struct listing* newer;
+	struct listing* older;
+};
+
+struct buffer {
+	char* data;
+	size_t length;
+	size_t size;
+	bool failed;
+};
+
+static struct listing* buckets[BUCKETS];
+static struct listing* newest = NULL;
+static struct listing* oldest = NULL;
+static int numberOfListings = 0;
+static size_t memoryUsed = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct listing** getBucket(const char* path) {
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (const char* c = path; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+
+	return &(buckets[hash % BUCKETS]);
+}
+
+static struct listing* findListing(const char* path, const char* relative) {
+	for (struct listing* listing = *getBucket(path); listing != NULL; listing = listing->nextInBucket) {
+		if (strcmp(listing->path, path) == 0 && strcmp(listing->relative, relative) == 0)
+			return listing;
+	}
+	return NULL;
+}
+
+static void unlinkLRU(struct listing* listing) {
+	if (listing->newer != NULL)
+		listing->newer->older = listing->older;
+	else
+		newest = listing->older;
+	if (listing->older != NULL)
+		listing->older->newer = listing->newer;
+	else
+		oldest = listing->newer;
+
+	listing->newer = NULL;
+	listing->older = NULL;
+}
+
+static void pushLRU(struct listing* listing) {
+	listing->older = newest;
+	listing->newer = NULL;
+	if (newest != NULL)
+		newest->newer = listing;
+	newest = listing;
+	if (oldest == NULL)
+		oldest = listing;
+}
+
+static void freeListing(struct listing* listing) {
+	free(listing->path);
+	free(listing->relative);
+	free(listing->names);
+	free(listing->entries);
+	free(listing->html);
+	free(listing);
+}
+
+/*
+ * Takes the listing out of the cache; it is freed once the last reference is released.
+ * Has to be called with the lock held.
+ */
+static void removeListing(struct listing* listing) {
+	struct listing** pointer = getBucket(listing->path);
+	while (*pointer != listing)
+		pointer = &((*pointer)->nextInBucket);
+	*pointer = listing->nextInBucket;
+	listing->nextInBucket = NULL;
+
+	unlinkLRU(listing);
+
+	numberOfListings--;
+	memoryUsed -= listing->memory;
+	listing->cached = false;
+
+	if (listing->references == 0)
+		freeListing(listing);
+}
+
+static void evict() {
+	while ((numberOfListings > LISTING_CACHE_SIZE || memoryUsed > LISTING_CACHE_MEMORY) && oldest != NULL)
+		removeListing(oldest);
+}
+
+static void releaseListing(struct listing* listing) {
+	pthread_mutex_lock(&lock);
+	listing->references--;
+	bool unused = listing->references == 0 && !listing->cached;
+	pthread_mutex_unlock(&lock);
+
+	if (unused)
+		freeListing(listing);
+}
+
+static bool isCurrent(const struct listing* listing, const struct stat* dirStat) {
+	return listing->dev == dirStat->st_dev && listing->ino == dirStat->st_ino
+		&& listing->mtime.tv_sec == dirStat->st_mtim.tv_sec && listing->mtime.tv_nsec == dirStat->st_mtim.tv_nsec;
+}
+
+static int compareEntries(const void* a, const void* b) {
+	const struct entry* entryA = a;
+	const struct entry* entryB = b;
+
+	// directories first
+	if (entryA->isDir != entryB->isDir)
+		return entryA->isDir ? -1 : 1;
+
+	return strcmp(entryA->name, entryB->name);
+}
+
+/*
+ * Reads the entries of the directory with getdents64 into one block of names and sorts them.
+ */
+static int readEntries(struct listing* listing) {
+	int fd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		error("listing: Couldn't open dir: %s", strerror(errno));
+		return -1;
+	}
+
+	// the parent is only shown below the document root
+	bool withParent = strcmp(listing->relative, "") != 0;
+
+	size_t namesSize = 4096;
+	size_t namesLength = 0;
+	size_t entriesSize = 64;
+	char* buffer = malloc(DENTS_BUFFER_SIZE);
+	listing->names = malloc(namesSize);
+	listing->entries = malloc(entriesSize * sizeof(struct entry));
+	if (buffer == NULL || listing->names == NULL || listing->entries == NULL) {
+		error("listing: Couldn't allocate for entries: %s", strerror(errno));
+		free(buffer);
+		close(fd);
+		return -1;
+	}
+
+	while (true) {
+		ssize_t length = getdents64(fd, buffer, DENTS_BUFFER_SIZE);
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			error("listing: Couldn't read dir: %s", strerror(errno));
+			free(buffer);
+			close(fd);
+			return -1;
+		}
+		if (length == 0)
+			break;
+
+		for (ssize_t position = 0; position < length;) {
+			struct dirent64* dirent = (struct dirent64*) (buffer + position);
+			position += dirent->d_reclen;
+
+			const char* name = dirent->d_name;
+			if (name[0] == '.' && !(withParent && strcmp(name, "..") == 0))
+				continue;
+
+			bool isDir = dirent->d_type == DT_DIR;
+			if (dirent->d_type == DT_UNKNOWN) {
+				// not every file system fills in the type
+				struct stat statObj;
+				isDir = fstatat(fd, name, &statObj, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(statObj.st_mode);
+			}
+
+			size_t nameLength = strlen(name) + 1;
+			if (namesLength + nameLength > namesSize) {
+				while (namesLength + nameLength > namesSize)
+					namesSize *= 2;
+				char* tmp = realloc(listing->names, namesSize);
+				if (tmp == NULL) {
+					error("listing: Couldn't allocate for entries: %s", strerror(errno));
+					free(buffer);
+					close(fd);
+					return -1;
+				}
+				listing->names = tmp;
+			}
+			if (listing->nrEntries == entriesSize) {
+				entriesSize *= 2;
+				struct entry* tmp = realloc(listing->entries, entriesSize * sizeof(struct entry));
+				if (tmp == NULL) {
+					error("listing: Couldn't allocate for entries: %s", strerror(errno));
+					free(buffer);
+					close(fd);
+					return -1;
+				}
+				listing->entries = tmp;
+			}
+
+			memcpy(listing->names + namesLength, name, nameLength);
+			listing->entries[listing->nrEntries++] = (struct entry) {
+				.offset = namesLength,
+				.isDir = isDir
+			};
+			namesLength += nameLength;
+		}
+	}
+
+	free(buffer);
+	close(fd);
+
+	for (size_t i = 0; i < listing->nrEntries; i++) {
+		listing->entries[i].name = listing->names + listing->entries[i].offset;
+	}
+	qsort(listing->entries, listing->nrEntries, sizeof(struct entry), &compareEntries);
+
+	listing->memory = sizeof(struct listing) + namesSize + entriesSize * sizeof(struct entry);
+
+	return 0;
+}
+
+static struct listing* readListing(const char* path, const struct stat* dirStat, const char* relative) {
+	struct listing* listing = malloc(sizeof(struct listing));
+	if (listing == NULL) {
+		error("listing: Couldn't allocate listing: %s", strerror(errno));
+		return NULL;
+	}
+
+	*listing = (struct listing) {
+		.path = strdup(path),
+		.relative = strdup(relative),
+		.dev = dirStat->st_dev,
+		.ino = dirStat->st_ino,
+		.mtime = dirStat->st_mtim,
+		.references = 1,
+		.cached = false
+	};
+	if (listing->path == NULL || listing->relative == NULL) {
+		error("listing: Couldn't allocate listing: %s", strerror(errno));
+		freeListing(listing);
+		return NULL;
+	}
+
+	if (readEntries(listing) < 0) {
+		freeListing(listing);
+		return NULL;
+	}
+
+	return listing;
+}
+
+/*
+ * Adds a listing that was just read to the cache. A directory that changed a moment ago might
+ * change again within the granularity of its mtime; its listing isn't cached until it settled.
+ */
+static void addListing(struct listing* listing, time_t started) {
+	if (listing->mtime.tv_sec + 1 >= started)
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	struct listing* other = findListing(listing->path, listing->relative);
+	if (other != NULL)
+		removeListing(other);
+
+	struct listing** bucket = getBucket(listing->path);
+	listing->nextInBucket = *bucket;
+	*bucket = listing;
+	pushLRU(listing);
+	listing->cached = true;
+	numberOfListings++;
+	memoryUsed += listing->memory;
+
+	evict();
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void append(struct buffer* buffer, const char* string, size_t length) {
+	if (buffer->failed)
+		return;
+
+	if (buffer->length + length > buffer->size) {
+		size_t size = buffer->size;
+		while (buffer->length + length > size)
+			size *= 2;
+		char* tmp = realloc(buffer->data, size);
+		if (tmp == NULL) {
+			buffer->failed = true;
+			return;
+		}
+		buffer->data = tmp;
+		buffer->size = size;
+	}
+
+	memcpy(buffer->data + buffer->length, string, length);
+	buffer->length += length;
+}
+
+#define appendLiteral(buffer, string) append(buffer, string, sizeof(string) - 1)
+
+static void appendEscaped(struct buffer* buffer, const char* string) {
+	const char* start = string;
+	for (const char* c = string; *c != '\0'; c++) {
+		const char* entity;
+		switch (*c) {
+			case '&':
+				entity = "&amp;";
+				break;
+			case '<':
+				entity = "&lt;";
+				break;
+			case '>':
+				entity = "&gt;";
+				break;
+			case '"':
+				entity = "&quot;";
+				break;
+			case '\'':
+				entity = "&#39;";
+				break;
+			default:
+				continue;
+		}
+		append(buffer, start, c - start);
+		append(buffer, entity, strlen(entity));
+		start = c + 1;
+	}
+	append(buffer, start, strlen(start));
+}
+
+// percent-encodes everything but unreserved characters and slashes
+static void appendUrl(struct buffer* buffer, const char* string) {
+	static const char* hex = "0123456789ABCDEF";
+
+	const char* start = string;
+	for (const char* c = string; *c != '\0'; c++) {
+		unsigned char character = *c;
+		if ((character >= 'a' && character <= 'z') || (character >= 'A' && character <= 'Z') || (character >= '0' && character <= '9')
+			|| character == '-' || character == '.' || character == '_' || character == '~' || character == '/')
+			continue;
+
+		append(buffer, start, c - start);
+		char encoded[3] = { '%', hex[character >> 4], hex[character & 0xf] };
+		append(buffer, encoded, 3);
+		start = c + 1;
+	}
+	append(buffer, start, strlen(start));
+}
+
+static void appendNumber(struct buffer* buffer, long number) {
+	char tmp[24];
+	int length = snprintf(tmp, sizeof(tmp), "%ld", number);
+	append(buffer, tmp, length);
+}
+
+/*
+ * Builds the page with the entries from to to in one buffer.
+ */
+static char* render(const struct listing* listing, size_t from, size_t to, long page, long pages, size_t* length) {
+	size_t relativeLength = strlen(listing->relative);
+
+	struct buffer buffer = {
+		// a rough guess; most names don't need escaping
+		.size = 512 + relativeLength * 2 + (to - from) * (96 + relativeLength)
+	};
+	for (size_t i = from; i < to; i++) {
+		buffer.size += 2 * strlen(listing->entries[i].name);
+	}
+	buffer.data = malloc(buffer.size);
+	if (buffer.data == NULL) {
+		error("listing: Couldn't allocate for page: %s", strerror(errno));
+		return NULL;
+	}
+
+	appendLiteral(&buffer, "<!DOCTYPE html>\n");
+	appendLiteral(&buffer, "<html>\n");
+	appendLiteral(&buffer, "	<head>\n");
+	appendLiteral(&buffer, "		<title>Index of ");
+	appendEscaped(&buffer, listing->relative);
+	appendLiteral(&buffer, "/</title>\n");
+	appendLiteral(&buffer, "	</head>\n");
+	appendLiteral(&buffer, "	<body>\n");
+	appendLiteral(&buffer, "		<h1>Index of ");
+	appendEscaped(&buffer, listing->relative);
+	appendLiteral(&buffer, "/</h1>\n");
+	appendLiteral(&buffer, "		<table>\n");
+	appendLiteral(&buffer, "			<tr>\n");
+	appendLiteral(&buffer, "				<th>Type</th>\n");
+	appendLiteral(&buffer, "				<th>File</th>\n");
+	appendLiteral(&buffer, "			</tr>\n");
+
+	for (size_t i = from; i < to; i++) {
+		const struct entry* entry = &(listing->entries[i]);
+		appendLiteral(&buffer, "			<tr>\n");
+		if (entry->isDir)
+			appendLiteral(&buffer, "				<td>D</td>\n");
+		else
+			appendLiteral(&buffer, "				<td></td>\n");
+		appendLiteral(&buffer, "				<td><a href='");
+		appendUrl(&buffer, listing->relative);
+		appendLiteral(&buffer, "/");
+		appendUrl(&buffer, entry->name);
+		appendLiteral(&buffer, "'>");
+		appendEscaped(&buffer, entry->name);
+		appendLiteral(&buffer, "</a></td>\n");
+		appendLiteral(&buffer, "			</tr>\n");
+	}
+
+	appendLiteral(&buffer, "		</table>\n");
+
+	if (pages > 1) {
+		appendLiteral(&buffer, "		<p>\n");
+		if (page > 1) {
+			appendLiteral(&buffer, "			<a href='?page=");
+			appendNumber(&buffer, page - 1);
+			appendLiteral(&buffer, "'>previous</a>\n");
+		}
+		appendLiteral(&buffer, "			page ");
+		appendNumber(&buffer, page);
+		appendLiteral(&buffer, " of ");
+		appendNumber(&buffer, pages);
+		appendLiteral(&buffer, "\n");
+		if (page < pages) {
+			appendLiteral(&buffer, "			<a href='?page=");
+			appendNumber(&buffer, page + 1);
+			appendLiteral(&buffer, "'>next</a>\n");
+		}
+		appendLiteral(&buffer, "		</p>\n");
+	}
+
+	appendLiteral(&buffer, "	</body>\n");
+	appendLiteral(&buffer, "</html>\n");
+
+	if (buffer.failed) {
+		error("listing: Couldn't allocate for page: %s", strerror(errno));
+		free(buffer.data);
+		return NULL;
+	}
+
+	*length = buffer.length;
+	return buffer.data;
+}
+
+int listing_get(const char* path, const struct stat* dirStat, const char* relative, long page, long pageSize, struct listingPage* result) {
+	*result = (struct listingPage) {};
+
+	pthread_mutex_lock(&lock);
+	struct listing* listing = findListing(path, relative);
+	if (listing != NULL && !isCurrent(listing, dirStat)) {
+		removeListing(listing);
+		listing = NULL;
+	}
+	if (listing != NULL) {
+		listing->references++;
+		unlinkLRU(listing);
+		pushLRU(listing);
+	}
+	pthread_mutex_unlock(&lock);
+
+	metrics_count(listing != NULL ? METRIC_CACHE_HITS + CACHE_LISTING : METRIC_CACHE_MISSES + CACHE_LISTING);
+
+	if (listing == NULL) {
+		struct timespec started;
+		clock_gettime(CLOCK_REALTIME, &started);
+
+		listing = readListing(path, dirStat, relative);
+		if (listing == NULL)
+			return -1;
+
+		addListing(listing, started.tv_sec);
+	}
+
+	if (pageSize > 0) {
+		long pages = (listing->nrEntries + pageSize - 1) / pageSize;
+		if (pages < 1)
+			pages = 1;
+		if (page > pages)
+			page = pages;
+		if (page < 1)
+			page = 1;
+
+		size_t from = (page - 1) * pageSize;
+		size_t to = from + pageSize;
+		if (to > listing->nrEntries)
+			to = listing->nrEntries;
+
+		result->rendered = render(listing, from, to, page, pages, &(result->length));
+		releaseListing(listing);
+		if (result->rendered == NULL)
+			return -1;
+
+		result->html = result->rendered;
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	bool rendered = listing->html != NULL;
+	pthread_mutex_unlock(&lock);
+
+	if (!rendered) {
+		size_t length;
+		char* html = render(listing, 0, listing->nrEntries, 1, 1, &length);
+		if (html == NULL) {
+			releaseListing(listing);
+			return -1;
+		}
+
+		pthread_mutex_lock(&lock);
+		if (listing->html == NULL) {
+			listing->html = html;
+			listing->htmlLength = length;
+			listing->memory += length;
+			if (listing->cached) {
+				memoryUsed += length;
+				evict();
+			}
+			html = NULL;
+		}
+		pthread_mutex_unlock(&lock);
+
+		// somebody else was faster
+		free(html);
+	}
+
+	result->html = listing->html;
+	result->length = listing->htmlLength;
+	result->listing = listing;
+
+	return 0;
+}
+
+void listing_release(struct listingPage* page) {
+	free(page->rendered);
+	if (page->listing != NULL)
+		releaseListing(page->listing);
+
+	*page = (struct listingPage) {};
+}
+
+void listing_flush() {
+	pthread_mutex_lock(&lock);
+	while (oldest != NULL)
+		removeListing(oldest);
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,33 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Directory listings of the file handler.
+ * The sorted entries of a directory and the generated page are kept in an LRU cache and reused
+ * until the mtime of the directory changes. Huge directories can be shown in pages; those are
+ * rendered from the cached entries.
+ */
+
+#define LISTING_CACHE_SIZE (64)
+// bytes of all cached listings together
+#define LISTING_CACHE_MEMORY (32 * 1024 * 1024)
+
+struct listingPage {
+	const char* html;
+	size_t length;
+	// private
+	struct listing* listing;
+	char* rendered;
+};
+
+// path is the directory, relative the path it is shown as; page counts from 1, a pageSize of 0 shows everything
+int listing_get(const char* path, const struct stat* dirStat, const char* relative, long page, long pageSize, struct listingPage* result);
+void listing_release(struct listingPage* page);
+// drops everything that isn't being sent right now
+void listing_flush();
+
+#endif
@@ -26,8 +26,19 @@ struct {
 } logger[MAX_LOGGER];
 int loggerCount = 0;
 
+loglevel_t loggingMinLevel = CRITICAL;
+
 void (*_criticalHandler)() = NULL;
 
+static void updateMinLevel() {
+	loglevel_t minLevel = CRITICAL;
+	for (int i = 0; i < loggerCount; i++) {
+		if (logger[i].loglevel < minLevel)
+			minLevel = logger[i].loglevel;
+	}
+	loggingMinLevel = minLevel;
+}
+
 void setLogging(FILE* file, loglevel_t loglevel, bool color) {
 	if (loggerCount == MAX_LOGGER - 1) {
 		return;
@@ -50,6 +61,27 @@ void setLogging(FILE* file, loglevel_t loglevel, bool color) {
 		sem_init(&(logger[loggerCount].write_sem), 0, 1);
 		loggerCount++;
 	}
+
+	updateMinLevel();
+}
+
+void removeLogging(FILE* file) {
+	for (int i = 0; i < loggerCount; i++) {
+		if (logger[i].file != file)
+			continue;
+
+		// semaphores can't be copied; every slot keeps its own
+		loggerCount--;
+		for (int j = i; j < loggerCount; j++) {
+			logger[j].file = logger[j + 1].file;
+			logger[j].loglevel = logger[j + 1].loglevel;
+			logger[j].color = logger[j + 1].color;
+		}
+		sem_destroy(&(logger[loggerCount].write_sem));
+		break;
+	}
+
+	updateMinLevel();
 }
 
 void setCriticalHandler(void (*handler)()) {
@@ -171,7 +203,8 @@ char* getLoglevelString(loglevel_t loglevel, bool color) {
 }
 
 void vlogging(loglevel_t loglevel, const char* format, va_list argptr) {
-	char* timestamp = getTimestamp();
+	// only format the timestamp if a logger actually wants this message
+	char* timestamp = NULL;
 
 	for(int i = 0; i < loggerCount; i++) {
 		if (loglevel < logger[i].loglevel)
@@ -182,17 +215,23 @@ void vlogging(loglevel_t loglevel, const char* format, va_list argptr) {
 		} else if (loglevel >= CUSTOM_LOGLEVEL_OFFSET)
 			continue;
 		
-		char* loglevelString = getLoglevelString(loglevel, logger[i].color);
+		// custom loglevels (e.g. the access log) bring their own line format
+		bool prefix = loglevel < CUSTOM_LOGLEVEL_OFFSET;
+
+		if (prefix && timestamp == NULL)
+			timestamp = getTimestamp();
 
 		va_list local;
 		va_copy(local, argptr);
 
 		sem_wait(&(logger[i].write_sem));
 
-		fprintf(logger[i].file, "%s %s ", timestamp, loglevelString);
-		#ifdef DEBUG
-		fprintf(logger[i].file, "[%ld] ", pthread_self());
-		#endif
+		if (prefix) {
+			fprintf(logger[i].file, "%s %s ", timestamp, getLoglevelString(loglevel, logger[i].color));
+			#ifdef DEBUG
+			fprintf(logger[i].file, "[%ld] ", pthread_self());
+			#endif
+		}
 		vfprintf(logger[i].file, format, local);
 		fprintf(logger[i].file, "\n");
 
@@ -201,48 +240,49 @@ void vlogging(loglevel_t loglevel, const char* format, va_list argptr) {
 		va_end(local);
 	}
 	
-	free(timestamp);
+	if (timestamp != NULL)
+		free(timestamp);
 
 	if (loglevel == CRITICAL)
 		callCritical();
 }
 
-void logging(loglevel_t loglevel, const char* format, ...) {
+void _logging(loglevel_t loglevel, const char* format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
 	vlogging(loglevel, format, argptr);
 	va_end(argptr);
 }
 
-void debug(const char* format, ...) {
+void _debug(const char* format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
 	vlogging(DEBUG, format, argptr);
 	va_end(argptr);
 }
 
-void verbose(const char* format, ...) {
+void _verbose(const char* format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
 	vlogging(VERBOSE, format, argptr);
 	va_end(argptr);
 }
 
-void info(const char* format, ...) {
+void _info(const char* format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
 	vlogging(INFO, format, argptr);
 	va_end(argptr);
 }
 
-void warn(const char* format, ...) {
+void _warn(const char* format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
 	vlogging(WARN, format, argptr);
 	va_end(argptr);
 }
 
-void error(const char* format, ...) {
+void _error(const char* format, ...) {
 	va_list argptr;
 	va_start(argptr, format);
 	vlogging(ERROR, format, argptr);
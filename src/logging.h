@@ -23,19 +23,44 @@ typedef int loglevel_t;
 
 #define MAX_LOGGER (10)
 
+/*
+ * Messages below this level are removed at compile time.
+ * e.g. -DLOGGING_COMPILE_LEVEL=INFO drops all debug and verbose calls.
+ */
+#ifndef LOGGING_COMPILE_LEVEL
+#define LOGGING_COMPILE_LEVEL (DEBUG)
+#endif
+
+/*
+ * lowest loglevel any logger is interested in; updated by setLogging/removeLogging
+ * checked at the call site so disabled messages cost only one branch
+ */
+extern loglevel_t loggingMinLevel;
+
+#define isLogging(loglevel) ((loglevel) >= LOGGING_COMPILE_LEVEL && (loglevel) >= loggingMinLevel)
+
+#define logging(loglevel, ...) do { if (isLogging(loglevel)) _logging(loglevel, __VA_ARGS__); } while(0)
+#define debug(...) do { if (isLogging(DEBUG)) _debug(__VA_ARGS__); } while(0)
+#define verbose(...) do { if (isLogging(VERBOSE)) _verbose(__VA_ARGS__); } while(0)
+#define info(...) do { if (isLogging(INFO)) _info(__VA_ARGS__); } while(0)
+#define warn(...) do { if (isLogging(WARN)) _warn(__VA_ARGS__); } while(0)
+#define error(...) do { if (isLogging(ERROR)) _error(__VA_ARGS__); } while(0)
+
 void setLogging(FILE* file, loglevel_t loglevel, bool color);
+void removeLogging(FILE* file);
 void setCriticalHandler(void (*handler)());
 void callCritical();
 
 void printBacktrace();
 
-void logging(loglevel_t loglevel, const char* format, ...);
-void debug(const char* format, ...);
-void verbose(const char* format, ...);
-void info(const char* format, ...);
-void warn(const char* format, ...);
-void error(const char* format, ...);
-void critical(const char* format, ...);
+void _logging(loglevel_t loglevel, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void _debug(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void _verbose(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void _info(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void _warn(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void _error(const char* format, ...) __attribute__((format(printf, 1, 2)));
+// not gated; the critical handler has to be called in any case
+void critical(const char* format, ...) __attribute__((format(printf, 1, 2)));
 
 loglevel_t strtologlevel(const char* string);
 
@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 
 #include "networking.h"
 #include "logging.h"
@@ -10,6 +12,9 @@
 #include "util.h"
 #include "signals.h"
 #include "config.h"
+#include "metrics.h"
+#include "fastcgi.h"
+#include "status.h"
 
 #ifdef SSL_SUPPORT
 #include "ssl.h"
@@ -21,23 +26,140 @@ struct networkingConfig networkingConfig;
 struct config* config;
 
 const char* configFile = NULL;
+// resolved at startup; an upgrade replaces the file behind it
+char* executable = NULL;
+char** arguments = NULL;
 
 void shutdownHandler() {
 	info("main: shutting down");
 
 	headers_free(&(networkingConfig.defaultHeaders));
 
+	fastcgi_destroy();
+
 	config_destroy(config);
 
+	metrics_destroy();
+
 	#ifdef SSL_SUPPORT
 	ssl_destroy();
 	#endif
 
+	free(executable);
+
 	exit(0);
 }
 
-void sigHandler(int signo) {
-	info("main: signal %d", signo);
+/*
+ * Stops accepting connections and gives the open ones until the drain timeout to finish.
+ * Another SIGINT or SIGTERM ends the wait early.
+ */
+void drain() {
+	networking_drain();
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(networking_connections() > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= config->server.drainTimeout)
+			break;
+
+		if (sigtimedwait(&mask, NULL, &(struct timespec) { .tv_nsec = 100000000 }) > 0) {
+			warn("main: not waiting for the remaining connections");
+			break;
+		}
+	}
+
+	int forced = 0;
+	if (networking_connections() > 0) {
+		forced = networking_closeAll();
+		// until the cleanup got to them
+		for (int i = 0; i < 20 && networking_connections() > 0; i++) {
+			usleep(100000);
+		}
+	}
+
+	if (forced > 0)
+		warn("main: %d connections drained, %d closed forcibly", networking_drained(), forced);
+	else
+		info("main: %d connections drained", networking_drained());
+}
+
+/*
+ * Called by the networking once no request uses a config that was replaced anymore.
+ */
+void releaseConfig(struct networkingConfig* networkingConfig) {
+	free(networkingConfig->binds.binds);
+	config_destroy((struct config*) networkingConfig->data);
+}
+
+/*
+ * Parses the config file again and hands the binds over to the networking.
+ * Logging and metrics settings only take effect after a restart.
+ */
+void reload() {
+	info("main: reloading %s", configFile);
+
+	FILE* file = fopen(configFile, "r");
+	if (file == NULL) {
+		error("main: couldn't open config file: %s; keeping the old config", strerror(errno));
+		return;
+	}
+
+	struct config* next = config_parse(file);
+
+	fclose(file);
+
+	// config_parse resets the log level
+	setLogging(stdout, config->logging.serverVerbosity, true);
+
+	if (next == NULL) {
+		error("main: couldn't parse config file; keeping the old config");
+		return;
+	}
+
+	struct networkingConfig nextNetworkingConfig;
+	if (config_getNetworkingConfig(next, &nextNetworkingConfig) == NULL) {
+		error("main: couldn't set up the new config; keeping the old one");
+		config_destroy(next);
+		return;
+	}
+
+	// the default headers stay the same
+	headers_free(&(nextNetworkingConfig.defaultHeaders));
+	nextNetworkingConfig.defaultHeaders = networkingConfig.defaultHeaders;
+	nextNetworkingConfig.release = &releaseConfig;
+	nextNetworkingConfig.data = next;
+
+	config = next;
+	networking_reload(nextNetworkingConfig);
+}
+
+/*
+ * Starts the (new) binary with the same arguments and hands the listeners over.
+ * Once it accepts connections this process finishes the ones it has and exits.
+ */
+void upgrade() {
+	if (executable == NULL) {
+		error("main: don't know where the binary is; can't upgrade");
+		return;
+	}
+
+	info("main: upgrading to %s", executable);
+
+	if (networking_handOver(executable, arguments) < 0) {
+		error("main: upgrade failed; keeping this process");
+		return;
+	}
+
+	drain();
 	shutdownHandler();
 }
 
@@ -45,11 +167,16 @@ void setup() {
 	setLogging(stdout, ERROR, true);
 	setCriticalHandler(&shutdownHandler);
 
-	signal_setup(SIGINT, &sigHandler);
-	signal_setup(SIGTERM, &sigHandler);
+	// the main thread waits for them; the threads that are started later inherit the mask
+	signal_block(SIGINT);
+	signal_block(SIGTERM);
+	signal_block(SIGHUP);
+	signal_block(SIGUSR2);
 
 	networkingConfig.defaultHeaders.number = 0;
 
+	status_init();
+
 	#ifdef SSL_SUPPORT
 	ssl_init();
 	#endif
@@ -92,6 +219,11 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
+	executable = realpath("/proc/self/exe", NULL);
+	if (executable == NULL)
+		warn("main: couldn't resolve binary: %s", strerror(errno));
+	arguments = argv;
+
 	FILE* file = fopen(configFile, "r");
 	if (file == NULL) {
 		error("main: couldn't open config file: %s", strerror(errno));
@@ -109,17 +241,39 @@ int main(int argc, char** argv) {
 	}
 	config_setLogging(config);
 
+	if (config_setMetrics(config) < 0) {
+		shutdownHandler();
+		return 0;
+	}
+
 	if (config_getNetworkingConfig(config, &networkingConfig) == NULL) {
 		shutdownHandler();
 		return 0;
 	}
 
 	headers_mod(&(networkingConfig.defaultHeaders), "Server", SERVER_STRING);
+	networkingConfig.release = &releaseConfig;
+	networkingConfig.data = config;
 
 	networking_init(networkingConfig);
 
+	const int signals[] = { SIGINT, SIGTERM, SIGHUP, SIGUSR2 };
 	while(true) {
-		sleep(0xffff);
+		int signo = signal_waitAny(signals, 4);
+		switch(signo) {
+			case SIGINT:
+			case SIGTERM:
+				info("main: signal %d", signo);
+				drain();
+				shutdownHandler();
+				break;
+			case SIGHUP:
+				reload();
+				break;
+			case SIGUSR2:
+				upgrade();
+				break;
+		}
 	}
 
 	shutdownHandler();
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+#include "misc.h"
+#include "files.h"
+#include "cgi.h"
+#include "fastcgi.h"
+#include "status.h"
+#include "logging.h"
+#include "util.h"
+#include "networking.h"
+
+static struct metricsSegment defaultSegment = {
+	.magic = METRICS_MAGIC,
+	.version = METRICS_VERSION,
+	.nrShards = METRICS_SHARDS,
+	.nrMetrics = NR_METRICS
+};
+
+static struct metricsSegment* segment = &defaultSegment;
+static char* sharedMemoryName = NULL;
+
+static int nextShard = 0;
+
+static const char* stateLabels[METRICS_NR_STATES] = {
+	"opened", "processing", "keep_alive", "aborted", "closed"
+};
+
+static const char* rejectionLabels[METRICS_NR_REJECTIONS] = {
+	[REJECTED_CONNECTIONS] = "connections",
+	[REJECTED_PEER] = "peer",
+	[REJECTED_SHED] = "shed",
+	[REJECTED_RATE] = "rate",
+	[REJECTED_HEADER_TIMEOUT] = "header_timeout",
+	[REJECTED_HEADER_RATE] = "header_rate",
+	[REJECTED_HEADER_SIZE] = "header_size",
+	[REJECTED_HEADER_COUNT] = "header_count",
+	[REJECTED_SEND_RATE] = "send_rate"
+};
+
+static const char* cacheLabels[METRICS_NR_CACHES] = {
+	[CACHE_RESOLVER] = "resolver",
+	[CACHE_LISTING] = "listing"
+};
+
+static const char* handlerLabels[METRICS_NR_HANDLER_TYPES] = {
+	[FILE_HANDLER_NO] = "file",
+	[CGI_HANDLER_NO] = "cgi",
+	[METRICS_HANDLER_NO] = "metrics",
+	[FASTCGI_HANDLER_NO] = "fastcgi",
+	[METRICS_NO_HANDLER] = "none"
+};
+
+static const long latencyBuckets[METRICS_NR_LATENCY_BUCKETS - 1] = METRICS_LATENCY_BUCKETS;
+
+int metrics_init(const char* name) {
+	if (name == NULL)
+		return 0;
+
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0) {
+		error("metrics: couldn't open shared memory %s: %s", name, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(struct metricsSegment)) < 0) {
+		error("metrics: couldn't resize shared memory: %s", strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+
+	struct metricsSegment* shared = mmap(NULL, sizeof(struct metricsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		error("metrics: couldn't map shared memory: %s", strerror(errno));
+		shm_unlink(name);
+		return -1;
+	}
+
+	sharedMemoryName = strdup(name);
+	if (sharedMemoryName == NULL) {
+		error("metrics: couldn't allocate for name: %s", strerror(errno));
+		munmap(shared, sizeof(struct metricsSegment));
+		shm_unlink(name);
+		return -1;
+	}
+
+	// keep whatever was counted until now
+	memcpy(shared, segment, sizeof(struct metricsSegment));
+	segment = shared;
+
+	info("metrics: counters available in shared memory %s", name);
+
+	return 0;
+}
+
+void metrics_destroy() {
+	if (sharedMemoryName == NULL)
+		return;
+
+	// the mapping stays in place; other threads might still be counting
+	shm_unlink(sharedMemoryName);
+	free(sharedMemoryName);
+	sharedMemoryName = NULL;
+}
+
+struct metricsShard* metrics_shard() {
+	static __thread int shard = -1;
+
+	if (shard < 0)
+		shard = __atomic_fetch_add(&nextShard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS;
+
+	return &(segment->shards[shard]);
+}
+
+int64_t metrics_get(enum metric metric) {
+	int64_t total = 0;
+	for (int i = 0; i < METRICS_SHARDS; i++) {
+		total += __atomic_load_n(&(segment->shards[i].values[metric]), __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+void metrics_stateChange(int oldState, int newState) {
+	struct metricsShard* shard = metrics_shard();
+
+	if (oldState < 0) {
+		__atomic_fetch_add(&(shard->values[METRIC_CONNECTIONS_ACCEPTED]), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(shard->values[METRIC_CONNECTIONS_ACTIVE]), 1, __ATOMIC_RELAXED);
+	} else if (oldState < METRICS_NR_STATES) {
+		__atomic_fetch_sub(&(shard->values[METRIC_CONNECTIONS_STATE + oldState]), 1, __ATOMIC_RELAXED);
+	}
+
+	if (newState < 0) {
+		__atomic_fetch_sub(&(shard->values[METRIC_CONNECTIONS_ACTIVE]), 1, __ATOMIC_RELAXED);
+	} else if (newState < METRICS_NR_STATES) {
+		__atomic_fetch_add(&(shard->values[METRIC_CONNECTIONS_STATE + newState]), 1, __ATOMIC_RELAXED);
+	}
+}
+
+void metrics_requestHandler(int handlerType) {
+	if (handlerType < 0 || handlerType >= METRICS_NR_HANDLER_TYPES)
+		handlerType = METRICS_NO_HANDLER;
+
+	metrics_count(METRIC_REQUESTS + handlerType);
+}
+
+void metrics_requestCompleted(int statusCode, long totalTime, size_t bytesOut) {
+	struct metricsShard* shard = metrics_shard();
+
+	int class = statusCode / 100;
+	if (class < 1 || class > 5)
+		class = 0;
+	__atomic_fetch_add(&(shard->values[METRIC_RESPONSES + class]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(shard->values[METRIC_BYTES_OUT]), bytesOut, __ATOMIC_RELAXED);
+
+	if (totalTime < 0)
+		return;
+
+	int bucket = 0;
+	while (bucket < METRICS_NR_LATENCY_BUCKETS - 1 && totalTime > latencyBuckets[bucket])
+		bucket++;
+
+	__atomic_fetch_add(&(shard->values[METRIC_LATENCY_BUCKET + bucket]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(shard->values[METRIC_LATENCY_SUM]), totalTime, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(shard->values[METRIC_LATENCY_COUNT]), 1, __ATOMIC_RELAXED);
+}
+
+static void metricsDump(FILE* stream) {
+	int64_t values[NR_METRICS];
+	for (int i = 0; i < NR_METRICS; i++) {
+		values[i] = metrics_get(i);
+	}
+
+	fprintf(stream, "# TYPE cfloor_connections_accepted_total counter\n");
+	fprintf(stream, "cfloor_connections_accepted_total %" PRId64 "\n", values[METRIC_CONNECTIONS_ACCEPTED]);
+	fprintf(stream, "# TYPE cfloor_connections_active gauge\n");
+	fprintf(stream, "cfloor_connections_active %" PRId64 "\n", values[METRIC_CONNECTIONS_ACTIVE]);
+
+	fprintf(stream, "# TYPE cfloor_connections gauge\n");
+	for (int i = 0; i < METRICS_NR_STATES; i++) {
+		fprintf(stream, "cfloor_connections{state=\"%s\"} %" PRId64 "\n", stateLabels[i], values[METRIC_CONNECTIONS_STATE + i]);
+	}
+	fprintf(stream, "# TYPE cfloor_connections_aborted_total counter\n");
+	for (int i = 0; i < METRICS_NR_STATES; i++) {
+		fprintf(stream, "cfloor_connections_aborted_total{state=\"%s\"} %" PRId64 "\n", stateLabels[i], values[METRIC_CONNECTIONS_ABORTED + i]);
+	}
+
+	fprintf(stream, "# TYPE cfloor_requests_total counter\n");
+	for (int i = 0; i < METRICS_NR_HANDLER_TYPES; i++) {
+		if (handlerLabels[i] == NULL)
+			continue;
+		fprintf(stream, "cfloor_requests_total{handler=\"%s\"} %" PRId64 "\n", handlerLabels[i], values[METRIC_REQUESTS + i]);
+	}
+
+	fprintf(stream, "# TYPE cfloor_responses_total counter\n");
+	for (int i = 1; i <= 5; i++) {
+		fprintf(stream, "cfloor_responses_total{class=\"%dxx\"} %" PRId64 "\n", i, values[METRIC_RESPONSES + i]);
+	}
+	fprintf(stream, "cfloor_responses_total{class=\"other\"} %" PRId64 "\n", values[METRIC_RESPONSES]);
+
+	fprintf(stream, "# TYPE cfloor_received_bytes_total counter\n");
+	fprintf(stream, "cfloor_received_bytes_total %" PRId64 "\n", values[METRIC_BYTES_IN]);
+	fprintf(stream, "# TYPE cfloor_sent_bytes_total counter\n");
+	fprintf(stream, "cfloor_sent_bytes_total %" PRId64 "\n", values[METRIC_BYTES_OUT]);
+
+	fprintf(stream, "# TYPE cfloor_request_duration_seconds histogram\n");
+	int64_t cumulative = 0;
+	for (int i = 0; i < METRICS_NR_LATENCY_BUCKETS - 1; i++) {
+		cumulative += values[METRIC_LATENCY_BUCKET + i];
+		fprintf(stream, "cfloor_request_duration_seconds_bucket{le=\"%g\"} %" PRId64 "\n", latencyBuckets[i] / 1000000.0, cumulative);
+	}
+	cumulative += values[METRIC_LATENCY_BUCKET + METRICS_NR_LATENCY_BUCKETS - 1];
+	fprintf(stream, "cfloor_request_duration_seconds_bucket{le=\"+Inf\"} %" PRId64 "\n", cumulative);
+	fprintf(stream, "cfloor_request_duration_seconds_sum %f\n", values[METRIC_LATENCY_SUM] / 1000000.0);
+	fprintf(stream, "cfloor_request_duration_seconds_count %" PRId64 "\n", values[METRIC_LATENCY_COUNT]);
+
+	fprintf(stream, "# TYPE cfloor_tls_handshakes_total counter\n");
+	fprintf(stream, "cfloor_tls_handshakes_total{result=\"ok\"} %" PRId64 "\n", values[METRIC_TLS_HANDSHAKES]);
+	fprintf(stream, "cfloor_tls_handshakes_total{result=\"error\"} %" PRId64 "\n", values[METRIC_TLS_HANDSHAKE_ERRORS]);
+
+	fprintf(stream, "# TYPE cfloor_cache_hits_total counter\n");
+	for (int i = 0; i < METRICS_NR_CACHES; i++) {
+		fprintf(stream, "cfloor_cache_hits_total{cache=\"%s\"} %" PRId64 "\n", cacheLabels[i], values[METRIC_CACHE_HITS + i]);
+	}
+	fprintf(stream, "# TYPE cfloor_cache_misses_total counter\n");
+	for (int i = 0; i < METRICS_NR_CACHES; i++) {
+		fprintf(stream, "cfloor_cache_misses_total{cache=\"%s\"} %" PRId64 "\n", cacheLabels[i], values[METRIC_CACHE_MISSES + i]);
+	}
+
+	fprintf(stream, "# TYPE cfloor_rejected_total counter\n");
+	for (int i = 0; i < METRICS_NR_REJECTIONS; i++) {
+		fprintf(stream, "cfloor_rejected_total{reason=\"%s\"} %" PRId64 "\n", rejectionLabels[i], values[METRIC_REJECTED + i]);
+	}
+	fprintf(stream, "# TYPE cfloor_handlers_queued gauge\n");
+	fprintf(stream, "cfloor_handlers_queued %" PRId64 "\n", values[METRIC_HANDLERS_QUEUED]);
+	fprintf(stream, "# TYPE cfloor_response_buffer_bytes gauge\n");
+	fprintf(stream, "cfloor_response_buffer_bytes %" PRId64 "\n", values[METRIC_RESPONSES_BUFFERED]);
+}
+
+void metricsHandler(struct request request, struct response response) {
+	char* body = NULL;
+	size_t length = 0;
+
+	FILE* stream = open_memstream(&body, &length);
+	if (stream == NULL) {
+		error("metrics: couldn't open memstream: %s", strerror(errno));
+		status(request, response, 500);
+		return;
+	}
+	metricsDump(stream);
+	fclose(stream);
+
+	char contentLength[32];
+	snprintf(contentLength, sizeof(contentLength), "%zu", length);
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Type", "text/plain; version=0.0.4");
+	headers_mod(&headers, "Content-Length", contentLength);
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+
+	if (fd < 0) {
+		free(body);
+		return;
+	}
+
+	if (writeAll(fd, body, length, networking_connectionTimeout()) < 0)
+		error("metrics: couldn't write response: %s", strerror(errno));
+
+	close(fd);
+	free(body);
+}
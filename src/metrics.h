@@ -0,0 +1,128 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "misc.h"
+
+#define METRICS_HANDLER_NO (2)
+
+/*
+ * Connection states as in enum connectionState (networking.h).
+ * Duplicated here to avoid the include cycle networking.h -> config.h.
+ */
+#define METRICS_NR_STATES (5)
+
+// slots for handler types (FILE_HANDLER_NO, CGI_HANDLER_NO, ...); the last slot counts requests without handler
+#define METRICS_NR_HANDLER_TYPES (8)
+#define METRICS_NO_HANDLER (METRICS_NR_HANDLER_TYPES - 1)
+
+// upper bounds of the latency histogram buckets in microseconds; +Inf is implicit
+#define METRICS_LATENCY_BUCKETS { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 }
+#define METRICS_NR_LATENCY_BUCKETS (12 + 1)
+
+// why a connection or request was turned away
+enum rejection {
+	// too many connections
+	REJECTED_CONNECTIONS,
+	// too many connections from the peer address
+	REJECTED_PEER,
+	// waited too long for a handler
+	REJECTED_SHED,
+	// over the rate limit of the peer
+	REJECTED_RATE,
+	// slow clients and oversized requests
+	REJECTED_HEADER_TIMEOUT,
+	REJECTED_HEADER_RATE,
+	REJECTED_HEADER_SIZE,
+	REJECTED_HEADER_COUNT,
+	REJECTED_SEND_RATE,
+	METRICS_NR_REJECTIONS
+};
+
+// caches whose hits and misses are counted
+enum cache {
+	// reverse lookups of client addresses; prefetches count as well
+	CACHE_RESOLVER,
+	// directory listings
+	CACHE_LISTING,
+	METRICS_NR_CACHES
+};
+
+enum metric {
+	METRIC_CONNECTIONS_ACCEPTED,
+	METRIC_CONNECTIONS_ACTIVE,
+	// gauge per connection state
+	METRIC_CONNECTIONS_STATE,
+	// aborted connections by the state they were in
+	METRIC_CONNECTIONS_ABORTED = METRIC_CONNECTIONS_STATE + METRICS_NR_STATES,
+	METRIC_REQUESTS = METRIC_CONNECTIONS_ABORTED + METRICS_NR_STATES,
+	// 1xx - 5xx; 0 for anything else
+	METRIC_RESPONSES = METRIC_REQUESTS + METRICS_NR_HANDLER_TYPES,
+	METRIC_BYTES_IN = METRIC_RESPONSES + 6,
+	METRIC_BYTES_OUT,
+	METRIC_LATENCY_BUCKET,
+	METRIC_LATENCY_SUM = METRIC_LATENCY_BUCKET + METRICS_NR_LATENCY_BUCKETS,
+	METRIC_LATENCY_COUNT,
+	METRIC_TLS_HANDSHAKES,
+	METRIC_TLS_HANDSHAKE_ERRORS,
+	// by enum cache
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_MISSES = METRIC_CACHE_HITS + METRICS_NR_CACHES,
+	// by enum rejection
+	METRIC_REJECTED = METRIC_CACHE_MISSES + METRICS_NR_CACHES,
+	// requests waiting for a handler
+	METRIC_HANDLERS_QUEUED = METRIC_REJECTED + METRICS_NR_REJECTIONS,
+	// bytes of responses the reactor buffers
+	METRIC_RESPONSES_BUFFERED,
+	NR_METRICS
+};
+
+/*
+ * Counters are sharded so that threads don't fight over cache lines.
+ * Every thread picks a shard on its first update; readers sum all shards.
+ *
+ * If a shared memory segment is configured the shards live there and
+ * external tools can read the counters without talking to the server:
+ * struct metricsSegment, all values native endian int64.
+ */
+#define METRICS_SHARDS (16)
+#define METRICS_MAGIC (0x43466d74)
+#define METRICS_VERSION (1)
+
+struct metricsShard {
+	int64_t values[NR_METRICS];
+} __attribute__((aligned(64)));
+
+struct metricsSegment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nrShards;
+	uint32_t nrMetrics;
+	struct metricsShard shards[METRICS_SHARDS];
+};
+
+int metrics_init(const char* sharedMemoryName);
+void metrics_destroy();
+
+struct metricsShard* metrics_shard();
+
+static inline void metrics_add(enum metric metric, int64_t value) {
+	__atomic_fetch_add(&(metrics_shard()->values[metric]), value, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_count(enum metric metric) {
+	metrics_add(metric, 1);
+}
+
+int64_t metrics_get(enum metric metric);
+
+// -1 as oldState for new connections, -1 as newState for freed ones
+void metrics_stateChange(int oldState, int newState);
+void metrics_requestHandler(int handlerType);
+void metrics_requestCompleted(int statusCode, long totalTime, size_t bytesOut);
+
+void metricsHandler(struct request request, struct response response);
+
+#endif
@@ -1,197 +1,379 @@
+#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "mime.h"
+#include "logging.h"
 
-struct mime {
-	const char* mime;
-	int number;
-	const char** extensions;
-} mimelist[] = {
-	{
-		.mime = "application/pdf",
-		.number = 1,
-		.extensions = (const char* []) {
-			"pdf"
-		}
-	},{
-		.mime = "text/css",
-		.number = 1,
-		.extensions = (const char* []) {
-			"css"
-		}
-	},{
-		.mime = "text/html",
-		.number = 2,
-		.extensions = (const char* []) {
-			"html",
-			"htm"
-		}
-	},{
-		.mime = "application/javascript",
-		.number = 1,
-		.extensions = (const char* []) {
-			"js"
-		}
-	},{
-		.mime = "application/json",
-		.number = 1,
-		.extensions = (const char* []) {
-			"json"
-		}
-	},{
-		.mime = "application/xml",
-		.number = 1,
-		.extensions = (const char* []) {
-			"xml"
-		}
-	},{
-		.mime = "image/jpeg",
-		.number = 2,
-		.extensions = (const char* []) {
-			"jpg",
-			"jpeg"
-		}
-	},{
-		.mime = "image/gif",
-		.number = 1,
-		.extensions = (const char* []) {
-			"gif"
-		}
-	},{
-		.mime = "image/x-icon",
-		.number = 1,
-		.extensions = (const char* []) {
-			"ico"
-		}
-	},{
-		.mime = "image/png",
-		.number = 1,
-		.extensions = (const char* []) {
-			"png"
-		}
-	},{
-		.mime = "image/svg+xml",
-		.number = 1,
-		.extensions = (const char* []) {
-			"svg"
-		}
-	},{
-		.mime = "audio/mpeg",
-		.number = 1,
-		.extensions = (const char* []) {
-			"mpga"
-		}
-	},{
-		.mime = "video/mpeg",
-		.number = 1,
-		.extensions = (const char* []) {
-			"mpeg"
-		}
-	},{
-		.mime = "audio/mp4",
-		.number = 4,
-		.extensions = (const char* []) {
-			"mp4a",
-			"m4a"
-		}
-	},{
-		.mime = "video/mp4",
-		.number = 1,
-		.extensions = (const char* []) {
-			"mp4"
-		}
-	},{
-		.mime = "video/webm",
-		.number = 1,
-		.extensions = (const char* []) {
-			"webm"
-		}
-	},{
-		.mime = "audio/aac",
-		.number = 1,
-		.extensions = (const char* []) {
-			"aac"
-		}
-	},{
-		.mime = "text/plain",
-		.number = 1,
-		.extensions = (const char* []) {
-			"txt"
-		}
-	},{
-		.mime = "audio/ogg",
-		.number = 2,
-		.extensions = (const char* []) {
-			"oga",
-			"ogg"
-		}
-	},{
-		.mime = "video/ogg",
-		.number = 1,
-		.extensions = (const char* []) {
-			"ogv"
-		}
-	},{
-		.mime = "image/tiff",
-		.number = 2,
-		.extensions = (const char* []) {
-			"tif",
-			"tiff"
-		}
-	},{
-		.mime = "audio/wav",
-		.number = 1,
-		.extensions = (const char* []) {
-			"wav"
-		}
-	},{
-		.mime = "audio/webm",
-		.number = 1,
-		.extensions = (const char* []) {
-			"weba"
-		}
-	},{
-		.mime = "image/webm",
-		.number = 1,
-		.extensions = (const char* []) {
-			"webp"
-		}
-	},{
-		.mime = "application/xhtml+xml",
-		.number = 1,
-		.extensions = (const char* []) {
-			"xhtml"
+#define BUILTIN_BUCKETS (64)
+// power of 2
+#define BUILTIN_SLOTS (256)
+#define INITIAL_MAP_SIZE (64)
+
+struct mimeType {
+	const char* extension;
+	const char* type;
+};
+
+static const struct mimeType builtinTypes[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "xhtml", "application/xhtml+xml" },
+	{ "css", "text/css" },
+	{ "js", "application/javascript" },
+	{ "mjs", "application/javascript" },
+	{ "json", "application/json" },
+	{ "map", "application/json" },
+	{ "webmanifest", "application/manifest+json" },
+	{ "xml", "application/xml" },
+	{ "xsl", "application/xml" },
+	{ "rss", "application/rss+xml" },
+	{ "atom", "application/atom+xml" },
+	{ "txt", "text/plain" },
+	{ "text", "text/plain" },
+	{ "log", "text/plain" },
+	{ "conf", "text/plain" },
+	{ "md", "text/markdown" },
+	{ "csv", "text/csv" },
+	{ "tsv", "text/tab-separated-values" },
+	{ "ics", "text/calendar" },
+	{ "vcf", "text/vcard" },
+	{ "pdf", "application/pdf" },
+	{ "ps", "application/postscript" },
+	{ "eps", "application/postscript" },
+	{ "rtf", "application/rtf" },
+	{ "wasm", "application/wasm" },
+	{ "zip", "application/zip" },
+	{ "gz", "application/gzip" },
+	{ "tgz", "application/gzip" },
+	{ "bz2", "application/x-bzip2" },
+	{ "xz", "application/x-xz" },
+	{ "zst", "application/zstd" },
+	{ "7z", "application/x-7z-compressed" },
+	{ "rar", "application/vnd.rar" },
+	{ "tar", "application/x-tar" },
+	{ "jar", "application/java-archive" },
+	{ "deb", "application/vnd.debian.binary-package" },
+	{ "rpm", "application/x-rpm" },
+	{ "iso", "application/x-iso9660-image" },
+	{ "apk", "application/vnd.android.package-archive" },
+	{ "exe", "application/vnd.microsoft.portable-executable" },
+	{ "doc", "application/msword" },
+	{ "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+	{ "xls", "application/vnd.ms-excel" },
+	{ "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+	{ "ppt", "application/vnd.ms-powerpoint" },
+	{ "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+	{ "odt", "application/vnd.oasis.opendocument.text" },
+	{ "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+	{ "odp", "application/vnd.oasis.opendocument.presentation" },
+	{ "epub", "application/epub+zip" },
+	{ "jpg", "image/jpeg" },
+	{ "jpeg", "image/jpeg" },
+	{ "gif", "image/gif" },
+	{ "png", "image/png" },
+	{ "apng", "image/apng" },
+	{ "webp", "image/webp" },
+	{ "avif", "image/avif" },
+	{ "svg", "image/svg+xml" },
+	{ "svgz", "image/svg+xml" },
+	{ "ico", "image/x-icon" },
+	{ "bmp", "image/bmp" },
+	{ "tif", "image/tiff" },
+	{ "tiff", "image/tiff" },
+	{ "heic", "image/heic" },
+	{ "mpga", "audio/mpeg" },
+	{ "mp3", "audio/mpeg" },
+	{ "mp4a", "audio/mp4" },
+	{ "m4a", "audio/mp4" },
+	{ "aac", "audio/aac" },
+	{ "oga", "audio/ogg" },
+	{ "ogg", "audio/ogg" },
+	{ "opus", "audio/ogg" },
+	{ "flac", "audio/flac" },
+	{ "wav", "audio/wav" },
+	{ "weba", "audio/webm" },
+	{ "mid", "audio/midi" },
+	{ "midi", "audio/midi" },
+	{ "mpeg", "video/mpeg" },
+	{ "mpg", "video/mpeg" },
+	{ "mp4", "video/mp4" },
+	{ "m4v", "video/mp4" },
+	{ "webm", "video/webm" },
+	{ "ogv", "video/ogg" },
+	{ "mov", "video/quicktime" },
+	{ "mkv", "video/x-matroska" },
+	{ "avi", "video/x-msvideo" },
+	{ "3gp", "video/3gpp" },
+	{ "ts", "video/mp2t" },
+	{ "m3u8", "application/vnd.apple.mpegurl" },
+	{ "woff", "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf", "font/ttf" },
+	{ "otf", "font/otf" },
+	{ "eot", "application/vnd.ms-fontobject" },
+};
+
+#define NR_BUILTIN_TYPES (sizeof(builtinTypes) / sizeof(builtinTypes[0]))
+
+/*
+ * Hash and displace: the extensions are spread over buckets with seed 0;
+ * every bucket gets the seed that moves all of its extensions to free slots.
+ */
+static struct {
+	unsigned short seeds[BUILTIN_BUCKETS];
+	// index of the type + 1; 0 is a free slot
+	unsigned char slots[BUILTIN_SLOTS];
+	bool broken;
+} builtin;
+
+static pthread_once_t builtinOnce = PTHREAD_ONCE_INIT;
+
+struct entry {
+	char* extension;
+	char* type;
+};
+
+struct mimeTypes {
+	// open addressing; size is a power of 2
+	size_t size;
+	size_t number;
+	struct entry* entries;
+};
+
+static unsigned int hash(const char* extension, size_t length, unsigned int seed) {
+	// FNV-1a of the lower case extension
+	unsigned int hash = 2166136261u;
+	hash ^= seed;
+	hash *= 16777619u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char) tolower((unsigned char) extension[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static bool placeBucket(int bucket, unsigned int seed) {
+	unsigned char placed[BUILTIN_SLOTS] = {};
+	for (size_t i = 0; i < NR_BUILTIN_TYPES; i++) {
+		const char* extension = builtinTypes[i].extension;
+		size_t length = strlen(extension);
+		if (hash(extension, length, 0) % BUILTIN_BUCKETS != bucket)
+			continue;
+
+		unsigned int slot = hash(extension, length, seed) & (BUILTIN_SLOTS - 1);
+		if (builtin.slots[slot] != 0 || placed[slot] != 0)
+			return false;
+		placed[slot] = i + 1;
+	}
+
+	for (int slot = 0; slot < BUILTIN_SLOTS; slot++) {
+		if (placed[slot] != 0)
+			builtin.slots[slot] = placed[slot];
+	}
+	builtin.seeds[bucket] = seed;
+
+	return true;
+}
+
+static void builtinInit() {
+	int sizes[BUILTIN_BUCKETS] = {};
+	int largest = 0;
+	for (size_t i = 0; i < NR_BUILTIN_TYPES; i++) {
+		const char* extension = builtinTypes[i].extension;
+		int bucket = hash(extension, strlen(extension), 0) % BUILTIN_BUCKETS;
+		if (++sizes[bucket] > largest)
+			largest = sizes[bucket];
+	}
+
+	// the crowded buckets go first while there are still many free slots
+	for (int size = largest; size > 0; size--) {
+		for (int bucket = 0; bucket < BUILTIN_BUCKETS; bucket++) {
+			if (sizes[bucket] != size)
+				continue;
+
+			unsigned int seed = 1;
+			while (seed <= 0xffff && !placeBucket(bucket, seed))
+				seed++;
+			if (seed > 0xffff) {
+				error("mime: couldn't build hash table of built-in types; falling back to linear search");
+				builtin.broken = true;
+				return;
+			}
 		}
-	},{
-		.mime = "audio/aac",
-		.number = 1,
-		.extensions = (const char* []) {
-			"aac"
+	}
+}
+
+static const char* findBuiltin(const char* extension, size_t length) {
+	pthread_once(&builtinOnce, &builtinInit);
+
+	if (builtin.broken) {
+		for (size_t i = 0; i < NR_BUILTIN_TYPES; i++) {
+			if (strlen(builtinTypes[i].extension) == length && strncasecmp(builtinTypes[i].extension, extension, length) == 0)
+				return builtinTypes[i].type;
 		}
-	},
-};
+		return NULL;
+	}
 
-const char* unknownMime = "application/octet-stream";
+	unsigned int seed = builtin.seeds[hash(extension, length, 0) % BUILTIN_BUCKETS];
+	int index = builtin.slots[hash(extension, length, seed) & (BUILTIN_SLOTS - 1)];
+	if (index == 0)
+		return NULL;
 
+	const struct mimeType* mimeType = &(builtinTypes[index - 1]);
+	if (strlen(mimeType->extension) != length || strncasecmp(mimeType->extension, extension, length) != 0)
+		return NULL;
 
-const char* getMineFromFileName(const char* filename) {
-	const char* extension = NULL;
-	const char* tmp = filename;
+	return mimeType->type;
+}
+
+static struct entry* findEntry(struct entry* entries, size_t size, const char* extension, size_t length) {
+	size_t index = hash(extension, length, 0) & (size - 1);
+	while (entries[index].extension != NULL) {
+		if (strlen(entries[index].extension) == length && strncasecmp(entries[index].extension, extension, length) == 0)
+			break;
+		index = (index + 1) & (size - 1);
+	}
+	return &(entries[index]);
+}
+
+static int grow(struct mimeTypes* types) {
+	size_t size = types->size * 2;
+	struct entry* entries = calloc(size, sizeof(struct entry));
+	if (entries == NULL)
+		return -1;
+
+	for (size_t i = 0; i < types->size; i++) {
+		const char* extension = types->entries[i].extension;
+		if (extension != NULL)
+			*findEntry(entries, size, extension, strlen(extension)) = types->entries[i];
+	}
+
+	free(types->entries);
+	types->entries = entries;
+	types->size = size;
+
+	return 0;
+}
+
+struct mimeTypes* mime_create() {
+	struct mimeTypes* types = malloc(sizeof(struct mimeTypes));
+	if (types == NULL)
+		return NULL;
+
+	types->size = INITIAL_MAP_SIZE;
+	types->number = 0;
+	types->entries = calloc(INITIAL_MAP_SIZE, sizeof(struct entry));
+	if (types->entries == NULL) {
+		free(types);
+		return NULL;
+	}
+
+	return types;
+}
+
+void mime_destroy(struct mimeTypes* types) {
+	if (types == NULL)
+		return;
 
-	while ((tmp = strcasestr(tmp, ".")) != NULL) {
-		tmp += 1;
-		extension = tmp;
+	for (size_t i = 0; i < types->size; i++) {
+		free(types->entries[i].extension);
+		free(types->entries[i].type);
 	}
-	if (extension == NULL)
-		return unknownMime;
+	free(types->entries);
+	free(types);
+}
+
+int mime_add(struct mimeTypes* types, const char* extension, const char* type) {
+	if ((types->number + 1) * 2 > types->size && grow(types) < 0)
+		return -1;
+
+	char* copy = strdup(type);
+	if (copy == NULL)
+		return -1;
+
+	struct entry* entry = findEntry(types->entries, types->size, extension, strlen(extension));
+	if (entry->extension == NULL) {
+		entry->extension = strdup(extension);
+		if (entry->extension == NULL) {
+			free(copy);
+			return -1;
+		}
+		types->number++;
+	}
+
+	free(entry->type);
+	entry->type = copy;
+
+	return 0;
+}
+
+int mime_load(struct mimeTypes* types, const char* filename) {
+	FILE* file = fopen(filename, "r");
+	if (file == NULL) {
+		error("mime: couldn't open %s: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	char* line = NULL;
+	size_t size = 0;
+	int result = 0;
+	while (getline(&line, &size, file) >= 0) {
+		char* comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = '\0';
 
-	for (int i = 0; i < (sizeof(mimelist) / sizeof(mimelist[0])); i++) {
-		for(int j = 0; j < mimelist[i].number; j++) {
-			if (strcmp(extension, mimelist[i].extensions[j]) == 0)
-				return mimelist[i].mime;
+		char* save;
+		const char* type = strtok_r(line, " \t\r\n", &save);
+		if (type == NULL)
+			continue;
+
+		const char* extension;
+		while ((extension = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			if (mime_add(types, extension, type) < 0) {
+				error("mime: couldn't add type of %s: %s", extension, strerror(errno));
+				result = -1;
+				break;
+			}
 		}
+		if (result < 0)
+			break;
+	}
+
+	free(line);
+	fclose(file);
+
+	return result;
+}
+
+const char* mime_lookup(const struct mimeTypes* types, const char* filename) {
+	const char* dot = strrchr(filename, '.');
+	if (dot == NULL || strchr(dot, '/') != NULL)
+		return MIME_UNKNOWN;
+
+	const char* extension = dot + 1;
+	size_t length = strlen(extension);
+	if (length == 0)
+		return MIME_UNKNOWN;
+
+	if (types != NULL) {
+		const struct entry* entry = findEntry(types->entries, types->size, extension, length);
+		if (entry->extension != NULL)
+			return entry->type;
 	}
 
-	return unknownMime;
+	const char* type = findBuiltin(extension, length);
+	if (type == NULL)
+		return MIME_UNKNOWN;
+
+	return type;
+}
+
+const char* getMineFromFileName(const char* filename) {
+	return mime_lookup(NULL, filename);
 }
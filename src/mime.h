@@ -1,6 +1,26 @@
 #ifndef MINE_H
 #define MINE_H
 
+/*
+ * Content types by file extension; extensions are matched case-insensitively.
+ * The built-in types are kept in a perfect hash table that is built on first use.
+ * More types can be loaded from files in mime.types format ("type ext ext ..." per line, "#" comments);
+ * those take precedence over the built-in ones.
+ */
+
+#define MIME_UNKNOWN "application/octet-stream"
+
+struct mimeTypes;
+
+struct mimeTypes* mime_create();
+void mime_destroy(struct mimeTypes* types);
+// later types of an extension replace earlier ones
+int mime_add(struct mimeTypes* types, const char* extension, const char* type);
+int mime_load(struct mimeTypes* types, const char* filename);
+
+// types may be NULL; the result lives as long as types
+const char* mime_lookup(const struct mimeTypes* types, const char* filename);
+
 const char* getMineFromFileName(const char* filename);
 
 #endif
@@ -1,5 +1,198 @@
-
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 
 #include "misc.h"
+#include "util.h"
+#include "logging.h"
+
+// what a reactor handler gets of the request body at once if it runs on a thread
+#define BLOCKING_BODY_BUFFER_SIZE (8192)
+
+struct blockingResponse {
+	struct request* request;
+	struct response response;
+	// the rest of the body goes here once the header is sent
+	int fd;
+	bool sent;
+	bool failed;
+};
+
+static int blockingSendHeader(int statusCode, struct headers* headers, struct request* request) {
+	struct blockingResponse* blocking = (struct blockingResponse*) request->_private;
+	if (blocking->sent) {
+		error("misc: handler responded twice");
+		return -1;
+	}
+	blocking->sent = true;
+
+	blocking->fd = blocking->response.sendHeader(statusCode, headers, blocking->request);
+	if (blocking->fd < 0) {
+		blocking->failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int blockingSendResponse(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request) {
+	struct blockingResponse* blocking = (struct blockingResponse*) request->_private;
+
+	if (headers_get(headers, "Content-Length") != NULL) {
+		if (blockingSendHeader(statusCode, headers, request) < 0)
+			return -1;
+		if (count > 0 && writevAll(blocking->fd, body, count, -1) < 0) {
+			blocking->failed = true;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (blocking->sent) {
+		error("misc: handler responded twice");
+		return -1;
+	}
+	blocking->sent = true;
+
+	if (blocking->response.sendResponse(statusCode, headers, body, count, blocking->request) < 0) {
+		blocking->failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int blockingSendBody(const struct iovec* body, int count, struct request* request) {
+	struct blockingResponse* blocking = (struct blockingResponse*) request->_private;
+	if (blocking->fd < 0 || blocking->failed)
+		return -1;
+
+	if (writevAll(blocking->fd, body, count, -1) < 0) {
+		blocking->failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void finishBlocking(struct blockingResponse* blocking, bool incomplete) {
+	if (blocking->fd < 0)
+		return;
+
+	if (incomplete) {
+		// the client can't tell where the response ends
+		shutdown(blocking->fd, SHUT_RDWR);
+	}
+	close(blocking->fd);
+}
+
+void runReactorHandler(const struct reactorHandler* handler, struct request request, struct response response) {
+	struct blockingResponse blocking = {
+		.request = &request,
+		.response = response,
+		.fd = -1
+	};
+
+	struct request inner = request;
+	inner.state = NULL;
+	inner._private = &blocking;
+
+	struct reactorResponse reactorResponse = {
+		.sendResponse = blockingSendResponse,
+		.sendBody = blockingSendBody
+	};
+
+	enum reactorResult result = handler->onRequest(&inner, reactorResponse);
+	if (result == REACTOR_BLOCKING) {
+		error("misc: reactor handler wants a thread but already has one");
+		result = REACTOR_ERROR;
+	}
+
+	// like on the reactor, onBody is only called if there is a body
+	bool hasBody = headers_get(request.headers, "Content-Length") != NULL || headers_get(request.headers, "Transfer-Encoding") != NULL;
+
+	while (result == REACTOR_MORE && hasBody && handler->onBody != NULL && request.fd >= 0) {
+		char buffer[BLOCKING_BODY_BUFFER_SIZE];
+		ssize_t length = read(request.fd, buffer, sizeof(buffer));
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			result = REACTOR_ERROR;
+			break;
+		}
+
+		result = handler->onBody(&inner, buffer, length, reactorResponse);
+		if (length == 0)
+			break;
+	}
+
+	while (result == REACTOR_MORE) {
+		if (handler->onWritable == NULL) {
+			error("misc: reactor handler has nothing more to send");
+			result = REACTOR_ERROR;
+			break;
+		}
+		result = handler->onWritable(&inner, reactorResponse);
+	}
+
+	if (handler->onComplete != NULL)
+		handler->onComplete(&inner, result == REACTOR_DONE && !blocking.failed);
+
+	finishBlocking(&blocking, result == REACTOR_ERROR);
+}
+
+static ssize_t blockingRead(char* buffer, size_t length, struct request* request) {
+	struct blockingResponse* blocking = (struct blockingResponse*) request->_private;
+	if (blocking->request->fd < 0)
+		return 0;
+
+	while (true) {
+		ssize_t tmp = read(blocking->request->fd, buffer, length);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		return tmp;
+	}
+}
+
+static int blockingWait(int fd, short events, struct request* request) {
+	return waitForFd(fd, events, -1);
+}
+
+static ssize_t blockingRelay(int fd, struct request* request) {
+	struct blockingResponse* blocking = (struct blockingResponse*) request->_private;
+	if (blocking->fd < 0 || blocking->failed)
+		return -1;
+
+	// the socket itself unless the body is encoded
+	return fileCopy(fd, blocking->fd);
+}
+
+void runCoroutineHandler(coroutine_t handler, struct request request, struct response response) {
+	struct blockingResponse blocking = {
+		.request = &request,
+		.response = response,
+		.fd = -1
+	};
+
+	struct request inner = request;
+	inner.state = NULL;
+	inner._private = &blocking;
+
+	handler(inner, (struct coroutineResponse) {
+		.sendResponse = blockingSendResponse,
+		.sendHeader = blockingSendHeader,
+		.write = blockingSendBody,
+		.read = blockingRead,
+		.wait = blockingWait,
+		.relay = blockingRelay
+	});
 
+	if (!blocking.sent)
+		error("misc: coroutine handler didn't respond");
 
+	finishBlocking(&blocking, blocking.failed);
+}
@@ -2,6 +2,9 @@
 #define MISC_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
 
 #include <pthread.h>
 
@@ -22,7 +25,7 @@ enum method {
 };
 
 enum protocol {
-	HTTP10, HTTP11
+	HTTP10, HTTP11, HTTP20
 };
 
 struct metaData {
@@ -45,7 +48,6 @@ union userData {
 };
 
 struct bind_private {
-	pthread_t threadId;
 	int socketFd;
 };
 
@@ -54,6 +56,12 @@ struct bind {
 	const char* port;
 	union userData settings;
 	bool ssl;
+	// in bytes; 0 means no limit
+	long maxBodySize;
+	// a handler needs the name of the peer (REMOTE_HOST); the lookup starts once the connection is accepted
+	bool resolvePeers;
+	// ms a request waits for the name; it gets "" afterwards
+	long resolveTimeout;
 
 	#ifdef SSL_SUPPORT
 	struct ssl_settings* ssl_settings;
@@ -65,11 +73,14 @@ struct bind {
 struct peer {
 	// INET6_ADDRSTRLEN should be enough
 	char addr[INET6_ADDRSTRLEN + 1];
+	// NULL if the bind doesn't resolve peers; "" if there is no name (yet)
 	char* name;
 	int port;
 	char portStr[5 + 1];
 };
 
+struct statusPages;
+
 struct request {
 	struct metaData metaData;
 	struct peer peer;
@@ -77,18 +88,105 @@ struct request {
 	struct bind bind;
 	int fd;
 	union userData userData;
+	// custom error pages of the site; may be NULL
+	const struct statusPages* statusPages;
+	// whatever a reactor handler keeps between its callbacks
+	void* state;
 	void* _private;
 };
 
+struct iovec;
+
+typedef int (*sendResponse_t)(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request);
+
 struct response {
+	// returns the fd for the body or -1; it can be the socket itself, which is non-blocking
+	// (use writeAll with networking_connectionTimeout or fileCopy instead of plain write)
 	int (*sendHeader)(int statusCode, struct headers* headers, struct request* request);
+	// a whole response; returns 0 or -1
+	sendResponse_t sendResponse;
 };
 
 typedef void (*handler_t)(struct request request, struct response response);
 
+/*
+ * Handlers that run on the reactor thread instead of a thread of their own. None of the callbacks may block.
+ * The response is queued and sent once the callback returned; request.fd is not used.
+ */
+struct reactorResponse {
+	// header and (the start of) the body; without a Content-Length header the body is the whole body
+	sendResponse_t sendResponse;
+	// more of the body; returns 0 or -1
+	int (*sendBody)(const struct iovec* body, int count, struct request* request);
+};
+
+enum reactorResult {
+	// the response is complete
+	REACTOR_DONE,
+	// the handler wants onBody or onWritable
+	REACTOR_MORE,
+	// onRequest only: the request goes to the blocking handler on a thread instead
+	REACTOR_BLOCKING,
+	// the response can't be completed; the connection is closed
+	REACTOR_ERROR
+};
+
+struct reactorHandler {
+	// the headers are complete
+	enum reactorResult (*onRequest)(struct request* request, struct reactorResponse response);
+	// the request body as it arrives, if there is one; length 0 ends it. If NULL the body is discarded.
+	enum reactorResult (*onBody)(struct request* request, const char* data, size_t length, struct reactorResponse response);
+	// once everything queued is sent, while the body arrives only if the handler queued something;
+	// has to queue more or finish unless it waits for the body
+	enum reactorResult (*onWritable)(struct request* request, struct reactorResponse response);
+	// the exchange is over; sent is false if the client didn't get the whole response. May be NULL.
+	void (*onComplete)(struct request* request, bool sent);
+};
+
+/*
+ * Drives a reactor handler with the blocking interface; for where the reactor can't run it
+ * (TLS, HTTP/2, chunked request bodies). REACTOR_BLOCKING is an error here.
+ */
+void runReactorHandler(const struct reactorHandler* handler, struct request request, struct response response);
+
+/*
+ * Sequential handlers that run as coroutines on the reactor. The calls below suspend the handler
+ * until the reactor has what it waits for; nothing else may block. request.fd is not used.
+ */
+struct coroutineResponse {
+	// like in struct reactorResponse; the response leaves once the handler waits or returns
+	sendResponse_t sendResponse;
+	// for bodies of unknown length; they follow with write (chunked if the connection stays open)
+	int (*sendHeader)(int statusCode, struct headers* headers, struct request* request);
+	// more of the body; returns once it is sent. 0 or -1
+	int (*write)(const struct iovec* body, int count, struct request* request);
+	// the request body; 0 at its end, -1 if it can't be read
+	ssize_t (*read)(char* buffer, size_t length, struct request* request);
+	// until fd is ready for events (POLLIN or POLLOUT); -1 if the client is gone
+	int (*wait)(int fd, short events, struct request* request);
+	// the rest of the body is what the pipe fd delivers until its end; spliced if the body goes
+	// to a plain socket. Returns the number of bytes or -1 if the client is gone
+	ssize_t (*relay)(int fd, struct request* request);
+};
+
+typedef void (*coroutine_t)(struct request request, struct coroutineResponse response);
+
+// runs a coroutine handler on the calling thread; the calls block instead
+void runCoroutineHandler(coroutine_t handler, struct request request, struct response response);
+
+struct rateLimit;
+
 struct handler {
 	handler_t handler;
+	// if set the request is handled on the reactor where possible; handler is used everywhere else
+	const struct reactorHandler* reactor;
+	// the same as a coroutine; takes precedence over reactor
+	coroutine_t coroutine;
 	union userData data;
+	// checked before the handler runs; may be NULL
+	const struct rateLimit* rateLimit;
+	// may be NULL
+	const struct statusPages* statusPages;
 };
 
 #endif
@@ -5,10 +5,16 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <spawn.h>
 
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -18,12 +24,121 @@
 #include "signals.h"
 #include "status.h"
 #include "util.h"
+#include "metrics.h"
+#include "http2.h"
+#include "eventloop.h"
+#include "resolver.h"
+#include "cgi.h"
+#include "admission.h"
+#include "coroutine.h"
 
 #ifdef SSL_SUPPORT
 #include "ssl.h"
 #endif
 
-struct networkingConfig networkingConfig;
+static struct networkingConfig networkingConfig;
+
+static struct eventLoop* eventLoop;
+
+// seconds a handler gets; TODO set timeout via config
+#define HANDLER_TIMEOUT (30)
+
+// connections the reactor has to look at again (e.g. the next pipelined request is waiting)
+static pthread_mutex_t scheduledLock = PTHREAD_MUTEX_INITIALIZER;
+static struct connection* scheduledConnections = NULL;
+
+/*
+ * The binds of one config. networking_reload makes a new one current; connections and
+ * exchanges keep the one they started with. Once the last of them is gone a replaced
+ * generation is released.
+ */
+struct generation {
+	struct networkingConfig config;
+	// one while it is current plus one per connection and exchange
+	int references;
+};
+
+/*
+ * A listening socket. Listeners are never freed since connections point to them;
+ * if the address of a closed one comes back a new listener is opened.
+ */
+struct listener {
+	// -1 if closed
+	int fd;
+	// of the current generation; NULL if closed
+	struct bind* bind;
+	struct listener* next;
+};
+
+// only the reactor changes these
+static struct generation* currentGeneration = NULL;
+static struct listener* listeners = NULL;
+// handed over to the reactor by networking_reload; the reactor holds it while it changes the listeners
+static pthread_mutex_t reloadLock = PTHREAD_MUTEX_INITIALIZER;
+static struct generation* nextGeneration = NULL;
+static bool draining = false;
+// the listeners are closed; only the reactor reads it
+static bool drained = false;
+// connections freed since the drain started; see networking_drained
+static int drainedConnections = 0;
+// becomes readable once the listeners are closed; see networking_drainfd
+static int drainfd = -1;
+// set by networking_closeAll; the reactor closes the connections, puts their number into closedByForce and resets it
+static bool closeAllPending = false;
+static int closedByForce = 0;
+static pthread_cond_t closeAllDone = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Admission control: connections are counted against the limits when they are accepted;
+ * requests beyond maxHandlers wait in a queue the reactor drains as handlers finish.
+ * CoDel decides which of the waiting ones are shed.
+ */
+static int openConnections = 0;
+static pthread_mutex_t admissionLock = PTHREAD_MUTEX_INITIALIZER;
+static int runningHandlers = 0;
+static struct exchange* waitingFirst = NULL;
+static struct exchange* waitingLast = NULL;
+static struct codel codel;
+// sent to connections and requests that are turned away; built by networking_init
+static char* rejectResponse = NULL;
+static size_t rejectResponseLength = 0;
+// status line and default headers of the answer to requests over the rate limit
+static char* limitedHeader = NULL;
+static size_t limitedHeaderLength = 0;
+
+// buffered responses of all connections; only touched by the reactor
+static long bufferedBytes = 0;
+static struct connection* stalledOutputs = NULL;
+
+static void leaveWaiting(struct exchange* exchange);
+static void releaseSlot(struct exchange* exchange);
+static void answerRejected(struct exchange* exchange);
+static void releaseConnection(const char* addr);
+static void failOutput(struct connection* connection);
+
+// listening sockets passed on by networking_handOver of the previous process
+struct inheritedListener {
+	int fd;
+	char address[INET6_ADDRSTRLEN + 1];
+	char port[16];
+};
+static struct inheritedListener* inherited = NULL;
+static int numberOfInherited = 0;
+
+static struct generation* acquireGeneration(struct generation* generation) {
+	__atomic_fetch_add(&(generation->references), 1, __ATOMIC_RELAXED);
+	return generation;
+}
+
+static void releaseGeneration(struct generation* generation) {
+	if (__atomic_sub_fetch(&(generation->references), 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	debug("networking: releasing replaced config");
+	if (generation->config.release != NULL)
+		generation->config.release(&(generation->config));
+	free(generation);
+}
 
 static inline long timespecDiffMs(struct timespec start, struct timespec end) {
 	return (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec / 1000000 - start.tv_nsec / 1000000);
@@ -42,16 +157,338 @@ static inline long timespacAgeMs(struct timespec start) {
 	return timespecDiffMs(start, getTime());
 }
 
+static inline bool timespecIsSet(struct timespec time) {
+	return time.tv_sec != 0 || time.tv_nsec != 0;
+}
+
+// returns -1 if one of the timestamps was never taken
+static inline long timespecSpanUs(struct timespec start, struct timespec end) {
+	if (!timespecIsSet(start) || !timespecIsSet(end))
+		return -1;
+
+	return (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+// connection has to be locked beforehand
+static inline void setState(struct connection* connection, enum connectionState state) {
+	if (connection->state == state)
+		return;
+
+	if (state == ABORTED)
+		metrics_count(METRIC_CONNECTIONS_ABORTED + connection->state);
+	metrics_stateChange(connection->state, state);
+
+	connection->state = state;
+}
+
 void updateTiming(struct connection* connection, bool stateChange) {
 	struct timespec time = getTime();
 
 	connection->timing.lastUpdate = time;
-	if (stateChange)	
+	if (stateChange)
 		connection->timing.states[connection->state] = time;
 }
 
+static void unlockMutex(void* mutex) {
+	pthread_mutex_unlock((pthread_mutex_t*) mutex);
+}
+
+static inline void stopThread(pthread_t self, pthread_t* thread, bool force) {
+	if (*thread == PTHREAD_NULL || pthread_equal(self, *thread))
+		return;
+
+	debug("networking: freeing thread");
+
+	if (force) {
+		if (pthread_cancel(*thread) < 0)
+			error("networking: cancel thread: %s", strerror(errno));
+	}
+	if (pthread_join(*thread, NULL) < 0)
+		error("networking: join thread: %s", strerror(errno));
+
+	*thread = PTHREAD_NULL;
+}
+
+// connection has to be locked beforehand
+static inline bool isReadable(struct connection* connection) {
+	if (connection->readingBody)
+		return false;
+	if (connection->state == OPENED)
+		return true;
+
+	// KEEP_ALIVE means the last request was persistent; the client may pipeline
+	return connection->state == KEEP_ALIVE && connection->pending < PIPELINE_MAX_DEPTH;
+}
+
+/*
+ * Makes the reactor process the connection.
+ * Connection has to be locked beforehand.
+ */
+static void schedule(struct connection* connection) {
+	pthread_mutex_lock(&scheduledLock);
+	if (!connection->scheduled) {
+		connection->scheduled = true;
+		// the reactor releases it once it is done with the connection
+		connection->inUse++;
+		connection->nextScheduled = scheduledConnections;
+		scheduledConnections = connection;
+	}
+	pthread_mutex_unlock(&scheduledLock);
+
+	eventloop_wakeup(eventLoop);
+}
+
+/*
+ * Blocks until all earlier exchanges on the connection are finished.
+ */
+static void waitForTurn(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+
+	pthread_mutex_lock(&(connection->lock));
+	pthread_cleanup_push(&unlockMutex, &(connection->lock));
+	while (connection->first != exchange)
+		pthread_cond_wait(&(connection->turn), &(connection->lock));
+	pthread_cleanup_pop(1);
+}
+
+/*
+ * Removes an exchange from the queue and hands it over to the reaper.
+ * Connection has to be locked beforehand.
+ */
+static void leaveQueue(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+
+	struct exchange* previous = NULL;
+	for (struct exchange* current = connection->first; current != NULL; current = current->next) {
+		if (current != exchange) {
+			previous = current;
+			continue;
+		}
+
+		if (previous == NULL) {
+			connection->first = exchange->next;
+		} else {
+			previous->next = exchange->next;
+		}
+		if (connection->last == exchange)
+			connection->last = previous;
+		break;
+	}
+
+	exchange->completed = true;
+	exchange->next = connection->done;
+	connection->done = exchange;
+
+	if (exchange->waiting) {
+		// aborted before it got a handler
+		pthread_mutex_lock(&admissionLock);
+		leaveWaiting(exchange);
+		pthread_mutex_unlock(&admissionLock);
+	}
+
+	connection->pending--;
+	connection->inUse--;
+
+	pthread_cond_broadcast(&(connection->turn));
+}
+
+/*
+ * Has to be called with the admission lock held.
+ */
+static void leaveWaiting(struct exchange* exchange) {
+	if (!exchange->waiting)
+		return;
+
+	if (exchange->previousWaiting != NULL)
+		exchange->previousWaiting->nextWaiting = exchange->nextWaiting;
+	else
+		waitingFirst = exchange->nextWaiting;
+	if (exchange->nextWaiting != NULL)
+		exchange->nextWaiting->previousWaiting = exchange->previousWaiting;
+	else
+		waitingLast = exchange->previousWaiting;
+
+	exchange->waiting = false;
+	exchange->nextWaiting = NULL;
+	exchange->previousWaiting = NULL;
+	metrics_add(METRIC_HANDLERS_QUEUED, -1);
+}
+
+/*
+ * Gives the handler slot back; the reactor hands it to the next waiting request.
+ */
+static void releaseSlot(struct exchange* exchange) {
+	pthread_mutex_lock(&admissionLock);
+	if (!exchange->hasSlot) {
+		pthread_mutex_unlock(&admissionLock);
+		return;
+	}
+	exchange->hasSlot = false;
+	runningHandlers--;
+	bool waiting = waitingFirst != NULL;
+	pthread_mutex_unlock(&admissionLock);
+
+	if (waiting)
+		eventloop_wakeup(eventLoop);
+}
+
+static void freeExchanges(struct exchange* exchange) {
+	pthread_t self = pthread_self();
+
+	while (exchange != NULL) {
+		struct exchange* next = exchange->next;
+
+		// the request thread might still store the handle of the response thread
+		stopThread(self, &(exchange->threads.request), false);
+		stopThread(self, &(exchange->threads.response), false);
+		stopThread(self, &(exchange->threads.encoder), false);
+		stopThread(self, &(exchange->threads.body), false);
+
+		// in case the handler was cancelled
+		releaseSlot(exchange);
+		if (exchange->waiting) {
+			pthread_mutex_lock(&admissionLock);
+			leaveWaiting(exchange);
+			pthread_mutex_unlock(&admissionLock);
+		}
+
+		if (exchange->body.readfd >= 0)
+			close(exchange->body.readfd);
+		if (exchange->body.writefd >= 0)
+			close(exchange->body.writefd);
+
+		if (exchange->metaData.path != NULL)
+			free(exchange->metaData.path);
+		if (exchange->metaData.queryString != NULL)
+			free(exchange->metaData.queryString);
+		if (exchange->metaData.uri != NULL)
+			free(exchange->metaData.uri);
+
+		headers_free(&(exchange->headers));
+
+		releaseGeneration(exchange->generation);
+
+		free(exchange);
+
+		exchange = next;
+	}
+}
+
+/*
+ * Joins and frees finished exchanges.
+ */
+static void reapExchanges(struct connection* connection) {
+	pthread_mutex_lock(&(connection->lock));
+	if (connection->aborting && connection->inUse > 0) {
+		// abortConnection is still working on them
+		pthread_mutex_unlock(&(connection->lock));
+		return;
+	}
+	if (connection->output.exchange != NULL && connection->output.exchange->completed) {
+		// the reactor still sends its response
+		pthread_mutex_unlock(&(connection->lock));
+		return;
+	}
+	struct exchange* done = connection->done;
+	connection->done = NULL;
+	pthread_mutex_unlock(&(connection->lock));
+
+	freeExchanges(done);
+}
+
+static void closeConnection(struct connection* connection);
+
 linkedList_t connectionList;
 
+/*
+ * No request is running or partly received. Has to be called by the reactor with the connection locked.
+ */
+static bool isIdle(struct connection* connection) {
+	return connection->first == NULL && !connection->readingBody && connection->currentHeader == NULL &&
+		connection->metaData.path == NULL && connection->bufferOffset >= connection->bufferLength;
+}
+
+/*
+ * Checks the data rates of the connection; returns why it is too slow or METRICS_NR_REJECTIONS.
+ * Has to be called with the connection locked, once per cleanup.
+ */
+static enum rejection tooSlow(struct connection* connection) {
+	if (connection->state == OPENED && connection->timing.requestStart.tv_sec != 0) {
+		// in the middle of the headers
+		long age = timespacAgeMs(connection->timing.requestStart);
+		if (networkingConfig.headerTimeout > 0 && age > networkingConfig.headerTimeout)
+			return REJECTED_HEADER_TIMEOUT;
+		if (networkingConfig.minReceiveRate > 0 && age >= RATE_WINDOW && connection->headerBytes * 1000 < networkingConfig.minReceiveRate * age)
+			return REJECTED_HEADER_RATE;
+		return METRICS_NR_REJECTIONS;
+	}
+
+	if (networkingConfig.minSendRate <= 0 || (connection->state != PROCESSING && connection->state != KEEP_ALIVE))
+		return METRICS_NR_REJECTIONS;
+
+	#ifdef SSL_SUPPORT
+	if (connection->sslConnection != NULL) {
+		// the socket belongs to the ssl connection
+		return METRICS_NR_REJECTIONS;
+	}
+	#endif
+
+	struct tcp_info info;
+	socklen_t length = sizeof(info);
+	if (getsockopt(connection->readfd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0 || length < sizeof(info)) {
+		return METRICS_NR_REJECTIONS;
+	}
+
+	if (info.tcpi_notsent_bytes == 0) {
+		// the client keeps up with what we send
+		connection->drainSince = (struct timespec) {};
+		return METRICS_NR_REJECTIONS;
+	}
+
+	if (connection->drainSince.tv_sec == 0) {
+		connection->drainSince = getTime();
+		connection->drainAcked = info.tcpi_bytes_acked;
+		return METRICS_NR_REJECTIONS;
+	}
+
+	long age = timespacAgeMs(connection->drainSince);
+	if (age < RATE_WINDOW)
+		return METRICS_NR_REJECTIONS;
+
+	long acked = info.tcpi_bytes_acked - connection->drainAcked;
+	connection->drainSince = getTime();
+	connection->drainAcked = info.tcpi_bytes_acked;
+
+	if (acked * 1000 < networkingConfig.minSendRate * age)
+		return REJECTED_SEND_RATE;
+
+	return METRICS_NR_REJECTIONS;
+}
+
+/*
+ * The handler gets an error on its next write; whatever is still queued is dropped once the socket is closed.
+ */
+static void cutOff(struct connection* connection) {
+	struct linger linger = {
+		.l_onoff = 1,
+		.l_linger = 0
+	};
+	setsockopt(connection->readfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	shutdown(connection->readfd, SHUT_RDWR);
+}
+
+// the rest of the body didn't arrive in time; a coroutine handler that doesn't read yet doesn't wait for it
+static bool bodyStalled(struct connection* connection, long age) {
+	struct exchange* exchange = connection->bodyExchange;
+	return exchange != NULL && !exchange->coroutine.paused && age > networkingConfig.connectionTimeout;
+}
+
+// a coroutine handler gets as long as a handler thread
+static bool coroutineTimedOut(struct connection* connection) {
+	struct exchange* exchange = connection->output.exchange;
+	return exchange != NULL && exchange->coroutine.coroutine != NULL && timespacAgeMs(exchange->timing.handlerStart) > HANDLER_TIMEOUT * 1000;
+}
+
 linkedList_t connectionsToFree;
 void cleanup() {
 	link_t* link = linked_first(&connectionList);
@@ -66,22 +503,48 @@ void cleanup() {
 
 		struct connection* connection = link->data;
 
+		reapExchanges(connection);
+
 		long diffms = timespacAgeMs(connection->timing.lastUpdate);
 
 		pthread_mutex_lock(&(connection->lock));
-		if (connection->state == KEEP_ALIVE) {
+		// processing connections are checked once they are unlinked
+		enum rejection slow = connection->state != PROCESSING ? tooSlow(connection) : METRICS_NR_REJECTIONS;
+		if (slow != METRICS_NR_REJECTIONS) {
+			metrics_count(METRIC_REJECTED + slow);
+			info("networking: %s:%s is too slow; closing connection", connection->peer.addr, connection->peer.portStr);
+		}
+
+		if (slow == REJECTED_SEND_RATE) {
+			cutOff(connection);
+		} else if (slow != METRICS_NR_REJECTIONS) {
+			setState(connection, ABORTED);
+			unlink = true;
+		} else if (bodyStalled(connection, diffms)) {
+			// the reactor handler waits too long for the rest of the body
+			setState(connection, ABORTED);
+			unlink = true;
+		} else if (coroutineTimedOut(connection)) {
+			error("networking: Timeout of coroutine handler.");
+			setState(connection, ABORTED);
+			unlink = true;
+		} else if (connection->state == KEEP_ALIVE) {
 			// KEEP_ALIVE means that the connection is persistent but there is an active handler
 			// don't unlink; don't abort connection
 		} else if (connection->state != OPENED) {
 			unlink = true;
+		} else if (drained && isIdle(connection)) {
+			// there are no listeners anymore; the client has to reconnect anyway
+			closeConnection(connection);
+			unlink = true;
 		} else if (diffms > networkingConfig.connectionTimeout) {
 			// the connection is open too long without data from the client
 			// TODO: add custom timeout if connection isPersistent
-			connection->state = ABORTED;
+			setState(connection, ABORTED);
 		}
 		pthread_mutex_unlock(&(connection->lock));
 
-		if (unlink) {	
+		if (unlink) {
 			linked_push(&connectionsToFree, connection);
 			unlinked++;
 			linked_unlink(link);
@@ -99,33 +562,44 @@ void cleanup() {
 	while(link != NULL) {
 		length++;
 		struct connection* connection = link->data;
-		
+
 		pthread_mutex_lock(&(connection->lock));
-		if (connection->inUse == 0) {	
+		if (bodyStalled(connection, timespacAgeMs(connection->timing.lastUpdate)) || coroutineTimedOut(connection))
+			setState(connection, ABORTED);
+		bool giveUp = connection->output.exchange != NULL && (connection->state == CLOSED || connection->state == ABORTED);
+		pthread_mutex_unlock(&(connection->lock));
+		if (giveUp) {
+			// nobody is going to take the rest of the response
+			failOutput(connection);
+		}
+
+		pthread_mutex_lock(&(connection->lock));
+		if (connection->state == PROCESSING && tooSlow(connection) == REJECTED_SEND_RATE) {
+			metrics_count(METRIC_REJECTED + REJECTED_SEND_RATE);
+			info("networking: %s:%s is too slow; closing connection", connection->peer.addr, connection->peer.portStr);
+			cutOff(connection);
+		}
+		if (connection->armed) {
+			// nobody is going to parse what arrives; the completion releases the connection
+			eventloop_cancel(eventLoop, connection->readfd, connection);
+		}
+		if (connection->inUse == 0) {
 			linked_unlink(link);
-		
-			freed++;
 
-			if (connection->threads.request != PTHREAD_NULL) {
-				pthread_cancel(connection->threads.request);
-				pthread_join(connection->threads.request, NULL);
-			}
-			if (connection->threads.response != PTHREAD_NULL) {
-				pthread_cancel(connection->threads.response);
-				pthread_join(connection->threads.response, NULL);
-			}
-			if (connection->threads.encoder != PTHREAD_NULL) {
-				pthread_cancel(connection->threads.encoder);
-				pthread_join(connection->threads.encoder, NULL);
-			}
+			freed++;
 
+			// all exchanges are finished; their threads don't need the lock anymore
+			freeExchanges(connection->done);
+			connection->done = NULL;
 
 			if (connection->state == ABORTED && connection->writefd >= 0) {
 				// either the client took too long to send the headers
 				// or this connection was persistent and the client didn't produce a request
-				// either way: since the writefd is still available 
+				// either way: since the writefd is still available
 				//             let's send a 408 status before closing the connection
-				
+				// (or 431 if the headers were too large)
+				int status = connection->errorStatus != 0 ? connection->errorStatus : 408;
+
 				int dupfd = dup(connection->writefd);
 				if (dupfd < 0) {
 					error("networking: couldn't dup fd for 408 handling: %s", strerror(errno));
@@ -137,18 +611,18 @@ void cleanup() {
 					close(dupfd);
 					goto CONTINUE_CLEANUP;
 				}
-				
+
 				struct headers headers = headers_create();
 				for(int i = 0; i < networkingConfig.defaultHeaders.number; i++) {
 					headers_mod(&headers, networkingConfig.defaultHeaders.headers[i].key, networkingConfig.defaultHeaders.headers[i].value);
-				} 
-				
+				}
+
 				// set connection close header as required by the standard
 				headers_mod(&headers, "Connection", "close");
 				// no content
 				headers_mod(&headers, "Content-Length", "0");
-				
-				fprintf(stream, "%s %d %s\r\n", protocolString(connection->metaData), 408, getStatusStrings(408).statusString);
+
+				fprintf(stream, "%s %d %s\r\n", protocolString(connection->metaData), status, getStatusStrings(status).statusString);
 
 				headers_dump(&headers, stream);
 				headers_free(&headers);
@@ -158,14 +632,20 @@ void cleanup() {
 			}
 			CONTINUE_CLEANUP:
 
+			eventloop_forget(eventLoop, connection->readfd);
+
 			#ifdef SSL_SUPPORT
-			if (connection->sslConnection != NULL)
+			if (connection->sslConnection != NULL) {
 				ssl_closeConnection(connection->sslConnection);
+				// the pipes belong to the ssl connection
+				connection->readfd = -1;
+				connection->writefd = -1;
+			}
 			#endif
-		
+
 			if (connection->readfd >= 0)
 				close(connection->readfd);
-			if (connection->writefd >= 0)
+			if (connection->writefd >= 0 && connection->writefd != connection->readfd)
 				close(connection->writefd);
 
 			if (connection->metaData.path != NULL)
@@ -182,11 +662,20 @@ void cleanup() {
 			if (connection->peer.name != NULL)
 				free(connection->peer.name);
 
+			metrics_stateChange(connection->state, -1);
+
+			if (drained && !connection->forced)
+				__atomic_add_fetch(&drainedConnections, 1, __ATOMIC_RELAXED);
+
+			releaseGeneration(connection->generation);
+			releaseConnection(connection->peer.addr);
+
 			pthread_mutex_unlock(&(connection->lock));
 			pthread_mutex_destroy(&(connection->lock));
+			pthread_cond_destroy(&(connection->turn));
 
 			free(connection);
-		} else {	
+		} else {
 			pthread_mutex_unlock(&(connection->lock));
 		}
 
@@ -203,7 +692,7 @@ void setNonBlocking(int fd, bool nonBlocking) {
 		// ignore; maybe the socket is dead
 		return;
 	}
-	
+
 	if (nonBlocking) {
 		flags |= O_NONBLOCK;
 	} else {
@@ -216,31 +705,53 @@ void setNonBlocking(int fd, bool nonBlocking) {
 
 }
 
-void setSIGIO(int fd, bool enable) {
-	// set socket to asynchronous
-
-	int flags = fcntl(fd, F_GETFL);
-	if (flags < 0) {
-		warn("networking: couldn't get socket flags");
-		// ignore; maybe the socket is dead
+/*
+ * Updates metrics and writes the access log entry for the request.
+ * Has to be called once the response is complete but before the request data is freed.
+ */
+void requestCompleted(struct exchange* exchange) {
+	if (exchange->response.statusCode == 0) {
+		// no response was sent
 		return;
 	}
-	
-	if (enable) {
-		flags |= O_ASYNC;
-	} else {
-		flags &= ~O_ASYNC;
-	}
-	if (fcntl(fd, F_SETFL, flags) < 0) {
-		error("networking: couldn't set socket flags");
+
+	struct exchangeTiming* timing = &(exchange->timing);
+	struct timespec completed = getTime();
+
+	metrics_requestCompleted(exchange->response.statusCode, timespecSpanUs(timing->requestStart, completed), exchange->response.headerBytes + exchange->response.bodyBytes);
+
+	if (!isLogging(HTTP_ACCESS))
 		return;
-	}
 
-	// set signal owner
-	fcntl(fd, F_SETOWN, getpid());
+	struct accessLogEntry entry = {
+		.metaData = exchange->metaData,
+		.remoteAddr = exchange->connection->peer.addr,
+		.referer = headers_get(&(exchange->headers), "Referer"),
+		.userAgent = headers_get(&(exchange->headers), "User-Agent"),
+		.statusCode = exchange->response.statusCode,
+		.headerBytes = exchange->response.headerBytes,
+		.bodyBytes = exchange->response.bodyBytes,
+		.headerParseTime = timespecSpanUs(timing->requestStart, timing->headersEnd),
+		.timeToFirstByte = timespecSpanUs(timing->requestStart, timing->firstByte),
+		.handlerTime = timespecSpanUs(timing->handlerStart, timing->handlerEnd),
+		.totalTime = timespecSpanUs(timing->requestStart, completed),
+		.tls = exchange->bind->ssl,
+		.keepAliveReuse = exchange->number - 1,
+		.time = completed.tv_sec
+	};
+
+	accesslog_write(networkingConfig.accessLogFormat, &entry);
 }
 
 int dumpHeaderBuffer(char* buffer, size_t size, struct connection* connection) {
+	connection->headerBytes += size;
+	if (networkingConfig.maxHeaderSize > 0 && connection->headerBytes > networkingConfig.maxHeaderSize) {
+		warn("networking: headers larger than %ld bytes; aborting request", networkingConfig.maxHeaderSize);
+		metrics_count(METRIC_REJECTED + REJECTED_HEADER_SIZE);
+		connection->errorStatus = 431;
+		return -1;
+	}
+
 	if (connection->currentHeader == NULL) {
 		connection->currentHeaderLength = 0;
 		connection->currentHeader = malloc(size + 1);
@@ -265,637 +776,3159 @@ int dumpHeaderBuffer(char* buffer, size_t size, struct connection* connection) {
 	return 0;
 }
 
-static inline void stopThread(pthread_t self, pthread_t* thread, bool force) {
-	if (pthread_equal(self, *thread))
-		return;
-
-	debug("networking: freeing thread");
+// connection has to be locked beforehand
+static void closeConnection(struct connection* connection) {
+	setState(connection, CLOSED);
+	updateTiming(connection, true);
 
-	if (force) {
-		if (pthread_cancel(*thread) < 0)
-			error("networking: cancel thread: %s", strerror(errno));
-	}
-	if (pthread_join(*thread, NULL) < 0) 
-		error("networking: join thread: %s", strerror(errno));
+	// the cleanup closes readfd once no read is pending on it anymore; this already ends a pending one
+	shutdown(connection->readfd, SHUT_RDWR);
+	int tmp = connection->writefd;
+	connection->writefd = -1;
+	if (tmp != connection->readfd)
+		close(tmp);
 
-	*thread = PTHREAD_NULL;
+	#ifdef SSL_SUPPORT
+	if (connection->sslConnection != NULL)
+		connection->sslConnection->writefd = -1;
+	#endif
 }
 
-void safeEndConnection(struct connection* connection, bool force) {
+/*
+ * Cancels everything that is going on on this connection.
+ * Called by the request thread of an exchange that timed out.
+ */
+void abortConnection(struct connection* connection) {
 	pthread_t self = pthread_self();
 
-	debug("networking: safely shuting down the connection%s.", force ? " (forced)" : "");
+	struct exchange* exchanges[PIPELINE_MAX_DEPTH];
+	int number = 0;
 
-	stopThread(self, &(connection->threads.request), true);
-	stopThread(self, &(connection->threads.response), force);
+	pthread_mutex_lock(&(connection->lock));
+	if (connection->aborting) {
+		// another request thread is already on it
+		pthread_mutex_unlock(&(connection->lock));
+		return;
+	}
+	connection->aborting = true;
+	setState(connection, CLOSED);
+	for (struct exchange* exchange = connection->first; exchange != NULL && number < PIPELINE_MAX_DEPTH; exchange = exchange->next) {
+		exchanges[number++] = exchange;
+	}
+	pthread_mutex_unlock(&(connection->lock));
 
-	// close socket
-	int tmp = connection->readfd;
-	connection->readfd = -1;
-	close(tmp);
-	tmp = connection->writefd;
-	connection->writefd = -1;
-	close(tmp);
+	debug("networking: aborting connection with %d exchanges", number);
+
+	// wake up everyone who is blocked on the socket
+	shutdown(connection->readfd, SHUT_RDWR);
+	shutdown(connection->writefd, SHUT_RDWR);
+
+	for (int i = 0; i < number; i++) {
+		stopThread(self, &(exchanges[i]->threads.request), true);
+		stopThread(self, &(exchanges[i]->threads.response), true);
+		stopThread(self, &(exchanges[i]->threads.encoder), true);
+		stopThread(self, &(exchanges[i]->threads.body), true);
+	}
 
 	pthread_mutex_lock(&(connection->lock));
-	//connection->state = CLOSED;
-	connection->inUse--;
+	for (int i = 0; i < number; i++) {
+		if (!exchanges[i]->completed)
+			leaveQueue(exchanges[i]);
+	}
+	updateTiming(connection, true);
 	pthread_mutex_unlock(&(connection->lock));
 }
 
-// connection has to be locked beforehand
-void resetPersistentConnection(struct connection* connection) {
-		debug("networking: resetting persistent connection to initial state");
-
-		pthread_t self = pthread_self();
-		
-		// kill request thread so that the connection doesn't get killed
-		stopThread(self, &(connection->threads.request), true);
-				
-		// if we are the encoding thread, 
-		// wait for response thread to terminate (should have happend already)
-		//
-		// if caller is response thread stopThread will do nothing
-		stopThread(self, &(connection->threads.response), false);
-		
-		// wait for encoder
-		if (connection->threads.encoder != PTHREAD_NULL) {
-			// if caller is encoder stopThread will to nothing
-			stopThread(self, &(connection->threads.encoder), false);
-		}
-		
-		// free request specific data
-		if (connection->metaData.path != NULL) {
-			free(connection->metaData.path);
-			connection->metaData.path = NULL;
-		}
-		if (connection->metaData.queryString != NULL) {
-			free(connection->metaData.queryString);
-			connection->metaData.queryString = NULL;
-		}
-		if (connection->metaData.uri != NULL) {
-			free(connection->metaData.uri);
-			connection->metaData.uri = NULL;
-		}
-		if (connection->currentHeader != NULL) {
-			free(connection->currentHeader);
-			connection->currentHeader = NULL;
-		}
+/*
+ * Has to be called once the response is sent completely.
+ * Hands the connection over to the next pipelined exchange.
+ */
+void exchangeCompleted(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+
+	// a handler that didn't respond might not be first yet
+	waitForTurn(exchange);
+
+	requestCompleted(exchange);
+
+	pthread_mutex_lock(&(connection->lock));
+	if (exchange->timedOut || exchange->completed) {
+		// abortConnection takes care of this
+		pthread_mutex_unlock(&(connection->lock));
+		return;
+	}
+
+	// no need for the timeout anymore
+	if (exchange->threads.request != PTHREAD_NULL)
+		pthread_cancel(exchange->threads.request);
+
+	leaveQueue(exchange);
 
-		headers_free(&(connection->headers));
-		
-		// set state to OPENED so a request can be read
-		connection->state = OPENED;
+	if (!exchange->isPersistent || !exchange->body.complete) {
+		// either the client wants us to close the connection
+		// or we don't know where the next request starts
+		debug("networking: closing connection");
+		closeConnection(connection);
+	} else if (connection->state == KEEP_ALIVE && connection->first == NULL) {
+		// set state to OPENED so the idle timeout applies
+		setState(connection, OPENED);
 		updateTiming(connection, true);
-		connection->inUse--;
-		
-		// possibly the client sent pipelined requests
-		// trigger sigio on data thread just in case
-		kill(getpid(), SIGIO);
+	}
+
+	// the next pipelined request might already be waiting in the buffer
+	// the reactor reaps the finished exchange as well
+	schedule(connection);
+
+	// a request that was rejected behind this one has no thread to answer it
+	struct exchange* next = connection->first;
+	bool answerNext = next != NULL && next->rejected != 0;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (answerNext)
+		answerRejected(next);
 }
 
-struct chunkedEncodingData {
-	struct connection* connection;
-	int readfd;
-};
+static void queueChunk(struct output* output, struct outputChunk* chunk) {
+	chunk->next = NULL;
+	if (output->last != NULL)
+		output->last->next = chunk;
+	else
+		output->first = chunk;
+	output->last = chunk;
+
+	size_t length = chunk->end - chunk->start;
+	output->queued += length;
+	bufferedBytes += length;
+	metrics_add(METRIC_RESPONSES_BUFFERED, length);
+}
 
 /*
- * This thread handles chunked transfer encoding for persistent connections
+ * Removes sent bytes from the front of the queue.
  */
-void* chunkedTransferEncodingThread(void* _data) {
-	#define ENCODING_MAX_CHUNK_SIZE (512)
+static void consumeChunks(struct output* output, size_t length) {
+	output->queued -= length;
+	bufferedBytes -= length;
+	metrics_add(METRIC_RESPONSES_BUFFERED, -((long) length));
+
+	while (length > 0) {
+		struct outputChunk* chunk = output->first;
+		size_t chunkLength = chunk->end - chunk->start;
+		if (length < chunkLength) {
+			chunk->start += length;
+			break;
+		}
 
-	struct chunkedEncodingData* data = (struct chunkedEncodingData*) _data;
-	
-	int dupFd = dup(data->connection->writefd);
-	if (dupFd < 0) {
-		error("networking: couldn't dup for chunked encoding");
-		
-		// closing pipe should cause the handler to terminate
-		close(data->readfd);
-		return NULL;
+		length -= chunkLength;
+		output->first = chunk->next;
+		if (output->first == NULL)
+			output->last = NULL;
+		free(chunk);
+	}
+}
+
+static void closeOutputPipe(struct output* output) {
+	if (output->readfd < 0)
+		return;
+
+	eventloop_forget(eventLoop, output->readfd);
+	close(output->readfd);
+	output->readfd = -1;
+}
+
+/*
+ * Sends what is queued without blocking; polls the socket once it is full.
+ */
+static void drainOutput(struct connection* connection) {
+	struct output* output = &(connection->output);
+
+	while (output->first != NULL) {
+		struct iovec iov[IOV_MAX_COUNT];
+		int count = 0;
+		for (struct outputChunk* chunk = output->first; chunk != NULL && count < IOV_MAX_COUNT; chunk = chunk->next) {
+			iov[count++] = (struct iovec) {
+				.iov_base = chunk->data + chunk->start,
+				.iov_len = chunk->end - chunk->start
+			};
+		}
+
+		struct msghdr message = {
+			.msg_iov = iov,
+			.msg_iovlen = count
+		};
+		ssize_t tmp = sendmsg(output->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (eventloop_poll(eventLoop, output->fd, POLLOUT, connection) < 0) {
+					error("networking: couldn't wait for socket: %s", strerror(errno));
+					output->failed = true;
+					return;
+				}
+				output->writing = true;
+
+				pthread_mutex_lock(&(connection->lock));
+				connection->inUse++;
+				pthread_mutex_unlock(&(connection->lock));
+				return;
+			}
+
+			debug("networking: couldn't send buffered response: %s", strerror(errno));
+			output->failed = true;
+			return;
+		}
+
+		if (!timespecIsSet(output->exchange->timing.firstByte))
+			output->exchange->timing.firstByte = getTime();
+
+		consumeChunks(output, tmp);
+	}
+}
+
+/*
+ * Reads what the handler wrote as long as there is room; polls the pipe once it is empty.
+ */
+static void fillOutput(struct connection* connection) {
+	struct output* output = &(connection->output);
+
+	while (output->queued < output->limit) {
+		if (networkingConfig.responseBufferTotal > 0 && bufferedBytes >= networkingConfig.responseBufferTotal) {
+			// continues once other connections sent some of theirs
+			if (!output->stalled) {
+				output->stalled = true;
+				output->nextStalled = stalledOutputs;
+				stalledOutputs = connection;
+
+				pthread_mutex_lock(&(connection->lock));
+				connection->inUse++;
+				pthread_mutex_unlock(&(connection->lock));
+			}
+			return;
+		}
+
+		// room for the chunk size in front and the CRLF behind
+		struct outputChunk* chunk = malloc(sizeof(struct outputChunk) + OUTPUT_CHUNK_HEADER + OUTPUT_CHUNK_SIZE + 2);
+		if (chunk == NULL) {
+			error("networking: couldn't allocate output buffer: %s", strerror(errno));
+			output->failed = true;
+			return;
+		}
+
+		ssize_t tmp = read(output->readfd, chunk->data + OUTPUT_CHUNK_HEADER, OUTPUT_CHUNK_SIZE);
+		if (tmp < 0) {
+			free(chunk);
+
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (eventloop_poll(eventLoop, output->readfd, POLLIN, connection) < 0) {
+					error("networking: couldn't wait for handler: %s", strerror(errno));
+					output->failed = true;
+					return;
+				}
+				output->reading = true;
+
+				pthread_mutex_lock(&(connection->lock));
+				connection->inUse++;
+				pthread_mutex_unlock(&(connection->lock));
+				return;
+			}
+
+			error("networking: couldn't read response of handler: %s", strerror(errno));
+			output->failed = true;
+			return;
+		}
+
+		if (tmp == 0) {
+			free(chunk);
+
+			// the handler is done
+			output->eof = true;
+			closeOutputPipe(output);
+
+			if (output->chunked) {
+				chunk = malloc(sizeof(struct outputChunk) + 5);
+				if (chunk == NULL) {
+					error("networking: couldn't allocate output buffer: %s", strerror(errno));
+					output->failed = true;
+					return;
+				}
+				memcpy(chunk->data, "0\r\n\r\n", 5);
+				chunk->start = 0;
+				chunk->end = 5;
+				queueChunk(output, chunk);
+			}
+			return;
+		}
+
+		output->total += tmp;
+
+		chunk->start = OUTPUT_CHUNK_HEADER;
+		chunk->end = OUTPUT_CHUNK_HEADER + tmp;
+		if (output->chunked) {
+			char size[OUTPUT_CHUNK_HEADER];
+			int sizeLength = snprintf(size, sizeof(size), "%zx\r\n", (size_t) tmp);
+			chunk->start -= sizeLength;
+			memcpy(chunk->data + chunk->start, size, sizeLength);
+			memcpy(chunk->data + chunk->end, "\r\n", 2);
+			chunk->end += 2;
+		}
+
+		if (tmp < OUTPUT_CHUNK_SIZE) {
+			// small responses don't need the whole chunk
+			struct outputChunk* smaller = realloc(chunk, sizeof(struct outputChunk) + chunk->end);
+			if (smaller != NULL)
+				chunk = smaller;
+		}
+
+		queueChunk(output, chunk);
+	}
+}
+
+/*
+ * Completes the exchange once the handler returned as well.
+ */
+static void finishOutput(struct connection* connection) {
+	struct output* output = &(connection->output);
+	struct exchange* exchange = output->exchange;
+
+	bool failed = output->failed;
+	if (output->queued > 0)
+		consumeChunks(output, output->queued);
+	closeOutputPipe(output);
+	exchange->response.bodyBytes = output->total;
+
+	*output = (struct output) {
+		.exchange = NULL,
+		.readfd = -1,
+		.fd = -1
+	};
+
+	if (exchange->inReactor) {
+		const struct reactorHandler* handler = exchange->threads.handler.reactor;
+		if (!timespecIsSet(exchange->timing.handlerEnd))
+			exchange->timing.handlerEnd = getTime();
+		if (handler->onComplete != NULL)
+			handler->onComplete(&(exchange->request), !failed);
 	}
-	FILE* writeFile = fdopen(dupFd, "w");
-	if (writeFile == NULL) {
-		error("networking: couldn't open FILE stream for chunked encoding");
-		
-		// closing pipe should cause the handler to terminate
+
+	pthread_mutex_lock(&(connection->lock));
+	if (failed) {
+		// the rest of the response is missing
+		exchange->isPersistent = false;
+	}
+	if (connection->bodyExchange == exchange) {
+		// the handler is done before the body; the connection is closed instead of reading the rest
+		connection->bodyExchange = NULL;
+		connection->readingBody = false;
+	}
+	exchange->outputDone = true;
+	bool complete = exchange->handlerDone;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (complete)
+		exchangeCompleted(exchange);
+}
+
+static void reactorWritable(struct connection* connection);
+
+/*
+ * Moves the buffered response along. Called by the reactor whenever something changed.
+ */
+static void pumpOutput(struct connection* connection) {
+	struct output* output = &(connection->output);
+
+	while (!output->failed) {
+		if (!output->writing)
+			drainOutput(connection);
+		if (output->failed || output->reading || output->stalled || output->eof)
+			break;
+
+		size_t queued = output->queued;
+		if (output->exchange->inReactor) {
+			reactorWritable(connection);
+		} else {
+			fillOutput(connection);
+		}
+		if (output->queued == queued)
+			break;
+	}
+
+	if (output->failed && output->reading) {
+		// the handler gets an error on its next write
+		eventloop_cancel(eventLoop, output->readfd, connection);
+	}
+	if (output->failed && output->polling) {
+		// the coroutine handler gets an error once the poll is done
+		eventloop_cancel(eventLoop, output->exchange->coroutine.fd, connection);
+	}
+
+	if (output->reading || output->writing || output->stalled || output->polling)
+		return;
+	if (!output->failed && !(output->eof && output->first == NULL))
+		return;
+
+	finishOutput(connection);
+}
+
+/*
+ * Takes over a response that bufferResponse handed to the reactor.
+ */
+static void startOutput(struct connection* connection) {
+	struct output* output = &(connection->output);
+
+	output->started = true;
+
+	// the header is not counted yet
+	struct outputChunk* header = output->first;
+	output->first = NULL;
+	output->last = NULL;
+	queueChunk(output, header);
+
+	pumpOutput(connection);
+}
+
+/*
+ * Gives up on the buffered response of a connection that is closed.
+ */
+static void failOutput(struct connection* connection) {
+	struct output* output = &(connection->output);
+	if (output->exchange == NULL || !output->started)
+		return;
+
+	output->failed = true;
+	if (output->writing)
+		eventloop_cancel(eventLoop, output->fd, connection);
+	pumpOutput(connection);
+}
+
+/*
+ * Continues buffered responses that waited for memory.
+ */
+static void resumeOutputs() {
+	if (networkingConfig.responseBufferTotal > 0 && bufferedBytes >= networkingConfig.responseBufferTotal)
+		return;
+
+	struct connection* connection = stalledOutputs;
+	stalledOutputs = NULL;
+	while (connection != NULL) {
+		struct connection* next = connection->output.nextStalled;
+		connection->output.stalled = false;
+		connection->output.nextStalled = NULL;
+
+		pumpOutput(connection);
+
+		pthread_mutex_lock(&(connection->lock));
+		connection->inUse--;
+		pthread_mutex_unlock(&(connection->lock));
+
+		connection = next;
+	}
+}
+
+/*
+ * Hands the response of the first exchange over to the reactor; returns the fd the handler writes the body to.
+ */
+static int bufferResponse(struct exchange* exchange, const char* header, size_t headerLength, bool chunked) {
+	struct connection* connection = exchange->connection;
+
+	struct outputChunk* chunk = malloc(sizeof(struct outputChunk) + headerLength);
+	if (chunk == NULL) {
+		error("networking: couldn't allocate output buffer: %s", strerror(errno));
+		return -1;
+	}
+	memcpy(chunk->data, header, headerLength);
+	chunk->next = NULL;
+	chunk->start = 0;
+	chunk->end = headerLength;
+
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		error("networking: couldn't create pipe for buffered response: %s", strerror(errno));
+		free(chunk);
+		return -1;
+	}
+	setNonBlocking(pipefd[0], true);
+
+	pthread_mutex_lock(&(connection->lock));
+	connection->output = (struct output) {
+		.exchange = exchange,
+		.readfd = pipefd[0],
+		.fd = connection->readfd,
+		.chunked = chunked,
+		.limit = networkingConfig.responseBuffer,
+		.first = chunk,
+		.last = chunk
+	};
+	// the reactor starts it
+	schedule(connection);
+	pthread_mutex_unlock(&(connection->lock));
+
+	return pipefd[1];
+}
+
+struct encoderData {
+	struct exchange* exchange;
+	int readfd;
+	bool chunked;
+	bool buffered;
+	char* header;
+	size_t headerLength;
+};
+
+static void freeEncoderData(void* _data) {
+	struct encoderData* data = (struct encoderData*) _data;
+
+	if (data->readfd >= 0)
 		close(data->readfd);
-		return NULL;
+	free(data->header);
+	free(data);
+}
+
+/*
+ * This thread writes responses that can't go to the socket directly:
+ * chunked transfer encoding for persistent connections and responses
+ * of pipelined requests that have to wait for earlier ones.
+ */
+void* responseEncoderThread(void* _data) {
+	#define ENCODING_MAX_CHUNK_SIZE (512)
+	#define ENCODING_MAX_CHUNK_HEADER (16)
+
+	struct encoderData* data = (struct encoderData*) _data;
+	struct exchange* exchange = data->exchange;
+	struct connection* connection = exchange->connection;
+
+	pthread_cleanup_push(&freeEncoderData, data);
+
+	if (data->buffered) {
+		// the pipe buffers the response in the meantime
+		waitForTurn(exchange);
 	}
-	
-	debug("networking: chunked transfer encoding: using max chunk size of %lld", ENCODING_MAX_CHUNK_SIZE);
-	
-	char c[ENCODING_MAX_CHUNK_SIZE];
 
-	size_t total = 0;
-	size_t chunks = 0;
-	int tmp;
-	while((tmp = read(data->readfd, c, ENCODING_MAX_CHUNK_SIZE)) > 0) {
-		fprintf(writeFile, "%x\r\n", tmp);
-		fwrite(c, sizeof(char), tmp, writeFile);
-		fputs("\r\n", writeFile);
-		total += tmp;
-		chunks++;
-	}
-	
-	debug("networking: chunked transfer encoding: %lld bytes sent in %lld chunks", total, chunks);
-	
-	if (0 == tmp) {
-		// send last chunk flag
-		fputs("0\r\n\r\n", writeFile);
+	int writefd = connection->writefd;
+
+	if (writeAll(writefd, data->header, data->headerLength, networkingConfig.connectionTimeout) < 0) {
+		error("networking: couldn't send header: %s", strerror(errno));
 	} else {
-		error("networking: error reading from chunked input: %s", strerror(errno));
-	}
-	
-	close(data->readfd);
-	fclose(writeFile); // close dup, fd will stay open
-	
-	pthread_mutex_lock(&(data->connection->resetOkay));
-	// once we have the lock we can destroy it
-	pthread_mutex_unlock(&(data->connection->resetOkay));
-	pthread_mutex_destroy(&(data->connection->resetOkay));
-	
-	pthread_mutex_lock(&(data->connection->lock));
-	resetPersistentConnection(data->connection);
-	pthread_mutex_unlock(&(data->connection->lock));
-	
-	free(data);
-	
+		exchange->timing.firstByte = getTime();
+
+		size_t total = 0;
+
+		if (data->chunked) {
+			debug("networking: chunked transfer encoding: using max chunk size of %d", ENCODING_MAX_CHUNK_SIZE);
+
+			char payload[ENCODING_MAX_CHUNK_SIZE];
+			char size[ENCODING_MAX_CHUNK_HEADER];
+
+			size_t chunks = 0;
+			int tmp;
+			while((tmp = read(data->readfd, payload, ENCODING_MAX_CHUNK_SIZE)) > 0) {
+				int sizeLength = snprintf(size, ENCODING_MAX_CHUNK_HEADER, "%x\r\n", tmp);
+
+				// chunk header, data and CRLF go out in one go
+				struct iovec chunk[3] = {
+					{ .iov_base = size, .iov_len = sizeLength },
+					{ .iov_base = payload, .iov_len = tmp },
+					{ .iov_base = "\r\n", .iov_len = 2 }
+				};
+				if (eventloop_writev(writefd, chunk, 3, networkingConfig.connectionTimeout) < 0)
+					break;
+
+				total += tmp;
+				chunks++;
+			}
+
+			debug("networking: chunked transfer encoding: %zu bytes sent in %zu chunks", total, chunks);
+
+			if (0 == tmp) {
+				// send last chunk flag
+				writeAll(writefd, "0\r\n\r\n", 5, networkingConfig.connectionTimeout);
+			} else {
+				error("networking: error during chunked transfer encoding: %s", strerror(errno));
+			}
+		} else {
+			total = fileCopy(data->readfd, writefd);
+		}
+
+		exchange->response.bodyBytes = total;
+	}
+
+	pthread_cleanup_pop(1);
+
+	// wait for the handler to return
+	pthread_mutex_lock(&(connection->lock));
+	pthread_cleanup_push(&unlockMutex, &(connection->lock));
+	while (!exchange->handlerDone)
+		pthread_cond_wait(&(connection->turn), &(connection->lock));
+	pthread_cleanup_pop(1);
+
+	exchangeCompleted(exchange);
+
 	return NULL;
 }
 
-void minimalErrorResponse(struct headers* headers, struct connection* connection) {
+/*
+ * Last resort if the response header can't be sent.
+ */
+void minimalErrorResponse(struct headers* headers, struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
 
 	// fix headers
 	headers_remove(headers, "Content-Encoding");
+	headers_remove(headers, "Transfer-Encoding");
 	headers_mod(headers, "Connection", "close");
-	headers_mod(headers, "Content-Length", 0);
-	
-	FILE* stream = fdopen(connection->writefd, "w");
+	headers_mod(headers, "Content-Length", "0");
+
+	waitForTurn(exchange);
+
+	char* response = NULL;
+	size_t length = 0;
+	FILE* stream = open_memstream(&response, &length);
 	if (stream == NULL) {
 		// all is lost
 		error("networking: this is fine... %s", strerror(errno));
-		
-		pthread_mutex_lock(&(connection->lock));
-		
-		// invalidate socket fd and close
-		int tmp = connection->writefd;
-		connection->writefd = -1;
-		close(tmp);
 	} else {
-		fprintf(stream, "%s %d %s\r\n", protocolString(connection->metaData), 500, getStatusStrings(500).statusString);
+		fprintf(stream, "%s %d %s\r\n", protocolString(exchange->metaData), 500, getStatusStrings(500).statusString);
 		headers_dump(headers, stream);
 		fprintf(stream, "\r\n");
-		
-		pthread_mutex_lock(&(connection->lock));
-		
-		// invalidate socket fd before closing
-		connection->writefd = -1;
 		fclose(stream);
-	}
 
-	if (connection->isPersistent) {
-		// this conenction is persistent
-		// => set this connection to non-persistent and close it.
-		connection->state = PROCESSING;
-		connection->isPersistent = false;
+		writeAll(connection->writefd, response, length, networkingConfig.connectionTimeout);
+		free(response);
 	}
-	
+
+	// the connection is closed once the exchange is completed
+	pthread_mutex_lock(&(connection->lock));
+	exchange->isPersistent = false;
 	pthread_mutex_unlock(&(connection->lock));
 }
 
-int sendHeader(int statusCode, struct headers* headers, struct request* request) {
-	debug("networking: sending headers");
-	
-	struct connection* connection = (struct connection*) request->_private;
+/*
+ * Adds the default and connection headers and serializes the header of the response.
+ * Returns NULL on error; chunked is set if the body needs chunked transfer encoding.
+ */
+static char* buildHeader(int statusCode, struct headers* headers, struct exchange* exchange, size_t* headerLength, bool* chunked) {
+	struct connection* connection = exchange->connection;
 
 	struct headers defaultHeaders = networkingConfig.defaultHeaders;
 
 	for(int i = 0; i < defaultHeaders.number; i++) {
 		headers_mod(headers, defaultHeaders.headers[i].key, defaultHeaders.headers[i].value);
-	} 
-	
+	}
+
 	bool chunkedTransferEncoding = false;
-	
-	if (connection->isPersistent) {
+
+	if (exchange->isPersistent && __atomic_load_n(&draining, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&(connection->lock));
+		// later pipelined requests are answered as well; the last one closes the connection
+		if (connection->last == exchange) {
+			exchange->isPersistent = false;
+			// no further requests are read
+			setState(connection, PROCESSING);
+		}
+		pthread_mutex_unlock(&(connection->lock));
+	}
+
+	if (exchange->isPersistent) {
 		debug("networking: this connection is persistent");
-		
+
 		headers_mod(headers, "Connection", "keep-alive");
-		
+
 		if (headers_get(headers, "Content-Length") == NULL) {
 			debug("networking: this response is chunked");
-		
+
 			headers_mod(headers, "Transfer-Encoding", "chunked");
 			chunkedTransferEncoding = true;
 		}
 	} else {
 		headers_mod(headers, "Connection", "close");
 	}
-	
-	// fd will be the fd to be returned to the caller
-	int fd = connection->writefd;
-	
-	// tmp is for sending headers
-	int tmp = dup(fd);
-	if (tmp < 0) {
-		error("networking: sendHeader: dup: %s", strerror(errno));
-		minimalErrorResponse(headers, connection);
+
+	char* header = NULL;
+	*headerLength = 0;
+	FILE* stream = open_memstream(&header, headerLength);
+	if (stream == NULL) {
+		error("networking: sendHeader: open_memstream: %s", strerror(errno));
+		return NULL;
+	}
+
+	struct statusStrings strings = getStatusStrings(statusCode);
+
+	fprintf(stream, "%s %d %s\r\n", protocolString(exchange->metaData), statusCode, strings.statusString);
+	headers_dump(headers, stream);
+	fprintf(stream, "\r\n");
+	fclose(stream);
+
+	*chunked = chunkedTransferEncoding;
+	return header;
+}
+
+/*
+ * Sends the header; returns the fd the handler writes the body to.
+ * If the handler writes to the socket directly, body (if any) is sent together with the header and bodySent is set.
+ */
+static int startResponse(int statusCode, struct headers* headers, struct request* request, const struct iovec* body, int count, bool* bodySent) {
+	debug("networking: sending headers");
+
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct connection* connection = exchange->connection;
+
+	bool chunkedTransferEncoding;
+	size_t headerLength;
+	char* header = buildHeader(statusCode, headers, exchange, &headerLength, &chunkedTransferEncoding);
+	if (header == NULL) {
+		minimalErrorResponse(headers, exchange);
 		return -1;
 	}
-	
-	if (chunkedTransferEncoding) {
+
+	pthread_mutex_lock(&(connection->lock));
+	// earlier pipelined requests are not done yet
+	bool buffered = connection->first != exchange;
+	pthread_mutex_unlock(&(connection->lock));
+
+	// the reactor sends the response; the handler only waits if it doesn't fit in the buffer
+	bool reactor = networkingConfig.responseBuffer > 0 && !buffered;
+	#ifdef SSL_SUPPORT
+	if (connection->sslConnection != NULL)
+		reactor = false;
+	#endif
+
+	// fd will be the fd to be returned to the caller
+	int fd;
+
+	if (reactor) {
+		fd = bufferResponse(exchange, header, headerLength, chunkedTransferEncoding);
+		free(header);
+		if (fd < 0) {
+			minimalErrorResponse(headers, exchange);
+			return -1;
+		}
+
+		exchange->isRelayed = true;
+	} else if (chunkedTransferEncoding || buffered) {
 		int pipefd[2];
-		
-		if (pipe(pipefd) < 0) {
-			close(tmp);
+
+		if (pipe2(pipefd, O_CLOEXEC) < 0) {
+			free(header);
 			error("networking: couldn't create pipe for encoding: %s", strerror(errno));
-			minimalErrorResponse(headers, connection);
+			minimalErrorResponse(headers, exchange);
 			return -1;
 		}
-	
-		struct chunkedEncodingData* data = malloc(sizeof(struct chunkedEncodingData));
+
+		if (buffered) {
+			// let fast handlers finish while they wait; failing is fine
+			fcntl(pipefd[1], F_SETPIPE_SZ, PIPELINE_BUFFER_SIZE);
+		}
+
+		struct encoderData* data = malloc(sizeof(struct encoderData));
 		if (data == NULL) {
-			close(tmp);
+			free(header);
 			close(pipefd[0]);
 			close(pipefd[1]);
 			error("networking: encoding data: malloc: %s", strerror(errno));
-			minimalErrorResponse(headers, connection);
+			minimalErrorResponse(headers, exchange);
 			return -1;
 		}
-	
-		data->connection = connection;
-		data->readfd = pipefd[0];
+
+		*data = (struct encoderData) {
+			.exchange = exchange,
+			.readfd = pipefd[0],
+			.chunked = chunkedTransferEncoding,
+			.buffered = buffered,
+			.header = header,
+			.headerLength = headerLength
+		};
 		fd = pipefd[1];
-	
+
 		// start encoding thread
-		if (pthread_create(&(connection->threads.encoder), NULL, &chunkedTransferEncodingThread, data) < 0) {
-			close(tmp);
-			close(pipefd[0]);
+		if (pthread_create(&(exchange->threads.encoder), NULL, &responseEncoderThread, data) != 0) {
+			exchange->threads.encoder = PTHREAD_NULL;
 			close(pipefd[1]);
-			free(data);
-		
+			freeEncoderData(data);
+
 			error("networking: Couldn't start encoding thread.");
-			minimalErrorResponse(headers, connection);
+			minimalErrorResponse(headers, exchange);
 			return -1;
 		}
+
+		exchange->isRelayed = true;
 	} else {
-		fd = dup(fd);
+		struct iovec iov[IOV_MAX_COUNT] = {
+			{
+				.iov_base = header,
+				.iov_len = headerLength
+			}
+		};
+		int number = 1;
+		if (body != NULL && count < IOV_MAX_COUNT) {
+			memcpy(iov + 1, body, count * sizeof(struct iovec));
+			number += count;
+			*bodySent = true;
+		}
+
+		ssize_t tmp = writevAll(connection->writefd, iov, number, networkingConfig.connectionTimeout);
+		free(header);
+		if (tmp < 0) {
+			error("networking: couldn't send header: %s", strerror(errno));
+			return -1;
+		}
+
+		fd = dup(connection->writefd);
 		if (fd < 0) {
-			close(tmp);
 			error("networking: sendHeader: dup: %s", strerror(errno));
-			minimalErrorResponse(headers, connection);
 			return -1;
 		}
-	}
-	
-	connection->isChunked = chunkedTransferEncoding;
-	
-	FILE* stream = fdopen(tmp, "w");	
-	if (stream == NULL) {
-		error("networking: sendHeader: fdopen: %s", strerror(errno));
-		minimalErrorResponse(headers, connection);
-		return -1;
+
+		exchange->timing.firstByte = getTime();
 	}
 
-	logging(HTTP_ACCESS, "%s %s %d %s", methodString(connection->metaData), connection->metaData.uri, statusCode, headers_get(request->headers, "User-Agent"));
+	exchange->isChunked = chunkedTransferEncoding;
 
-	struct statusStrings strings = getStatusStrings(statusCode);
+	exchange->response.statusCode = statusCode;
+	exchange->response.headerBytes = headerLength;
+	if (!exchange->isRelayed) {
+		// the handler writes directly to the socket; trust the announced length
+		const char* contentLength = headers_get(headers, "Content-Length");
+		if (contentLength != NULL)
+			exchange->response.bodyBytes = strtoul(contentLength, NULL, 10);
+	}
 
-	fprintf(stream, "%s %d %s\r\n", protocolString(connection->metaData), statusCode, strings.statusString);
+	return fd;
+}
 
-	headers_dump(headers, stream);
+int sendHeader(int statusCode, struct headers* headers, struct request* request) {
+	return startResponse(statusCode, headers, request, NULL, 0, NULL);
+}
+
+/*
+ * Sends a response that is complete in memory; it gets a Content-Length and leaves in one writev if possible.
+ */
+int sendResponse(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request) {
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += body[i].iov_len;
+	}
+
+	char contentLength[24];
+	snprintf(contentLength, sizeof(contentLength), "%zu", length);
+	headers_mod(headers, "Content-Length", contentLength);
+
+	bool bodySent = false;
+	int fd = startResponse(statusCode, headers, request, body, count, &bodySent);
+	if (fd < 0)
+		return -1;
+
+	int result = 0;
+	if (!bodySent && writevAll(fd, body, count, networkingConfig.connectionTimeout) < 0)
+		result = -1;
+	close(fd);
+
+	return result;
+}
+
+// queues header and body in one chunk; *chunked is set if the body is chunk encoded
+static int queueResponse(struct exchange* exchange, int statusCode, struct headers* headers, const struct iovec* body, int count, bool* chunked) {
+	struct output* output = &(exchange->connection->output);
+
+	if (exchange->response.statusCode != 0) {
+		error("networking: reactor handler responded twice");
+		return -1;
+	}
+	if (output->failed)
+		return -1;
+
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += body[i].iov_len;
+	}
+
+	size_t headerLength;
+	char* header = buildHeader(statusCode, headers, exchange, &headerLength, chunked);
+	if (header == NULL)
+		return -1;
+
+	struct outputChunk* chunk = malloc(sizeof(struct outputChunk) + headerLength + length);
+	if (chunk == NULL) {
+		error("networking: couldn't allocate output buffer: %s", strerror(errno));
+		free(header);
+		return -1;
+	}
+	memcpy(chunk->data, header, headerLength);
+	free(header);
+
+	chunk->start = 0;
+	chunk->end = headerLength;
+	for (int i = 0; i < count; i++) {
+		memcpy(chunk->data + chunk->end, body[i].iov_base, body[i].iov_len);
+		chunk->end += body[i].iov_len;
+	}
+	queueChunk(output, chunk);
+	output->total += length;
+	output->refilled = true;
+
+	exchange->response.statusCode = statusCode;
+	exchange->response.headerBytes = headerLength;
+
+	return 0;
+}
+
+/*
+ * sendResponse of reactor handlers; header and body are queued in one chunk.
+ */
+static int reactorSendResponse(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+
+	if (headers_get(headers, "Content-Length") == NULL) {
+		size_t length = 0;
+		for (int i = 0; i < count; i++) {
+			length += body[i].iov_len;
+		}
+
+		char contentLength[24];
+		snprintf(contentLength, sizeof(contentLength), "%zu", length);
+		headers_mod(headers, "Content-Length", contentLength);
+	}
+
+	bool chunked;
+	return queueResponse(exchange, statusCode, headers, body, count, &chunked);
+}
+
+static int reactorSendBody(const struct iovec* body, int count, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct output* output = &(exchange->connection->output);
+
+	if (exchange->response.statusCode == 0) {
+		error("networking: reactor handler sent a body without header");
+		return -1;
+	}
+	if (output->failed)
+		return -1;
+
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += body[i].iov_len;
+	}
+	if (length == 0)
+		return 0;
+
+	struct outputChunk* chunk = malloc(sizeof(struct outputChunk) + length);
+	if (chunk == NULL) {
+		error("networking: couldn't allocate output buffer: %s", strerror(errno));
+		return -1;
+	}
+	chunk->start = 0;
+	chunk->end = 0;
+	for (int i = 0; i < count; i++) {
+		memcpy(chunk->data + chunk->end, body[i].iov_base, body[i].iov_len);
+		chunk->end += body[i].iov_len;
+	}
+	queueChunk(output, chunk);
+	output->total += length;
+	output->refilled = true;
+
+	return 0;
+}
+
+static const struct reactorResponse reactorResponse = {
+	.sendResponse = reactorSendResponse,
+	.sendBody = reactorSendBody
+};
+
+// takes what a callback of the reactor handler returned
+static void applyResult(struct exchange* exchange, enum reactorResult result) {
+	struct output* output = &(exchange->connection->output);
+
+	switch(result) {
+		case REACTOR_DONE:
+			output->eof = true;
+			exchange->timing.handlerEnd = getTime();
+			break;
+		case REACTOR_MORE:
+			break;
+		default:
+			warn("networking: reactor handler couldn't complete the response");
+			output->failed = true;
+			break;
+	}
+}
+
+/*
+ * Asks the reactor handler for more once everything queued is sent. While the body arrives
+ * only if the handler queued something in the meantime; it waits for the body otherwise.
+ */
+static void reactorWritable(struct connection* connection) {
+	struct output* output = &(connection->output);
+	struct exchange* exchange = output->exchange;
+
+	if (output->first != NULL || output->polling)
+		return;
+	if (connection->bodyExchange == exchange && !output->refilled)
+		return;
+
+	const struct reactorHandler* handler = exchange->threads.handler.reactor;
+	enum reactorResult result = REACTOR_ERROR;
+	output->refilled = false;
+	if (handler->onWritable != NULL)
+		result = handler->onWritable(&(exchange->request), reactorResponse);
+
+	if (result == REACTOR_MORE && output->first == NULL && !output->polling && connection->bodyExchange != exchange) {
+		// it would be called again right away
+		error("networking: reactor handler wants to send more but didn't");
+		result = REACTOR_ERROR;
+	}
+	applyResult(exchange, result);
+}
+
+/*
+ * Hands what arrived of the request body to the reactor handler.
+ * Returns 1 once the body is complete, 0 if more has to arrive and -1 if the client is gone.
+ */
+static int feedBody(struct connection* connection) {
+	struct exchange* exchange = connection->bodyExchange;
+	struct body* body = &(exchange->body);
+	struct output* output = &(connection->output);
+	const struct reactorHandler* handler = exchange->threads.handler.reactor;
+
+	while (body->received < body->length) {
+		if (exchange->coroutine.paused) {
+			// the rest stays in the buffer until the handler reads again
+			return 0;
+		}
+
+		size_t length = connection->bufferLength - connection->bufferOffset;
+		if (length == 0)
+			return connection->readStatus > 0 ? 0 : -1;
+
+		if (length > body->length - body->received)
+			length = body->length - body->received;
+		const char* data = connection->buffer + connection->bufferOffset;
+		connection->bufferOffset += length;
+		body->received += length;
+		updateTiming(connection, false);
+
+		// once the handler is done the rest is discarded
+		if (handler->onBody != NULL && !output->eof && !output->failed) {
+			applyResult(exchange, handler->onBody(&(exchange->request), data, length, reactorResponse));
+			pumpOutput(connection);
+		}
+
+		if (connection->bodyExchange != exchange) {
+			// the exchange is over; the connection is closed
+			return 0;
+		}
+	}
+
+	debug("networking: request body complete; %zu bytes received", body->received);
+
+	pthread_mutex_lock(&(connection->lock));
+	body->complete = true;
+	connection->readingBody = false;
+	connection->bodyExchange = NULL;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (handler->onBody != NULL && !output->eof && !output->failed)
+		applyResult(exchange, handler->onBody(&(exchange->request), NULL, 0, reactorResponse));
+	pumpOutput(connection);
+
+	return 1;
+}
+
+/*
+ * Reactor handlers run on the reactor unless TLS or the request body need a thread.
+ * A body is only read by the reactor if the exchange is first; it can't wait for its turn then.
+ */
+static bool runsInReactor(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+
+	if (exchange->threads.handler.reactor == NULL)
+		return false;
+	#ifdef SSL_SUPPORT
+	if (connection->sslConnection != NULL)
+		return false;
+	#endif
+
+	// the body isn't read if it is not acceptable
+	if (exchange->body.status != 0 || exchange->body.framing == BODY_NONE)
+		return true;
+	if (exchange->body.framing != BODY_LENGTH || exchange->body.expectContinue)
+		return false;
+
+	pthread_mutex_lock(&(connection->lock));
+	bool first = connection->first == exchange;
+	pthread_mutex_unlock(&(connection->lock));
+
+	return first;
+}
+
+static void admitHandler(struct exchange* exchange);
+
+/*
+ * Calls the reactor handler of the exchange; it has to be first on its connection.
+ */
+static void startReactorHandler(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+	const struct reactorHandler* handler = exchange->threads.handler.reactor;
+
+	pthread_mutex_lock(&(connection->lock));
+	exchange->reactorStarted = true;
+	exchange->isRelayed = true;
+	connection->output = (struct output) {
+		.exchange = exchange,
+		.readfd = -1,
+		.fd = connection->readfd,
+		.started = true
+	};
+	if (exchange->body.status == 0 && exchange->body.framing != BODY_NONE) {
+		connection->bodyExchange = exchange;
+	} else {
+		// a body that is not acceptable isn't read; the connection is closed afterwards
+		exchange->body.complete = exchange->body.status == 0;
+	}
+	struct peer peer = connection->peer;
+	pthread_mutex_unlock(&(connection->lock));
+
+	exchange->request = (struct request) {
+		.metaData = exchange->metaData,
+		.headers = &(exchange->headers),
+		.fd = -1,
+		.peer = peer,
+		.userData = exchange->threads.handler.data,
+		.statusPages = exchange->threads.handler.statusPages,
+		.state = NULL,
+		._private = exchange
+	};
+
+	exchange->timing.handlerStart = getTime();
+
+	enum reactorResult result = handler->onRequest(&(exchange->request), reactorResponse);
+	if (result == REACTOR_BLOCKING && exchange->response.statusCode == 0) {
+		debug("networking: reactor handler hands the request to a thread");
+
+		pthread_mutex_lock(&(connection->lock));
+		exchange->inReactor = false;
+		exchange->isRelayed = false;
+		exchange->body.complete = false;
+		connection->bodyExchange = NULL;
+		connection->output = (struct output) {
+			.exchange = NULL,
+			.readfd = -1,
+			.fd = -1
+		};
+		pthread_mutex_unlock(&(connection->lock));
+
+		admitHandler(exchange);
+		return;
+	}
+
+	pthread_mutex_lock(&(connection->lock));
+	exchange->handlerDone = true;
+	if (connection->bodyExchange == exchange) {
+		// the body might already be in the buffer
+		schedule(connection);
+	}
+	pthread_mutex_unlock(&(connection->lock));
+
+	applyResult(exchange, result);
+	pumpOutput(connection);
+}
+
+/*
+ * Starts the reactor handler of the first exchange once the responses before it are sent.
+ */
+static void startPendingHandler(struct connection* connection) {
+	pthread_mutex_lock(&(connection->lock));
+	struct exchange* exchange = connection->first;
+	bool start = exchange != NULL && exchange->inReactor && !exchange->reactorStarted && connection->output.exchange == NULL;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (start)
+		startReactorHandler(exchange);
+}
+
+/*
+ * Coroutine handlers run like reactor handlers; the callbacks of coroutineReactor resume the coroutine
+ * once what it waits for is there. Every call fails once the exchange is over.
+ */
+
+// returns -1 if the exchange ended in the meantime
+static int suspend(struct exchange* exchange, enum coroutineWait waitingFor) {
+	if (exchange->coroutine.failed)
+		return -1;
+
+	exchange->coroutine.waitingFor = waitingFor;
+	coroutine_yield();
+	exchange->coroutine.waitingFor = COROUTINE_RUNNING;
+
+	return exchange->coroutine.failed ? -1 : 0;
+}
+
+static int coroutineSendResponse(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	if (exchange->coroutine.failed)
+		return -1;
+
+	return reactorSendResponse(statusCode, headers, body, count, request);
+}
+
+static int coroutineSendHeader(int statusCode, struct headers* headers, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	if (exchange->coroutine.failed)
+		return -1;
+
+	return queueResponse(exchange, statusCode, headers, NULL, 0, &(exchange->coroutine.chunked));
+}
+
+static int coroutineWrite(const struct iovec* body, int count, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	if (exchange->coroutine.failed)
+		return -1;
+
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += body[i].iov_len;
+	}
+	if (length == 0)
+		return 0;
+
+	if (exchange->coroutine.chunked) {
+		char size[24];
+		struct iovec framed[count + 2];
+		framed[0] = (struct iovec) {
+			.iov_base = size,
+			.iov_len = snprintf(size, sizeof(size), "%zx\r\n", length)
+		};
+		memcpy(framed + 1, body, count * sizeof(struct iovec));
+		framed[count + 1] = (struct iovec) {
+			.iov_base = "\r\n",
+			.iov_len = 2
+		};
+
+		if (reactorSendBody(framed, count + 2, request) < 0)
+			return -1;
+	} else if (reactorSendBody(body, count, request) < 0) {
+		return -1;
+	}
+	if (exchange->connection->output.first == NULL) {
+		// there was nothing to send
+		return 0;
+	}
+
+	return suspend(exchange, COROUTINE_WAIT_SENT);
+}
+
+static ssize_t coroutineRead(char* buffer, size_t length, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct exchangeCoroutine* state = &(exchange->coroutine);
+	struct connection* connection = exchange->connection;
+
+	while (state->pendingOffset == state->pendingLength) {
+		if (state->failed)
+			return -1;
+		if (exchange->body.complete)
+			return 0;
+		if (connection->bodyExchange != exchange) {
+			// the body is not read (see startReactorHandler)
+			return -1;
+		}
+
+		if (state->paused) {
+			state->paused = false;
+
+			pthread_mutex_lock(&(connection->lock));
+			// the rest might already be in the buffer
+			schedule(connection);
+			pthread_mutex_unlock(&(connection->lock));
+		}
+
+		if (suspend(exchange, COROUTINE_WAIT_BODY) < 0)
+			return -1;
+	}
+
+	size_t available = state->pendingLength - state->pendingOffset;
+	if (length > available)
+		length = available;
+	memcpy(buffer, state->pending + state->pendingOffset, length);
+	state->pendingOffset += length;
+
+	return length;
+}
+
+static int coroutineWait(int fd, short events, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct connection* connection = exchange->connection;
+	if (exchange->coroutine.failed)
+		return -1;
+
+	if (eventloop_poll(eventLoop, fd, events, connection) < 0) {
+		error("networking: coroutine handler can't wait for fd: %s", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_lock(&(connection->lock));
+	connection->inUse++;
+	pthread_mutex_unlock(&(connection->lock));
+
+	exchange->coroutine.fd = fd;
+	connection->output.polling = true;
+
+	return suspend(exchange, COROUTINE_WAIT_FD);
+}
+
+// relay for chunked bodies; the chunks need their framing
+static ssize_t coroutineCopy(int fd, struct request* request) {
+	char* buffer = malloc(OUTPUT_CHUNK_SIZE);
+	if (buffer == NULL) {
+		error("networking: couldn't allocate relay buffer: %s", strerror(errno));
+		return -1;
+	}
+
+	ssize_t total = 0;
+	while (true) {
+		ssize_t tmp = read(fd, buffer, OUTPUT_CHUNK_SIZE);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0 && errno == EAGAIN) {
+			if (coroutineWait(fd, POLLIN, request) < 0) {
+				total = -1;
+				break;
+			}
+			continue;
+		}
+		if (tmp < 0)
+			debug("networking: couldn't read body of coroutine handler: %s", strerror(errno));
+		if (tmp <= 0)
+			break;
+
+		struct iovec body = {
+			.iov_base = buffer,
+			.iov_len = tmp
+		};
+		if (coroutineWrite(&body, 1, request) < 0) {
+			total = -1;
+			break;
+		}
+		total += tmp;
+	}
+
+	free(buffer);
+	return total;
+}
+
+/*
+ * Splices the pipe to the socket once everything that is queued is sent;
+ * the body doesn't pass through the response buffer.
+ */
+static ssize_t coroutineRelay(int fd, struct request* request) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct output* output = &(exchange->connection->output);
+	if (exchange->coroutine.failed)
+		return -1;
+
+	if (exchange->response.statusCode == 0) {
+		error("networking: reactor handler sent a body without header");
+		return -1;
+	}
+	if (exchange->coroutine.chunked)
+		return coroutineCopy(fd, request);
+
+	ssize_t total = 0;
+	while (true) {
+		if (output->first != NULL && suspend(exchange, COROUTINE_WAIT_SENT) < 0)
+			return -1;
+
+		ssize_t tmp = splice(fd, NULL, output->fd, NULL, RELAY_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (tmp > 0) {
+			if (!timespecIsSet(exchange->timing.firstByte))
+				exchange->timing.firstByte = getTime();
+			output->total += tmp;
+			total += tmp;
+			continue;
+		}
+		if (tmp == 0)
+			return total;
+
+		if (errno == EINTR)
+			continue;
+		if (errno == EINVAL && total == 0) {
+			debug("networking: can't splice; copying instead");
+			return coroutineCopy(fd, request);
+		}
+		if (errno != EAGAIN) {
+			debug("networking: couldn't relay body of coroutine handler: %s", strerror(errno));
+			// the body is incomplete; the connection can't be used anymore
+			exchange->coroutine.failed = true;
+			return -1;
+		}
+
+		// either the pipe is empty or the socket is full
+		struct pollfd pollfd = {
+			.fd = fd,
+			.events = POLLIN
+		};
+		bool readable = poll(&pollfd, 1, 0) == 1 && (pollfd.revents & POLLIN);
+		if (coroutineWait(readable ? output->fd : fd, readable ? POLLOUT : POLLIN, request) < 0)
+			return -1;
+	}
+}
+
+static const struct coroutineResponse coroutineResponse = {
+	.sendResponse = coroutineSendResponse,
+	.sendHeader = coroutineSendHeader,
+	.write = coroutineWrite,
+	.read = coroutineRead,
+	.wait = coroutineWait,
+	.relay = coroutineRelay
+};
+
+static void coroutineMain(void* data) {
+	struct exchange* exchange = (struct exchange*) data;
+
+	exchange->threads.handler.coroutine(exchange->request, coroutineResponse);
+}
+
+// runs the coroutine until it waits again
+static enum reactorResult resumeCoroutine(struct exchange* exchange) {
+	struct exchangeCoroutine* state = &(exchange->coroutine);
+
+	if (!coroutine_resume(state->coroutine))
+		return REACTOR_MORE;
+
+	coroutine_destroy(state->coroutine);
+	state->coroutine = NULL;
+
+	if (state->failed)
+		return REACTOR_ERROR;
+	if (exchange->response.statusCode == 0) {
+		error("networking: coroutine handler didn't respond");
+		if (status_send(&(exchange->request), reactorSendResponse, 500) < 0)
+			return REACTOR_ERROR;
+	}
+	if (state->chunked) {
+		static struct iovec lastChunk = {
+			.iov_base = "0\r\n\r\n",
+			.iov_len = 5
+		};
+		if (reactorSendBody(&lastChunk, 1, &(exchange->request)) < 0)
+			return REACTOR_ERROR;
+	}
+
+	return REACTOR_DONE;
+}
+
+static enum reactorResult coroutineRequest(struct request* request, struct reactorResponse response) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+
+	if (exchange->bind->resolvePeers && request->peer.name == NULL) {
+		// the reactor doesn't wait for a lookup; a thread does (see getPeer)
+		char* name = resolver_peek(request->peer.addr);
+		if (name == NULL)
+			return REACTOR_BLOCKING;
+
+		if (name[0] != '\0') {
+			struct connection* connection = exchange->connection;
+			pthread_mutex_lock(&(connection->lock));
+			if (connection->peer.name == NULL) {
+				// keep it for the next request
+				connection->peer.name = name;
+				name = NULL;
+			}
+			request->peer.name = connection->peer.name;
+			pthread_mutex_unlock(&(connection->lock));
+		}
+		free(name);
+	}
+
+	exchange->coroutine.coroutine = coroutine_create(&coroutineMain, exchange);
+	if (exchange->coroutine.coroutine == NULL) {
+		// a thread will do
+		return REACTOR_BLOCKING;
+	}
+
+	return resumeCoroutine(exchange);
+}
+
+static enum reactorResult coroutineBody(struct request* request, const char* data, size_t length, struct reactorResponse response) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct exchangeCoroutine* state = &(exchange->coroutine);
+
+	if (length > 0) {
+		// what wasn't read yet moves to the front
+		memmove(state->pending, state->pending + state->pendingOffset, state->pendingLength - state->pendingOffset);
+		state->pendingLength -= state->pendingOffset;
+		state->pendingOffset = 0;
+
+		if (state->pendingLength + length > state->pendingSize) {
+			char* pending = realloc(state->pending, state->pendingLength + length);
+			if (pending == NULL) {
+				error("networking: couldn't allocate request body buffer: %s", strerror(errno));
+				return REACTOR_ERROR;
+			}
+			state->pending = pending;
+			state->pendingSize = state->pendingLength + length;
+		}
+
+		memcpy(state->pending + state->pendingLength, data, length);
+		state->pendingLength += length;
+	}
+
+	enum reactorResult result = REACTOR_MORE;
+	if (state->waitingFor == COROUTINE_WAIT_BODY)
+		result = resumeCoroutine(exchange);
+
+	if (state->coroutine != NULL && state->pendingOffset < state->pendingLength) {
+		// no more until the handler reads again
+		state->paused = true;
+	}
+
+	return result;
+}
+
+static enum reactorResult coroutineWritable(struct request* request, struct reactorResponse response) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+
+	if (exchange->coroutine.waitingFor != COROUTINE_WAIT_SENT)
+		return REACTOR_MORE;
+
+	return resumeCoroutine(exchange);
+}
+
+static void coroutineComplete(struct request* request, bool sent) {
+	struct exchange* exchange = (struct exchange*) request->_private;
+	struct exchangeCoroutine* state = &(exchange->coroutine);
+
+	if (state->coroutine != NULL) {
+		// the call it waits in fails; so does every call after it
+		state->failed = true;
+		if (coroutine_resume(state->coroutine)) {
+			coroutine_destroy(state->coroutine);
+		} else {
+			error("networking: coroutine handler didn't return; its stack is lost");
+		}
+		state->coroutine = NULL;
+	}
+
+	free(state->pending);
+	state->pending = NULL;
+}
+
+static const struct reactorHandler coroutineReactor = {
+	.onRequest = coroutineRequest,
+	.onBody = coroutineBody,
+	.onWritable = coroutineWritable,
+	.onComplete = coroutineComplete
+};
+
+/*
+ * A poll of a coroutine handler is done.
+ */
+static void coroutinePolled(struct connection* connection) {
+	struct output* output = &(connection->output);
+
+	output->polling = false;
+	if (!output->failed)
+		applyResult(output->exchange, resumeCoroutine(output->exchange));
+}
+
+/*
+ * Determines how the request body is framed.
+ * Returns 0 if the body is acceptable, otherwise the status code to answer with.
+ */
+int prepareBody(struct exchange* exchange) {
+	struct body* body = &(exchange->body);
+
+	*body = (struct body) {
+		.framing = BODY_NONE,
+		.splice = true,
+		.readfd = -1,
+		.writefd = -1
+	};
+
+	const char* transferEncoding = headers_get(&(exchange->headers), "Transfer-Encoding");
+	const char* contentLength = headers_get(&(exchange->headers), "Content-Length");
+
+	if (transferEncoding != NULL) {
+		if (contentLength != NULL) {
+			// ambiguous framing; the classic request smuggling setup
+			return 400;
+		}
+		if (strcasecmp(transferEncoding, "chunked") != 0) {
+			// we can't decode anything but chunked
+			return 501;
+		}
+		body->framing = BODY_CHUNKED;
+	} else if (contentLength != NULL) {
+		char* endptr;
+		errno = 0;
+		long long length = strtoll(contentLength, &endptr, 10);
+		if (!isdigit(contentLength[0]) || *endptr != '\0' || errno == ERANGE)
+			return 400;
+
+		body->length = length;
+		if (length > 0)
+			body->framing = BODY_LENGTH;
+	}
+
+	long maxBodySize = exchange->bind->maxBodySize;
+	if (maxBodySize > 0 && body->length > (size_t) maxBodySize)
+		return 413;
+
+	const char* expect = headers_get(&(exchange->headers), "Expect");
+	if (expect != NULL) {
+		if (strcasecmp(expect, "100-continue") != 0)
+			return 417;
+
+		// HTTP/1.0 clients don't know about interim responses
+		body->expectContinue = body->framing != BODY_NONE && exchange->metaData.protocol == HTTP11;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads at most length bytes from the client; returns 0 on EOF.
+ * Data that the data handler already received is used first.
+ */
+static ssize_t bodyRead(struct connection* connection, char* buffer, size_t length) {
+	size_t buffered = connection->bufferLength - connection->bufferOffset;
+	if (buffered > 0) {
+		if (length > buffered)
+			length = buffered;
+		memcpy(buffer, connection->buffer + connection->bufferOffset, length);
+		connection->bufferOffset += length;
+		return length;
+	}
+
+	while (true) {
+		ssize_t tmp = read(connection->readfd, buffer, length);
+		if (tmp >= 0) {
+			metrics_add(METRIC_BYTES_IN, tmp);
+			return tmp;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (waitForFd(connection->readfd, POLLIN, networkingConfig.connectionTimeout) < 0)
+			return -1;
+	}
+}
+
+// once the handler has closed its end the data is discarded
+static void bodyWrite(struct body* body, const char* buffer, size_t length) {
+	while (length > 0 && body->writefd >= 0) {
+		ssize_t tmp = write(body->writefd, buffer, length);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+
+			close(body->writefd);
+			body->writefd = -1;
+			return;
+		}
+
+		buffer += tmp;
+		length -= tmp;
+	}
+}
+
+/*
+ * Moves exactly length bytes of body data from the client to the handler.
+ * Uses splice if possible so the data doesn't have to pass through user space.
+ */
+static int bodyCopy(struct exchange* exchange, size_t length) {
+	struct connection* connection = exchange->connection;
+	struct body* body = &(exchange->body);
+	char buffer[BODY_BUFFER_SIZE];
+
+	while (length > 0) {
+		size_t size = length;
+		ssize_t tmp;
+
+		if (body->writefd >= 0 && body->splice && connection->bufferOffset == connection->bufferLength) {
+			if (size > BODY_SPLICE_SIZE)
+				size = BODY_SPLICE_SIZE;
+
+			tmp = splice(connection->readfd, NULL, body->writefd, NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (tmp == 0)
+				return -1;
+
+			if (tmp < 0) {
+				switch(errno) {
+					case EINTR:
+						break;
+					case EAGAIN:
+						// either the client or the handler is slow
+						if (waitForFd(connection->readfd, POLLIN, networkingConfig.connectionTimeout) < 0 || waitForFd(body->writefd, POLLOUT, networkingConfig.connectionTimeout) < 0)
+							return -1;
+						break;
+					case EPIPE:
+						// the handler is not interested in the rest
+						close(body->writefd);
+						body->writefd = -1;
+						break;
+					default:
+						// splice is not supported for this pair of fds
+						body->splice = false;
+						break;
+				}
+				continue;
+			}
+
+			metrics_add(METRIC_BYTES_IN, tmp);
+		} else {
+			if (size > BODY_BUFFER_SIZE)
+				size = BODY_BUFFER_SIZE;
+
+			tmp = bodyRead(connection, buffer, size);
+			if (tmp <= 0)
+				return -1;
+
+			bodyWrite(body, buffer, tmp);
+		}
+
+		length -= tmp;
+		body->received += tmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads a single line byte by byte so nothing after the body is consumed.
+ * Returns the length of the line without CRLF or -1 on error.
+ */
+static int bodyReadLine(struct connection* connection, char* line, size_t size) {
+	size_t length = 0;
+	char c;
+
+	while (true) {
+		if (bodyRead(connection, &c, 1) <= 0)
+			return -1;
+		if (c == '\n')
+			break;
+		if (length + 1 >= size)
+			return -1;
+
+		line[length++] = c;
+	}
+
+	if (length > 0 && line[length - 1] == '\r')
+		length--;
+	line[length] = '\0';
+
+	return length;
+}
+
+static int bodyDecodeChunked(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+	struct body* body = &(exchange->body);
+	long maxBodySize = exchange->bind->maxBodySize;
+	char line[BODY_MAX_LINE_LENGTH];
+
+	while (true) {
+		if (bodyReadLine(connection, line, BODY_MAX_LINE_LENGTH) < 0)
+			return -1;
+
+		char* endptr;
+		errno = 0;
+		unsigned long long size = strtoull(line, &endptr, 16);
+		// chunk extensions are ignored
+		if (!isxdigit(line[0]) || errno == ERANGE || (*endptr != '\0' && *endptr != ';' && *endptr != ' ' && *endptr != '\t')) {
+			warn("networking: invalid chunk size '%s'", line);
+			return -1;
+		}
+
+		if (size == 0)
+			break;
+
+		if (maxBodySize > 0 && body->received + size > (size_t) maxBodySize) {
+			warn("networking: request body exceeds %ld bytes", maxBodySize);
+			return -1;
+		}
+
+		if (bodyCopy(exchange, size) < 0)
+			return -1;
+
+		// CRLF after the chunk data
+		if (bodyReadLine(connection, line, BODY_MAX_LINE_LENGTH) != 0)
+			return -1;
+	}
+
+	// trailers are ignored
+	int tmp;
+	while((tmp = bodyReadLine(connection, line, BODY_MAX_LINE_LENGTH)) > 0);
+
+	return tmp;
+}
+
+/*
+ * This thread reads the request body from the client and feeds the decoded body to the handler.
+ */
+void* requestBodyThread(void* data) {
+	struct exchange* exchange = (struct exchange*) data;
+	struct connection* connection = exchange->connection;
+	struct body* body = &(exchange->body);
+
+	int tmp;
+	if (body->framing == BODY_CHUNKED) {
+		tmp = bodyDecodeChunked(exchange);
+	} else {
+		tmp = bodyCopy(exchange, body->length);
+	}
+
+	// EOF for the handler
+	if (body->writefd >= 0) {
+		close(body->writefd);
+		body->writefd = -1;
+	}
+
+	if (tmp < 0) {
+		// the socket stays with us; the connection is closed once the exchange is done
+		warn("networking: couldn't read request body; %zu bytes received", body->received);
+		return NULL;
+	}
+
+	debug("networking: request body complete; %zu bytes received", body->received);
+
+	pthread_mutex_lock(&(connection->lock));
+	body->complete = true;
+	connection->readingBody = false;
+	// the next pipelined request might be waiting
+	schedule(connection);
+	pthread_mutex_unlock(&(connection->lock));
+
+	return NULL;
+}
+
+/*
+ * Sets up the pipe the handler reads the request body from.
+ */
+int startBody(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+	struct body* body = &(exchange->body);
+
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		error("networking: couldn't create pipe for request body: %s", strerror(errno));
+		return -1;
+	}
+	body->readfd = pipefd[0];
+	body->writefd = pipefd[1];
+
+	if (body->framing == BODY_NONE) {
+		// the handler just gets EOF
+		close(body->writefd);
+		body->writefd = -1;
+		body->complete = true;
+		return 0;
+	}
+
+	if (body->expectContinue) {
+		const char* interim = "HTTP/1.1 100 Continue\r\n\r\n";
+		if (writeAll(connection->writefd, interim, strlen(interim), networkingConfig.connectionTimeout) < 0)
+			warn("networking: couldn't send 100 Continue: %s", strerror(errno));
+	}
+
+	if (pthread_create(&(exchange->threads.body), NULL, &requestBodyThread, exchange) != 0) {
+		error("networking: Couldn't start request body thread.");
+
+		exchange->threads.body = PTHREAD_NULL;
+		close(body->readfd);
+		close(body->writefd);
+		body->readfd = -1;
+		body->writefd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Has to be called once the handler returned.
+ * Whatever is left of the body is discarded by the body thread.
+ */
+void finishBody(struct exchange* exchange) {
+	struct body* body = &(exchange->body);
+
+	if (body->readfd >= 0) {
+		close(body->readfd);
+		body->readfd = -1;
+	}
+
+	stopThread(pthread_self(), &(exchange->threads.body), false);
+}
+
+/*
+ * Waits (at most resolveTimeout ms) for the name of the peer if the bind needs it.
+ * Returns the peer for the handler; if name isn't the connection's it is put into *toFree.
+ */
+static struct peer getPeer(struct exchange* exchange, char** toFree) {
+	struct connection* connection = exchange->connection;
+	*toFree = NULL;
+
+	pthread_mutex_lock(&(connection->lock));
+	bool missing = connection->peer.name == NULL;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (exchange->bind->resolvePeers && missing) {
+		char* name = resolver_lookup(connection->peer.addr, exchange->bind->resolveTimeout);
+
+		pthread_mutex_lock(&(connection->lock));
+		if (name != NULL && name[0] != '\0' && connection->peer.name == NULL) {
+			// keep it for the next request
+			connection->peer.name = name;
+		} else {
+			*toFree = name;
+		}
+		pthread_mutex_unlock(&(connection->lock));
+	}
+
+	pthread_mutex_lock(&(connection->lock));
+	struct peer peer = connection->peer;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (peer.name == NULL && *toFree != NULL)
+		peer.name = *toFree;
+
+	return peer;
+}
+
+/*
+ * This thread calls the handler.
+ */
+void* responseThread(void* data) {
+	struct exchange* exchange = (struct exchange*) data;
+	struct connection* connection = exchange->connection;
+
+	debug("networking: calling response handler");
+
+	if (exchange->body.status == 0) {
+		if (exchange->body.expectContinue) {
+			// the interim response must not get between earlier responses
+			waitForTurn(exchange);
+		}
+
+		if (startBody(exchange) < 0) {
+			exchange->threads.handler = (struct handler) {
+				.handler = status500
+			};
+		}
+	}
+
+	char* unresolved;
+	struct peer peer = getPeer(exchange, &unresolved);
+
+	exchange->timing.handlerStart = getTime();
+
+	exchange->threads.handler.handler((struct request) {
+		.metaData = exchange->metaData,
+		.headers = &(exchange->headers),
+		.fd = exchange->body.readfd,
+		.peer = peer,
+		.userData = exchange->threads.handler.data,
+		.statusPages = exchange->threads.handler.statusPages,
+		._private = exchange
+	}, (struct response) {
+		.sendHeader = sendHeader,
+		.sendResponse = sendResponse
+	});
+
+	exchange->timing.handlerEnd = getTime();
+	releaseSlot(exchange);
+
+	if (unresolved != NULL)
+		free(unresolved);
+
+	debug("networking: response handler returned");
+
+	finishBody(exchange);
+
+	pthread_mutex_lock(&(connection->lock));
+	exchange->handlerDone = true;
+	pthread_cond_broadcast(&(connection->turn));
+	// otherwise the encoder thread or the reactor completes the exchange once everything is sent
+	bool complete = !exchange->isRelayed || exchange->outputDone;
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (complete)
+		exchangeCompleted(exchange);
+
+	return NULL;
+}
+
+struct handler networking_limitHandler(struct handler handler, const struct rateLimit* serverLimit, const char* addr) {
+	int retryAfter = ratelimit_check(serverLimit, addr);
+	if (retryAfter == 0)
+		retryAfter = ratelimit_check(handler.rateLimit, addr);
+	if (retryAfter == 0)
+		return handler;
+
+	metrics_count(METRIC_REJECTED + REJECTED_RATE);
+	return (struct handler) {
+		.handler = status429,
+		.reactor = &status429Reactor,
+		.data = {
+			.integer = retryAfter
+		}
+	};
+}
+
+/*
+ * Sets the handler of the exchange. The reactor calls this before the request waits for a handler slot.
+ */
+static void findHandler(struct exchange* exchange) {
+	struct handler handler;
+	if (exchange->body.status != 0) {
+		metrics_requestHandler(-1);
+		handler = (struct handler) {
+			.handler = statusHandler,
+			.reactor = &statusReactor,
+			.data = {
+				.integer = exchange->body.status
+			}
+		};
+	} else {
+		handler = exchange->generation->config.getHandler(exchange->metaData, headers_get(&(exchange->headers), "Host"), exchange->bind);
+		handler = networking_limitHandler(handler, NULL, exchange->connection->peer.addr);
+	}
+
+	if (handler.handler == NULL) {
+		handler.handler = status500;
+		handler.reactor = &status500Reactor;
+		handler.coroutine = NULL;
+		handler.data.ptr = NULL;
+	}
+	if (handler.coroutine != NULL)
+		handler.reactor = &coroutineReactor;
+
+	exchange->threads.handler = handler;
+}
+
+/*
+ * This thread handles finding a handler and handler timeout
+ */
+void* requestThread(void* data) {
+	struct exchange* exchange = (struct exchange*) data;
+	struct connection* connection = exchange->connection;
+
+	if (pthread_create(&(exchange->threads.response), NULL, &responseThread, exchange) != 0) {
+		exchange->threads.response = PTHREAD_NULL;
+
+		error("networking: Couldn't start response thread.");
+		warn("networking: Aborting request.");
+
+		abortConnection(connection);
+
+		return NULL;
+	}
+
+
+	debug("networking: going to sleep");
+	sleep(HANDLER_TIMEOUT);
+
+	// from here on we must not be interrupted
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	pthread_mutex_lock(&(connection->lock));
+	if (exchange->completed) {
+		pthread_mutex_unlock(&(connection->lock));
+		return NULL;
+	}
+	exchange->timedOut = true;
+	pthread_mutex_unlock(&(connection->lock));
+
+	error("networking: Timeout of handler.");
+	error("networking: Aborting");
+
+	abortConnection(connection);
+
+	return NULL;
+}
+
+static void runRequestHandler(struct exchange* exchange) {
+	debug("networking: starting request handler");
+	if (pthread_create(&(exchange->threads.request), NULL, &requestThread, exchange) != 0) {
+		exchange->threads.request = PTHREAD_NULL;
+
+		error("networking: Couldn't start request thread.");
+		warn("networking: Aborting request.");
+
+		releaseSlot(exchange);
+		abortConnection(exchange->connection);
+
+		return;
+	}
+}
+
+/*
+ * Answers a request without running its handler: with the pre-serialized 503 if it waited too long for one
+ * or with 429 if it is over the rate limit (retryAfter > 0).
+ * It is sent once the responses of earlier pipelined requests are out; the connection is closed afterwards.
+ */
+static void rejectExchange(struct exchange* exchange, enum rejection reason, int retryAfter) {
+	struct connection* connection = exchange->connection;
+
+	metrics_count(METRIC_REJECTED + reason);
+	debug("networking: rejecting request for %s", exchange->metaData.path);
+
+	pthread_mutex_lock(&(connection->lock));
+	exchange->rejected = retryAfter > 0 ? 429 : 503;
+	exchange->retryAfter = retryAfter;
+	exchange->isPersistent = false;
+	if (connection->state == KEEP_ALIVE)
+		setState(connection, PROCESSING);
+	bool first = connection->first == exchange;
+	pthread_mutex_unlock(&(connection->lock));
+
+	// otherwise exchangeCompleted of the one before answers it
+	if (first)
+		answerRejected(exchange);
+}
+
+/*
+ * One attempt to write without blocking; the reactor must not wait for a client that doesn't read.
+ * Returns what was written, which is less than everything if the socket (or the pipe to the TLS encoder) is full.
+ */
+static ssize_t writevNow(int fd, struct iovec* iov, int count) {
+	struct msghdr message = {
+		.msg_iov = iov,
+		.msg_iovlen = count
+	};
+	ssize_t length = sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (length >= 0 || errno != ENOTSOCK)
+		return length;
+
+	// nobody else writes to the pipe while the exchange is the first of the connection
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	length = writev(fd, iov, count);
+	int tmp = errno;
+	fcntl(fd, F_SETFL, flags);
+	errno = tmp;
+
+	return length;
+}
+
+static void answerRejected(struct exchange* exchange) {
+	struct connection* connection = exchange->connection;
+
+	struct iovec iov[2];
+	int count;
+	char tail[64];
+	if (exchange->rejected == 429) {
+		int length = snprintf(tail, sizeof(tail), "Retry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", exchange->retryAfter);
+		iov[0] = (struct iovec) { .iov_base = limitedHeader, .iov_len = limitedHeaderLength };
+		iov[1] = (struct iovec) { .iov_base = tail, .iov_len = length };
+		count = 2;
+	} else {
+		iov[0] = (struct iovec) { .iov_base = rejectResponse, .iov_len = rejectResponseLength };
+		count = 1;
+	}
+
+	if (connection->writefd >= 0 && iov[0].iov_base != NULL) {
+		// this might run in the reactor; the connection is closed afterwards anyway, so whatever doesn't fit is dropped
+		ssize_t length = writevNow(connection->writefd, iov, count);
+		if (length < (ssize_t) (iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0)))
+			debug("networking: client doesn't take the rejection; closing");
+		if (length > 0) {
+			exchange->response.statusCode = exchange->rejected;
+			exchange->response.headerBytes = length;
+			exchange->timing.firstByte = getTime();
+		}
+	}
+	exchange->handlerDone = true;
+
+	exchangeCompleted(exchange);
+}
+
+/*
+ * Runs the handler of the exchange. Reactor handlers run right away (or once the responses before them are sent);
+ * the others need a handler slot. If all of them are taken the request waits for the reactor to hand it one.
+ */
+void startRequestHandler(struct exchange* exchange) {
+	// the fast path: no thread and no handler slot for requests over the limit
+	int retryAfter = ratelimit_check(&(networkingConfig.rateLimit), exchange->connection->peer.addr);
+	if (retryAfter > 0) {
+		rejectExchange(exchange, REJECTED_RATE, retryAfter);
+		return;
+	}
+
+	findHandler(exchange);
+
+	if (runsInReactor(exchange)) {
+		exchange->inReactor = true;
+		startPendingHandler(exchange->connection);
+		return;
+	}
+
+	admitHandler(exchange);
+}
+
+static void admitHandler(struct exchange* exchange) {
+	if (networkingConfig.maxHandlers <= 0) {
+		runRequestHandler(exchange);
+		return;
+	}
+
+	struct connection* connection = exchange->connection;
+
+	// lock order: connection, then admission
+	pthread_mutex_lock(&(connection->lock));
+	if (exchange->completed) {
+		// the connection was aborted in the meantime
+		pthread_mutex_unlock(&(connection->lock));
+		return;
+	}
+
+	pthread_mutex_lock(&admissionLock);
+	bool run = runningHandlers < networkingConfig.maxHandlers && waitingFirst == NULL;
+	if (run) {
+		runningHandlers++;
+		exchange->hasSlot = true;
+	} else {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		exchange->queued = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+		exchange->waiting = true;
+		exchange->nextWaiting = NULL;
+		exchange->previousWaiting = waitingLast;
+		if (waitingLast != NULL)
+			waitingLast->nextWaiting = exchange;
+		else
+			waitingFirst = exchange;
+		waitingLast = exchange;
+		metrics_add(METRIC_HANDLERS_QUEUED, 1);
+	}
+	pthread_mutex_unlock(&admissionLock);
+	pthread_mutex_unlock(&(connection->lock));
+
+	if (run)
+		runRequestHandler(exchange);
+}
+
+/*
+ * Hands free handler slots to waiting requests; CoDel sheds the ones that waited too long.
+ * Only the reactor calls this.
+ */
+static void dispatchWaiting() {
+	while(true) {
+		struct timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		long now = time.tv_sec * 1000000 + time.tv_nsec / 1000;
+
+		pthread_mutex_lock(&admissionLock);
+		struct exchange* exchange = waitingFirst;
+		if (exchange == NULL || (networkingConfig.maxHandlers > 0 && runningHandlers >= networkingConfig.maxHandlers)) {
+			pthread_mutex_unlock(&admissionLock);
+			break;
+		}
+		leaveWaiting(exchange);
+		bool shed = networkingConfig.shedTarget > 0 && codel_shouldShed(&codel, now - exchange->queued, now);
+		if (!shed) {
+			runningHandlers++;
+			exchange->hasSlot = true;
+		}
+		pthread_mutex_unlock(&admissionLock);
+
+		// it can't be freed in the meantime; only the reactor frees exchanges
+		pthread_mutex_lock(&(exchange->connection->lock));
+		bool completed = exchange->completed;
+		pthread_mutex_unlock(&(exchange->connection->lock));
+
+		if (completed)
+			releaseSlot(exchange);
+		else if (shed)
+			rejectExchange(exchange, REJECTED_SHED, 0);
+		else
+			runRequestHandler(exchange);
+	}
+}
+
+/*
+ * Counts a new connection against the limits. If it is over one of them
+ * it gets the pre-serialized 503 (unless it's TLS) and is closed.
+ */
+static bool admitConnection(struct bind* bind, int fd, const char* addr) {
+	enum rejection reason;
+
+	// counted even without limits; a reload might set one
+	int open = __atomic_add_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+	if (networkingConfig.maxConnections > 0 && open > networkingConfig.maxConnections) {
+		__atomic_sub_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+		reason = REJECTED_CONNECTIONS;
+	} else if (!admission_addPeer(addr, networkingConfig.maxConnectionsPerPeer)) {
+		__atomic_sub_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+		reason = REJECTED_PEER;
+	} else {
+		return true;
+	}
+
+	metrics_count(METRIC_REJECTED + reason);
+	info("networking: turning away connection from %s: %s", addr, reason == REJECTED_PEER ? "too many connections from peer" : "too many connections");
+
+	if (!bind->ssl && rejectResponse != NULL) {
+		// the socket buffer of a new connection has room for it
+		send(fd, rejectResponse, rejectResponseLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	close(fd);
+
+	return false;
+}
+
+// the connection of addr is gone
+static void releaseConnection(const char* addr) {
+	__atomic_sub_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+	admission_removePeer(addr);
+}
+
+/*
+ * Turns the request that was just parsed into an exchange and starts its handler.
+ * Returns 1 if the next pipelined request can be parsed right away, 0 if not
+ * and -1 on error.
+ */
+int startExchange(struct connection* connection) {
+	struct exchange* exchange = malloc(sizeof(struct exchange));
+	if (exchange == NULL) {
+		error("networking: couldn't allocate exchange: %s", strerror(errno));
+		return -1;
+	}
+
+	// new requests go to the current config unless the bind was removed from it
+	if (connection->listener->bind != NULL && connection->generation != currentGeneration) {
+		releaseGeneration(connection->generation);
+		connection->generation = acquireGeneration(currentGeneration);
+		connection->bind = connection->listener->bind;
+	}
+
+	*exchange = (struct exchange) {
+		.connection = connection,
+		.next = NULL,
+		.number = ++(connection->requests),
+		.bind = connection->bind,
+		.generation = acquireGeneration(connection->generation),
+		.metaData = connection->metaData,
+		.headers = connection->headers,
+		.timing = {
+			.requestStart = connection->timing.requestStart,
+			.headersEnd = getTime()
+		},
+		.hasSlot = false,
+		.waiting = false,
+		.rejected = 0,
+		.threads = {
+			/*
+			 * This is really hacky. pthread_t is no(t always an) integer.
+			 * TODO: better solution
+			 */
+			.request = PTHREAD_NULL,
+			.response = PTHREAD_NULL,
+			.encoder = PTHREAD_NULL,
+			.body = PTHREAD_NULL
+		}
+	};
+
+	// the exchange owns the request data now
+	connection->metaData = (struct metaData) {
+		.path = NULL,
+		.queryString = NULL
+	};
+	connection->headers = headers_create();
+	connection->timing.requestStart = (struct timespec) {};
+
+	const char* connectionHeader = headers_get(&(exchange->headers), "Connection");
+	if (connectionHeader == NULL) {
+		if (exchange->metaData.protocol == HTTP10) {
+			// in HTTP 1.0 does not have persistent connections by default
+			exchange->isPersistent = false;
+		} else {
+			// HTTP 1.1 uses persistent connections unless specified otherwise
+			exchange->isPersistent = true;
+		}
+	} else if (strcasecmp(connectionHeader, "close") == 0) {
+		exchange->isPersistent = false;
+	} else {
+		exchange->isPersistent = true;
+	}
 
-	fprintf(stream, "\r\n");
-	fclose(stream);
+	int bodyStatus = prepareBody(exchange);
+	if (bodyStatus != 0) {
+		// we can't tell where the body ends => answer and close
+		warn("networking: rejecting request body with status %d", bodyStatus);
+		exchange->body.status = bodyStatus;
+		exchange->isPersistent = false;
+	}
 
-	return fd;
+	pthread_mutex_lock(&(connection->lock));
+	if (connection->last == NULL) {
+		connection->first = exchange;
+	} else {
+		connection->last->next = exchange;
+	}
+	connection->last = exchange;
+	connection->pending++;
+	connection->inUse++;
+
+	if (bodyStatus == 0 && exchange->body.framing != BODY_NONE)
+		connection->readingBody = true;
+
+	if (exchange->isPersistent) {
+		setState(connection, KEEP_ALIVE);
+	} else {
+		setState(connection, PROCESSING);
+	}
+
+	int next = isReadable(connection) ? 1 : 0;
+	pthread_mutex_unlock(&(connection->lock));
+
+	updateTiming(connection, true);
+	startRequestHandler(exchange);
+
+	return next;
 }
 
 /*
- * This thread calls the handler.
+ * Next byte of the request; the reactor fills the buffer once data arrives.
+ * Returns 1 if a byte is available, 0 on EOF and -1 on error (EAGAIN if there is no data yet).
  */
-void* responseThread(void* data) {
+static inline int nextByte(struct connection* connection, char* c) {
+	if (connection->bufferOffset >= connection->bufferLength) {
+		if (connection->readStatus > 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (connection->readStatus < 0) {
+			errno = -(connection->readStatus);
+			return -1;
+		}
+		return 0;
+	}
+
+	*c = connection->buffer[connection->bufferOffset++];
+	return 1;
+}
+
+void* http2Thread(void* data) {
 	struct connection* connection = (struct connection*) data;
 
-	debug("networking: calling response handler");
-	
+	http2_serve(connection, &networkingConfig);
+
+	pthread_mutex_lock(&(connection->lock));
+	closeConnection(connection);
+	connection->inUse--;
+	pthread_mutex_unlock(&(connection->lock));
+
+	return NULL;
+}
+
+/*
+ * Hands the connection over to an HTTP/2 session; the data handler doesn't read from it anymore.
+ */
+int startHttp2(struct connection* connection) {
+	debug("networking: switching to HTTP/2");
 
-	if (connection->isPersistent) {
-		pthread_mutex_init(&connection->resetOkay, NULL);
-		pthread_mutex_lock(&(connection->resetOkay));
+	pthread_mutex_lock(&(connection->lock));
+	setState(connection, PROCESSING);
+	connection->inUse++;
+	pthread_mutex_unlock(&(connection->lock));
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	int tmp = pthread_create(&thread, &attributes, &http2Thread, connection);
+	pthread_attr_destroy(&attributes);
+
+	if (tmp != 0) {
+		error("networking: Couldn't start HTTP/2 thread.");
+
+		pthread_mutex_lock(&(connection->lock));
+		connection->inUse--;
+		pthread_mutex_unlock(&(connection->lock));
+		return -1;
 	}
 
-	connection->threads.handler.handler((struct request) {
-		.metaData = connection->metaData,
-		.headers = &(connection->headers),
-		.fd = connection->readfd,
-		.peer = connection->peer,
-		.userData = connection->threads.handler.data,
-		._private = connection 
-	}, (struct response) {
-		.sendHeader = sendHeader
-	});
-	
-	debug("networking: response handler returned");
+	return 0;
+}
+
+#define BUFFER_LENGTH (64)
+
+/*
+ * Parses what the reactor received on the connection and starts the exchanges.
+ * Once the buffer is drained the next read is armed.
+ */
+static void processConnection(struct connection* connection) {
+	debug("networking: processing connection");
 
-	// lock before isPersistent check in case the connection gets aborted
 	pthread_mutex_lock(&(connection->lock));
-	if (connection->isPersistent) {
-		if (!connection->isChunked) {
-			pthread_mutex_unlock(&(connection->resetOkay));
-			pthread_mutex_destroy(&(connection->resetOkay));
-			
-			resetPersistentConnection(connection);
-		} else {
-			pthread_mutex_unlock(&(connection->resetOkay));
-		}
-		// unlock after reset
+	// the next request can be read if the connection is idle or the client pipelines
+	// or the body is read for a reactor handler
+	bool body = connection->bodyExchange != NULL;
+	if (!body && !isReadable(connection)) {
 		pthread_mutex_unlock(&(connection->lock));
-	} else {
-		// unlock before safeEndConnection
+		return;
+	}
+	connection->inUse++;
+	pthread_mutex_unlock(&(connection->lock));
+
+	// join the threads of finished exchanges
+	reapExchanges(connection);
+
+	int tmp;
+	char c;
+	char buffer[BUFFER_LENGTH];
+	size_t length = 0;
+	bool dropConnection = false;
+	bool stopReading = false;
+	char last = 0;
+	if (body) {
+		tmp = feedBody(connection);
+		if (tmp < 0) {
+			debug("networking: connection ended during request body");
+			dropConnection = true;
+		} else if (tmp == 0) {
+			stopReading = true;
+		}
+	}
+	if (connection->currentHeaderLength > 0) {
+		debug("networking: continuing header line of %zu bytes", connection->currentHeaderLength);
+		last = connection->currentHeader[connection->currentHeaderLength - 1];
+	}
+	while(!dropConnection && !stopReading && (tmp = nextByte(connection, &c)) > 0) {
+		if (connection->metaData.path == NULL && connection->currentHeader == NULL && length == 0) {
+			// first byte of a new request
+			connection->timing.requestStart = getTime();
+			connection->headerBytes = 0;
+			connection->headerCount = 0;
+		}
+
+		if (last == '\r' && c == '\n') {
+			if (dumpHeaderBuffer(&(buffer[0]), length, connection) < 0) {
+				dropConnection = true;
+				break;
+			}
+
+			// \r is in the buffer
+			connection->currentHeaderLength--;
+			connection->currentHeader[connection->currentHeaderLength] = '\0';
+
+			updateTiming(connection, false);
+
+			if (connection->metaData.path == NULL) {
+				// protocol line
+
+				if (connection->requests == 0 && strcmp(connection->currentHeader, HTTP2_PREFACE_LINE) == 0) {
+					// HTTP/2 with prior knowledge (or ALPN)
+					connection->currentHeaderLength = 0;
+					free(connection->currentHeader);
+					connection->currentHeader = NULL;
+					length = 0;
+
+					if (startHttp2(connection) < 0) {
+						dropConnection = true;
+					} else {
+						stopReading = true;
+					}
+					break;
+				}
+
+				tmp = headers_metadata(&(connection->metaData), connection->currentHeader);
+				if (tmp == HEADERS_ALLOC_ERROR) {
+					error("networking: couldn't allocate memory for meta data: %s", strerror(errno));
+					warn("networking: aborting request");
+					dropConnection = true;
+					break;
+				} else if (tmp == HEADERS_PARSE_ERROR) {
+					error("networking: error while reading header line");
+					warn("networking: aborting request");
+					dropConnection = true;
+					break;
+				} else if (connection->metaData.protocol == HTTP20) {
+					error("networking: HTTP/2 request without connection preface");
+					warn("networking: aborting request");
+					dropConnection = true;
+					break;
+				}
+			} else {
+				// header line
+
+				tmp = headers_parse(&(connection->headers), connection->currentHeader, connection->currentHeaderLength);
+				if (tmp == HEADERS_END) {
+					connection->currentHeaderLength = 0;
+					free(connection->currentHeader);
+					connection->currentHeader = NULL;
+					length = 0;
+					last = 0;
+
+					debug("networking: headers complete");
+
+					tmp = startExchange(connection);
+					if (tmp < 0) {
+						dropConnection = true;
+						break;
+					}
+					if (tmp == 0) {
+						// the rest stays in the buffer until the connection is readable again
+						stopReading = true;
+						break;
+					}
+					continue;
+				} else if (tmp == HEADERS_ALLOC_ERROR) {
+					error("networking: couldn't allocate memory for header: %s", strerror(errno));
+					warn("networking: aborting request");
+					dropConnection = true;
+					break;
+				} else if (tmp == HEADERS_PARSE_ERROR) {
+					error("networking: failed to parse headers");
+					warn("networking: aborting request");
+					dropConnection = true;
+					break;
+
+				} else if (networkingConfig.maxHeaders > 0 && ++(connection->headerCount) > networkingConfig.maxHeaders) {
+					warn("networking: more than %ld headers; aborting request", networkingConfig.maxHeaders);
+					metrics_count(METRIC_REJECTED + REJECTED_HEADER_COUNT);
+					connection->errorStatus = 431;
+					dropConnection = true;
+					break;
+				}
+			}
+
+			connection->currentHeaderLength = 0;
+			free(connection->currentHeader);
+			connection->currentHeader = NULL;
+			length = 0;
+
+			continue;
+		}
+
+		if (length >= BUFFER_LENGTH) {
+			length = 0;
+			if (dumpHeaderBuffer(&(buffer[0]), BUFFER_LENGTH, connection) < 0) {
+				dropConnection = true;
+				break;
+			}
+		}
+
+		buffer[length++] = c;
+		last = c;
+	}
+
+	if (!dropConnection && !stopReading) {
+		if (tmp < 0) {
+			switch(errno) {
+				case EAGAIN:
+					// no more data to be ready
+					// ignore this error
+					break;
+				default:
+					dropConnection = true;
+					error("networking: error reading socket: %s", strerror(errno));
+					break;
+			}
+		} else if (tmp == 0) {
+			debug("networking: connection ended");
+
+			buffer[length] = '\0';
+			debug("networking: buffer: '%s'", buffer);
+			dropConnection = true;
+		}
+	}
+
+	if (length > 0 && !dropConnection) {
+		if (dumpHeaderBuffer(&(buffer[0]), length, connection) < 0) {
+			dropConnection = true;
+		}
+	}
+
+	// doesn't work as an else branch
+	// if the connection ends (tmp == 0)
+	// the connection has to be dropped to free resources before the timeout
+	if (dropConnection) {
+		connection->currentHeaderLength = 0;
+		if (connection->currentHeader != NULL)
+			free(connection->currentHeader);
+		connection->currentHeader = NULL;
+
+		debug("networking: dropping connection");
+
+		pthread_mutex_lock(&(connection->lock));
+		setState(connection, ABORTED);
 		pthread_mutex_unlock(&(connection->lock));
-		safeEndConnection(connection, false);
 	}
-	
-	return NULL;
+
+	pthread_mutex_lock(&(connection->lock));
+	if (!dropConnection && !connection->armed && (isReadable(connection) || connection->bodyExchange != NULL) && connection->bufferOffset >= connection->bufferLength) {
+		// wait for the next request (or the next part of this one)
+		if (eventloop_read(eventLoop, connection->readfd, connection) < 0) {
+			error("networking: couldn't wait for data: %s", strerror(errno));
+			setState(connection, ABORTED);
+		} else {
+			connection->armed = true;
+			connection->inUse++;
+		}
+	}
+	connection->inUse--;
+	pthread_mutex_unlock(&(connection->lock));
 }
 
 /*
- * This thread handles finding a handler and handler timeout
+ * Reads of the reactor end up here.
  */
-void* requestThread(void* data) {
-	struct connection* connection = (struct connection*) data;
+static void onRead(struct event* event) {
+	struct connection* connection = (struct connection*) event->data;
+
+	pthread_mutex_lock(&(connection->lock));
+	connection->armed = false;
+	pthread_mutex_unlock(&(connection->lock));
 
-	struct handler handler = networkingConfig.getHandler(connection->metaData, headers_get(&(connection->headers), "Host"), connection->bind);
+	if (event->result > 0) {
+		// reads are only armed when the buffer is drained
+		memcpy(connection->buffer, event->buffer, event->result);
+		connection->bufferOffset = 0;
+		connection->bufferLength = event->result;
+		metrics_add(METRIC_BYTES_IN, event->result);
+	} else if (event->result != -ECANCELED) {
+		connection->readStatus = event->result;
+	}
+	eventloop_release(eventLoop, event);
 
-	if (handler.handler == NULL) {
-		handler.handler = status500;
-		handler.data.ptr = NULL;
+	if (event->result != -ECANCELED) {
+		// otherwise the cleanup gave up on the connection
+		processConnection(connection);
 	}
 
-	connection->threads.handler = handler;
+	pthread_mutex_lock(&(connection->lock));
+	connection->inUse--;
+	pthread_mutex_unlock(&(connection->lock));
+}
 
-	if (pthread_create(&(connection->threads.response), NULL, &responseThread, connection) < 0) {
-		int tmp = connection->readfd;
-		connection->readfd = -1;
-		close(tmp);
-		tmp = connection->writefd;
-		connection->writefd = -1;
-		close(tmp);
+/*
+ * Polls of buffered responses and coroutine handlers end up here.
+ */
+static void onPoll(struct event* event) {
+	struct connection* connection = (struct connection*) event->data;
+	struct output* output = &(connection->output);
+
+	if (output->writing && event->fd == output->fd)
+		output->writing = false;
+	else if (output->polling && event->fd == output->exchange->coroutine.fd)
+		coroutinePolled(connection);
+	else
+		output->reading = false;
+
+	pumpOutput(connection);
+
+	pthread_mutex_lock(&(connection->lock));
+	connection->inUse--;
+	pthread_mutex_unlock(&(connection->lock));
+}
+
+/*
+ * Processes connections that were scheduled by other threads.
+ */
+static void onWakeup() {
+	while(true) {
+		pthread_mutex_lock(&scheduledLock);
+		struct connection* connection = scheduledConnections;
+		if (connection == NULL) {
+			pthread_mutex_unlock(&scheduledLock);
+			break;
+		}
+		scheduledConnections = connection->nextScheduled;
+		connection->scheduled = false;
+		pthread_mutex_unlock(&scheduledLock);
+
+		pthread_mutex_lock(&(connection->lock));
+		bool start = connection->output.exchange != NULL && !connection->output.started;
+		pthread_mutex_unlock(&(connection->lock));
+		if (start)
+			startOutput(connection);
+
+		startPendingHandler(connection);
+		processConnection(connection);
 
-		error("networking: Couldn't start response thread.");
-		warn("networking: Aborting request.");
-		
 		pthread_mutex_lock(&(connection->lock));
-		connection->state = ABORTED;
 		connection->inUse--;
 		pthread_mutex_unlock(&(connection->lock));
-		
+	}
+}
+
+/*
+ * The connection takes over the reference to generation.
+ */
+static struct connection* createConnection(struct listener* listener, struct bind* bindObj, struct generation* generation, struct peer peer, int readfd, int writefd) {
+	struct connection* connection = malloc(sizeof (struct connection));
+	if (connection == NULL) {
+		error("networking: Couldn't allocate connection objekt: %s", strerror(errno));
 		return NULL;
 	}
 
+	// lock doesn't yet exist
+	connection->state = OPENED;
+	metrics_stateChange(-1, OPENED);
+	connection->peer = peer;
+	connection->bind = bindObj;
+	connection->generation = generation;
+	connection->listener = listener;
+	connection->readfd = readfd;
+	connection->writefd = writefd;
+	connection->metaData = (struct metaData) {
+		.path = NULL,
+		.queryString = NULL
+	};
+	connection->headers = headers_create();
+	connection->currentHeaderLength = 0;
+	connection->currentHeader = NULL;
+	connection->bufferOffset = 0;
+	connection->bufferLength = 0;
+	connection->first = NULL;
+	connection->last = NULL;
+	connection->pending = 0;
+	connection->done = NULL;
+	connection->readingBody = false;
+	connection->bodyExchange = NULL;
+	connection->armed = false;
+	connection->readStatus = 1;
+	connection->scheduled = false;
+	connection->nextScheduled = NULL;
+	connection->aborting = false;
+	connection->forced = false;
+	connection->inUse = 0;
+	connection->requests = 0;
+	connection->timing = (struct timing) {};
+	connection->headerBytes = 0;
+	connection->headerCount = 0;
+	connection->errorStatus = 0;
+	connection->drainAcked = 0;
+	connection->drainSince = (struct timespec) {};
+	connection->output = (struct output) {
+		.exchange = NULL,
+		.readfd = -1,
+		.fd = -1
+	};
+	#ifdef SSL_SUPPORT
+	connection->sslConnection = NULL;
+	#endif
+	pthread_mutex_init(&connection->lock, NULL);
+	pthread_cond_init(&connection->turn, NULL);
+	updateTiming(connection, false);
+
+	return connection;
+}
 
-	debug("networking: going to sleep");
-	// TODO set timeout via config
-	sleep(30);
+#ifdef SSL_SUPPORT
+struct handshake {
+	struct listener* listener;
+	struct bind* bind;
+	struct generation* generation;
+	struct peer peer;
+	int socket;
+};
 
-	error("networking: Timeout of handler.");
-	error("networking: Aborting");
+/*
+ * The TLS handshake blocks; the reactor gets the connection once it is done.
+ */
+void* handshakeThread(void* data) {
+	struct handshake* handshake = (struct handshake*) data;
+
+	setNonBlocking(handshake->socket, false);
+
+	struct ssl_connection* sslConnection = ssl_initConnection(handshake->bind->ssl_settings, handshake->socket);
+	if (sslConnection == NULL) {
+		metrics_count(METRIC_TLS_HANDSHAKE_ERRORS);
+		error("networking: failed to open ssl connection");
+		close(handshake->socket);
+		releaseGeneration(handshake->generation);
+		releaseConnection(handshake->peer.addr);
+		free(handshake);
+		return NULL;
+	}
+
+	metrics_count(METRIC_TLS_HANDSHAKES);
+
+	setNonBlocking(sslConnection->readfd, true);
+
+	struct connection* connection = createConnection(handshake->listener, handshake->bind, handshake->generation, handshake->peer, sslConnection->readfd, sslConnection->writefd);
+	if (connection == NULL) {
+		ssl_closeConnection(sslConnection);
+		close(handshake->socket);
+		releaseGeneration(handshake->generation);
+		releaseConnection(handshake->peer.addr);
+		free(handshake);
+		return NULL;
+	}
+	connection->sslConnection = sslConnection;
+	free(handshake);
 
-	
-	safeEndConnection(connection, true);
+	linked_push(&connectionList, connection);
+
+	pthread_mutex_lock(&(connection->lock));
+	schedule(connection);
+	pthread_mutex_unlock(&(connection->lock));
 
 	return NULL;
 }
+#endif
 
-void startRequestHandler(struct connection* connection) {
-	debug("networking: starting request handler");
-	if (pthread_create(&(connection->threads.request), NULL, &requestThread, connection) != 0) {
-		error("networking: Couldn't start request thread.");
-		warn("networking: Aborting request.");
-		
-		pthread_mutex_lock(&(connection->lock));
-		connection->state = ABORTED;
-		connection->inUse--;
-		pthread_mutex_unlock(&(connection->lock));
-		
+/*
+ * Sets up a connection for a socket the reactor accepted.
+ */
+static void acceptConnection(struct listener* listener, int fd) {
+	struct bind* bindObj = listener->bind;
+	struct sockaddr_storage client;
+	socklen_t clientSize = sizeof (client);
+
+	if (getpeername(fd, (struct sockaddr*) &client, &clientSize) < 0) {
+		// the client is already gone
+		debug("networking: getpeername: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	struct peer peer;
+	int family = client.ss_family;
+	void* addrPtr;
+
+	if (family == AF_INET) {
+		addrPtr = &(((struct sockaddr_in*) &client)->sin_addr);
+		peer.port = ntohs(((struct sockaddr_in*) &client)->sin_port);
+	} else if (family == AF_INET6) {
+		addrPtr = &(((struct sockaddr_in6*) &client)->sin6_addr);
+		peer.port = ntohs(((struct sockaddr_in6*) &client)->sin6_port);
+	} else {
+		error("networking: unsupported address family %d", family);
+		close(fd);
+		return;
+	}
+
+	if (inet_ntop(family, addrPtr, &(peer.addr[0]), INET6_ADDRSTRLEN + 1) == NULL) {
+		error("networking: Couldn't set peer addr string: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	snprintf(&(peer.portStr[0]), 5 + 1, "%d", peer.port);
+
+	if (!admitConnection(bindObj, fd, peer.addr))
+		return;
+
+	// the name is only looked up if a handler needs it; in the meantime the request is parsed
+	peer.name = NULL;
+	if (bindObj->resolvePeers)
+		resolver_prefetch(peer.addr);
+
+	info("networking: new connection from %s:%s", peer.addr, peer.portStr);
+
+	#ifdef SSL_SUPPORT
+	if (bindObj->ssl_settings != NULL) {
+		struct handshake* handshake = malloc(sizeof(struct handshake));
+		if (handshake == NULL) {
+			error("networking: Couldn't allocate handshake: %s", strerror(errno));
+			releaseConnection(peer.addr);
+			close(fd);
+			return;
+		}
+		*handshake = (struct handshake) {
+			.listener = listener,
+			.bind = bindObj,
+			.generation = acquireGeneration(currentGeneration),
+			.peer = peer,
+			.socket = fd
+		};
+
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+		pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+		pthread_t thread;
+		int tmp = pthread_create(&thread, &attributes, &handshakeThread, handshake);
+		pthread_attr_destroy(&attributes);
+
+		if (tmp != 0) {
+			error("networking: Couldn't start handshake thread.");
+			releaseGeneration(handshake->generation);
+			releaseConnection(peer.addr);
+			free(handshake);
+			close(fd);
+		}
+		return;
+	}
+	#endif
+
+	// the socket is already non-blocking; reading and writing share it
+	struct generation* generation = acquireGeneration(currentGeneration);
+	struct connection* connection = createConnection(listener, bindObj, generation, peer, fd, fd);
+	if (connection == NULL) {
+		releaseGeneration(generation);
+		releaseConnection(peer.addr);
+		close(fd);
+		return;
+	}
+
+	linked_push(&connectionList, connection);
+
+	// arms the first read
+	processConnection(connection);
+}
+
+static void onAccept(struct event* event) {
+	struct listener* listener = (struct listener*) event->data;
+
+	if (listener == NULL || listener->bind == NULL) {
+		// the listener was closed in the meantime
+		if (event->result >= 0)
+			close(event->result);
 		return;
 	}
-}
+	struct bind* bindObj = listener->bind;
 
-#define BUFFER_LENGTH (64)
+	if (event->result >= 0) {
+		acceptConnection(listener, event->result);
+		return;
+	}
 
-pthread_t dataThreadId;
+	switch(-(event->result)) {
+		case ENETDOWN:
+		case EPROTO:
+		case ENOPROTOOPT:
+		case EHOSTDOWN:
+		case ENONET:
+		case EHOSTUNREACH:
+		case EOPNOTSUPP:
+		case ENETUNREACH:
+		case EAGAIN:
+
+		case ECONNABORTED:
+		case EINTR:
+			// the client gave up; keep going
+			break;
 
-void dataHandler() {
-	pthread_t self = pthread_self();
+		default:
+			error("networking: Could not accept connection on %s:%s: %s", bindObj->address == NULL ? "0.0.0.0" : bindObj->address, bindObj->port, strerror(-(event->result)));
+			break;
+	}
+}
+
+static void applyGeneration(struct generation* generation);
+static void closeListener(struct listener* listener);
 
-	debug("networking: data handler got called.");
+/*
+ * Closes all connections that are still open (see networking_closeAll). Returns how many.
+ */
+static int closeAll() {
+	int number = 0;
 
-	for(link_t* link = linked_first(&connectionList); link != NULL; link = linked_next(link)) {
+	for (link_t* link = linked_first(&connectionList); link != NULL; link = linked_next(link)) {
 		struct connection* connection = link->data;
-		
+
 		pthread_mutex_lock(&(connection->lock));
-		// we don't support pipelining, current request has to be finished for the next to start
-		if (connection->state != OPENED) {
-			pthread_mutex_unlock(&(connection->lock));
-			continue;
+		if (connection->state != CLOSED && connection->state != ABORTED) {
+			// handlers that are still writing get EPIPE; HTTP/2 sessions see the end of the stream
+			connection->forced = true;
+			closeConnection(connection);
+			number++;
 		}
-		connection->inUse++;
 		pthread_mutex_unlock(&(connection->lock));
-		
-		// if the connection is persistent there could be still
-		// unjoined threads -> join them
-		if (connection->threads.response != PTHREAD_NULL) {
-			stopThread(self, &(connection->threads.response), false);
-		}
-		if (connection->threads.encoder != PTHREAD_NULL) {
-			stopThread(self, &(connection->threads.encoder), false);
-		}
-		
-		int tmp;
-		char c;
-		char buffer[BUFFER_LENGTH];
-		size_t length = 0;
-		bool dropConnection = false;
-		bool handlerStarted = false;
-		char last = 0;
-		if (connection->currentHeaderLength > 0) {
-			debug("%d, %x", connection->currentHeaderLength, connection->currentHeader);
-			last = connection->currentHeader[connection->currentHeaderLength - 1];
-		}
-		while((tmp = read(connection->readfd, &c, 1)) > 0) {
-			if (last == '\r' && c == '\n') {
-				if (dumpHeaderBuffer(&(buffer[0]), length, connection) < 0) {
-					dropConnection = true;
-					break;
-				}
-
-				// \r is in the buffer
-				connection->currentHeaderLength--;
-				connection->currentHeader[connection->currentHeaderLength] = '\0';
-
-				updateTiming(connection, false);
+	}
 
-				if (connection->metaData.path == NULL) {	
-					// protocol line
-					
-					tmp = headers_metadata(&(connection->metaData), connection->currentHeader);
-					if (tmp == HEADERS_ALLOC_ERROR) {
-						error("networking: couldn't allocate memory for meta data: %s", strerror(errno));
-						warn("networking: aborting request");
-						dropConnection = true;
-						break;
-					} else if (tmp == HEADERS_PARSE_ERROR) {
-						error("networking: error while reading header line");
-						warn("networking: aborting request");
-						dropConnection = true;
-						break;
-					}
-				} else {
-					// header line
-					
-					tmp = headers_parse(&(connection->headers), connection->currentHeader, connection->currentHeaderLength);
-					if (tmp == HEADERS_END) {
-						connection->currentHeaderLength = 0;			
-						free(connection->currentHeader);
-						connection->currentHeader = NULL;
-
-						debug("networking: headers complete");
-						
-						connection->isPersistent = true;	
-						const char* connectionHeader = headers_get(&(connection->headers), "Connection");
-						if (connectionHeader == NULL) {
-							if (connection->metaData.protocol == HTTP10) {
-								// in HTTP 1.0 does not have persistent connections by default
-								connection->isPersistent = false;
-							} else {
-								// HTTP 1.1 uses persistent connections unless specified otherwise
-								connection->isPersistent = true;
-							}
-						} else if (strcasecmp(connectionHeader, "close") == 0) {
-							connection->isPersistent = false;
-						} else if (strcasecmp(connectionHeader, "keep-alive") == 0) {
-							connection->isPersistent = true;
-						}
-						
-						pthread_mutex_lock(&(connection->lock));
-						if (connection->isPersistent) {
-							connection->state = KEEP_ALIVE;
-						} else {
-							connection->state = PROCESSING;
-						}
-						pthread_mutex_unlock(&(connection->lock));
-						
-						updateTiming(connection, true);
-						startRequestHandler(connection);
-						
-						handlerStarted = true;
-						break;
-					} else if (tmp == HEADERS_ALLOC_ERROR) {
-						error("networking: couldn't allocate memory for header: %s", strerror(errno));
-						warn("networking: aborting request");
-						dropConnection = true;
-						break;
-					} else if (tmp == HEADERS_PARSE_ERROR) {
-						error("networking: failed to parse headers");
-						warn("networking: aborting request");
-						dropConnection = true;
-						break;
+	return number;
+}
 
-					}
-				}
+/*
+ * The reactor thread: accepts connections, receives requests and does the clean up.
+ */
+void* reactorThread(void* _) {
+	struct event events[EVENTLOOP_MAX_EVENTS];
+	struct timespec lastCleanup = getTime();
 
-				connection->currentHeaderLength = 0;
-				free(connection->currentHeader);
-				connection->currentHeader = NULL;
-				length = 0;
+	while(true) {
+		long timeout = CLEANUP_INTERVAl - timespacAgeMs(lastCleanup);
+		if (timeout < 0)
+			timeout = 0;
+
+		int number = eventloop_wait(eventLoop, events, EVENTLOOP_MAX_EVENTS, timeout);
+		if (number < 0) {
+			error("networking: reactor: wait: %s", strerror(errno));
+			debug("networking: reactor: waiting 1s");
+			sleep(1);
+			continue;
+		}
 
-				continue;
-			}
-			
-			if (length >= BUFFER_LENGTH) {
-				length = 0;
-				if (dumpHeaderBuffer(&(buffer[0]), BUFFER_LENGTH, connection) < 0) {
-					dropConnection = true;
+		for (int i = 0; i < number; i++) {
+			switch(events[i].type) {
+				case EVENT_ACCEPT:
+					onAccept(&(events[i]));
+					break;
+				case EVENT_READ:
+					onRead(&(events[i]));
+					break;
+				case EVENT_WAKEUP:
+					onWakeup();
+					break;
+				case EVENT_POLL:
+					onPoll(&(events[i]));
 					break;
-				}
 			}
-
-			buffer[length++] = c;
-			last = c;
-		}
-		
-		if (handlerStarted) {
-			// skip the rest
-			// no need to decrement inUse counter
-			// since the handler is started
-			continue;
 		}
-		
-		if (!dropConnection) {
-			if (tmp < 0) {
-				switch(errno) {
-					case EAGAIN:
-						// no more data to be ready
-						// ignore this error
-						break;
-					default:
-						dropConnection = true;
-						error("networking: error reading socket: %s", strerror(errno));
-						break;
-				}
-			} else if (tmp == 0) {
-				debug("networking: connection ended");
 
-				buffer[length] = '\0';
-				debug("networking: buffer: '%s'", buffer);
-				dropConnection = true;
-			}
-			if (length > 0) {
-				if (dumpHeaderBuffer(&(buffer[0]), length, connection) < 0) {
-					dropConnection = true;
-				}
+		// not earlier; the events above might belong to a listener that is closed now
+		pthread_mutex_lock(&reloadLock);
+		struct generation* generation = nextGeneration;
+		nextGeneration = NULL;
+		if (generation != NULL) {
+			if (draining)
+				releaseGeneration(generation);
+			else
+				applyGeneration(generation);
+		}
+		dispatchWaiting();
+		resumeOutputs();
+
+		bool forceClose = closeAllPending;
+		bool startDrain = draining && !drained;
+		if (startDrain) {
+			for (struct listener* listener = listeners; listener != NULL; listener = listener->next) {
+				if (listener->bind != NULL)
+					closeListener(listener);
 			}
+			drained = true;
 		}
-		
-		// doesn't work as an else branch
-		// if the connection ends (tmp == 0)
-		// the connection has to be dropped to free resources before the timeout
-		if (dropConnection) {
-			connection->currentHeaderLength = 0;
-			if (connection->currentHeader != NULL)
-				free(connection->currentHeader);
-			connection->currentHeader = NULL;
-		
-			debug("networking: dropping connection");
-			setSIGIO(connection->readfd, false);
-			
-			pthread_mutex_lock(&(connection->lock));
-			connection->state = ABORTED;
-			pthread_mutex_unlock(&(connection->lock));
+		pthread_mutex_unlock(&reloadLock);
+
+		if (startDrain) {
+			// HTTP/2 sessions say goodbye on their own
+			if (drainfd >= 0)
+				eventfd_write(drainfd, 1);
+			// closes the idle connections right away
+			cleanup();
+			lastCleanup = getTime();
 		}
 
-		pthread_mutex_lock(&(connection->lock));
-		connection->inUse--;
-		pthread_mutex_unlock(&(connection->lock));
-	}
-}
-void* dataThread(void* ignore) {
-	while(true) {
-		if (signal_wait(SIGIO) != 0) {
-			error("networking: data thread: sigwait: %s", strerror(errno));
-			debug("networking: data thread: waiting 1s");
-			sleep(1);
+		if (forceClose) {
+			// only the reactor frees connections; so they can't go away while we close them
+			int number = closeAll();
+			pthread_mutex_lock(&reloadLock);
+			closeAllPending = false;
+			closedByForce = number;
+			pthread_cond_broadcast(&closeAllDone);
+			pthread_mutex_unlock(&reloadLock);
+		}
+
+		if (timespacAgeMs(lastCleanup) >= CLEANUP_INTERVAl) {
+			cleanup();
+			lastCleanup = getTime();
 		}
-		dataHandler();
 	}
 }
 
-void* listenThread(void* _bind) {
-	struct bind* bindObj = (struct bind*) _bind;
-
+/*
+ * Returns the listening socket or -1.
+ */
+static int openListener(struct bind* bindObj) {
 	info("networking: Starting to listen on %s:%s", bindObj->address, bindObj->port);
 
 	struct addrinfo hints;
@@ -911,18 +3944,19 @@ void* listenThread(void* _bind) {
 	hints.ai_canonname = NULL;
 	hints.ai_addr = NULL;
 	hints.ai_next = NULL;
-	
+
 	int tmp;
 
 	tmp = getaddrinfo(bindObj->address, bindObj->port, &hints, &result);
-	if (tmp < 0) {
+	if (tmp != 0) {
 		error("networking: networking: could't get addrinfo: %s", gai_strerror(tmp));
 		warn("networking: Not listening on %s:%s", bindObj->address == NULL ? "0.0.0.0" : bindObj->address, bindObj->port);
-		return NULL;
+		return -1;
 	}
 
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		tmp = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		// the reactor accepts until there is nothing left
+		tmp = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
 
 		if (tmp == -1)
 			continue;
@@ -935,7 +3969,7 @@ void* listenThread(void* _bind) {
 			close(tmp);
 			continue;
 		}
-		
+
 		bindObj->_private.socketFd = tmp;
 
 		if (bind(tmp, rp->ai_addr, rp->ai_addrlen) == 0)
@@ -944,193 +3978,258 @@ void* listenThread(void* _bind) {
 		close(tmp);
 	}
 
+	freeaddrinfo(result);
+
 	if (rp == NULL) {
 		error("networking: Could not bind: %s", strerror(errno));
 		warn("networking: Not listening on %s:%s", bindObj->address == NULL ? "0.0.0.0" : bindObj->address, bindObj->port);
-		return NULL;
+		return -1;
 	}
 
 	if (listen(tmp, LISTEN_BACKLOG) < 0) {
 		error("networking: Could not listen.");
 		warn("networking: Not listening on %s:%s", bindObj->address == NULL ? "0.0.0.0" : bindObj->address, bindObj->port);
-		return NULL;
+		close(tmp);
+		return -1;
 	}
 
-	freeaddrinfo(result);
+	return tmp;
+}
 
-	while(true) {
-		struct sockaddr_storage client;
-		socklen_t clientSize = sizeof (client);
+pthread_t reactorThreadId;
 
-		tmp = accept(bindObj->_private.socketFd, (struct sockaddr *) &client, &clientSize);
-		if (tmp < 0) {
-			switch(errno) {
-				case ENETDOWN:
-				case EPROTO:
-				case ENOPROTOOPT:
-				case EHOSTDOWN:
-				case ENONET:
-				case EHOSTUNREACH:
-				case EOPNOTSUPP:
-				case ENETUNREACH:
-				case EAGAIN:
-				
-				case ECONNABORTED:
-				case EINTR:
-					// retry
-					break;
+static bool sameAddress(const struct bind* a, const struct bind* b) {
+	if ((a->address == NULL) != (b->address == NULL))
+		return false;
+	if (a->address != NULL && strcmp(a->address, b->address) != 0)
+		return false;
+	return strcmp(a->port, b->port) == 0 && a->ssl == b->ssl;
+}
 
-				default:
-					error("networking: Could not accept connection: %s", strerror(errno));
-					warn("networking: Not listening on %s:%s", bindObj->address == NULL ? "0.0.0.0" : bindObj->address, bindObj->port);
-					return NULL;
-			}
+static const char* addressString(const struct bind* bind) {
+	return bind->address == NULL ? "0.0.0.0" : bind->address;
+}
+
+static void closeListener(struct listener* listener) {
+	// the connections on it stay with their config until they are done
+	info("networking: No longer listening on %s:%s", addressString(listener->bind), listener->bind->port);
+	eventloop_unaccept(eventLoop, listener->fd);
+	close(listener->fd);
+	listener->fd = -1;
+	listener->bind = NULL;
+}
+
+/*
+ * Reads the listeners of the previous process from the environment.
+ */
+static void inheritListeners() {
+	const char* value = getenv(HANDOVER_LISTENERS_ENV);
+	if (value == NULL)
+		return;
+
+	char* list = strdup(value);
+	unsetenv(HANDOVER_LISTENERS_ENV);
+	if (list == NULL) {
+		error("networking: couldn't copy inherited listeners: %s", strerror(errno));
+		return;
+	}
+
+	int number = 1;
+	for (const char* c = list; *c != '\0'; c++) {
+		if (*c == ';')
+			number++;
+	}
+	inherited = malloc(number * sizeof(struct inheritedListener));
+	if (inherited == NULL) {
+		error("networking: couldn't allocate inherited listeners: %s", strerror(errno));
+		free(list);
+		return;
+	}
 
+	char* saveptr;
+	for (char* entry = strtok_r(list, ";", &saveptr); entry != NULL; entry = strtok_r(NULL, ";", &saveptr)) {
+		struct inheritedListener* listener = &(inherited[numberOfInherited]);
+		if (sscanf(entry, "%d %46s %15s", &(listener->fd), listener->address, listener->port) != 3 || listener->fd < 0) {
+			warn("networking: ignoring inherited listener '%s'", entry);
 			continue;
 		}
-		
-		struct connection* connection = malloc(sizeof (struct connection));
-		if (connection == NULL) {
-			error("networking: Couldn't allocate connection objekt: %s", strerror(errno));
+		numberOfInherited++;
+	}
+
+	free(list);
+}
+
+/*
+ * Returns the inherited listening socket for the address of bind or -1.
+ */
+static int takeInherited(struct bind* bind) {
+	const char* address = bind->address == NULL ? "*" : bind->address;
+
+	for (int i = 0; i < numberOfInherited; i++) {
+		struct inheritedListener* listener = &(inherited[i]);
+		if (listener->fd < 0 || strcmp(listener->address, address) != 0 || strcmp(listener->port, bind->port) != 0)
 			continue;
-		}
 
-		
-		struct peer peer;
-		int family = client.ss_family;
-		void* addrPtr;
+		int fd = listener->fd;
+		listener->fd = -1;
+		// it was only passed on for the exec
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		bind->_private.socketFd = fd;
 
-		if (family == AF_INET) {
-			addrPtr = &(((struct sockaddr_in*) &client)->sin_addr);
-			peer.port = ntohs(((struct sockaddr_in*) &client)->sin_port);
-		} else if (family == AF_INET6) {
-			addrPtr = &(((struct sockaddr_in6*) &client)->sin6_addr);
-			peer.port = ntohs(((struct sockaddr_in6*) &client)->sin6_port);
-		}
+		info("networking: Took over listener on %s:%s", addressString(bind), bind->port);
+		return fd;
+	}
 
-		if (inet_ntop(family, addrPtr, &(peer.addr[0]), INET6_ADDRSTRLEN + 1) == NULL) {
-			free(connection);
-			error("networking: Couldn't set peer addr string: %s", strerror(errno));
-			return NULL;
+	return -1;
+}
+
+/*
+ * Closes the inherited listeners the config doesn't use and tells the previous process we are ready.
+ */
+static void finishInheriting() {
+	for (int i = 0; i < numberOfInherited; i++) {
+		if (inherited[i].fd >= 0) {
+			info("networking: Not taking over listener on %s:%s", inherited[i].address, inherited[i].port);
+			close(inherited[i].fd);
 		}
+	}
+	free(inherited);
+	inherited = NULL;
+	numberOfInherited = 0;
 
-		struct hostent entry;
-		struct hostent* result;
-		int h_errno;
+	const char* value = getenv(HANDOVER_READY_ENV);
+	if (value == NULL)
+		return;
+	int fd = atoi(value);
+	unsetenv(HANDOVER_READY_ENV);
 
-		#define LOCAL_BUFFER_SIZE (128)	
-		char buffer[LOCAL_BUFFER_SIZE];
+	if (write(fd, "", 1) != 1)
+		error("networking: couldn't notify previous process: %s", strerror(errno));
+	close(fd);
+}
 
-		gethostbyaddr_r(&client, sizeof(client), family, &entry, &(buffer[0]), LOCAL_BUFFER_SIZE, &result, &h_errno);
-		if (result == NULL) {
-			peer.name = strdup("");
-		} else {
-			peer.name = strdup(entry.h_name);
-			if (peer.name == NULL) {
-				error("networking: Couldn't strdup hostname: %s", strerror(errno));
-				peer.name = strdup("");
-			}
+/*
+ * Makes the generation current: moves the listeners over to its binds, opens new ones and closes
+ * the ones it doesn't have. Has to be called by the reactor (or before it is started).
+ */
+static void applyGeneration(struct generation* generation) {
+	struct binds* binds = &(generation->config.binds);
+	bool used[binds->number];
+
+	// open first; a closed fd could be reused right away and get completions meant for the old socket
+	for (int i = 0; i < binds->number; i++) {
+		struct bind* bind = &(binds->binds[i]);
+		used[i] = false;
+
+		struct listener* listener = listeners;
+		for (; listener != NULL; listener = listener->next) {
+			if (listener->bind != NULL && sameAddress(listener->bind, bind))
+				break;
 		}
-		
-		if (peer.name == NULL) {
-			close(tmp);
-			free(connection);
-			error("networking: bad: strdup on empty string: %s", strerror(errno));
+		if (listener != NULL) {
+			bind->_private.socketFd = listener->fd;
+			used[i] = true;
 			continue;
 		}
 
-		snprintf(&(peer.portStr[0]), 5 + 1, "%d", peer.port);
+		int fd = takeInherited(bind);
+		if (fd < 0)
+			fd = openListener(bind);
+		if (fd < 0)
+			continue;
 
-		info("networking: new connection from %s:%s", peer.addr, peer.portStr);
+		listener = malloc(sizeof(struct listener));
+		if (listener == NULL) {
+			error("networking: Couldn't allocate listener: %s", strerror(errno));
+			close(fd);
+			continue;
+		}
 
-		#ifdef SSL_SUPPORT
-		if (bindObj->ssl_settings != NULL) {			
-			setNonBlocking(tmp, false);
+		if (eventloop_accept(eventLoop, fd, listener) < 0) {
+			error("networking: Couldn't accept on %s:%s: %s", addressString(bind), bind->port, strerror(errno));
+			free(listener);
+			close(fd);
+			continue;
+		}
 
-			struct ssl_connection* sslConnection = ssl_initConnection(bindObj->ssl_settings, tmp);
-			if (sslConnection == NULL) {
-				free(connection);
-				close(tmp);
-				error("networking: failed to open ssl connection");
-				continue;
-			}
-	
-			connection->sslConnection = sslConnection;
-			connection->readfd = sslConnection->readfd;
-			connection->writefd = sslConnection->writefd;
+		*listener = (struct listener) {
+			.fd = fd,
+			.bind = bind,
+			.next = listeners
+		};
+		listeners = listener;
+		used[i] = true;
+	}
 
-			setNonBlocking(connection->readfd, true);
-			setSIGIO(connection->readfd, true);	
-		} else {
-			connection->sslConnection = NULL;
-
-			connection->readfd = tmp;
-			connection->writefd = dup(tmp);
-			if (connection->writefd < 0) {
-				error("networking: listen: dup: %s", strerror(errno));
-				free(connection);
-				close(tmp);
-				continue;
-			}
+	for (struct listener* listener = listeners; listener != NULL; listener = listener->next) {
+		if (listener->bind == NULL)
+			continue;
 
-			setNonBlocking(tmp, true);
-			setSIGIO(tmp, true);	
-		}
-		#else 
-			connection->readfd = tmp;
-			connection->writefd = dup(tmp);
-			if (connection->writefd < 0) {
-				error("networking: listen: dup: %s", strerror(errno));
-				free(connection);
-				close(tmp);
-				continue;
+		struct bind* bind = NULL;
+		for (int i = 0; i < binds->number; i++) {
+			if (used[i] && sameAddress(listener->bind, &(binds->binds[i]))) {
+				bind = &(binds->binds[i]);
+				break;
 			}
+		}
 
-			setNonBlocking(tmp, true);
-			setSIGIO(tmp, true);
-		#endif
-
-		// lock doesn't yet exist
-		connection->state = OPENED;
-		connection->peer = peer;
-		connection->bind = bindObj;
-		connection->metaData = (struct metaData) {
-			.path = NULL,
-			.queryString = NULL
-		};
-		connection->headers = headers_create();
-		connection->threads = (struct threads) {
-			/*
-			 * This is really hacky. pthread_t is no(t always an) integer.
-			 * TODO: better solution
-			 */
-			.request = PTHREAD_NULL,
-			.response = PTHREAD_NULL,
-			.encoder = PTHREAD_NULL,
-			.handler = {},
-		};
-		connection->currentHeaderLength = 0;
-		connection->currentHeader = NULL;
-		connection->inUse = 0;
-		pthread_mutex_init(&connection->lock, NULL);
-		updateTiming(connection, false);
+		if (bind == NULL)
+			closeListener(listener);
+		else
+			listener->bind = bind;
+	}
 
-		linked_push(&connectionList, connection);
+	struct generation* old = currentGeneration;
+	currentGeneration = generation;
+	networkingConfig.accessLogFormat = generation->config.accessLogFormat;
+	networkingConfig.maxConnections = generation->config.maxConnections;
+	networkingConfig.maxConnectionsPerPeer = generation->config.maxConnectionsPerPeer;
+	networkingConfig.maxHandlers = generation->config.maxHandlers;
+	networkingConfig.rateLimit = generation->config.rateLimit;
+	networkingConfig.headerTimeout = generation->config.headerTimeout;
+	networkingConfig.minReceiveRate = generation->config.minReceiveRate;
+	networkingConfig.maxHeaderSize = generation->config.maxHeaderSize;
+	networkingConfig.maxHeaders = generation->config.maxHeaders;
+	networkingConfig.minSendRate = generation->config.minSendRate;
+	networkingConfig.responseBuffer = generation->config.responseBuffer;
+	networkingConfig.responseBufferTotal = generation->config.responseBufferTotal;
+	if (networkingConfig.shedTarget != generation->config.shedTarget || networkingConfig.shedInterval != generation->config.shedInterval) {
+		networkingConfig.shedTarget = generation->config.shedTarget;
+		networkingConfig.shedInterval = generation->config.shedInterval;
+		codel_init(&codel, networkingConfig.shedTarget, networkingConfig.shedInterval);
+	}
 
-		// trigger sigio in case we missed something
-		kill(getpid(), SIGIO);
+	if (old != NULL) {
+		info("networking: config reloaded");
+		releaseGeneration(old);
 	}
 }
 
-void* cleanupThread(void* _) {
-	while(true) {
-		if (signal_wait(SIGALRM) != 0) {
-			error("networking: clean up thread: sigwait: %s", strerror(errno));
-			debug("networking: clean up thread: waiting 1s");
-			sleep(1);
-		}
-		cleanup();
+static void buildRejectResponses() {
+	FILE* stream = open_memstream(&rejectResponse, &rejectResponseLength);
+	if (stream == NULL) {
+		error("networking: Couldn't build 503 response: %s", strerror(errno));
+		return;
+	}
+
+	fprintf(stream, "HTTP/1.1 503 Service Unavailable\r\n");
+	for (int i = 0; i < networkingConfig.defaultHeaders.number; i++) {
+		fprintf(stream, "%s: %s\r\n", networkingConfig.defaultHeaders.headers[i].key, networkingConfig.defaultHeaders.headers[i].value);
 	}
+	fprintf(stream, "Retry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	fclose(stream);
+
+	stream = open_memstream(&limitedHeader, &limitedHeaderLength);
+	if (stream == NULL) {
+		error("networking: Couldn't build 429 response: %s", strerror(errno));
+		return;
+	}
+
+	fprintf(stream, "HTTP/1.1 429 Too Many Requests\r\n");
+	for (int i = 0; i < networkingConfig.defaultHeaders.number; i++) {
+		fprintf(stream, "%s: %s\r\n", networkingConfig.defaultHeaders.headers[i].key, networkingConfig.defaultHeaders.headers[i].value);
+	}
+	fclose(stream);
 }
 
 void networking_init(struct networkingConfig _networkingConfig) {
@@ -1139,37 +4238,242 @@ void networking_init(struct networkingConfig _networkingConfig) {
 	connectionList = linked_create();
 	connectionsToFree = linked_create();
 
-	signal_block(SIGIO);
-	signal_block(SIGALRM);
-	
+	codel_init(&codel, networkingConfig.shedTarget, networkingConfig.shedInterval);
+	buildRejectResponses();
+
 	// in case a pipe breaks
 	signal_block(SIGPIPE);
 
-	if (pthread_create(&dataThreadId, NULL, &cleanupThread, NULL) != 0) {
-		critical("networking: Couldn't start data thread.");
+	eventLoop = eventloop_create(RECEIVE_BUFFER_SIZE);
+	if (eventLoop == NULL) {
+		critical("networking: Couldn't create event loop.");
 		return;
 	}
+	info("networking: using %s event loop", eventloop_backend());
+
+	drainfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (drainfd < 0)
+		warn("networking: couldn't create drain notification; HTTP/2 sessions won't see a drain: %s", strerror(errno));
 
-	timer_t timer = timer_createSignalTimer(SIGALRM);
-	if (timer == NULL) {
-		critical("networking: Couldn't create cleaup timer.");
+	struct generation* generation = malloc(sizeof(struct generation));
+	if (generation == NULL) {
+		critical("networking: Couldn't allocate config: %s", strerror(errno));
 		return;
 	}
-	if (timer_startInterval(timer, CLEANUP_INTERVAl) < 0) {
-		critical("networking: Couldn't start cleaup timer.");
+	*generation = (struct generation) {
+		.config = networkingConfig,
+		.references = 1
+	};
+	inheritListeners();
+	applyGeneration(generation);
+
+	if (pthread_create(&reactorThreadId, NULL, &reactorThread, NULL) != 0) {
+		critical("networking: Couldn't start reactor thread.");
 		return;
 	}
 
-	if (pthread_create(&dataThreadId, NULL, &dataThread, NULL) != 0) {
-		critical("networking: Couldn't start data thread.");
+	finishInheriting();
+}
+
+void networking_reload(struct networkingConfig networkingConfig) {
+	struct generation* generation = malloc(sizeof(struct generation));
+	if (generation == NULL) {
+		error("networking: Couldn't allocate config: %s", strerror(errno));
+		if (networkingConfig.release != NULL)
+			networkingConfig.release(&networkingConfig);
 		return;
 	}
+	*generation = (struct generation) {
+		.config = networkingConfig,
+		.references = 1
+	};
+
+	pthread_mutex_lock(&reloadLock);
+	struct generation* skipped = nextGeneration;
+	nextGeneration = generation;
+	pthread_mutex_unlock(&reloadLock);
+
+	if (skipped != NULL) {
+		// the reactor didn't get to it before the next reload
+		releaseGeneration(skipped);
+	}
 
-	for(int i = 0; i < networkingConfig.binds.number; i++) {
-		struct bind* bind = &(networkingConfig.binds.binds[i]);
-		if (pthread_create(&(bind->_private.threadId), NULL, &listenThread, bind) != 0) {
-			critical("networking: Couldn't start data thread.");
-			return;
+	eventloop_wakeup(eventLoop);
+}
+
+pid_t networking_handOver(const char* path, char* const argv[]) {
+	int readyPipe[2];
+	if (pipe2(readyPipe, O_CLOEXEC) < 0) {
+		error("networking: couldn't create pipe for hand over: %s", strerror(errno));
+		return -1;
+	}
+
+	char* list = NULL;
+	size_t listLength = 0;
+	FILE* stream = open_memstream(&list, &listLength);
+	if (stream == NULL) {
+		error("networking: couldn't allocate listener list: %s", strerror(errno));
+		close(readyPipe[0]);
+		close(readyPipe[1]);
+		return -1;
+	}
+
+	pthread_mutex_lock(&reloadLock);
+
+	int number = 0;
+	for (struct listener* listener = listeners; listener != NULL; listener = listener->next) {
+		if (listener->fd >= 0)
+			number++;
+	}
+
+	// the new process gets the listeners as fd 3 and up and the ready pipe after them;
+	// the copies are above that so the dup2s of the spawn don't overwrite each other
+	int firstFree = 3 + number + 1;
+	int copies[number + 1];
+	int copied = 0;
+	for (struct listener* listener = listeners; listener != NULL; listener = listener->next) {
+		if (listener->fd < 0)
+			continue;
+		copies[copied] = fcntl(listener->fd, F_DUPFD_CLOEXEC, firstFree);
+		if (copies[copied] < 0)
+			break;
+		fprintf(stream, "%s%d %s %s", copied > 0 ? ";" : "", 3 + copied, listener->bind->address == NULL ? "*" : listener->bind->address, listener->bind->port);
+		copied++;
+	}
+
+	pthread_mutex_unlock(&reloadLock);
+
+	fclose(stream);
+
+	pid_t pid = -1;
+	int tmp = 0;
+
+	if (copied < number) {
+		error("networking: couldn't copy listener: %s", strerror(errno));
+		tmp = -1;
+	} else {
+		copies[copied] = fcntl(readyPipe[1], F_DUPFD_CLOEXEC, firstFree);
+		if (copies[copied] < 0) {
+			error("networking: couldn't copy pipe: %s", strerror(errno));
+			tmp = -1;
+		} else {
+			copied++;
+		}
+	}
+
+	if (tmp == 0) {
+		char readyFd[16];
+		snprintf(readyFd, sizeof(readyFd), "%d", 3 + number);
+
+		struct headers env = headers_create();
+		headers_mod(&env, HANDOVER_LISTENERS_ENV, list);
+		headers_mod(&env, HANDOVER_READY_ENV, readyFd);
+		char** envp = cgi_buildEnvp(&env);
+		headers_free(&env);
+
+		posix_spawn_file_actions_t actions;
+		posix_spawnattr_t attributes;
+		posix_spawn_file_actions_init(&actions);
+		posix_spawnattr_init(&attributes);
+
+		for (int i = 0; i < copied; i++) {
+			if (tmp == 0)
+				tmp = posix_spawn_file_actions_adddup2(&actions, copies[i], 3 + i);
 		}
+		// neither client connections nor pipes of handlers
+		if (tmp == 0)
+			tmp = posix_spawn_file_actions_addclosefrom_np(&actions, firstFree);
+
+		// we block some signals; the new process sets up its own mask
+		sigset_t mask;
+		sigemptyset(&mask);
+		if (tmp == 0)
+			tmp = posix_spawnattr_setsigmask(&attributes, &mask);
+		if (tmp == 0)
+			tmp = posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+		if (tmp == 0 && envp == NULL)
+			tmp = errno;
+		if (tmp == 0)
+			tmp = posix_spawn(&pid, path, &actions, &attributes, argv, envp);
+		if (tmp != 0) {
+			error("networking: couldn't start %s: %s", path, strerror(tmp));
+			pid = -1;
+		}
+
+		posix_spawnattr_destroy(&attributes);
+		posix_spawn_file_actions_destroy(&actions);
+		free(envp);
+	}
+
+	for (int i = 0; i < copied; i++) {
+		close(copies[i]);
+	}
+	close(readyPipe[1]);
+	free(list);
+
+	if (pid < 0) {
+		close(readyPipe[0]);
+		return -1;
+	}
+
+	info("networking: started %s (pid %d); waiting for it to take over", path, pid);
+
+	// EOF if it exited without taking over
+	char ready;
+	tmp = poll(&(struct pollfd) { .fd = readyPipe[0], .events = POLLIN }, 1, HANDOVER_TIMEOUT);
+	if (tmp == 1)
+		tmp = read(readyPipe[0], &ready, 1);
+	close(readyPipe[0]);
+
+	if (tmp != 1) {
+		error("networking: new process didn't take over; keeping the listeners");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
 	}
+
+	return pid;
+}
+
+void networking_drain() {
+	info("networking: draining connections");
+
+	pthread_mutex_lock(&reloadLock);
+	__atomic_store_n(&draining, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&reloadLock);
+
+	eventloop_wakeup(eventLoop);
+}
+
+long networking_connectionTimeout() {
+	return networkingConfig.connectionTimeout;
+}
+
+int networking_connections() {
+	return linked_length(&connectionList) + linked_length(&connectionsToFree);
+}
+
+int networking_drainfd() {
+	return drainfd;
+}
+
+int networking_drained() {
+	return __atomic_load_n(&drainedConnections, __ATOMIC_RELAXED);
+}
+
+int networking_closeAll() {
+	pthread_mutex_lock(&reloadLock);
+	closeAllPending = true;
+	pthread_mutex_unlock(&reloadLock);
+
+	eventloop_wakeup(eventLoop);
+
+	pthread_mutex_lock(&reloadLock);
+	while (closeAllPending)
+		pthread_cond_wait(&closeAllDone, &reloadLock);
+	int number = closedByForce;
+	pthread_mutex_unlock(&reloadLock);
+
+	return number;
 }
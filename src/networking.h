@@ -2,6 +2,7 @@
 #define NETWORKING_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <signal.h>
@@ -11,11 +12,26 @@
 
 #include "headers.h"
 #include "misc.h"
+#include "ratelimit.h"
+#include "accesslog.h"
 
 #ifdef SSL_SUPPORT
 #include "ssl.h"
 #endif
 
+#define RECEIVE_BUFFER_SIZE (4096)
+
+// max number of pipelined requests per connection that are processed concurrently
+#define PIPELINE_MAX_DEPTH (16)
+// pipe size for responses that have to wait for earlier ones
+#define PIPELINE_BUFFER_SIZE (1 << 20)
+// what the reactor reads of a buffered response at once
+#define OUTPUT_CHUNK_SIZE (16384)
+// room for the size line of a chunk (chunked transfer encoding)
+#define OUTPUT_CHUNK_HEADER (16)
+// what a coroutine handler splices to the socket at once; one full pipe buffer
+#define RELAY_SPLICE_SIZE (65536)
+
 #define NR_CONNECTION_STATE (5)
 enum connectionState {
 	OPENED = 0,
@@ -29,6 +45,18 @@ enum connectionState {
 struct timing {
 	struct timespec states[NR_CONNECTION_STATE];
 	struct timespec lastUpdate;
+
+	// first byte of the request that is currently being parsed
+	struct timespec requestStart;
+};
+
+// per request
+struct exchangeTiming {
+	struct timespec requestStart;
+	struct timespec headersEnd;
+	struct timespec handlerStart;
+	struct timespec handlerEnd;
+	struct timespec firstByte;
 };
 
 typedef struct handler (*handlerGetter_t)(struct metaData metaData, const char* host, struct bind* bind);
@@ -37,26 +65,214 @@ struct threads {
 	pthread_t request;
 	pthread_t response;
 	pthread_t encoder;
+	pthread_t body;
 	struct handler handler;
 };
 
+enum bodyFraming {
+	BODY_NONE,
+	BODY_LENGTH,
+	BODY_CHUNKED
+};
+
+// request body of the current request
+struct body {
+	enum bodyFraming framing;
+	// announced length; only valid for BODY_LENGTH
+	size_t length;
+	size_t received;
+	// status code to answer with if the body is not acceptable; 0 otherwise
+	int status;
+	bool expectContinue;
+	bool complete;
+	bool splice;
+	// the handler reads the decoded body from readfd; the body thread feeds writefd
+	int readfd;
+	int writefd;
+};
+
+struct connection;
+struct listener;
+struct generation;
+
+// part of a buffered response; data[start] to data[end] is still to be sent
+struct outputChunk {
+	struct outputChunk* next;
+	size_t start;
+	size_t end;
+	char data[];
+};
+
+/*
+ * Response the reactor sends for the handler (see networkingConfig.responseBuffer).
+ * The handler writes into a pipe; the reactor reads it as long as the queue is below the limits
+ * and writes the queue to the socket without blocking. Only touched by the reactor.
+ * Reactor handlers (struct reactorHandler) queue their response directly; there is no pipe then.
+ */
+struct output {
+	// NULL if no response is buffered
+	struct exchange* exchange;
+	// read end of the pipe; -1 once it is closed
+	int readfd;
+	// the socket
+	int fd;
+	bool chunked;
+	// networkingConfig.responseBuffer when the response started
+	size_t limit;
+	// set by the reactor once it took over
+	bool started;
+	bool eof;
+	bool failed;
+	// a poll is pending on readfd or fd
+	bool reading;
+	bool writing;
+	// waiting for memory (networkingConfig.responseBufferTotal)
+	bool stalled;
+	// a poll is pending for a coroutine handler (see struct exchangeCoroutine)
+	bool polling;
+	// the reactor handler queued something since onWritable was called
+	bool refilled;
+	struct connection* nextStalled;
+	size_t queued;
+	// body bytes read from the handler
+	size_t total;
+	struct outputChunk* first;
+	struct outputChunk* last;
+};
+
+enum coroutineWait {
+	COROUTINE_RUNNING,
+	// more of the request body
+	COROUTINE_WAIT_BODY,
+	// the queued response is sent
+	COROUTINE_WAIT_SENT,
+	// an fd of the handler is ready
+	COROUTINE_WAIT_FD
+};
+
+/*
+ * A coroutine handler (see coroutine_t) on the reactor; only touched by the reactor.
+ */
+struct exchangeCoroutine {
+	struct coroutine* coroutine;
+	enum coroutineWait waitingFor;
+	// body that arrived but wasn't read yet
+	char* pending;
+	size_t pendingOffset;
+	size_t pendingLength;
+	size_t pendingSize;
+	// the rest of the body stays in the connection buffer while the handler doesn't read
+	bool paused;
+	// of COROUTINE_WAIT_FD
+	int fd;
+	// the body is chunk encoded (see coroutineResponse.sendHeader)
+	bool chunked;
+	// the exchange is over; every call fails from now on
+	bool failed;
+};
+
+/*
+ * One request and its response. If the client pipelines there can be
+ * several exchanges per connection; their responses are sent in order.
+ */
+struct exchange {
+	struct connection* connection;
+	struct exchange* next;
+	// position on the connection (starting at 1)
+	int number;
+	// of the config that was current when the request arrived
+	struct bind* bind;
+	struct generation* generation;
+	struct metaData metaData;
+	struct headers headers;
+	struct exchangeTiming timing;
+	struct threads threads;
+	struct body body;
+	bool isPersistent;
+	bool isChunked;
+	// the response goes through the encoder thread or the reactor
+	bool isRelayed;
+	bool handlerDone;
+	// the reactor sent the buffered response
+	bool outputDone;
+	// the handler runs on the reactor (see struct reactorHandler)
+	bool inReactor;
+	bool reactorStarted;
+	// what the reactor handler gets; only touched by the reactor
+	struct request request;
+	struct exchangeCoroutine coroutine;
+	bool completed;
+	bool timedOut;
+	// admission control; see startRequestHandler
+	bool hasSlot;
+	bool waiting;
+	// status of the pre-serialized answer (503 or 429) if the handler doesn't run; 0 otherwise
+	int rejected;
+	int retryAfter;
+	long queued;
+	struct exchange* nextWaiting;
+	struct exchange* previousWaiting;
+	struct {
+		int statusCode;
+		size_t headerBytes;
+		size_t bodyBytes;
+	} response;
+};
+
 struct connection {
 	enum connectionState state;
 	struct peer peer;
+	// of the config the last request used (HTTP/1) or the connection was accepted with
 	struct bind* bind;
+	struct generation* generation;
+	struct listener* listener;
 	pthread_mutex_t lock;
-	pthread_mutex_t resetOkay;
+	// signaled when the first exchange changes or a handler returns
+	pthread_cond_t turn;
 	volatile sig_atomic_t inUse;
 	int readfd;
 	int writefd;
+	// request that is currently being parsed
 	struct metaData metaData;
 	struct headers headers;
 	size_t currentHeaderLength;
 	char* currentHeader;
+	// received but not yet parsed
+	char buffer[RECEIVE_BUFFER_SIZE];
+	size_t bufferOffset;
+	size_t bufferLength;
 	struct timing timing;
-	struct threads threads;
-	bool isPersistent;
-	bool isChunked;
+	// of the request that is currently being parsed
+	size_t headerBytes;
+	int headerCount;
+	// sent instead of 408 once the connection is aborted
+	int errorStatus;
+	// bytes the client acknowledged since drainSince; the window starts once a response is stuck in the socket
+	long drainAcked;
+	struct timespec drainSince;
+	// buffered response of the first exchange
+	struct output output;
+	// exchanges in the order the requests arrived; only the first one may write to the socket
+	struct exchange* first;
+	struct exchange* last;
+	int pending;
+	// finished exchanges whose threads have to be joined
+	struct exchange* done;
+	// the body thread owns the socket until the body is read
+	bool readingBody;
+	// unless the reactor reads it for the handler of this exchange
+	struct exchange* bodyExchange;
+	// a read is pending on the event loop
+	bool armed;
+	// last read of the reactor: 1 if there was data, 0 on EOF, -errno on error
+	int readStatus;
+	// queued for the reactor
+	bool scheduled;
+	struct connection* nextScheduled;
+	bool aborting;
+	// closed by networking_closeAll
+	bool forced;
+	int requests;
 	#ifdef SSL_SUPPORT
 	struct ssl_connection* sslConnection;
 	#endif
@@ -70,9 +286,35 @@ struct binds {
 struct networkingConfig {
 	struct binds binds;
 	long connectionTimeout;
+	// 0 means no limit for these
 	long maxConnections;
+	long maxConnectionsPerPeer;
+	long maxHandlers;
+	// ms; see struct codel; a target of 0 turns shedding off
+	long shedTarget;
+	long shedInterval;
+	// per peer; checked before a request gets a handler slot
+	struct rateLimit rateLimit;
+	// slow clients; 0 turns each of these off
+	// ms from the first byte of a request until its headers are complete
+	long headerTimeout;
+	// bytes/s while the headers are read
+	long minReceiveRate;
+	// bytes of request line and headers
+	long maxHeaderSize;
+	long maxHeaders;
+	// bytes/s the client has to take off a response that is waiting to be sent
+	long minSendRate;
+	// bytes of a response the reactor buffers so that the handler can return early; 0 turns buffering off (plain TCP only)
+	long responseBuffer;
+	// of all connections together
+	long responseBufferTotal;
 	struct headers defaultHeaders;
 	handlerGetter_t getHandler;
+	enum accessLogFormat accessLogFormat;
+	// called once a config that was replaced by networking_reload isn't used anymore (may be NULL)
+	void (*release)(struct networkingConfig* networkingConfig);
+	void* data;
 };
 
 #define CLEANUP_INTERVAl (1000)
@@ -82,8 +324,65 @@ struct networkingConfig {
 #define TIMING_CLOCK CLOCK_REALTIME
 
 #define DEFAULT_MAX_CONNECTIONS (1024)
+#define DEFAULT_MAX_CONNECTIONS_PER_PEER (0)
+// requests beyond this wait for a handler
+#define DEFAULT_MAX_HANDLERS (256)
 #define DEFAULT_CONNECTION_TIMEOUT (30000)
+#define DEFAULT_HEADER_TIMEOUT (10000)
+#define DEFAULT_MIN_RECEIVE_RATE (100)
+#define DEFAULT_MAX_HEADER_SIZE (16384)
+#define DEFAULT_MAX_HEADERS (100)
+#define DEFAULT_MIN_SEND_RATE (100)
+// ms the data rates are measured over
+#define RATE_WINDOW (2000)
+#define DEFAULT_RESPONSE_BUFFER (0)
+#define DEFAULT_RESPONSE_BUFFER_TOTAL (64 * 1024 * 1024)
+// 0 means no limit
+#define DEFAULT_MAX_BODY_SIZE (0)
+
+#define BODY_BUFFER_SIZE (8192)
+#define BODY_SPLICE_SIZE (65536)
+#define BODY_MAX_LINE_LENGTH (1024)
+
+/*
+ * Contract between a server and the one networking_handOver starts:
+ * the listening sockets are inherited as "fd address port" entries separated by ";" (address "*" for any)
+ * and the new process writes a byte to the ready fd once it accepts connections.
+ */
+#define HANDOVER_LISTENERS_ENV "CFLOOR_LISTENERS"
+#define HANDOVER_READY_ENV "CFLOOR_READY_FD"
+// ms to wait for the new process
+#define HANDOVER_TIMEOUT (10000)
 
 void networking_init(struct networkingConfig networkingConfig);
+/*
+ * Replaces binds, sites and handlers (and the access log format, the limits and the rate limit);
+ * everything else stays as it was at networking_init.
+ * Listeners of binds that are still there are kept, new ones are opened and removed ones closed.
+ * Requests that are already running finish with the old config; it is released after the last one.
+ */
+void networking_reload(struct networkingConfig networkingConfig);
+/*
+ * Starts path with argv and passes the listening sockets on; the new process takes them over
+ * in networking_init instead of opening its own. Returns the pid once it accepts connections or -1.
+ */
+pid_t networking_handOver(const char* path, char* const argv[]);
+/*
+ * Stops accepting connections. Idle connections are closed right away; the next response
+ * on a keep-alive connection gets "Connection: close".
+ */
+void networking_drain();
+// connections that are not closed yet
+int networking_connections();
+// in ms; how long handlers on a thread wait for a slow client (see struct request)
+long networking_connectionTimeout();
+// returns a 429 handler instead of handler if addr is over serverLimit (may be NULL) or the limit of the handler
+struct handler networking_limitHandler(struct handler handler, const struct rateLimit* serverLimit, const char* addr);
+// connections that were closed after networking_drain without being forced
+int networking_drained();
+// readable once the drain started (it is never reset); -1 if it couldn't be created
+int networking_drainfd();
+// closes all connections that are still open on the reactor and waits for it; running handlers can't write anymore. Returns how many.
+int networking_closeAll();
 
 #endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+
+#define BUCKETS (RATELIMIT_SHARD_SIZE * 2)
+// tokens are counted in millionths; a second of refill adds rate * TOKEN
+#define TOKEN (1000000L)
+
+struct entry {
+	char addr[INET6_ADDRSTRLEN + 1];
+	const struct rateLimit* limit;
+	long tokens;
+	// µs
+	long updated;
+
+	struct entry* nextInBucket;
+	// LRU list; most recently used first
+	struct entry* newer;
+	struct entry* older;
+};
+
+static struct shard {
+	pthread_mutex_t lock;
+	struct entry entries[RATELIMIT_SHARD_SIZE];
+	int numberOfEntries;
+	struct entry* buckets[BUCKETS];
+	struct entry* newest;
+	struct entry* oldest;
+} shards[RATELIMIT_SHARDS];
+
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+static void init() {
+	for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+		pthread_mutex_init(&(shards[i].lock), NULL);
+	}
+}
+
+static unsigned int hash(const struct rateLimit* limit, const char* addr) {
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (const char* c = addr; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	hash ^= (unsigned int) ((size_t) limit >> 4);
+	hash *= 16777619u;
+
+	return hash;
+}
+
+static void unlinkLRU(struct shard* shard, struct entry* entry) {
+	if (entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		shard->newest = entry->older;
+	if (entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		shard->oldest = entry->newer;
+}
+
+static void pushLRU(struct shard* shard, struct entry* entry) {
+	entry->older = shard->newest;
+	entry->newer = NULL;
+	if (shard->newest != NULL)
+		shard->newest->newer = entry;
+	shard->newest = entry;
+	if (shard->oldest == NULL)
+		shard->oldest = entry;
+}
+
+// has to be called with the lock of the shard held
+static struct entry* getEntry(struct shard* shard, struct entry** bucket, const struct rateLimit* limit, const char* addr, long now) {
+	for (struct entry* entry = *bucket; entry != NULL; entry = entry->nextInBucket) {
+		if (entry->limit == limit && strcmp(entry->addr, addr) == 0) {
+			if (entry != shard->newest) {
+				unlinkLRU(shard, entry);
+				pushLRU(shard, entry);
+			}
+			return entry;
+		}
+	}
+
+	struct entry* entry;
+	if (shard->numberOfEntries < RATELIMIT_SHARD_SIZE) {
+		entry = &(shard->entries[shard->numberOfEntries++]);
+	} else {
+		entry = shard->oldest;
+		unlinkLRU(shard, entry);
+
+		struct entry** pointer = &(shard->buckets[hash(entry->limit, entry->addr) / RATELIMIT_SHARDS % BUCKETS]);
+		while (*pointer != entry)
+			pointer = &((*pointer)->nextInBucket);
+		*pointer = entry->nextInBucket;
+	}
+
+	strncpy(entry->addr, addr, INET6_ADDRSTRLEN);
+	entry->addr[INET6_ADDRSTRLEN] = '\0';
+	entry->limit = limit;
+	entry->tokens = (limit->burst > 0 ? limit->burst : limit->rate) * TOKEN;
+	entry->updated = now;
+
+	entry->nextInBucket = *bucket;
+	*bucket = entry;
+	pushLRU(shard, entry);
+
+	return entry;
+}
+
+long ratelimit_take(const struct rateLimit* limit, const char* addr, long now) {
+	if (limit == NULL || limit->rate <= 0)
+		return 0;
+
+	pthread_once(&initialized, &init);
+
+	unsigned int value = hash(limit, addr);
+	struct shard* shard = &(shards[value % RATELIMIT_SHARDS]);
+
+	pthread_mutex_lock(&(shard->lock));
+	struct entry* entry = getEntry(shard, &(shard->buckets[value / RATELIMIT_SHARDS % BUCKETS]), limit, addr, now);
+
+	long capacity = (limit->burst > 0 ? limit->burst : limit->rate) * TOKEN;
+	long elapsed = now - entry->updated;
+	if (elapsed > 0) {
+		// µs * requests/s = millionths of a request
+		if (elapsed >= (capacity - entry->tokens) / limit->rate)
+			entry->tokens = capacity;
+		else
+			entry->tokens += elapsed * limit->rate;
+		entry->updated = now;
+	}
+
+	long retryAfter = 0;
+	if (entry->tokens >= TOKEN) {
+		entry->tokens -= TOKEN;
+	} else {
+		long missing = (TOKEN - entry->tokens + limit->rate - 1) / limit->rate;
+		retryAfter = (missing + 999999) / 1000000;
+	}
+	pthread_mutex_unlock(&(shard->lock));
+
+	return retryAfter;
+}
+
+long ratelimit_check(const struct rateLimit* limit, const char* addr) {
+	if (limit == NULL || limit->rate <= 0)
+		return 0;
+
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return ratelimit_take(limit, addr, time.tv_sec * 1000000 + time.tv_nsec / 1000);
+}
+
+void ratelimit_flush() {
+	pthread_once(&initialized, &init);
+
+	for (int i = 0; i < RATELIMIT_SHARDS; i++) {
+		struct shard* shard = &(shards[i]);
+		pthread_mutex_lock(&(shard->lock));
+		shard->numberOfEntries = 0;
+		memset(shard->buckets, 0, sizeof(shard->buckets));
+		shard->newest = NULL;
+		shard->oldest = NULL;
+		pthread_mutex_unlock(&(shard->lock));
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/*
+ * Token buckets per peer address and limit.
+ * The buckets live in a fixed number of shards with a fixed number of entries each;
+ * if a shard is full the least recently used bucket is dropped (that peer starts over with a full bucket).
+ */
+
+#define RATELIMIT_SHARDS (16)
+// buckets per shard
+#define RATELIMIT_SHARD_SIZE (1024)
+
+struct rateLimit {
+	// requests per second; 0 means no limit
+	long rate;
+	// requests a peer may send at once; 0 means rate
+	long burst;
+};
+
+/*
+ * Takes a token from the bucket of addr for limit; now is in µs.
+ * Returns 0 if there was one, otherwise the seconds until there is one again.
+ * limit may be NULL.
+ */
+long ratelimit_take(const struct rateLimit* limit, const char* addr, long now);
+// the same with the current time
+long ratelimit_check(const struct rateLimit* limit, const char* addr);
+// drops all buckets
+void ratelimit_flush();
+
+#endif
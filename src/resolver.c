@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "resolver.h"
+#include "logging.h"
+#include "metrics.h"
+
+#define BUCKETS (RESOLVER_CACHE_SIZE * 2)
+
+struct entry {
+	char addr[INET6_ADDRSTRLEN + 1];
+	// NULL while pending or if the address has no name
+	char* name;
+	bool pending;
+	time_t expires;
+
+	struct entry* nextInBucket;
+	// LRU list; most recently used first
+	struct entry* newer;
+	struct entry* older;
+	// lookup queue
+	struct entry* nextQueued;
+};
+
+static struct entry entries[RESOLVER_CACHE_SIZE];
+static int numberOfEntries = 0;
+// flushed entries; linked with nextInBucket
+static struct entry* unused = NULL;
+static struct entry* buckets[BUCKETS];
+static struct entry* newest = NULL;
+static struct entry* oldest = NULL;
+
+static struct entry* queueHead = NULL;
+static struct entry* queueTail = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// signaled whenever a lookup is queued
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+// signaled whenever a lookup finishes
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static bool workersStarted = false;
+
+static char* reverseLookup(const char* addr);
+static resolverBackend_t backend = &reverseLookup;
+
+static time_t now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec;
+}
+
+static struct entry** getBucket(const char* addr) {
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (const char* c = addr; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+
+	return &(buckets[hash % BUCKETS]);
+}
+
+static struct entry* findEntry(const char* addr) {
+	for (struct entry* entry = *getBucket(addr); entry != NULL; entry = entry->nextInBucket) {
+		if (strcmp(entry->addr, addr) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static void unlinkLRU(struct entry* entry) {
+	if (entry->newer != NULL)
+		entry->newer->older = entry->older;
+	else
+		newest = entry->older;
+	if (entry->older != NULL)
+		entry->older->newer = entry->newer;
+	else
+		oldest = entry->newer;
+
+	entry->newer = NULL;
+	entry->older = NULL;
+}
+
+static void pushLRU(struct entry* entry) {
+	entry->older = newest;
+	entry->newer = NULL;
+	if (newest != NULL)
+		newest->newer = entry;
+	newest = entry;
+	if (oldest == NULL)
+		oldest = entry;
+}
+
+static void removeEntry(struct entry* entry) {
+	struct entry** pointer = getBucket(entry->addr);
+	while (*pointer != entry)
+		pointer = &((*pointer)->nextInBucket);
+	*pointer = entry->nextInBucket;
+
+	unlinkLRU(entry);
+
+	free(entry->name);
+	entry->name = NULL;
+	entry->addr[0] = '\0';
+}
+
+/*
+ * Returns an unused entry; evicts the least recently used one that isn't being looked up if the cache is full.
+ * Returns NULL if every entry is still pending.
+ */
+static struct entry* newEntry() {
+	if (unused != NULL) {
+		struct entry* entry = unused;
+		unused = entry->nextInBucket;
+		return entry;
+	}
+	if (numberOfEntries < RESOLVER_CACHE_SIZE)
+		return &(entries[numberOfEntries++]);
+
+	for (struct entry* entry = oldest; entry != NULL; entry = entry->newer) {
+		if (!entry->pending) {
+			removeEntry(entry);
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static char* reverseLookup(const char* addr) {
+	struct sockaddr_storage address = {};
+	socklen_t length;
+
+	if (strchr(addr, ':') != NULL) {
+		struct sockaddr_in6* in6 = (struct sockaddr_in6*) &address;
+		in6->sin6_family = AF_INET6;
+		if (inet_pton(AF_INET6, addr, &(in6->sin6_addr)) != 1)
+			return NULL;
+		length = sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in* in = (struct sockaddr_in*) &address;
+		in->sin_family = AF_INET;
+		if (inet_pton(AF_INET, addr, &(in->sin_addr)) != 1)
+			return NULL;
+		length = sizeof(struct sockaddr_in);
+	}
+
+	char name[NI_MAXHOST];
+	int tmp = getnameinfo((struct sockaddr*) &address, length, name, sizeof(name), NULL, 0, NI_NAMEREQD);
+	if (tmp != 0) {
+		debug("resolver: no name for %s: %s", addr, gai_strerror(tmp));
+		return NULL;
+	}
+
+	return strdup(name);
+}
+
+static void* workerThread(void* data) {
+	pthread_mutex_lock(&lock);
+	while (true) {
+		while (queueHead == NULL)
+			pthread_cond_wait(&queued, &lock);
+
+		struct entry* entry = queueHead;
+		queueHead = entry->nextQueued;
+		if (queueHead == NULL)
+			queueTail = NULL;
+		entry->nextQueued = NULL;
+
+		char addr[INET6_ADDRSTRLEN + 1];
+		strcpy(addr, entry->addr);
+		resolverBackend_t lookup = backend;
+
+		pthread_mutex_unlock(&lock);
+		char* name = lookup(addr);
+		pthread_mutex_lock(&lock);
+
+		// pending entries are never evicted; so this is still ours
+		entry->name = name;
+		entry->pending = false;
+		entry->expires = now() + (name != NULL ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+		pthread_cond_broadcast(&finished);
+	}
+
+	return NULL;
+}
+
+static void lockForFork() {
+	pthread_mutex_lock(&lock);
+}
+
+static void unlockAfterFork() {
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The workers don't exist in a forked child; lookups that were queued or running are dropped
+ * so that they are started again.
+ */
+static void resetAfterFork() {
+	for (struct entry* entry = oldest; entry != NULL; entry = entry->newer) {
+		if (entry->pending) {
+			entry->pending = false;
+			entry->expires = 0;
+		}
+		entry->nextQueued = NULL;
+	}
+	queueHead = NULL;
+	queueTail = NULL;
+	workersStarted = false;
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void startWorkers() {
+	static bool forkHandlers = false;
+	if (!forkHandlers)
+		forkHandlers = pthread_atfork(&lockForFork, &unlockAfterFork, &resetAfterFork) == 0;
+
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+	int started = 0;
+	for (int i = 0; i < RESOLVER_WORKERS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, &attributes, &workerThread, NULL) == 0)
+			started++;
+	}
+	pthread_attr_destroy(&attributes);
+
+	if (started == 0) {
+		error("resolver: couldn't start worker threads");
+		return;
+	}
+
+	workersStarted = true;
+}
+
+/*
+ * Returns the entry for the address and queues a lookup if there is no valid result.
+ * Has to be called with the lock held. Returns NULL if the cache is full of pending lookups.
+ */
+static struct entry* getEntry(const char* addr) {
+	struct entry* entry = findEntry(addr);
+	if (entry != NULL && (entry->pending || entry->expires > now())) {
+		metrics_count(METRIC_CACHE_HITS + CACHE_RESOLVER);
+		unlinkLRU(entry);
+		pushLRU(entry);
+		return entry;
+	}
+
+	metrics_count(METRIC_CACHE_MISSES + CACHE_RESOLVER);
+
+	if (entry != NULL) {
+		unlinkLRU(entry);
+		pushLRU(entry);
+
+		free(entry->name);
+		entry->name = NULL;
+	} else {
+		if (!workersStarted)
+			startWorkers();
+		if (!workersStarted)
+			return NULL;
+
+		entry = newEntry();
+		if (entry == NULL) {
+			warn("resolver: too many pending lookups; not looking up %s", addr);
+			return NULL;
+		}
+
+		strncpy(entry->addr, addr, INET6_ADDRSTRLEN);
+		entry->addr[INET6_ADDRSTRLEN] = '\0';
+		entry->name = NULL;
+
+		struct entry** bucket = getBucket(entry->addr);
+		entry->nextInBucket = *bucket;
+		*bucket = entry;
+		pushLRU(entry);
+	}
+
+	entry->pending = true;
+	entry->nextQueued = NULL;
+	if (queueTail != NULL)
+		queueTail->nextQueued = entry;
+	else
+		queueHead = entry;
+	queueTail = entry;
+	pthread_cond_signal(&queued);
+
+	return entry;
+}
+
+void resolver_prefetch(const char* addr) {
+	pthread_mutex_lock(&lock);
+	getEntry(addr);
+	pthread_mutex_unlock(&lock);
+}
+
+char* resolver_lookup(const char* addr, int timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	char* name = NULL;
+
+	pthread_mutex_lock(&lock);
+	struct entry* entry = getEntry(addr);
+	if (entry != NULL) {
+		// pending entries can't be evicted; so entry stays valid while we wait
+		while (entry->pending) {
+			if (pthread_cond_timedwait(&finished, &lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		if (!entry->pending && entry->name != NULL)
+			name = strdup(entry->name);
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (name == NULL)
+		name = strdup("");
+
+	return name;
+}
+
+char* resolver_peek(const char* addr) {
+	char* name = NULL;
+
+	pthread_mutex_lock(&lock);
+	struct entry* entry = getEntry(addr);
+	if (entry == NULL) {
+		name = strdup("");
+	} else if (!entry->pending) {
+		name = strdup(entry->name != NULL ? entry->name : "");
+	}
+	pthread_mutex_unlock(&lock);
+
+	return name;
+}
+
+void resolver_setBackend(resolverBackend_t lookup) {
+	pthread_mutex_lock(&lock);
+	backend = lookup != NULL ? lookup : &reverseLookup;
+	pthread_mutex_unlock(&lock);
+}
+
+void resolver_flush() {
+	pthread_mutex_lock(&lock);
+	struct entry* entry = oldest;
+	while (entry != NULL) {
+		struct entry* next = entry->newer;
+		if (!entry->pending) {
+			removeEntry(entry);
+			entry->nextInBucket = unused;
+			unused = entry;
+		}
+		entry = next;
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,32 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+/*
+ * Reverse lookups of peer addresses.
+ * Lookups are done by a small pool of worker threads; names (and the lack of one) are kept in an LRU cache.
+ */
+
+// seconds a name is cached
+#define RESOLVER_TTL (300)
+// seconds an address without a name is cached
+#define RESOLVER_NEGATIVE_TTL (60)
+#define RESOLVER_CACHE_SIZE (1024)
+#define RESOLVER_WORKERS (4)
+// ms a handler waits for a lookup that is still running
+#define RESOLVER_DEFAULT_WAIT (1000)
+
+// returns the name of the address (has to be freed) or NULL if it has none
+typedef char* (*resolverBackend_t)(const char* addr);
+
+// starts a lookup unless the address is cached or already being looked up
+void resolver_prefetch(const char* addr);
+// returns the name of addr ("" if there is none or the lookup took longer than timeout ms); has to be freed
+char* resolver_lookup(const char* addr, int timeout);
+// like resolver_lookup but doesn't wait; returns NULL while the lookup is still running
+char* resolver_peek(const char* addr);
+// replaces getnameinfo(); NULL restores it
+void resolver_setBackend(resolverBackend_t lookup);
+// drops everything that isn't being looked up right now
+void resolver_flush();
+
+#endif
@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "routing.h"
+#include "logging.h"
+
+#define INITIAL_HOST_MAP_SIZE (16)
+
+static struct radixNode* newNode(const char* label, size_t length) {
+	struct radixNode* node = malloc(sizeof(struct radixNode));
+	if (node == NULL)
+		return NULL;
+
+	char* copy = malloc(length + 1);
+	if (copy == NULL) {
+		free(node);
+		return NULL;
+	}
+	memcpy(copy, label, length);
+	copy[length] = '\0';
+
+	*node = (struct radixNode) {
+		.label = copy,
+		.length = length,
+		.value = NULL,
+		.nrChildren = 0,
+		.children = NULL
+	};
+
+	return node;
+}
+
+static void freeNode(struct radixNode* node) {
+	for (int i = 0; i < node->nrChildren; i++) {
+		freeNode(node->children[i]);
+		free(node->children[i]);
+	}
+	free(node->children);
+	free(node->label);
+}
+
+static int findChild(const struct radixNode* node, char c) {
+	for (int i = 0; i < node->nrChildren; i++) {
+		if (node->children[i]->label[0] == c)
+			return i;
+	}
+	return -1;
+}
+
+static int addChild(struct radixNode* node, struct radixNode* child) {
+	struct radixNode** children = realloc(node->children, (node->nrChildren + 1) * sizeof(struct radixNode*));
+	if (children == NULL)
+		return -1;
+
+	children[node->nrChildren++] = child;
+	node->children = children;
+
+	return 0;
+}
+
+static int radixInsert(struct radixNode* node, const char* key, size_t length, void* value, long priority) {
+	while (length > 0) {
+		int index = findChild(node, key[0]);
+		if (index < 0) {
+			struct radixNode* child = newNode(key, length);
+			if (child == NULL)
+				return -1;
+			if (addChild(node, child) < 0) {
+				freeNode(child);
+				free(child);
+				return -1;
+			}
+			node = child;
+			break;
+		}
+
+		struct radixNode* child = node->children[index];
+		size_t common = 0;
+		while (common < child->length && common < length && child->label[common] == key[common])
+			common++;
+
+		if (common < child->length) {
+			// split the edge; the new node takes the place of child
+			struct radixNode* middle = newNode(child->label, common);
+			if (middle == NULL)
+				return -1;
+			char* rest = strdup(child->label + common);
+			if (rest == NULL || addChild(middle, child) < 0) {
+				free(rest);
+				freeNode(middle);
+				free(middle);
+				return -1;
+			}
+			free(child->label);
+			child->label = rest;
+			child->length -= common;
+
+			node->children[index] = middle;
+			child = middle;
+		}
+
+		node = child;
+		key += common;
+		length -= common;
+	}
+
+	if (node->value == NULL || priority > node->priority) {
+		node->value = value;
+		node->priority = priority;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the value of the longest key that is a prefix of key and is followed by separator
+ * (or by the end of key if atEnd is set).
+ */
+static void* radixLongestPrefix(const struct radixNode* node, const char* key, size_t length, char separator, bool atEnd) {
+	void* best = NULL;
+	size_t position = 0;
+
+	while (true) {
+		if (node->value != NULL) {
+			if (position == length ? atEnd : key[position] == separator)
+				best = node->value;
+		}
+		if (position == length)
+			break;
+
+		int index = findChild(node, key[position]);
+		if (index < 0)
+			break;
+		const struct radixNode* child = node->children[index];
+		if (length - position < child->length || memcmp(child->label, key + position, child->length) != 0)
+			break;
+
+		position += child->length;
+		node = child;
+	}
+
+	return best;
+}
+
+/*
+ * Lower case, without port and trailing dot. Returns the length or -1 if it doesn't fit.
+ */
+static long normalizeHost(const char* host, char buffer[ROUTING_MAX_HOST_LENGTH + 1]) {
+	size_t length = 0;
+	size_t colon = 0;
+	for (; host[length] != '\0'; length++) {
+		if (length >= ROUTING_MAX_HOST_LENGTH)
+			return -1;
+		char c = host[length];
+		if (c == ':')
+			colon = length;
+		else if (c == ']')
+			colon = 0;
+		buffer[length] = tolower((unsigned char) c);
+	}
+
+	// the colon of an IPv6 address without port is always followed by ]
+	if (colon > 0)
+		length = colon;
+	if (length > 0 && buffer[length - 1] == '.')
+		length--;
+	buffer[length] = '\0';
+
+	return length;
+}
+
+static size_t hash(const char* host) {
+	// FNV-1a
+	size_t hash = 2166136261u;
+	for (const char* c = host; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct hostEntry* findHost(struct hostEntry* map, size_t size, const char* host) {
+	size_t index = hash(host) & (size - 1);
+	while (map[index].host != NULL && strcmp(map[index].host, host) != 0)
+		index = (index + 1) & (size - 1);
+	return &(map[index]);
+}
+
+static int growHostMap(struct routes* routes) {
+	size_t size = routes->hostMapSize * 2;
+	struct hostEntry* map = calloc(size, sizeof(struct hostEntry));
+	if (map == NULL)
+		return -1;
+
+	for (size_t i = 0; i < routes->hostMapSize; i++) {
+		if (routes->hostMap[i].host != NULL)
+			*findHost(map, size, routes->hostMap[i].host) = routes->hostMap[i];
+	}
+
+	free(routes->hostMap);
+	routes->hostMap = map;
+	routes->hostMapSize = size;
+
+	return 0;
+}
+
+struct routes* routes_create(int nrSites) {
+	struct routes* routes = malloc(sizeof(struct routes));
+	if (routes == NULL)
+		return NULL;
+
+	*routes = (struct routes) {
+		.hostMapSize = INITIAL_HOST_MAP_SIZE,
+		.nrHosts = 0,
+		.wildcards = {},
+		.defaultSite = -1,
+		.nrSites = nrSites
+	};
+
+	routes->hostMap = calloc(INITIAL_HOST_MAP_SIZE, sizeof(struct hostEntry));
+	routes->handlers = calloc(nrSites > 0 ? nrSites : 1, sizeof(struct radixNode));
+	if (routes->hostMap == NULL || routes->handlers == NULL) {
+		free(routes->hostMap);
+		free(routes->handlers);
+		free(routes);
+		return NULL;
+	}
+
+	return routes;
+}
+
+void routes_destroy(struct routes* routes) {
+	if (routes == NULL)
+		return;
+
+	for (size_t i = 0; i < routes->hostMapSize; i++) {
+		free(routes->hostMap[i].host);
+	}
+	free(routes->hostMap);
+
+	freeNode(&(routes->wildcards));
+
+	for (int i = 0; i < routes->nrSites; i++) {
+		freeNode(&(routes->handlers[i]));
+	}
+	free(routes->handlers);
+
+	free(routes);
+}
+
+int routes_addHost(struct routes* routes, int site, const char* hostname) {
+	if (strcmp(hostname, "*") == 0) {
+		if (routes->defaultSite < 0)
+			routes->defaultSite = site;
+		return 0;
+	}
+
+	char buffer[ROUTING_MAX_HOST_LENGTH + 1];
+	bool isWildcard = strncmp(hostname, "*.", 2) == 0;
+	long length = normalizeHost(isWildcard ? hostname + 2 : hostname, buffer);
+	if (length <= 0) {
+		error("routing: invalid hostname '%s'", hostname);
+		return -1;
+	}
+
+	if (isWildcard) {
+		char reversed[ROUTING_MAX_HOST_LENGTH + 1];
+		for (long i = 0; i < length; i++) {
+			reversed[i] = buffer[length - 1 - i];
+		}
+		// sites are numbered from 0; earlier sites win
+		return radixInsert(&(routes->wildcards), reversed, length, (void*) (long) (site + 1), -site);
+	}
+
+	if ((routes->nrHosts + 1) * 2 > routes->hostMapSize && growHostMap(routes) < 0)
+		return -1;
+
+	struct hostEntry* entry = findHost(routes->hostMap, routes->hostMapSize, buffer);
+	if (entry->host != NULL) {
+		// the first site with the name wins
+		return 0;
+	}
+
+	entry->host = strdup(buffer);
+	if (entry->host == NULL)
+		return -1;
+	entry->site = site;
+	routes->nrHosts++;
+
+	return 0;
+}
+
+int routes_addHandler(struct routes* routes, int site, const char* dir, void* handler) {
+	size_t length = strlen(dir);
+	size_t keyLength = length;
+	while (keyLength > 0 && dir[keyLength - 1] == '/')
+		keyLength--;
+
+	// the longer directory wins (like "/cgi/" over "/cgi"); the first one if they are equally long
+	return radixInsert(&(routes->handlers[site]), dir, keyLength, handler, length);
+}
+
+int routes_findSite(struct routes* routes, const char* host) {
+	if (host == NULL)
+		return routes->defaultSite;
+
+	char buffer[ROUTING_MAX_HOST_LENGTH + 1];
+	long length = normalizeHost(host, buffer);
+	if (length <= 0)
+		return routes->defaultSite;
+
+	struct hostEntry* entry = findHost(routes->hostMap, routes->hostMapSize, buffer);
+	if (entry->host != NULL)
+		return entry->site;
+
+	char reversed[ROUTING_MAX_HOST_LENGTH + 1];
+	for (long i = 0; i < length; i++) {
+		reversed[i] = buffer[length - 1 - i];
+	}
+	long wildcard = (long) radixLongestPrefix(&(routes->wildcards), reversed, length, '.', false);
+	if (wildcard > 0)
+		return wildcard - 1;
+
+	return routes->defaultSite;
+}
+
+void* routes_findHandler(struct routes* routes, int site, const char* path) {
+	return radixLongestPrefix(&(routes->handlers[site]), path, strlen(path), '/', true);
+}
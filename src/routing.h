@@ -0,0 +1,58 @@
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Compiled routing table of a bind: which site serves a host and which handler serves a path.
+ * It is built once and not changed afterwards; lookups don't allocate and cost O(length of host + path).
+ *
+ * Hostnames are matched case-insensitively and without the port:
+ *  - exact names are kept in a hash map
+ *  - wildcards ("*.example.com"; subdomains only) in a radix tree of the reversed names, the longest suffix wins
+ *  - "*" (or a site without hostnames) is the default site; the first one wins
+ * Handler directories are kept in a radix tree per site; the longest directory containing the path wins.
+ */
+
+// hostnames longer than this never match (RFC 1035 allows 253)
+#define ROUTING_MAX_HOST_LENGTH (255)
+
+struct radixNode {
+	char* label;
+	size_t length;
+	void* value;
+	// decides which value is kept if a key is inserted twice; higher wins
+	long priority;
+	int nrChildren;
+	struct radixNode** children;
+};
+
+struct hostEntry {
+	char* host;
+	int site;
+};
+
+struct routes {
+	// open addressing; size is a power of 2
+	size_t hostMapSize;
+	size_t nrHosts;
+	struct hostEntry* hostMap;
+	struct radixNode wildcards;
+	int defaultSite;
+	int nrSites;
+	struct radixNode* handlers;
+};
+
+struct routes* routes_create(int nrSites);
+void routes_destroy(struct routes* routes);
+
+int routes_addHost(struct routes* routes, int site, const char* hostname);
+int routes_addHandler(struct routes* routes, int site, const char* dir, void* handler);
+
+// returns the site or -1; host may be NULL
+int routes_findSite(struct routes* routes, const char* host);
+// returns the handler or NULL
+void* routes_findHandler(struct routes* routes, int site, const char* path);
+
+#endif
@@ -48,6 +48,19 @@ int signal_wait(int signo) {
 	return sigwait(&mask, &_);
 }
 
+int signal_waitAny(const int signos[], int number) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int i = 0; i < number; i++) {
+		sigaddset(&mask, signos[i]);
+	}
+
+	int signo;
+	if (sigwait(&mask, &signo) != 0)
+		return -1;
+	return signo;
+}
+
 static void timerHandler(union sigval target) {
 	((void (*)(void))(target.sival_ptr))();
 }
@@ -61,7 +74,7 @@ timer_t timer_createThreadTimer(void (*handler)()) {
 	timer_t timer;
 
 	if (timer_create(CLOCK_BOOTTIME, &sevp, &timer) < 0) {
-		timer = NULL;
+		timer = TIMER_NULL;
 	}
 	return timer;
 }
@@ -73,7 +86,7 @@ timer_t timer_createSignalTimer(int signo) {
 	timer_t timer;
 
 	if (timer_create(CLOCK_BOOTTIME, &sevp, &timer) < 0) {
-		timer = NULL;
+		timer = TIMER_NULL;
 	}
 	
 	return timer;
@@ -3,12 +3,17 @@
 
 #include <time.h>
 
+// timer ids start at 0, so NULL is a valid timer
+#define TIMER_NULL ((timer_t) -1)
+
 int signal_setup(int signum, void (*handler)(int signo));
 int signal_block_all();
 int signal_allow_all();
 int signal_block(int signo);
 int signal_allow(int signo);
 int signal_wait(int signo);
+// returns the signal that arrived or -1
+int signal_waitAny(const int signos[], int number);
 
 timer_t timer_createThreadTimer(void (*handler)());
 timer_t timer_createSignalTimer(int signo);
@@ -24,6 +24,17 @@ void ssl_destroy() {
 	EVP_cleanup();
 }
 
+// wire format: length prefixed protocol names in order of preference
+static const unsigned char supportedProtocols[] = "\x02h2\x08http/1.1";
+
+static int selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void* arg) {
+	// the data handler recognizes HTTP/2 by its connection preface, so the choice just has to be announced
+	if (SSL_select_next_proto((unsigned char**) out, outlen, supportedProtocols, sizeof(supportedProtocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
 int ssl_initSettings(struct ssl_settings* settings) {
 	SSL_CTX* ctx = SSL_CTX_new( SSLv23_server_method());
 
@@ -40,6 +51,8 @@ int ssl_initSettings(struct ssl_settings* settings) {
 
 	SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
 
+	SSL_CTX_set_alpn_select_cb(ctx, &selectProtocol, NULL);
+
 	settings->_private.ctx = ctx;
 
 	return 0;
@@ -1,371 +1,421 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "status.h"
 #include "misc.h"
 #include "logging.h"
 
-struct statusStrings getStatusStrings(int status) {
-	switch(status) {
-		case 100:
-			return (struct statusStrings) {
-				.statusString = "Continue",
-				.statusFormat = ""
-			};
-		case 101:
-			return (struct statusStrings) {
-				.statusString = "Switching Protocols",
-				.statusFormat = ""
-			};
-		case 102:
-			return (struct statusStrings) {
-				.statusString = "Processing",
-				.statusFormat = ""
-			};
+static const struct statusStrings statusStrings[STATUS_CODES] = {
+	[100] = { "Continue", "" },
+	[101] = { "Switching Protocols", "" },
+	[102] = { "Processing", "" },
 
-		case 200:
-			return (struct statusStrings) {
-				.statusString = "OK",
-				.statusFormat = ""
-			};
-		case 201:
-			return (struct statusStrings) {
-				.statusString = "Created",
-				.statusFormat = ""
-			};
-		case 202:
-			return (struct statusStrings) {
-				.statusString = "Accepted",
-				.statusFormat = ""
-			};
-		case 203:
-			return (struct statusStrings) {
-				.statusString = "Non-Authoritative Information",
-				.statusFormat = ""
-			};
-		case 204:
-			return (struct statusStrings) {
-				.statusString = "No Content",
-				.statusFormat = ""
-			};
-		case 205:
-			return (struct statusStrings) {
-				.statusString = "Reset Content",
-				.statusFormat = ""
-			};
-		case 206:
-			return (struct statusStrings) {
-				.statusString = "Partial Content",
-				.statusFormat = ""
-			};
-		case 207:
-			return (struct statusStrings) {
-				.statusString = "Multi-Status",
-				.statusFormat = ""
-			};
-		case 208:
-			return (struct statusStrings) {
-				.statusString = "Already Reported",
-				.statusFormat = ""
-			};
-		case 226:
-			return (struct statusStrings) {
-				.statusString = "IM Used",
-				.statusFormat = ""
-			};
+	[200] = { "OK", "" },
+	[201] = { "Created", "" },
+	[202] = { "Accepted", "" },
+	[203] = { "Non-Authoritative Information", "" },
+	[204] = { "No Content", "" },
+	[205] = { "Reset Content", "" },
+	[206] = { "Partial Content", "" },
+	[207] = { "Multi-Status", "" },
+	[208] = { "Already Reported", "" },
+	[226] = { "IM Used", "" },
 
-		case 300:
-			return (struct statusStrings) {
-				.statusString = "Multiple Choices",
-				.statusFormat = ""
-			};
-		case 301:
-			return (struct statusStrings) {
-				.statusString = "Moved Permanently",
-				.statusFormat = ""
-			};
-		case 302:
-			return (struct statusStrings) {
-				.statusString = "Found (Moved Temporarily)",
-				.statusFormat = ""
-			};
-		case 303:
-			return (struct statusStrings) {
-				.statusString = "See Other",
-				.statusFormat = ""
-			};
-		case 304:
-			return (struct statusStrings) {
-				.statusString = "Not Modified",
-				.statusFormat = ""
-			};
-		case 305:
-			return (struct statusStrings) {
-				.statusString = "Use Proxy",
-				.statusFormat = ""
-			};
-		case 306:
-			return (struct statusStrings) {
-				.statusString = "(reserved)",
-				.statusFormat = ""
-			};
-		case 307:
-			return (struct statusStrings) {
-				.statusString = "Temporary Redirect",
-				.statusFormat = ""
-			};
-		case 308:
-			return (struct statusStrings) {
-				.statusString = "Permanent Redirect",
-				.statusFormat = ""
-			};
+	[300] = { "Multiple Choices", "" },
+	[301] = { "Moved Permanently", "" },
+	[302] = { "Found (Moved Temporarily)", "" },
+	[303] = { "See Other", "" },
+	[304] = { "Not Modified", "" },
+	[305] = { "Use Proxy", "" },
+	[306] = { "(reserved)", "" },
+	[307] = { "Temporary Redirect", "" },
+	[308] = { "Permanent Redirect", "" },
 
-		case 400:
-			return (struct statusStrings) {
-				.statusString = "Bad Request",
-				.statusFormat = ""
-			};
-		case 401:
-			return (struct statusStrings) {
-				.statusString = "Unauthorized",
-				.statusFormat = ""
-			};
-		case 402:
-			return (struct statusStrings) {
-				.statusString = "Payment Required",
-				.statusFormat = ""
-			};
-		case 403:
-			return (struct statusStrings) {
-				.statusString = "Forbidden",
-				.statusFormat = "You don't have the permission to access %s."
-			};
-		case 404:
-			return (struct statusStrings) {
-				.statusString = "Not found",
-				.statusFormat = "The file %s was not found on this server."
-			};
-		case 405:
-			return (struct statusStrings) {
-				.statusString = "Method Not Allowed",
-				.statusFormat = ""
-			};
-		case 406:
-			return (struct statusStrings) {
-				.statusString = "Not Acceptable",
-				.statusFormat = ""
-			};
-		case 407:
-			return (struct statusStrings) {
-				.statusString = "Proxy Auhentication Required",
-				.statusFormat = ""
-			};
-		case 408:
-			return (struct statusStrings) {
-				.statusString = "Request Timeout",
-				.statusFormat = ""
-			};
-		case 409:
-			return (struct statusStrings) {
-				.statusString = "Conflict",
-				.statusFormat = ""
-			};
-		case 410:
-			return (struct statusStrings) {
-				.statusString = "Gone",
-				.statusFormat = ""
-			};
-		case 411:
-			return (struct statusStrings) {
-				.statusString = "Length Required",
-				.statusFormat = ""
-			};
-		case 412:
-			return (struct statusStrings) {
-				.statusString = "Precondition Failed",
-				.statusFormat = ""
-			};
-		case 413:
-			return (struct statusStrings) {
-				.statusString = "Request Entity Too Large",
-				.statusFormat = ""
-			};
-		case 414:
-			return (struct statusStrings) {
-				.statusString = "URI Too Long",
-				.statusFormat = ""
-			};
-		case 415:
-			return (struct statusStrings) {
-				.statusString = "Unsupported Media Type",
-				.statusFormat = ""
-			};
-		case 416:
-			return (struct statusStrings) {
-				.statusString = "Requested Range Not Satisfiable",
-				.statusFormat = ""
-			};
-		case 417:
-			return (struct statusStrings) {
-				.statusString = "Expectation Failed",
-				.statusFormat = ""
-			};
-		case 418:
-			return (struct statusStrings) {
-				.statusString = "I'm a teapot",
-				.statusFormat = ""
-			};
-		case 420:
-			return (struct statusStrings) {
-				.statusString = "Policy Not Fulfilled",
-				.statusFormat = ""
-			};
-		case 421:
-			return (struct statusStrings) {
-				.statusString = "Misdirected Request",
-				.statusFormat = ""
-			};
-		case 422:
-			return (struct statusStrings) {
-				.statusString = "Unprocessable Entity",
-				.statusFormat = ""
-			};
-		case 423:
-			return (struct statusStrings) {
-				.statusString = "Locked",
-				.statusFormat = ""
-			};
-		case 424:
-			return (struct statusStrings) {
-				.statusString = "Failed Dependency",
-				.statusFormat = ""
-			};
-		case 426:
-			return (struct statusStrings) {
-				.statusString = "Upgrade Required",
-				.statusFormat = ""
-			};
-		case 428:
-			return (struct statusStrings) {
-				.statusString = "Precondition Required",
-				.statusFormat = ""
-			};
-		case 429:
-			return (struct statusStrings) {
-				.statusString = "Too Many Requests",
-				.statusFormat = ""
-			};
-		case 431:
-			return (struct statusStrings) {
-				.statusString = "Request Header Fields Too Large",
-				.statusFormat = ""
-			};
-		case 451:
-			return (struct statusStrings) {
-				.statusString = "Unavailable For Legal Reasons",
-				.statusFormat = ""
-			};
+	[400] = { "Bad Request", "" },
+	[401] = { "Unauthorized", "" },
+	[402] = { "Payment Required", "" },
+	[403] = { "Forbidden", "You don't have the permission to access %s." },
+	[404] = { "Not found", "The file %s was not found on this server." },
+	[405] = { "Method Not Allowed", "" },
+	[406] = { "Not Acceptable", "" },
+	[407] = { "Proxy Auhentication Required", "" },
+	[408] = { "Request Timeout", "" },
+	[409] = { "Conflict", "" },
+	[410] = { "Gone", "" },
+	[411] = { "Length Required", "" },
+	[412] = { "Precondition Failed", "" },
+	[413] = { "Request Entity Too Large", "" },
+	[414] = { "URI Too Long", "" },
+	[415] = { "Unsupported Media Type", "" },
+	[416] = { "Requested Range Not Satisfiable", "" },
+	[417] = { "Expectation Failed", "" },
+	[418] = { "I'm a teapot", "" },
+	[420] = { "Policy Not Fulfilled", "" },
+	[421] = { "Misdirected Request", "" },
+	[422] = { "Unprocessable Entity", "" },
+	[423] = { "Locked", "" },
+	[424] = { "Failed Dependency", "" },
+	[426] = { "Upgrade Required", "" },
+	[428] = { "Precondition Required", "" },
+	[429] = { "Too Many Requests", "" },
+	[431] = { "Request Header Fields Too Large", "" },
+	[451] = { "Unavailable For Legal Reasons", "" },
 
-		case 500:
-			return (struct statusStrings) {
-				.statusString = "Internal Server Error",
-				.statusFormat = ""
-			};
-		case 501:
-			return (struct statusStrings) {
-				.statusString = "Not Implemented",
-				.statusFormat = ""
-			};
-		case 502:
-			return (struct statusStrings) {
-				.statusString = "Bad Gateway",
-				.statusFormat = ""
-			};
-		case 503:
-			return (struct statusStrings) {
-				.statusString = "Service Unavailable",
-				.statusFormat = ""
-			};
-		case 504:
-			return (struct statusStrings) {
-				.statusString = "Gateway Timeout",
-				.statusFormat = ""
-			};
-		case 505:
-			return (struct statusStrings) {
-				.statusString = "HTTP Version Not Supported",
-				.statusFormat = ""
-			};
-		case 506:
-			return (struct statusStrings) {
-				.statusString = "Variant Also Negotiates",
-				.statusFormat = ""
-			};
-		case 507:
-			return (struct statusStrings) {
-				.statusString = "Insufficient Storage",
-				.statusFormat = ""
-			};
-		case 508:
-			return (struct statusStrings) {
-				.statusString = "Loop Detected",
-				.statusFormat = ""
-			};
-		case 509:
-			return (struct statusStrings) {
-				.statusString = "Bandwidth Limit Exceeded",
-				.statusFormat = ""
-			};
-		case 510:
-			return (struct statusStrings) {
-				.statusString = "Not Extended",
-				.statusFormat = ""
-			};
-		case 511:
-			return (struct statusStrings) {
-				.statusString = "Notwork Authentication Required",
-				.statusFormat = ""
-			};
+	[500] = { "Internal Server Error", "" },
+	[501] = { "Not Implemented", "" },
+	[502] = { "Bad Gateway", "" },
+	[503] = { "Service Unavailable", "" },
+	[504] = { "Gateway Timeout", "" },
+	[505] = { "HTTP Version Not Supported", "" },
+	[506] = { "Variant Also Negotiates", "" },
+	[507] = { "Insufficient Storage", "" },
+	[508] = { "Loop Detected", "" },
+	[509] = { "Bandwidth Limit Exceeded", "" },
+	[510] = { "Not Extended", "" },
+	[511] = { "Notwork Authentication Required", "" },
+};
 
-		default:
-			return (struct statusStrings) {
-				.statusString = "Unknown Status Code",
-				.statusFormat = "This is pretty bad."
-			};
-	}
-}
+static const struct statusStrings unknownStatus = {
+	.statusString = "Unknown Status Code",
+	.statusFormat = "This is pretty bad."
+};
 
-void status(struct request request, struct response response, int status) {
-	struct headers headers = headers_create();
-	headers_mod(&headers, "Content-Type", "text/html; charset=utf-8");
-	int fd = response.sendHeader(status, &headers, &request);
-	headers_free(&headers);
+struct page {
+	char* data;
+	size_t length;
+	// where the path of the request goes; length if the page doesn't show it
+	size_t split;
+};
+
+static struct page defaultPages[STATUS_CODES];
+static struct page unknownPage;
+static pthread_once_t pagesOnce = PTHREAD_ONCE_INIT;
+
+struct customPage {
+	int status;
+	char* data;
+	size_t length;
+};
+
+struct statusPages {
+	int number;
+	struct customPage* pages;
+};
+
+struct statusStrings getStatusStrings(int status) {
+	if (status < 0 || status >= STATUS_CODES || statusStrings[status].statusString == NULL)
+		return unknownStatus;
+
+	return statusStrings[status];
+}
 
-	FILE* stream = fdopen(fd, "w");
+static void renderPage(struct page* page, struct statusStrings strings) {
+	FILE* stream = open_memstream(&(page->data), &(page->length));
 	if (stream == NULL) {
-		error("status: Couldn't get stream from fd: %s", strerror(errno));
+		error("status: Couldn't render page: %s", strerror(errno));
+		page->data = NULL;
+		page->length = 0;
 		return;
 	}
 
-	struct statusStrings string = getStatusStrings(status);
-
 	fprintf(stream, "<!DOCTYPE html>\n");
 	fprintf(stream, "<html>\n");
 	fprintf(stream, "	<head>\n");
-	fprintf(stream, "		<title>%s</title>\n", string.statusString);
+	fprintf(stream, "		<title>%s</title>\n", strings.statusString);
 	fprintf(stream, "	</head>\n");
 	fprintf(stream, "	<body>\n");
-	fprintf(stream, "		<h1>%s</h1>\n", string.statusString);
-	fprintf(stream, string.statusFormat, request.metaData.path);
+	fprintf(stream, "		<h1>%s</h1>\n", strings.statusString);
+
+	long split = -1;
+	if (strings.statusFormat[0] != '\0') {
+		const char* placeholder = strstr(strings.statusFormat, "%s");
+		fprintf(stream, "		<p>");
+		if (placeholder != NULL) {
+			fwrite(strings.statusFormat, 1, placeholder - strings.statusFormat, stream);
+			split = ftell(stream);
+			fprintf(stream, "%s", placeholder + 2);
+		} else {
+			fprintf(stream, "%s", strings.statusFormat);
+		}
+		fprintf(stream, "</p>\n");
+	}
+
 	fprintf(stream, "		<hr />\n");
 	fprintf(stream, "	</body>\n");
 	fprintf(stream, "</html>\n");
 
 	fclose(stream);
+
+	page->split = split >= 0 ? split : page->length;
+}
+
+static void renderPages() {
+	for (int status = 0; status < STATUS_CODES; status++) {
+		if (statusStrings[status].statusString != NULL)
+			renderPage(&(defaultPages[status]), statusStrings[status]);
+	}
+	renderPage(&unknownPage, unknownStatus);
+}
+
+void status_init() {
+	pthread_once(&pagesOnce, &renderPages);
+}
+
+static char* escapeHtml(const char* string) {
+	size_t length = 0;
+	for (const char* c = string; *c != '\0'; c++) {
+		switch (*c) {
+			case '&':
+				length += 5;
+				break;
+			case '<':
+			case '>':
+				length += 4;
+				break;
+			case '"':
+				length += 6;
+				break;
+			case '\'':
+				length += 5;
+				break;
+			default:
+				length++;
+		}
+	}
+
+	char* escaped = malloc(length + 1);
+	if (escaped == NULL)
+		return NULL;
+
+	char* position = escaped;
+	for (const char* c = string; *c != '\0'; c++) {
+		switch (*c) {
+			case '&':
+				position = stpcpy(position, "&amp;");
+				break;
+			case '<':
+				position = stpcpy(position, "&lt;");
+				break;
+			case '>':
+				position = stpcpy(position, "&gt;");
+				break;
+			case '"':
+				position = stpcpy(position, "&quot;");
+				break;
+			case '\'':
+				position = stpcpy(position, "&#39;");
+				break;
+			default:
+				*(position++) = *c;
+		}
+	}
+	*position = '\0';
+
+	return escaped;
+}
+
+struct statusPages* status_createPages() {
+	struct statusPages* pages = malloc(sizeof(struct statusPages));
+	if (pages == NULL)
+		return NULL;
+
+	pages->number = 0;
+	pages->pages = NULL;
+
+	return pages;
+}
+
+void status_destroyPages(struct statusPages* pages) {
+	if (pages == NULL)
+		return;
+
+	for (int i = 0; i < pages->number; i++) {
+		free(pages->pages[i].data);
+	}
+	free(pages->pages);
+	free(pages);
+}
+
+static const struct customPage* findPage(const struct statusPages* pages, int status) {
+	if (pages == NULL)
+		return NULL;
+
+	for (int i = 0; i < pages->number; i++) {
+		if (pages->pages[i].status == status)
+			return &(pages->pages[i]);
+	}
+	return NULL;
+}
+
+int status_loadPage(struct statusPages* pages, int status, const char* filename) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		error("status: Couldn't open %s: %s", filename, strerror(errno));
+		return -1;
+	}
+
+	struct stat statObj;
+	if (fstat(fd, &statObj) < 0 || !S_ISREG(statObj.st_mode)) {
+		error("status: %s is not a file", filename);
+		close(fd);
+		return -1;
+	}
+
+	size_t length = statObj.st_size;
+	char* data = malloc(length > 0 ? length : 1);
+	if (data == NULL) {
+		error("status: Couldn't allocate for %s: %s", filename, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	size_t position = 0;
+	while (position < length) {
+		ssize_t tmp = read(fd, data + position, length - position);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp <= 0) {
+			error("status: Couldn't read %s: %s", filename, tmp < 0 ? strerror(errno) : "file got shorter");
+			free(data);
+			close(fd);
+			return -1;
+		}
+		position += tmp;
+	}
+	close(fd);
+
+	struct customPage* page = (struct customPage*) findPage(pages, status);
+	if (page == NULL) {
+		struct customPage* tmp = realloc(pages->pages, (pages->number + 1) * sizeof(struct customPage));
+		if (tmp == NULL) {
+			error("status: Couldn't allocate for page: %s", strerror(errno));
+			free(data);
+			return -1;
+		}
+		pages->pages = tmp;
+		page = &(pages->pages[pages->number++]);
+		page->data = NULL;
+	}
+
+	free(page->data);
+	*page = (struct customPage) {
+		.status = status,
+		.data = data,
+		.length = length
+	};
+
+	return 0;
+}
+
+/*
+ * Pages are rendered in advance; only the path (if the page shows it) is added per request.
+ * sendResponse is the one of either handler interface.
+ */
+static int sendStatus(struct request* request, sendResponse_t sendResponse, int status, struct headers* headers) {
+	headers_mod(headers, "Content-Type", "text/html; charset=utf-8");
+
+	struct iovec body[3];
+	int count = 0;
+	char* path = NULL;
+
+	const struct customPage* custom = findPage(request->statusPages, status);
+	if (custom != NULL) {
+		body[count++] = (struct iovec) {
+			.iov_base = custom->data,
+			.iov_len = custom->length
+		};
+	} else {
+		status_init();
+
+		const struct page* page = &unknownPage;
+		if (status >= 0 && status < STATUS_CODES && statusStrings[status].statusString != NULL)
+			page = &(defaultPages[status]);
+
+		body[count++] = (struct iovec) {
+			.iov_base = page->data,
+			.iov_len = page->split
+		};
+		if (page->split < page->length) {
+			path = escapeHtml(request->metaData.path);
+			if (path != NULL) {
+				body[count++] = (struct iovec) {
+					.iov_base = path,
+					.iov_len = strlen(path)
+				};
+			}
+			body[count++] = (struct iovec) {
+				.iov_base = page->data + page->split,
+				.iov_len = page->length - page->split
+			};
+		}
+	}
+
+	int result = sendResponse(status, headers, body, count, request);
+	headers_free(headers);
+	free(path);
+
+	return result;
+}
+
+int status_send(struct request* request, sendResponse_t sendResponse, int status) {
+	struct headers headers = headers_create();
+	return sendStatus(request, sendResponse, status, &headers);
+}
+
+void status(struct request request, struct response response, int status) {
+	status_send(&request, response.sendResponse, status);
 }
 
 void status500(struct request request, struct response response) {
 	status(request, response, 500);
 }
+
+// answers with the status code given as user data
+void statusHandler(struct request request, struct response response) {
+	status(request, response, request.userData.integer);
+}
+
+static int send429(struct request* request, sendResponse_t sendResponse) {
+	char retryAfter[16];
+	snprintf(retryAfter, sizeof(retryAfter), "%d", request->userData.integer);
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Retry-After", retryAfter);
+	return sendStatus(request, sendResponse, 429, &headers);
+}
+
+// the user data is the number of seconds the client should wait
+void status429(struct request request, struct response response) {
+	send429(&request, response.sendResponse);
+}
+
+static enum reactorResult reactor500(struct request* request, struct reactorResponse response) {
+	return status_send(request, response.sendResponse, 500) < 0 ? REACTOR_ERROR : REACTOR_DONE;
+}
+
+static enum reactorResult reactorStatus(struct request* request, struct reactorResponse response) {
+	return status_send(request, response.sendResponse, request->userData.integer) < 0 ? REACTOR_ERROR : REACTOR_DONE;
+}
+
+static enum reactorResult reactor429(struct request* request, struct reactorResponse response) {
+	return send429(request, response.sendResponse) < 0 ? REACTOR_ERROR : REACTOR_DONE;
+}
+
+const struct reactorHandler status500Reactor = {
+	.onRequest = reactor500
+};
+
+const struct reactorHandler statusReactor = {
+	.onRequest = reactorStatus
+};
+
+const struct reactorHandler status429Reactor = {
+	.onRequest = reactor429
+};
@@ -8,9 +8,35 @@ struct statusStrings {
 	const char* statusFormat;
 };
 
+// status codes are below this
+#define STATUS_CODES (600)
+
 struct statusStrings getStatusStrings(int status);
 
+/*
+ * Custom pages of a site by status code; loaded from files when the config is parsed.
+ * Without one the default page of the status code is sent; those are rendered by status_init.
+ * Only the bodies are cached: the header has the Date, the default headers of the config and
+ * the connection state, and HTTP/2 encodes it on its own. Thread handlers send header and body
+ * with one writev.
+ */
+// renders the default pages; if it isn't called the first status_send does it
+void status_init();
+struct statusPages* status_createPages();
+void status_destroyPages(struct statusPages* pages);
+// a later page for the same status code replaces the earlier one
+int status_loadPage(struct statusPages* pages, int status, const char* filename);
+
 void status500(struct request request, struct response response);
+void statusHandler(struct request request, struct response response);
+void status429(struct request request, struct response response);
 void status(struct request request, struct response response, int status);
+// the page of status with the sendResponse of either handler interface; returns 0 or -1
+int status_send(struct request* request, sendResponse_t sendResponse, int status);
+
+// the handlers above on the reactor (see struct reactorHandler)
+extern const struct reactorHandler status500Reactor;
+extern const struct reactorHandler statusReactor;
+extern const struct reactorHandler status429Reactor;
 
 #endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <sys/select.h>
 #include <unistd.h>
@@ -13,6 +14,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include "networking.h"
 #include "linked.h"
@@ -21,8 +24,21 @@
 #include "headers.h"
 #include "util.h"
 #include "config.h"
+#include "status.h"
 #include "files.h"
 #include "cgi.h"
+#include "fastcgi.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "hpack.h"
+#include "http2.h"
+#include "eventloop.h"
+#include "resolver.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "listing.h"
+#include "mime.h"
+#include "coroutine.h"
 
 bool global = true;
 bool overall = true;
@@ -92,6 +108,234 @@ void testUtil() {
 	free(tmp);
 }
 
+#define EVENTLOOP_LARGE_PART (65536)
+
+struct eventLoopWriter {
+	struct eventLoop* loop;
+	int fd;
+	// three parts of "a", "b" and "c" that don't fit the socket buffer instead of "hello world"
+	bool large;
+	ssize_t result;
+	volatile bool done;
+};
+
+void* eventLoopWriterThread(void* _data) {
+	struct eventLoopWriter* data = (struct eventLoopWriter*) _data;
+
+	if (data->large) {
+		char* parts = malloc(3 * EVENTLOOP_LARGE_PART);
+		struct iovec iov[3];
+		for (int i = 0; i < 3; i++) {
+			memset(parts + i * EVENTLOOP_LARGE_PART, 'a' + i, EVENTLOOP_LARGE_PART);
+			iov[i] = (struct iovec) { .iov_base = parts + i * EVENTLOOP_LARGE_PART, .iov_len = EVENTLOOP_LARGE_PART };
+		}
+		data->result = eventloop_writev(data->fd, iov, 3, 1000);
+		free(parts);
+	} else {
+		struct iovec iov[2] = {
+			{ .iov_base = "hello ", .iov_len = 6 },
+			{ .iov_base = "world", .iov_len = 5 }
+		};
+		data->result = eventloop_writev(data->fd, iov, 2, 1000);
+	}
+
+	data->done = true;
+	eventloop_wakeup(data->loop);
+
+	return NULL;
+}
+
+// the first event within a second
+int nextEvent(struct eventLoop* loop, struct event* event) {
+	struct event events[EVENTLOOP_MAX_EVENTS];
+	for (int i = 0; i < 10; i++) {
+		int number = eventloop_wait(loop, events, EVENTLOOP_MAX_EVENTS, 100);
+		if (number > 0) {
+			*event = events[0];
+			return number;
+		}
+	}
+	return 0;
+}
+
+void testEventLoop() {
+	struct eventLoop* loop = eventloop_create(64);
+	checkNull(loop, "loop created");
+	if (loop == NULL)
+		return;
+
+	printf("backend: %s\n\n", eventloop_backend());
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+		showError();
+		return;
+	}
+
+	int data;
+	struct event event;
+	struct event events[EVENTLOOP_MAX_EVENTS];
+
+	checkInt(eventloop_read(loop, fds[0], &data), 0, "read armed");
+	checkInt(eventloop_wait(loop, events, EVENTLOOP_MAX_EVENTS, 50), 0, "nothing to read yet");
+
+	write(fds[1], "ping", 4);
+	checkInt(nextEvent(loop, &event), 1, "one event");
+	checkBool(event.type == EVENT_READ && event.data == &data, "read event");
+	checkInt(event.result, 4, "bytes read");
+	checkBool(event.buffer != NULL && memcmp(event.buffer, "ping", 4) == 0, "data read");
+	eventloop_release(loop, &event);
+
+	eventloop_read(loop, fds[0], &data);
+	checkInt(eventloop_cancel(loop, fds[0], &data), 0, "cancel read");
+	nextEvent(loop, &event);
+	checkBool(event.type == EVENT_READ && event.data == &data, "cancelled read event");
+	checkInt(event.result, -ECANCELED, "read cancelled");
+
+	// a poll doesn't get in the way of a read on the same fd
+	int pollData;
+	eventloop_read(loop, fds[0], &data);
+	checkInt(eventloop_poll(loop, fds[0], POLLOUT, &pollData), 0, "poll armed");
+	nextEvent(loop, &event);
+	checkBool(event.type == EVENT_POLL && event.data == &pollData && event.fd == fds[0], "poll event");
+	checkBool(event.result > 0 && (event.result & POLLOUT), "writable");
+	write(fds[1], "pong", 4);
+	nextEvent(loop, &event);
+	checkBool(event.type == EVENT_READ && event.data == &data && event.result == 4, "read after poll");
+	eventloop_release(loop, &event);
+
+	eventloop_wakeup(loop);
+	nextEvent(loop, &event);
+	checkBool(event.type == EVENT_WAKEUP, "wakeup");
+
+	// the handler threads need the loop to be running
+	struct eventLoopWriter writer = {
+		.loop = loop,
+		.fd = fds[1],
+		.done = false
+	};
+	pthread_t thread;
+	pthread_create(&thread, NULL, &eventLoopWriterThread, &writer);
+	for (int i = 0; i < 50 && !writer.done; i++) {
+		eventloop_wait(loop, events, EVENTLOOP_MAX_EVENTS, 100);
+	}
+	pthread_join(thread, NULL);
+
+	char buffer[16] = {};
+	checkInt(writer.result, 11, "writev complete");
+	read(fds[0], buffer, sizeof(buffer) - 1);
+	checkString(buffer, "hello world", "writev data");
+
+	printf("testing writev that doesn't fit the socket buffer...\n\n");
+	int size = 4096;
+	setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	writer = (struct eventLoopWriter) {
+		.loop = loop,
+		.fd = fds[1],
+		.large = true,
+		.done = false
+	};
+	pthread_create(&thread, NULL, &eventLoopWriterThread, &writer);
+	char* received = malloc(3 * EVENTLOOP_LARGE_PART);
+	size_t length = 0;
+	for (int i = 0; i < 500 && length < 3 * EVENTLOOP_LARGE_PART; i++) {
+		eventloop_wait(loop, events, EVENTLOOP_MAX_EVENTS, 10);
+		ssize_t tmp = read(fds[0], received + length, 3 * EVENTLOOP_LARGE_PART - length);
+		if (tmp > 0)
+			length += tmp;
+	}
+	for (int i = 0; i < 50 && !writer.done; i++) {
+		eventloop_wait(loop, events, EVENTLOOP_MAX_EVENTS, 100);
+	}
+	pthread_join(thread, NULL);
+
+	checkInt(writer.result, 3 * EVENTLOOP_LARGE_PART, "writev complete");
+	checkInt(length, 3 * EVENTLOOP_LARGE_PART, "everything received");
+	size_t inOrder = 0;
+	while (inOrder < length && received[inOrder] == 'a' + (char) (inOrder / EVENTLOOP_LARGE_PART))
+		inOrder++;
+	checkInt(inOrder, 3 * EVENTLOOP_LARGE_PART, "parts in order");
+	free(received);
+
+	eventloop_forget(loop, fds[0]);
+	close(fds[0]);
+	close(fds[1]);
+	eventloop_destroy(loop);
+}
+
+static int stubLookups = 0;
+
+// "hosts file": 10.0.0.x is host-x, 10.0.1.x takes a second, 127.0.0.1 is stub-loopback after 300 ms,
+// everything else has no name
+char* stubResolver(const char* addr) {
+	__sync_fetch_and_add(&stubLookups, 1);
+
+	if (strcmp(addr, "127.0.0.1") == 0) {
+		usleep(300000);
+		return strdup("stub-loopback");
+	}
+
+	int number;
+	if (sscanf(addr, "10.0.1.%d", &number) == 1) {
+		sleep(1);
+	} else if (sscanf(addr, "10.0.0.%d", &number) != 1) {
+		return NULL;
+	}
+
+	char* name = malloc(16);
+	snprintf(name, 16, "host-%d", number);
+	return name;
+}
+
+void testResolver() {
+	resolver_setBackend(&stubResolver);
+	resolver_flush();
+
+	resolver_prefetch("10.0.0.1");
+	char* name = resolver_lookup("10.0.0.1", 1000);
+	checkString(name, "host-1", "lookup");
+	free(name);
+
+	int64_t hits = metrics_get(METRIC_CACHE_HITS + CACHE_RESOLVER);
+	name = resolver_lookup("10.0.0.1", 0);
+	checkString(name, "host-1", "cached");
+	free(name);
+	checkInt(metrics_get(METRIC_CACHE_HITS + CACHE_RESOLVER) - hits, 1, "hit counted");
+	checkInt(stubLookups, 1, "looked up once");
+
+	name = resolver_lookup("192.168.0.1", 1000);
+	checkString(name, "", "no name");
+	free(name);
+	name = resolver_lookup("192.168.0.1", 1000);
+	free(name);
+	checkInt(stubLookups, 2, "missing name cached");
+
+	name = resolver_lookup("10.0.1.2", 100);
+	checkString(name, "", "deadline");
+	free(name);
+	name = resolver_lookup("10.0.1.2", 2000);
+	checkString(name, "host-2", "finished after deadline");
+	free(name);
+	checkInt(stubLookups, 3, "slow lookup not repeated");
+
+	char addr[INET6_ADDRSTRLEN + 1];
+	for (int i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+		snprintf(addr, sizeof(addr), "10.0.%d.%d", 2 + i / 256, i % 256);
+		free(resolver_lookup(addr, 1000));
+	}
+	name = resolver_lookup("10.0.0.1", 1000);
+	checkString(name, "host-1", "evicted entry looked up again");
+	free(name);
+	checkInt(stubLookups, 3 + RESOLVER_CACHE_SIZE + 1, "oldest entry evicted");
+
+	resolver_setBackend(NULL);
+	resolver_flush();
+
+	name = resolver_lookup("127.0.0.1", 2000);
+	checkString(name, "localhost", "getnameinfo");
+	free(name);
+}
+
 void testLinkedList() {
 	linkedList_t list = linked_create();
 	
@@ -197,6 +441,11 @@ void testLogging() {
 	info("This info should not be displayed.");
 	checkBool(!hasData(pipefd[0]), "no data read (info)");
 
+	checkInt(loggingMinLevel, DEFAULT_LOGLEVEL, "min level");
+	int evaluated = 0;
+	debug("This debug should not be formatted: %d", evaluated++);
+	checkInt(evaluated, 0, "debug args not evaluated");
+
 	warn("This warning should be displayed.");
 	checkBool(hasData(pipefd[0]), "data read (warn)");
 	fflush(pipeRead);
@@ -211,6 +460,9 @@ void testLogging() {
 	checkBool(hasData(pipefd[0]), "data read (crititcal)");
 	fflush(pipeRead);
 
+	// later tests fork servers; they must not log into the closed pipe
+	removeLogging(pipeWrite);
+
 	fclose(pipeWrite);
 	fclose(pipeRead);
 }
@@ -221,7 +473,7 @@ void timerThread() {
 }
 void testTimers() {
 	timer_t timer = timer_createThreadTimer(&timerThread);
-	if (timer == NULL) {
+	if (timer == TIMER_NULL) {
 		showError();
 		return;
 	}
@@ -236,6 +488,355 @@ void testTimers() {
 	checkBool(counter >= 99 && counter <= 101, "interval count");
 }
 
+// sets the mtime of path to seconds ago; listings of directories that just changed aren't cached
+void makeOld(const char* path, int seconds) {
+	struct timespec times[2];
+	clock_gettime(CLOCK_REALTIME, &times[0]);
+	times[0].tv_sec -= seconds;
+	times[1] = times[0];
+	utimensat(AT_FDCWD, path, times, 0);
+}
+
+void testListing() {
+	char dir[] = "/tmp/cfloor-listing-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		showError();
+		return;
+	}
+
+	const char* files[] = { "b.txt", "a<&>.txt", ".hidden", "c.txt" };
+	char path[PATH_MAX];
+	for (int i = 0; i < 3; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+	snprintf(path, sizeof(path), "%s/sub", dir);
+	mkdir(path, 0755);
+	makeOld(dir, 100);
+
+	struct stat statObj;
+	stat(dir, &statObj);
+
+	struct listingPage page;
+	checkInt(listing_get(dir, &statObj, "", 1, 0, &page), 0, "listing");
+	char* html = strndup(page.html, page.length);
+	char* sub = strstr(html, "<td>D</td>\n\t\t\t\t<td><a href='/sub'>sub</a></td>");
+	char* escaped = strstr(html, "<a href='/a%3C%26%3E.txt'>a&lt;&amp;&gt;.txt</a>");
+	char* plain = strstr(html, "<a href='/b.txt'>b.txt</a>");
+	checkBool(sub != NULL && escaped != NULL && plain != NULL, "entries escaped");
+	checkBool(sub < escaped && escaped < plain, "sorted");
+	checkBool(strstr(html, ".hidden") == NULL && strstr(html, "..") == NULL, "hidden files not listed");
+	free(html);
+
+	struct listingPage again;
+	int64_t hits = metrics_get(METRIC_CACHE_HITS + CACHE_LISTING);
+	int64_t misses = metrics_get(METRIC_CACHE_MISSES + CACHE_LISTING);
+	listing_get(dir, &statObj, "", 1, 0, &again);
+	checkBool(again.html == page.html, "listing cached");
+	checkInt(metrics_get(METRIC_CACHE_HITS + CACHE_LISTING) - hits, 1, "hit counted");
+	checkInt(metrics_get(METRIC_CACHE_MISSES + CACHE_LISTING) - misses, 0, "no miss counted");
+	listing_release(&again);
+	listing_release(&page);
+
+	checkInt(listing_get(dir, &statObj, "/dir", 1, 0, &page), 0, "listing below root");
+	html = strndup(page.html, page.length);
+	checkBool(strstr(html, "<a href='/dir/..'>..</a>") != NULL, "parent listed");
+	free(html);
+	listing_release(&page);
+
+	checkInt(listing_get(dir, &statObj, "", 2, 2, &page), 0, "page");
+	html = strndup(page.html, page.length);
+	checkBool(strstr(html, "b.txt") != NULL && strstr(html, "sub") == NULL, "entries of page");
+	checkBool(strstr(html, "<a href='?page=1'>previous</a>\n\t\t\tpage 2 of 2\n") != NULL, "page navigation");
+	free(html);
+	listing_release(&page);
+
+	snprintf(path, sizeof(path), "%s/%s", dir, files[3]);
+	close(open(path, O_WRONLY | O_CREAT, 0644));
+	makeOld(dir, 50);
+	stat(dir, &statObj);
+	listing_get(dir, &statObj, "", 1, 0, &page);
+	html = strndup(page.html, page.length);
+	checkBool(strstr(html, "c.txt") != NULL, "changed directory read again");
+	free(html);
+	listing_release(&page);
+
+	listing_flush();
+	for (int i = 0; i < 4; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/sub", dir);
+	rmdir(path);
+	rmdir(dir);
+}
+
+void testMime() {
+	checkString(getMineFromFileName("/var/www/index.html"), "text/html", "html");
+	checkString(getMineFromFileName("/var/www/IMAGE.PNG"), "image/png", "case-insensitive");
+	checkString(getMineFromFileName("song.m4a"), "audio/mp4", "second extension of a type");
+	checkString(getMineFromFileName("archive.tar.gz"), "application/gzip", "last extension");
+	checkString(getMineFromFileName("/var/www.d/README"), MIME_UNKNOWN, "dot in directory");
+	checkString(getMineFromFileName("file.nope"), MIME_UNKNOWN, "unknown extension");
+	checkString(getMineFromFileName("file."), MIME_UNKNOWN, "empty extension");
+
+	char filename[] = "/tmp/cfloor-mime-XXXXXX";
+	int fd = mkstemp(filename);
+	const char* content = "# comment\n"
+		"text/x-custom\ttxt  FOO\n"
+		"\n"
+		"application/x-other bar # trailing comment\n";
+	write(fd, content, strlen(content));
+	close(fd);
+
+	struct mimeTypes* types = mime_create();
+	checkInt(mime_load(types, filename), 0, "mime.types loaded");
+	checkString(mime_lookup(types, "notes.txt"), "text/x-custom", "override");
+	checkString(mime_lookup(types, "file.foo"), "text/x-custom", "added");
+	checkString(mime_lookup(types, "file.BAR"), "application/x-other", "added case-insensitive");
+	checkString(mime_lookup(types, "style.css"), "text/css", "built-in types still there");
+	checkString(mime_lookup(types, "x.comment"), MIME_UNKNOWN, "comments ignored");
+	checkString(getMineFromFileName("notes.txt"), "text/plain", "built-in types unchanged");
+
+	for (int i = 0; i < 200; i++) {
+		char extension[16];
+		snprintf(extension, sizeof(extension), "ext%d", i);
+		mime_add(types, extension, "application/x-many");
+	}
+	checkString(mime_lookup(types, "file.ext123"), "application/x-many", "map grown");
+	checkString(mime_lookup(types, "file.bar"), "application/x-other", "entries kept when grown");
+
+	mime_destroy(types);
+	checkInt(mime_load(NULL, "/nonexistent/mime.types"), -1, "missing file");
+	unlink(filename);
+}
+
+struct {
+	int status;
+	char contentType[64];
+	char body[4096];
+	size_t length;
+} sentResponse;
+
+int captureResponse(int statusCode, struct headers* headers, const struct iovec* body, int count, struct request* request) {
+	sentResponse.status = statusCode;
+	snprintf(sentResponse.contentType, sizeof(sentResponse.contentType), "%s", headers_get(headers, "Content-Type"));
+	sentResponse.length = 0;
+	for (int i = 0; i < count; i++) {
+		memcpy(sentResponse.body + sentResponse.length, body[i].iov_base, body[i].iov_len);
+		sentResponse.length += body[i].iov_len;
+	}
+	sentResponse.body[sentResponse.length] = '\0';
+	return 0;
+}
+
+void testStatus() {
+	checkString(getStatusStrings(404).statusString, "Not found", "status string");
+	checkString(getStatusStrings(299).statusString, "Unknown Status Code", "unknown status");
+	checkString(getStatusStrings(-1).statusString, "Unknown Status Code", "out of range");
+
+	struct request request = {
+		.metaData = {
+			.path = "/<script>"
+		}
+	};
+	struct response response = {
+		.sendResponse = &captureResponse
+	};
+
+	status(request, response, 404);
+	checkInt(sentResponse.status, 404, "status sent");
+	checkString(sentResponse.contentType, "text/html; charset=utf-8", "content type");
+	checkBool(strstr(sentResponse.body, "<h1>Not found</h1>") != NULL, "default page");
+	checkBool(strstr(sentResponse.body, "The file /&lt;script&gt; was not found") != NULL, "path escaped");
+
+	status(request, response, 503);
+	checkBool(strstr(sentResponse.body, "<title>Service Unavailable</title>") != NULL, "page without path");
+	checkBool(strstr(sentResponse.body, "script") == NULL, "no path");
+
+	char filename[] = "/tmp/cfloor-status-XXXXXX";
+	int fd = mkstemp(filename);
+	write(fd, "custom 404\n", 11);
+	close(fd);
+
+	char text[512];
+	snprintf(text, sizeof(text),
+		"bind 127.0.0.1:1234 {\n"
+		"	site {\n"
+		"		root = /\n"
+		"		errorpage 404 = %s\n"
+		"		handler / {\n"
+		"			type = file\n"
+		"		}\n"
+		"	}\n"
+		"}\n", filename);
+	FILE* file = fmemopen(text, strlen(text), "r");
+	struct config* config = config_parse(file);
+	fclose(file);
+	checkNull(config, "config parsed");
+	unlink(filename);
+	if (config == NULL)
+		return;
+
+	request.statusPages = config->binds[0]->sites[0]->handlers[0]->statusPages;
+	checkNull((void*) request.statusPages, "error pages loaded");
+	status(request, response, 404);
+	checkString(sentResponse.body, "custom 404\n", "custom page");
+	status(request, response, 500);
+	checkBool(strstr(sentResponse.body, "<h1>Internal Server Error</h1>") != NULL, "default page for other codes");
+
+	config_destroy(config);
+}
+
+void testCGI() {
+	struct headers env = headers_create();
+	headers_mod(&env, "FOO", "bar");
+	headers_mod(&env, "PATH", "/cgi");
+
+	char** envp = cgi_buildEnvp(&env);
+	checkNull(envp, "envp built");
+
+	int foo = 0;
+	int path = 0;
+	int total = 0;
+	for (char** var = envp; *var != NULL; var++) {
+		if (strcmp(*var, "FOO=bar") == 0)
+			foo++;
+		if (strncmp(*var, "PATH=", 5) == 0)
+			path++;
+		total++;
+	}
+	checkInt(foo, 1, "variable present");
+	checkInt(path, 1, "server variable overridden");
+	checkBool(total >= 2, "server environment inherited");
+
+	int pipefd[2];
+	pipe(pipefd);
+	pid_t pid;
+	checkInt(cgi_spawn("/usr/bin/env", -1, pipefd[1], envp, &pid), 0, "script spawned");
+	close(pipefd[1]);
+
+	char output[8192];
+	size_t length = 0;
+	ssize_t tmp;
+	while ((tmp = read(pipefd[0], output + length, sizeof(output) - length - 1)) > 0)
+		length += tmp;
+	output[length] = '\0';
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+
+	checkBool(strstr(output, "FOO=bar\n") != NULL, "script got environment");
+	checkBool(cgi_spawn("/nonexistent", -1, -1, envp, &pid) != 0, "spawn error reported");
+
+	free(envp);
+	headers_free(&env);
+}
+
+struct coroutineTest {
+	int steps;
+	struct coroutine* self;
+};
+
+void coroutineSteps(void* data) {
+	struct coroutineTest* test = (struct coroutineTest*) data;
+	test->self = coroutine_current();
+	test->steps++;
+	coroutine_yield();
+
+	// the stack is small but not that small
+	char block[16384];
+	memset(block, 1, sizeof(block));
+	test->steps += block[sizeof(block) - 1];
+}
+
+void testCoroutines() {
+	checkBool(coroutine_current() == NULL, "no coroutine outside");
+
+	struct coroutineTest test = {};
+	struct coroutine* coroutine = coroutine_create(&coroutineSteps, &test);
+	checkNull(coroutine, "coroutine created");
+	checkInt(test.steps, 0, "not started yet");
+	checkBool(!coroutine_resume(coroutine), "yielded");
+	checkInt(test.steps, 1, "ran until yield");
+	checkVoid(test.self, coroutine, "current coroutine");
+	checkBool(coroutine_current() == NULL, "back outside");
+	checkBool(coroutine_resume(coroutine), "returned");
+	checkInt(test.steps, 2, "ran to the end");
+	checkBool(coroutine_resume(coroutine), "stays returned");
+	coroutine_destroy(coroutine);
+
+	test = (struct coroutineTest) {};
+	struct coroutine* second = coroutine_create(&coroutineSteps, &test);
+	checkVoid(second, coroutine, "stack reused");
+	coroutine_resume(second);
+	coroutine_resume(second);
+	checkInt(test.steps, 2, "reused stack works");
+	coroutine_destroy(second);
+}
+
+#define FIELD_LIST_SIZE (512)
+
+// collects the decoded fields as "name: value\n"
+int hpackCollect(const char* name, const char* value, void* data) {
+	char* list = (char*) data;
+	size_t length = strlen(list);
+	snprintf(list + length, FIELD_LIST_SIZE - length, "%s: %s\n", name, value);
+	return 0;
+}
+
+void testHpack() {
+	char list[FIELD_LIST_SIZE];
+	struct hpackTable table = hpack_createTable(HPACK_DEFAULT_TABLE_SIZE);
+
+	// examples from RFC 7541, appendix C
+	const unsigned char literal[] = { 0x82, 0x86, 0x84, 0x41, 0x0f, 0x77, 0x77, 0x77, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f, 0x6d };
+	list[0] = '\0';
+	checkInt(hpack_decode(&table, literal, sizeof(literal), &hpackCollect, list), HPACK_SUCCESS, "literal: decode");
+	checkString(list, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", "literal: fields");
+	checkInt(table.size, 57, "literal: table size");
+	hpack_freeTable(&table);
+
+	table = hpack_createTable(HPACK_DEFAULT_TABLE_SIZE);
+	const unsigned char first[] = { 0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff };
+	list[0] = '\0';
+	checkInt(hpack_decode(&table, first, sizeof(first), &hpackCollect, list), HPACK_SUCCESS, "huffman: first");
+	checkString(list, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", "huffman: first fields");
+	checkInt(table.size, 57, "huffman: first table size");
+
+	const unsigned char second[] = { 0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf };
+	list[0] = '\0';
+	checkInt(hpack_decode(&table, second, sizeof(second), &hpackCollect, list), HPACK_SUCCESS, "huffman: second");
+	checkString(list, ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", "huffman: second fields");
+	checkInt(table.size, 110, "huffman: second table size");
+
+	const unsigned char third[] = { 0x82, 0x87, 0x85, 0xbf, 0x40, 0x88, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf };
+	list[0] = '\0';
+	checkInt(hpack_decode(&table, third, sizeof(third), &hpackCollect, list), HPACK_SUCCESS, "huffman: third");
+	checkString(list, ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", "huffman: third fields");
+	checkInt(table.size, 164, "huffman: third table size");
+
+	const unsigned char invalid[] = { 0x80 };
+	checkInt(hpack_decode(&table, invalid, sizeof(invalid), &hpackCollect, list), HPACK_DECODE_ERROR, "index 0");
+	hpack_freeTable(&table);
+
+	char* block = NULL;
+	size_t length = 0;
+	FILE* stream = open_memstream(&block, &length);
+	hpack_encodeStatus(stream, 200);
+	hpack_encodeStatus(stream, 418);
+	hpack_encode(stream, "Content-Type", "text/plain");
+	hpack_encode(stream, "X-Test", "Hello World");
+	fclose(stream);
+
+	table = hpack_createTable(HPACK_DEFAULT_TABLE_SIZE);
+	list[0] = '\0';
+	checkInt(hpack_decode(&table, (unsigned char*) block, length, &hpackCollect, list), HPACK_SUCCESS, "encode: decode");
+	checkString(list, ":status: 200\n:status: 418\ncontent-type: text/plain\nx-test: Hello World\n", "encode: round trip");
+	checkInt(table.size, 0, "encode: no indexing");
+	hpack_freeTable(&table);
+	free(block);
+}
+
 void testHeaders() {
 	struct headers headers = (struct headers) {
 		.number = 0
@@ -255,6 +856,143 @@ void testHeaders() {
 	headers_free(&headers);
 }
 
+void testAccessLog() {
+	char buffer[ACCESS_LOG_LINE_LENGTH];
+
+	struct accessLogEntry entry = {
+		.metaData = {
+			.method = GET,
+			.protocol = HTTP11,
+			.uri = "/index.html?"
+		},
+		.remoteAddr = "127.0.0.1",
+		.referer = NULL,
+		.userAgent = "test \"agent\"",
+		.statusCode = 200,
+		.headerBytes = 100,
+		.bodyBytes = 23,
+		.headerParseTime = 1,
+		.timeToFirstByte = 2,
+		.handlerTime = 3,
+		.totalTime = 4,
+		.tls = false,
+		.keepAliveReuse = 1,
+		.time = 0
+	};
+
+	accesslog_format(ACCESS_LOG_CLF, &entry, buffer, ACCESS_LOG_LINE_LENGTH);
+	checkBool(strncmp(buffer, "127.0.0.1 - - [", 15) == 0, "clf prefix");
+	checkBool(strstr(buffer, "] \"GET /index.html? HTTP/1.1\" 200 23") != NULL, "clf request");
+
+	accesslog_format(ACCESS_LOG_COMBINED, &entry, buffer, ACCESS_LOG_LINE_LENGTH);
+	checkBool(strstr(buffer, "\"-\" \"test \\\"agent\\\"\"") != NULL, "combined escaping");
+	checkBool(buffer[strlen(buffer) - 1] == '"', "combined ends with the user agent");
+
+	accesslog_format(ACCESS_LOG_TIMING, &entry, buffer, ACCESS_LOG_LINE_LENGTH);
+	checkBool(strstr(buffer, "\"-\" \"test \\\"agent\\\"\" sent=123 tls=0 reuse=1") != NULL, "timing after combined");
+	checkBool(strstr(buffer, "total_us=4") != NULL, "timing breakdown");
+
+	accesslog_format(ACCESS_LOG_JSON, &entry, buffer, ACCESS_LOG_LINE_LENGTH);
+	checkBool(buffer[0] == '{' && buffer[strlen(buffer) - 1] == '}', "json object");
+	checkBool(strstr(buffer, "\"user_agent\":\"test \\\"agent\\\"\"") != NULL, "json escaping");
+	checkBool(strstr(buffer, "\"bytes_sent\":123,\"body_bytes\":23") != NULL, "json bytes");
+	checkBool(strstr(buffer, "\"total_us\":4}") != NULL, "json timing");
+
+	checkInt(accesslog_format(ACCESS_LOG_JSON, &entry, buffer, 16), 15, "truncation");
+}
+
+void testMetrics() {
+	int64_t accepted = metrics_get(METRIC_CONNECTIONS_ACCEPTED);
+	int64_t active = metrics_get(METRIC_CONNECTIONS_ACTIVE);
+
+	metrics_stateChange(-1, OPENED);
+	metrics_stateChange(OPENED, KEEP_ALIVE);
+	checkInt(metrics_get(METRIC_CONNECTIONS_ACCEPTED), accepted + 1, "accepted");
+	checkInt(metrics_get(METRIC_CONNECTIONS_ACTIVE), active + 1, "active");
+	checkInt(metrics_get(METRIC_CONNECTIONS_STATE + KEEP_ALIVE), 1, "state gauge");
+	checkInt(metrics_get(METRIC_CONNECTIONS_STATE + OPENED), 0, "state gauge");
+	metrics_stateChange(KEEP_ALIVE, -1);
+	checkInt(metrics_get(METRIC_CONNECTIONS_ACTIVE), active, "active");
+	checkInt(metrics_get(METRIC_CONNECTIONS_STATE + KEEP_ALIVE), 0, "state gauge");
+
+	metrics_requestCompleted(404, 3000, 100);
+	metrics_requestCompleted(200, 20000000, 50);
+	checkInt(metrics_get(METRIC_RESPONSES + 4), 1, "status class");
+	checkInt(metrics_get(METRIC_BYTES_OUT), 150, "bytes out");
+	checkInt(metrics_get(METRIC_LATENCY_BUCKET + 1), 1, "latency bucket");
+	checkInt(metrics_get(METRIC_LATENCY_BUCKET + METRICS_NR_LATENCY_BUCKETS - 1), 1, "latency +Inf");
+	checkInt(metrics_get(METRIC_LATENCY_COUNT), 2, "latency count");
+
+	metrics_requestHandler(CGI_HANDLER_NO);
+	metrics_requestHandler(12345);
+	checkInt(metrics_get(METRIC_REQUESTS + CGI_HANDLER_NO), 1, "handler requests");
+	checkInt(metrics_get(METRIC_REQUESTS + METRICS_NO_HANDLER), 1, "no handler requests");
+}
+
+void testAdmission() {
+	checkBool(admission_addPeer("192.0.2.1", 2), "first connection");
+	checkBool(admission_addPeer("192.0.2.1", 2), "second connection");
+	checkBool(!admission_addPeer("192.0.2.1", 2), "over the limit");
+	checkBool(admission_addPeer("192.0.2.2", 2), "other peer");
+	checkInt(admission_peerConnections("192.0.2.1"), 2, "peer count");
+	admission_removePeer("192.0.2.1");
+	checkBool(admission_addPeer("192.0.2.1", 2), "below the limit again");
+	checkBool(admission_addPeer("192.0.2.1", 0), "no limit");
+	checkInt(admission_peerConnections("192.0.2.1"), 3, "counted without limit");
+	for (int i = 0; i < 3; i++)
+		admission_removePeer("192.0.2.1");
+	admission_removePeer("192.0.2.2");
+	checkInt(admission_peerConnections("192.0.2.1"), 0, "all removed");
+
+	// 10 ms target, 100 ms interval; times in µs
+	struct codel codel;
+	codel_init(&codel, 10, 100);
+	checkBool(!codel_shouldShed(&codel, 5000, 1000000), "below target");
+	checkBool(!codel_shouldShed(&codel, 20000, 1010000), "above target for less than an interval");
+	checkBool(!codel_shouldShed(&codel, 20000, 1100000), "above target for less than an interval");
+	checkBool(codel_shouldShed(&codel, 20000, 1110000), "above target for an interval");
+	checkBool(!codel_shouldShed(&codel, 20000, 1150000), "waits for the next drop");
+	checkBool(codel_shouldShed(&codel, 20000, 1210000), "next drop");
+	// the interval shrinks with the square root of the count
+	checkBool(codel_shouldShed(&codel, 20000, 1281000), "faster drop");
+	checkBool(!codel_shouldShed(&codel, 5000, 1290000), "below target again");
+	checkBool(!codel_shouldShed(&codel, 20000, 1300000), "not dropping anymore");
+}
+
+void testRateLimit() {
+	struct rateLimit limit = { .rate = 2, .burst = 3 };
+	long now = 1000000;
+
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 0, "first request");
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 0, "burst");
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 0, "burst");
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 1, "over the limit");
+	checkInt(ratelimit_take(&limit, "192.0.2.2", now), 0, "other peer");
+	struct rateLimit other = { .rate = 1 };
+	checkInt(ratelimit_take(&other, "192.0.2.1", now), 0, "other limit");
+	checkInt(ratelimit_take(&other, "192.0.2.1", now), 1, "burst defaults to rate");
+	checkInt(ratelimit_take(NULL, "192.0.2.1", now), 0, "no limit");
+
+	// 2 requests per second
+	now += 500000;
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 0, "refilled");
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 1, "over the limit again");
+	now += 10000000;
+	for (int i = 0; i < 3; i++)
+		ratelimit_take(&limit, "192.0.2.1", now);
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 1, "not more than the burst");
+
+	// the table is full long before this; the least recently seen peers are dropped
+	char addr[INET6_ADDRSTRLEN + 1];
+	for (int i = 0; i < RATELIMIT_SHARDS * RATELIMIT_SHARD_SIZE * 4; i++) {
+		snprintf(addr, sizeof(addr), "10.%d.%d.%d", i >> 16, (i >> 8) & 0xff, i & 0xff);
+		ratelimit_take(&limit, addr, now);
+	}
+	checkInt(ratelimit_take(&limit, "192.0.2.1", now), 0, "evicted");
+
+	ratelimit_flush();
+}
+
 void testConfig() {
 	FILE* file;
 
@@ -276,6 +1014,7 @@ void testConfig() {
 
 	checkString(config->binds[0]->addr, "0.0.0.0", "bind addr check");
 	checkString(config->binds[0]->port, "80", "bind port check");
+	checkInt(config->binds[0]->maxBodySize, 1048576, "bind max body size check");
 	checkInt(config->binds[0]->nrSites, 1, "site no check");
 	checkInt(config->binds[0]->sites[0]->nrHostnames, 1, "site hostname no check");
 	checkString(config->binds[0]->sites[0]->hostnames[0], "example.com", "site hostname check");
@@ -288,6 +1027,7 @@ void testConfig() {
 	checkInt(config->binds[0]->sites[0]->handlers[0]->settings.fileSettings.indexfiles.number, 1, "handler settings index no");
 	checkString(config->binds[0]->sites[0]->handlers[0]->settings.fileSettings.indexfiles.files[0], "index.html", "handler settings index check");
 	checkString(config->logging.accessLogfile, "access.log", "access log file check");
+	checkInt(config->logging.accessLogFormat, ACCESS_LOG_JSON, "access log format check");
 	checkString(config->logging.serverLogfile, "server.log", "server log file check");
 	printf("%s\n", config->logging.serverLogfile);
 	checkInt(config->logging.serverVerbosity, INFO, "server log verbosity check");
@@ -316,11 +1056,90 @@ void testConfig() {
 	config_destroy(config);
 }
 
+void* routedHandler(struct config* config, const char* host, const char* path) {
+	struct networkingConfig networkingConfig;
+	if (config_getNetworkingConfig(config, &networkingConfig) == NULL)
+		return NULL;
+
+	struct metaData metaData = {
+		.path = (char*) path,
+		.uri = (char*) path
+	};
+	struct handler handler = config_getHandler(metaData, host, &(networkingConfig.binds.binds[0]));
+
+	free(networkingConfig.binds.binds);
+	headers_free(&(networkingConfig.defaultHeaders));
+
+	return handler.handler;
+}
+
+void testRouting() {
+	const char* text =
+		"bind 127.0.0.1:8080 {\n"
+		"	site {\n"
+		"		root = /\n"
+		"		handler / {\n"
+		"			type = file\n"
+		"		}\n"
+		"	}\n"
+		"	site {\n"
+		"		hostname = example.com\n"
+		"		alias = www.example.com\n"
+		"		root = /\n"
+		"		handler / {\n"
+		"			type = file\n"
+		"		}\n"
+		"		handler /cgi-bin {\n"
+		"			type = cgi\n"
+		"		}\n"
+		"		handler /cgi-bin/fcgi/ {\n"
+		"			type = fastcgi\n"
+		"		}\n"
+		"	}\n"
+		"	site {\n"
+		"		hostname = *.example.com\n"
+		"		root = /\n"
+		"		handler /metrics {\n"
+		"			type = metrics\n"
+		"		}\n"
+		"	}\n"
+		"	site {\n"
+		"		hostname = *.api.example.com\n"
+		"		root = /\n"
+		"		handler /api {\n"
+		"			type = cgi\n"
+		"		}\n"
+		"	}\n"
+		"}\n";
+
+	FILE* file = fmemopen((void*) text, strlen(text), "r");
+	struct config* config = config_parse(file);
+	fclose(file);
+	checkNull(config, "config parsed");
+	if (config == NULL)
+		return;
+
+	checkVoid(routedHandler(config, "example.com", "/index.html"), &fileHandler, "exact host");
+	checkVoid(routedHandler(config, "www.example.com", "/"), &fileHandler, "alias");
+	checkVoid(routedHandler(config, "Example.COM:8080", "/cgi-bin/test.sh"), &cgiHandler, "case and port ignored");
+	checkVoid(routedHandler(config, "example.com", "/cgi-bin"), &cgiHandler, "directory itself");
+	checkVoid(routedHandler(config, "example.com", "/cgi-binary"), &fileHandler, "only whole path segments");
+	checkVoid(routedHandler(config, "example.com", "/cgi-bin/fcgi/test"), &fastcgiHandler, "longest directory");
+	checkVoid(routedHandler(config, "a.example.com", "/metrics"), &metricsHandler, "wildcard");
+	checkVoid(routedHandler(config, "x.api.example.com", "/api/v1"), &cgiHandler, "longest wildcard");
+	checkVoid(routedHandler(config, "api.example.com", "/api"), &status500, "wildcard without handler");
+	checkVoid(routedHandler(config, "other.org", "/"), &fileHandler, "default site");
+	checkVoid(routedHandler(config, NULL, "/"), &fileHandler, "no host");
+
+	config_destroy(config);
+}
+
 #define LOCAL_PORT (1337)
 #define LOCAL_PORT_STRING ("1337")
 
 struct {
 	handler_t handler;
+	union userData data;
 	struct bind bind;
 	int pid;
 } serverdata = {
@@ -345,7 +1164,8 @@ void stopWebserver() {
 
 struct handler handlerGetter(struct metaData metaData, const char* host, struct bind* bind) {
 	return (struct handler) {
-		.handler = serverdata.handler
+		.handler = serverdata.handler,
+		.data = serverdata.data
 	};
 }
 
@@ -680,39 +1500,1982 @@ void testPersistence() {
 	stopWebserver();
 }
 
-void test(const char* name, void (*testFunction)()) {
-	printf("%s\n", name);
-	printf("%.*s\n", (int) strlen(name), 
-		"===================================");
-	testFunction();
-	if (!global)
-		overall = false;
-	printf("%s: %s\n\n", name, global ? "OK" : "FAILED");
-	global = true;
+char* readBody(FILE* stream, size_t length) {
+	length = fread(&(buffer[0]), 1, length, stream);
+	buffer[length] = '\0';
+	return buffer;
 }
 
-void header(const char* text) {
-	printf("\n");
-	printf("=======================================\n");
-	printf("== %s\n", text);
-	printf("=======================================\n");
+// echoes the request body
+void testBodyHandler(struct request request, struct response response) {
+	char body[256];
+	size_t length = 0;
+	ssize_t tmp;
+	while ((tmp = read(request.fd, body + length, sizeof(body) - length)) > 0)
+		length += tmp;
+
+	char contentLength[16];
+	snprintf(contentLength, sizeof(contentLength), "%zu", length);
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Length", contentLength);
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+	write(fd, body, length);
+	close(fd);
 }
 
-int main(int argc, char** argv) {
+void testRequestBody() {
+	struct headers headers;
+	int status;
+	FILE* stream;
+
+	serverdata.bind.maxBodySize = 64;
+	startWebserver(&testBodyHandler);
+
+	printf("testing body with Content-Length...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "5");
+	stream = sendRequest(NULL, HTTP11, POST, "/", headers);
+	fprintf(stream, "hello");
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Content-Length"), "5", "body length");
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "hello", "body echoed");
+
+	printf("testing chunked body on the same connection...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Transfer-Encoding", "chunked");
+	stream = sendRequest(stream, HTTP11, POST, "/", headers);
+	fprintf(stream, "4\r\nWiki\r\n5;ext=1\r\npedia\r\n0\r\nX-Trailer: yes\r\n\r\n");
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Content-Length"), "9", "body length");
+	headers_free(&headers);
+	checkString(readBody(stream, 9), "Wikipedia", "chunked body decoded");
+
+	printf("testing Expect: 100-continue...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "3");
+	headers_mod(&headers, "Expect", "100-continue");
+	stream = sendRequest(stream, HTTP11, POST, "/", headers);
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 100, "interim response");
+	checkString(readline(stream), "\r\n", "interim response empty");
+	fprintf(stream, "abc");
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Connection"), "keep-alive", "connection still persistent");
+	headers_free(&headers);
+	checkString(readBody(stream, 3), "abc", "body echoed");
+	fclose(stream);
+
+	printf("testing body exceeding the limit...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "65");
+	stream = sendRequest(NULL, HTTP11, POST, "/", headers);
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 413, "body rejected");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Connection"), "close", "connection closed");
+	headers_free(&headers);
+	fclose(stream);
+
+	stopWebserver();
+
+	// a handler that ignores the body must not desync the connection
+	startWebserver(&testHandler1);
+
+	printf("testing unread body...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "10");
+	stream = sendRequest(NULL, HTTP11, POST, "/", headers);
+	fprintf(stream, "0123456789");
+	stream = sendRequest(stream, HTTP11, GET, "/", headers_create());
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "second request found");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	fclose(stream);
+
+	stopWebserver();
+
+	serverdata.bind.maxBodySize = 0;
+}
+
+// answers with the path; "/slow" takes a while, "/chunked" has no Content-Length
+void testPipelineHandler(struct request request, struct response response) {
+	const char* path = request.metaData.path;
+	if (strcmp(path, "/slow") == 0)
+		usleep(300000);
+
+	char contentLength[24];
+	snprintf(contentLength, sizeof(contentLength), "%zu", strlen(path));
+
+	struct headers headers = headers_create();
+	if (strcmp(path, "/chunked") != 0)
+		headers_mod(&headers, "Content-Length", contentLength);
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+	write(fd, path, strlen(path));
+	close(fd);
+}
+
+void testPipelining() {
+	struct headers headers;
+	int status;
+	FILE* stream;
+
+	startWebserver(&testPipelineHandler);
+
+	printf("testing pipelined requests with a slow first response...\n\n");
+	stream = sendRequest(NULL, HTTP11, GET, "/slow", headers_create());
+	stream = sendRequest(stream, HTTP11, GET, "/chunked", headers_create());
+	stream = sendRequest(stream, HTTP11, GET, "/fast", headers_create());
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "/slow", "first response first");
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Transfer-Encoding"), "chunked", "second response chunked");
+	headers_free(&headers);
+	checkString(readline(stream), "8\r\n", "chunk size");
+	checkString(readBody(stream, 10), "/chunked\r\n", "second response second");
+	checkString(readline(stream), "0\r\n", "last chunk");
+	checkString(readline(stream), "\r\n", "chunked response complete");
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "/fast", "third response third");
+
+	printf("testing that the connection is still usable...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Connection", "close");
+	stream = sendRequest(stream, HTTP11, GET, "/fast", headers);
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Connection"), "close", "connection closed");
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "/fast", "body okay");
+	fclose(stream);
+
+	stopWebserver();
+}
+
+// "/echo" returns the request body; everything else is answered like in the pipelining test
+void testHttp2Handler(struct request request, struct response response) {
+	if (strcmp(request.metaData.path, "/echo") == 0) {
+		testBodyHandler(request, response);
+	} else {
+		testPipelineHandler(request, response);
+	}
+}
+
+void h2Send(int fd, int type, int flags, uint32_t id, const void* payload, size_t length) {
+	unsigned char frame[HTTP2_FRAME_HEADER_LENGTH + 256];
+	frame[0] = 0;
+	frame[1] = (length >> 8) & 0xff;
+	frame[2] = length & 0xff;
+	frame[3] = type;
+	frame[4] = flags;
+	frame[5] = (id >> 24) & 0xff;
+	frame[6] = (id >> 16) & 0xff;
+	frame[7] = (id >> 8) & 0xff;
+	frame[8] = id & 0xff;
+	memcpy(frame + HTTP2_FRAME_HEADER_LENGTH, payload, length);
+	write(fd, frame, HTTP2_FRAME_HEADER_LENGTH + length);
+}
+
+void h2SendRequest(int fd, uint32_t id, const char* method, const char* path, const char* extraName, bool endStream) {
+	char* block = NULL;
+	size_t length = 0;
+	FILE* stream = open_memstream(&block, &length);
+	hpack_encode(stream, ":method", method);
+	hpack_encode(stream, ":scheme", "http");
+	hpack_encode(stream, ":path", path);
+	hpack_encode(stream, ":authority", "localhost");
+	if (extraName != NULL)
+		hpack_encode(stream, extraName, "test");
+	fclose(stream);
+
+	h2Send(fd, HTTP2_HEADERS, HTTP2_FLAG_END_HEADERS | (endStream ? HTTP2_FLAG_END_STREAM : 0), id, block, length);
+	free(block);
+}
+
+bool h2ReadFully(int fd, unsigned char* buffer, size_t length) {
+	while (length > 0) {
+		struct pollfd pollfd = {
+			.fd = fd,
+			.events = POLLIN
+		};
+		if (poll(&pollfd, 1, 5000) <= 0)
+			return false;
+
+		ssize_t tmp = read(fd, buffer, length);
+		if (tmp <= 0)
+			return false;
+		buffer += tmp;
+		length -= tmp;
+	}
+	return true;
+}
+
+// returns the payload length or -1 on EOF or timeout
+int h2Receive(int fd, int* type, int* flags, uint32_t* id, unsigned char* payload) {
+	unsigned char header[HTTP2_FRAME_HEADER_LENGTH];
+	if (!h2ReadFully(fd, header, HTTP2_FRAME_HEADER_LENGTH))
+		return -1;
+
+	size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+	*type = header[3];
+	*flags = header[4];
+	*id = ((header[5] & 0x7f) << 24) | (header[6] << 16) | (header[7] << 8) | header[8];
+
+	if (length > HTTP2_MAX_FRAME_SIZE || !h2ReadFully(fd, payload, length))
+		return -1;
+
+	return length;
+}
+
+void testHttp2() {
+	startWebserver(&testHttp2Handler);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sockaddr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(LOCAL_PORT)
+	};
+	inet_pton(AF_INET, "127.0.0.1", &sockaddr.sin_addr);
+	if (connect(fd, (struct sockaddr*) &sockaddr, sizeof(struct sockaddr_in)) < 0) {
+		printf("PANIC: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	printf("testing multiplexed streams...\n\n");
+	write(fd, HTTP2_PREFACE_LINE "\r\n" HTTP2_PREFACE_REST, strlen(HTTP2_PREFACE_LINE "\r\n" HTTP2_PREFACE_REST));
+	h2Send(fd, HTTP2_SETTINGS, 0, 0, NULL, 0);
+	h2SendRequest(fd, 1, "GET", "/slow", NULL, true);
+	h2SendRequest(fd, 3, "GET", "/fast", NULL, true);
+	h2SendRequest(fd, 5, "POST", "/echo", NULL, false);
+	h2Send(fd, HTTP2_DATA, HTTP2_FLAG_END_STREAM, 5, "hello h2", 8);
+	h2Send(fd, HTTP2_PING, 0, 0, "12345678", 8);
+
+	struct hpackTable table = hpack_createTable(HPACK_DEFAULT_TABLE_SIZE);
+	unsigned char payload[HTTP2_MAX_FRAME_SIZE];
+	char fields[6][FIELD_LIST_SIZE] = {};
+	char bodies[6][FIELD_LIST_SIZE] = {};
+	// order in which the streams ended
+	uint32_t ended[3];
+	int numberEnded = 0;
+	bool settings = false;
+	bool pong = false;
+
+	int type, flags, length;
+	uint32_t id;
+	while (numberEnded < 3 && (length = h2Receive(fd, &type, &flags, &id, payload)) >= 0) {
+		if (type == HTTP2_SETTINGS && !(flags & HTTP2_FLAG_ACK)) {
+			settings = true;
+		} else if (type == HTTP2_PING && (flags & HTTP2_FLAG_ACK)) {
+			pong = memcmp(payload, "12345678", 8) == 0;
+		} else if (type == HTTP2_HEADERS && id < 6) {
+			hpack_decode(&table, payload, length, &hpackCollect, fields[id]);
+		} else if (type == HTTP2_DATA && id < 6) {
+			strncat(bodies[id], (char*) payload, length);
+		}
+
+		if ((type == HTTP2_HEADERS || type == HTTP2_DATA) && (flags & HTTP2_FLAG_END_STREAM))
+			ended[numberEnded++] = id;
+	}
+
+	checkBool(settings, "server settings");
+	checkBool(pong, "ping answered");
+	checkInt(numberEnded, 3, "all streams ended");
+	checkBool(numberEnded == 3 && ended[2] == 1, "slow stream last");
+	checkBool(strstr(fields[1], ":status: 200\n") == fields[1], "status of stream 1");
+	checkBool(strstr(fields[1], "server: Test\n") != NULL, "default header");
+	checkString(bodies[1], "/slow", "body of stream 1");
+	checkString(bodies[3], "/fast", "body of stream 3");
+	checkString(bodies[5], "hello h2", "request body echoed");
+
+	printf("testing malformed request...\n\n");
+	h2SendRequest(fd, 7, "GET", "/fast", "Connection", true);
+	length = h2Receive(fd, &type, &flags, &id, payload);
+	while (length >= 0 && type != HTTP2_RST_STREAM)
+		length = h2Receive(fd, &type, &flags, &id, payload);
+	checkInt(id, 7, "stream reset");
+	checkInt(length == 4 ? payload[3] : -1, HTTP2_PROTOCOL_ERROR, "protocol error");
+
+	printf("testing that the connection is still usable...\n\n");
+	h2SendRequest(fd, 9, "GET", "/fast", NULL, true);
+	bodies[1][0] = '\0';
+	while ((length = h2Receive(fd, &type, &flags, &id, payload)) >= 0) {
+		if (type == HTTP2_DATA && id == 9)
+			strncat(bodies[1], (char*) payload, length);
+		if (id == 9 && (flags & HTTP2_FLAG_END_STREAM))
+			break;
+	}
+	checkString(bodies[1], "/fast", "body okay");
+
+	unsigned char goaway[8] = {};
+	h2Send(fd, HTTP2_GOAWAY, 0, 0, goaway, sizeof(goaway));
+	while ((length = h2Receive(fd, &type, &flags, &id, payload)) >= 0 && type != HTTP2_GOAWAY);
+	checkInt(type, HTTP2_GOAWAY, "session closed");
+
+	hpack_freeTable(&table);
+	close(fd);
+
+	stopWebserver();
+}
+
+long elapsedMs(struct timespec since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+#define FASTCGI_FLOOD (1024 * 1024)
+
+void testFastCGI() {
+	struct headers headers;
+	int status;
+	FILE* stream;
+	FILE* streams[3];
+
+	char* documentRoot = realpath("tests", NULL);
+	struct fastcgiSettings settings = {
+		.documentRoot = documentRoot,
+		.minWorkers = 0,
+		.maxWorkers = 2,
+		.idleTimeout = FASTCGI_DEFAULT_IDLE_TIMEOUT,
+		.queueTimeout = FASTCGI_DEFAULT_QUEUE_TIMEOUT
+	};
+
+	serverdata.data.ptr = &settings;
+	startWebserver(&fastcgiHandler);
+
+	printf("testing simple request...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "4");
+	stream = sendRequest(NULL, HTTP11, POST, "/fastcgi-worker?hello", headers);
+	fprintf(stream, "body");
+	fflush(stream);
+
+	status = readStatus(stream, NULL);
+	checkInt(status, 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Content-Type"), "text/plain", "header from worker");
+	headers_free(&headers);
+
+	// first chunk
+	readline(stream);
+	checkString(readline(stream), "hello from fastcgi\n", "body from worker");
+	checkString(readline(stream), "query: hello\n", "query string passed");
+	checkString(readline(stream), "body: body\n", "request body passed");
+	fclose(stream);
+
+	printf("testing concurrent requests...\n\n");
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < 3; i++) {
+		streams[i] = sendRequest(NULL, HTTP10, GET, "/fastcgi-worker?sleep=300", headers_create());
+		fflush(streams[i]);
+	}
+	bool allOkay = true;
+	for (int i = 0; i < 3; i++) {
+		status = readStatus(streams[i], NULL);
+		allOkay &= (status == 200);
+		headers = readHeaders(streams[i]);
+		headers_free(&headers);
+		fclose(streams[i]);
+	}
+	checkBool(allOkay, "all requests served");
+	checkBool(elapsedMs(start) < 600, "requests ran concurrently");
+
+	printf("testing output before the request body is read...\n\n");
+	// both are far more than the socket buffers take
+	char* body = malloc(FASTCGI_FLOOD);
+	memset(body, 'b', FASTCGI_FLOOD);
+	char length[16];
+	snprintf(length, sizeof(length), "%d", FASTCGI_FLOOD);
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", length);
+	char uri[32];
+	snprintf(uri, sizeof(uri), "/fastcgi-worker?flood=%d", FASTCGI_FLOOD);
+	stream = sendRequest(NULL, HTTP10, POST, uri, headers);
+	fwrite(body, 1, FASTCGI_FLOOD, stream);
+	fflush(stream);
+	free(body);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	size_t flooded = 0;
+	int c;
+	while ((c = fgetc(stream)) == 'x')
+		flooded++;
+	checkInt(flooded, FASTCGI_FLOOD, "output before the body");
+	ungetc(c, stream);
+	checkString(readline(stream), "hello from fastcgi\n", "output after the body");
+	fclose(stream);
+
+	stopWebserver();
+
+	// one worker with 2 request slots; the third request has to wait and times out
+	settings.maxWorkers = 1;
+	settings.queueTimeout = 100;
+	startWebserver(&fastcgiHandler);
+
+	printf("testing backpressure...\n\n");
+	for (int i = 0; i < 3; i++) {
+		streams[i] = sendRequest(NULL, HTTP10, GET, "/fastcgi-worker?sleep=500", headers_create());
+		fflush(streams[i]);
+		usleep(20000);
+	}
+	int served = 0;
+	int rejected = 0;
+	for (int i = 0; i < 3; i++) {
+		status = readStatus(streams[i], NULL);
+		if (status == 200)
+			served++;
+		if (status == 503)
+			rejected++;
+		headers = readHeaders(streams[i]);
+		headers_free(&headers);
+		fclose(streams[i]);
+	}
+	checkInt(served, 2, "worker slots used");
+	checkInt(rejected, 1, "excess request rejected");
+
+	stopWebserver();
+
+	serverdata.data.ptr = NULL;
+	free(documentRoot);
+}
+
+#define RELOAD_PORT (1338)
+
+// the response body is the name of the config (the settings of the bind)
+void reloadHandler(struct request request, struct response response) {
+	const char* name = request.userData.ptr;
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Length", "1");
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+	write(fd, name, 1);
+	close(fd);
+}
+
+struct handler reloadGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	return (struct handler) {
+		.handler = &reloadHandler,
+		.data = bind->settings
+	};
+}
+
+int releasePipe[2];
+void reloadRelease(struct networkingConfig* config) {
+	write(releasePipe[1], config->data, 1);
+}
+
+int connectTo(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sockaddr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port)
+	};
+	inet_pton(AF_INET, "127.0.0.1", &sockaddr.sin_addr);
+	if (connect(fd, (struct sockaddr*) &sockaddr, sizeof(struct sockaddr_in)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// sends a keep-alive request; returns the name of the config that answered it
+int askConfig(FILE* stream) {
+	sendRequest(stream, HTTP11, GET, "/", headers_create());
+	fflush(stream);
+	if (readStatus(stream, NULL) != 200)
+		return -1;
+	struct headers headers = readHeaders(stream);
+	headers_free(&headers);
+	return fgetc(stream);
+}
+
+int releasedConfig() {
+	char name;
+	if (!hasData(releasePipe[0]) || read(releasePipe[0], &name, 1) != 1)
+		return -1;
+	return name;
+}
+
+void testReload() {
+	if (pipe(releasePipe) < 0) {
+		showError();
+		return;
+	}
+
+	struct bind bindsA[] = {
+		{ .address = "127.0.0.1", .port = LOCAL_PORT_STRING, .settings = { .ptr = "A" } }
+	};
+	struct bind bindsB[] = {
+		{ .address = "127.0.0.1", .port = LOCAL_PORT_STRING, .settings = { .ptr = "B" } },
+		{ .address = "127.0.0.1", .port = "1338", .settings = { .ptr = "B" } }
+	};
+	struct bind bindsC[] = {
+		{ .address = "127.0.0.1", .port = "1338", .settings = { .ptr = "C" } }
+	};
+	struct networkingConfig configs[] = {
+		{ .binds = { 1, bindsA }, .data = "A" },
+		{ .binds = { 2, bindsB }, .data = "B" },
+		{ .binds = { 1, bindsC }, .data = "C" }
+	};
+	for (int i = 0; i < 3; i++) {
+		configs[i].connectionTimeout = DEFAULT_CONNECTION_TIMEOUT;
+		configs[i].maxConnections = DEFAULT_MAX_CONNECTIONS;
+		configs[i].defaultHeaders = headers_create();
+		configs[i].getHandler = &reloadGetter;
+		configs[i].release = &reloadRelease;
+	}
+
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		signal_block(SIGHUP);
+		networking_init(configs[0]);
+		printf("webserver started.\n");
+		for (int i = 1; i < 3; i++) {
+			signal_wait(SIGHUP);
+			networking_reload(configs[i]);
+		}
+		while(true) {
+			sleep(0xffff);
+		}
+		exit(0);
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	FILE* old = sendRequest(NULL, HTTP11, GET, "/", headers_create());
+	fflush(old);
+	readStatus(old, NULL);
+	struct headers headers = readHeaders(old);
+	headers_free(&headers);
+	checkInt(fgetc(old), 'A', "initial config");
+
+	printf("reloading...\n\n");
+	kill(serverdata.pid, SIGHUP);
+	usleep(200000);
+
+	checkInt(askConfig(old), 'B', "open connection uses new config");
+	checkInt(releasedConfig(), 'A', "old config released");
+
+	int fd = connectTo(RELOAD_PORT);
+	checkBool(fd >= 0, "new bind opened");
+	FILE* added = fdopen(fd, "w+");
+	checkInt(askConfig(added), 'B', "new bind served");
+	fclose(added);
+
+	printf("reloading...\n\n");
+	kill(serverdata.pid, SIGHUP);
+	usleep(200000);
+
+	fd = connectTo(LOCAL_PORT);
+	checkInt(fd, -1, "removed bind closed");
+	if (fd >= 0)
+		close(fd);
+	checkInt(askConfig(old), 'B', "removed bind drained");
+	checkInt(releasedConfig(), -1, "drained config kept");
+
+	fd = connectTo(RELOAD_PORT);
+	added = fdopen(fd, "w+");
+	checkInt(askConfig(added), 'C', "kept bind uses new config");
+	fclose(added);
+
+	fclose(old);
+	// connections are cleaned up once per second
+	usleep(1500000);
+	checkInt(releasedConfig(), 'B', "drained config released");
+
+	stopWebserver();
+
+	for (int i = 0; i < 3; i++) {
+		headers_free(&(configs[i].defaultHeaders));
+	}
+	close(releasePipe[0]);
+	close(releasePipe[1]);
+}
+
+// the body is the pid of the process that answered
+void handOverHandler(struct request request, struct response response) {
+	if (strcmp(request.metaData.path, "/slow") == 0)
+		usleep(500000);
+	else if (strcmp(request.metaData.path, "/stuck") == 0)
+		usleep(2000000);
+
+	char body[32];
+	snprintf(body, sizeof(body), "%d\n", getpid());
+	char length[24];
+	snprintf(length, sizeof(length), "%zu", strlen(body));
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Length", length);
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+	write(fd, body, strlen(body));
+	close(fd);
+}
+
+struct handler handOverGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	return (struct handler) {
+		.handler = &handOverHandler
+	};
+}
+
+void startHandOverServer() {
+	networking_init((struct networkingConfig) {
+		.binds = { 1, &serverdata.bind },
+		.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+		.maxConnections = DEFAULT_MAX_CONNECTIONS,
+		.defaultHeaders = headers_create(),
+		.getHandler = &handOverGetter
+	});
+}
+
+int readPid(FILE* stream) {
+	if (readStatus(stream, NULL) != 200)
+		return -1;
+	struct headers headers = readHeaders(stream);
+	headers_free(&headers);
+	return atoi(readline(stream));
+}
+
+void testHandOver() {
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		signal_block(SIGUSR2);
+		startHandOverServer();
+		printf("webserver started.\n");
+		signal_wait(SIGUSR2);
+		// the new process is this test binary; main() turns it into a server
+		if (networking_handOver("/proc/self/exe", (char*[]) { "test", NULL }) < 0)
+			exit(1);
+		networking_drain();
+		while(networking_connections() > 0) {
+			usleep(100000);
+		}
+		exit(0);
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	int old = serverdata.pid;
+
+	FILE* idle = sendRequest(NULL, HTTP11, GET, "/", headers_create());
+	fflush(idle);
+	checkInt(readPid(idle), old, "served by old process");
+
+	FILE* slow = sendRequest(NULL, HTTP10, GET, "/slow", headers_create());
+	fflush(slow);
+	usleep(100000);
+
+	printf("handing over...\n\n");
+	kill(old, SIGUSR2);
+	usleep(200000);
+
+	FILE* stream = sendRequest(NULL, HTTP11, GET, "/", headers_create());
+	fflush(stream);
+	int new = readPid(stream);
+	fclose(stream);
+	checkBool(new > 0 && new != old, "served by new process");
+
+	checkInt(readPid(slow), old, "running request finished");
+	fclose(slow);
+
+	checkInt(fgetc(idle), EOF, "idle connection closed");
+	fclose(idle);
+
+	int status = -1;
+	for (int i = 0; i < 50 && serverdata.pid != 0; i++) {
+		if (waitpid(old, &status, WNOHANG) == old)
+			serverdata.pid = 0;
+		else
+			usleep(100000);
+	}
+	checkBool(serverdata.pid == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0, "old process exited");
+	stopWebserver();
+
+	if (new > 0)
+		kill(new, SIGTERM);
+	// the listener is gone once the new process is
+	usleep(200000);
+}
+
+void testDrain() {
+	int pipefd[2];
+	if (pipe(pipefd) < 0) {
+		showError();
+		return;
+	}
+
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		signal_block(SIGUSR2);
+		startHandOverServer();
+		printf("webserver started.\n");
+		signal_wait(SIGUSR2);
+
+		// what main() does with a drain timeout of 1s
+		networking_drain();
+		usleep(1000000);
+		int result[2];
+		result[1] = networking_closeAll();
+		usleep(1500000);
+		result[0] = networking_drained();
+		write(pipefd[1], result, sizeof(result));
+		exit(0);
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	FILE* idle = sendRequest(NULL, HTTP11, GET, "/", headers_create());
+	fflush(idle);
+	readPid(idle);
+
+	FILE* busy = sendRequest(NULL, HTTP11, GET, "/slow", headers_create());
+	fflush(busy);
+	FILE* stuck = sendRequest(NULL, HTTP11, GET, "/stuck", headers_create());
+	fflush(stuck);
+
+	int h2Idle = connectTo(LOCAL_PORT);
+	write(h2Idle, HTTP2_PREFACE_LINE "\r\n" HTTP2_PREFACE_REST, strlen(HTTP2_PREFACE_LINE "\r\n" HTTP2_PREFACE_REST));
+	h2Send(h2Idle, HTTP2_SETTINGS, 0, 0, NULL, 0);
+	int h2Busy = connectTo(LOCAL_PORT);
+	write(h2Busy, HTTP2_PREFACE_LINE "\r\n" HTTP2_PREFACE_REST, strlen(HTTP2_PREFACE_LINE "\r\n" HTTP2_PREFACE_REST));
+	h2Send(h2Busy, HTTP2_SETTINGS, 0, 0, NULL, 0);
+	h2SendRequest(h2Busy, 1, "GET", "/slow", NULL, true);
+	usleep(100000);
+
+	printf("draining...\n\n");
+	kill(serverdata.pid, SIGUSR2);
+	usleep(100000);
+
+	int fd = connectTo(LOCAL_PORT);
+	checkInt(fd, -1, "not accepting");
+	if (fd >= 0)
+		close(fd);
+
+	unsigned char payload[HTTP2_MAX_FRAME_SIZE];
+	int type, flags, length;
+	uint32_t id;
+
+	printf("testing idle HTTP/2 session...\n\n");
+	while ((length = h2Receive(h2Idle, &type, &flags, &id, payload)) >= 0 && type != HTTP2_GOAWAY);
+	checkInt(type, HTTP2_GOAWAY, "GOAWAY sent");
+	checkBool(length == 8 && memcmp(payload, "\0\0\0\0\0\0\0\0", 8) == 0, "no error and no stream");
+	checkInt(h2Receive(h2Idle, &type, &flags, &id, payload), -1, "idle session closed");
+	close(h2Idle);
+
+	printf("testing busy HTTP/2 session...\n\n");
+	while ((length = h2Receive(h2Busy, &type, &flags, &id, payload)) >= 0 && type != HTTP2_GOAWAY);
+	checkInt(type, HTTP2_GOAWAY, "GOAWAY sent");
+	checkBool(length == 8 && memcmp(payload, "\0\0\0\x01\0\0\0\0", 8) == 0, "running stream is the last one");
+
+	h2SendRequest(h2Busy, 3, "GET", "/", NULL, true);
+	bool refused = false;
+	bool ended = false;
+	while ((length = h2Receive(h2Busy, &type, &flags, &id, payload)) >= 0) {
+		if (type == HTTP2_RST_STREAM && id == 3)
+			refused = length == 4 && payload[3] == HTTP2_REFUSED_STREAM;
+		if (id == 1 && (type == HTTP2_HEADERS || type == HTTP2_DATA) && (flags & HTTP2_FLAG_END_STREAM))
+			ended = true;
+	}
+	checkBool(refused, "new stream refused");
+	checkBool(ended, "running stream finished");
+	close(h2Busy);
+
+	checkBool(hasData(fileno(idle)), "idle connection closed");
+	checkInt(fgetc(idle), EOF, "idle connection closed");
+	fclose(idle);
+
+	checkInt(readStatus(busy, NULL), 200, "running request finished");
+	struct headers headers = readHeaders(busy);
+	checkString(headers_get(&headers, "Connection"), "close", "keep-alive ended");
+	headers_free(&headers);
+	readline(busy);
+	checkInt(fgetc(busy), EOF, "connection closed after response");
+	fclose(busy);
+
+	// the handler can't write anymore once the connection is closed
+	checkInt(fgetc(stuck), EOF, "stuck connection closed");
+	fclose(stuck);
+
+	int result[2] = { -1, -1 };
+	read(pipefd[0], result, sizeof(result));
+	checkInt(result[0], 4, "drained connections");
+	checkInt(result[1], 1, "forced connections");
+
+	stopWebserver();
+	close(pipefd[0]);
+	close(pipefd[1]);
+}
+
+void testAdmissionControl() {
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		networking_init((struct networkingConfig) {
+			.binds = { 1, &serverdata.bind },
+			.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+			.maxConnections = DEFAULT_MAX_CONNECTIONS,
+			.maxConnectionsPerPeer = 3,
+			.maxHandlers = 1,
+			.shedTarget = 10,
+			.shedInterval = 100,
+			.defaultHeaders = headers_create(),
+			.getHandler = &handOverGetter
+		});
+		printf("webserver started.\n");
+		while(true) {
+			sleep(0xffff);
+		}
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	// the first one runs, the second one waits for it, the third one waits for both
+	FILE* streams[3];
+	for (int i = 0; i < 3; i++) {
+		streams[i] = sendRequest(NULL, HTTP11, GET, "/slow", headers_create());
+		fflush(streams[i]);
+		usleep(10000);
+	}
+
+	FILE* rejected = fdopen(connectTo(LOCAL_PORT), "r+");
+	checkInt(readStatus(rejected, NULL), 503, "too many connections from peer");
+	struct headers headers = readHeaders(rejected);
+	checkString(headers_get(&headers, "Retry-After"), "1", "retry after");
+	headers_free(&headers);
+	checkInt(fgetc(rejected), EOF, "rejected connection closed");
+	fclose(rejected);
+
+	checkBool(readPid(streams[0]) > 0, "running request");
+	checkBool(readPid(streams[1]) > 0, "waiting request");
+
+	// it waited longer than the target for more than an interval
+	checkInt(readStatus(streams[2], NULL), 503, "shed request");
+	headers = readHeaders(streams[2]);
+	checkString(headers_get(&headers, "Connection"), "close", "shed request closes connection");
+	headers_free(&headers);
+	checkInt(fgetc(streams[2]), EOF, "shed connection closed");
+
+	for (int i = 0; i < 3; i++)
+		fclose(streams[i]);
+
+	stopWebserver();
+}
+
+struct rateLimit limitedPath = { .rate = 1, .burst = 1 };
+struct handler rateLimitGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	return (struct handler) {
+		.handler = &handOverHandler,
+		.rateLimit = strcmp(metaData.path, "/limited") == 0 ? &limitedPath : NULL
+	};
+}
+
+void testRateLimiting() {
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		networking_init((struct networkingConfig) {
+			.binds = { 1, &serverdata.bind },
+			.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+			.maxConnections = DEFAULT_MAX_CONNECTIONS,
+			.rateLimit = { .rate = 1, .burst = 4 },
+			.defaultHeaders = headers_create(),
+			.getHandler = &rateLimitGetter
+		});
+		printf("webserver started.\n");
+		while(true) {
+			sleep(0xffff);
+		}
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	FILE* stream = sendRequest(NULL, HTTP11, GET, "/limited", headers_create());
+	fflush(stream);
+	checkBool(readPid(stream) > 0, "below handler limit");
+	sendRequest(stream, HTTP11, GET, "/limited", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 429, "over handler limit");
+	struct headers headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Retry-After"), "1", "retry after");
+	headers_free(&headers);
+	fclose(stream);
+
+	// the handler limit doesn't count here; two requests are left of the server-wide burst
+	stream = sendRequest(NULL, HTTP11, GET, "/", headers_create());
+	fflush(stream);
+	checkBool(readPid(stream) > 0, "below server limit");
+	sendRequest(stream, HTTP11, GET, "/", headers_create());
+	fflush(stream);
+	checkBool(readPid(stream) > 0, "below server limit");
+	sendRequest(stream, HTTP11, GET, "/", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 429, "over server limit");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Retry-After"), "1", "retry after");
+	checkString(headers_get(&headers, "Content-Length"), "0", "no body");
+	headers_free(&headers);
+	checkInt(fgetc(stream), EOF, "connection closed");
+	fclose(stream);
+
+	stopWebserver();
+}
+
+#define SLOW_CLIENT_BODY (16 * 1024 * 1024)
+void slowClientHandler(struct request request, struct response response) {
+	if (strcmp(request.metaData.path, "/big") != 0) {
+		handOverHandler(request, response);
+		return;
+	}
+
+	char length[16];
+	snprintf(length, sizeof(length), "%d", SLOW_CLIENT_BODY);
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Length", length);
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+
+	char buffer[64 * 1024];
+	memset(buffer, 'x', sizeof(buffer));
+	for (int i = 0; i < SLOW_CLIENT_BODY / sizeof(buffer); i++) {
+		if (writeAll(fd, buffer, sizeof(buffer), 10000) < 0)
+			break;
+	}
+	close(fd);
+}
+
+struct handler slowClientGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	return (struct handler) {
+		.handler = &slowClientHandler
+	};
+}
+
+void testSlowClients() {
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		networking_init((struct networkingConfig) {
+			.binds = { 1, &serverdata.bind },
+			.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+			.maxConnections = DEFAULT_MAX_CONNECTIONS,
+			.headerTimeout = 4000,
+			.minReceiveRate = 100,
+			.maxHeaderSize = 1024,
+			.maxHeaders = 10,
+			.minSendRate = 1000,
+			.defaultHeaders = headers_create(),
+			.getHandler = &slowClientGetter
+		});
+		printf("webserver started.\n");
+		while(true) {
+			sleep(0xffff);
+		}
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	struct headers headers = headers_create();
+	for (int i = 0; i < 11; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "X-Header-%d", i);
+		headers_mod(&headers, name, "value");
+	}
+	FILE* stream = sendRequest(NULL, HTTP11, GET, "/", headers);
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 431, "too many headers");
+	fclose(stream);
+
+	char value[2000];
+	memset(value, 'x', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+	headers = headers_create();
+	headers_mod(&headers, "X-Large", value);
+	stream = sendRequest(NULL, HTTP11, GET, "/", headers);
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 431, "headers too large");
+	fclose(stream);
+
+	// one trickles below the minimum rate; the other one is fast enough but never finishes its headers
+	int trickle = connectTo(LOCAL_PORT);
+	int endless = connectTo(LOCAL_PORT);
+	send(endless, "GET / HTTP/1.1\r\nX-Endless: ", 27, MSG_NOSIGNAL);
+	int trickleClosed = -1;
+	int endlessClosed = -1;
+	for (int i = 0; i < 40 && endlessClosed < 0; i++) {
+		if (trickleClosed < 0) {
+			if (hasData(trickle))
+				trickleClosed = i;
+			else
+				send(trickle, "G", 1, MSG_NOSIGNAL);
+		}
+		if (hasData(endless))
+			endlessClosed = i;
+		else
+			send(endless, "xxxxxxxxxxxxxxxxxxxxxxxxx", 25, MSG_NOSIGNAL);
+		usleep(200000);
+	}
+	checkBool(trickleClosed >= 0 && trickleClosed < endlessClosed, "trickle aborted before deadline");
+	checkBool(endlessClosed >= 20, "endless headers aborted at deadline");
+
+	stream = fdopen(trickle, "r");
+	checkInt(readStatus(stream, NULL), 408, "trickle timed out");
+	fclose(stream);
+	stream = fdopen(endless, "r");
+	checkInt(readStatus(stream, NULL), 408, "endless headers timed out");
+	fclose(stream);
+
+	// never reads the response
+	stream = sendRequest(NULL, HTTP11, GET, "/big", headers_create());
+	fflush(stream);
+	usleep(5000000);
+	checkInt(readStatus(stream, NULL), 200, "big response");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	size_t received = 0;
+	char buffer[4096];
+	size_t tmp;
+	while ((tmp = fread(buffer, 1, sizeof(buffer), stream)) > 0)
+		received += tmp;
+	checkBool(received < SLOW_CLIENT_BODY, "slow reader cut off");
+	fclose(stream);
+
+	stopWebserver();
+}
+
+#define BUFFERED_LARGE (200 * 1024)
+#define BUFFERED_HUGE (4 * 1024 * 1024)
+int bufferedPipe[2];
+void bufferedHandler(struct request request, struct response response) {
+	const char* path = request.metaData.path;
+	size_t size;
+	if (strcmp(path, "/large") == 0) {
+		size = BUFFERED_LARGE;
+	} else if (strcmp(path, "/huge") == 0) {
+		size = BUFFERED_HUGE;
+	} else {
+		testPipelineHandler(request, response);
+		return;
+	}
+
+	char length[16];
+	snprintf(length, sizeof(length), "%zu", size);
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Length", length);
+	int fd = response.sendHeader(200, &headers, &request);
+	headers_free(&headers);
+
+	char block[4096];
+	for (size_t written = 0; written < size; written += sizeof(block)) {
+		memset(block, 'a' + (written / sizeof(block)) % 26, sizeof(block));
+		if (writeAll(fd, block, sizeof(block), 10000) < 0)
+			break;
+	}
+	close(fd);
+
+	write(bufferedPipe[1], "r", 1);
+}
+
+struct handler bufferedGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	return (struct handler) {
+		.handler = &bufferedHandler
+	};
+}
+
+// reads a body of length bytes as bufferedHandler writes it; returns how many bytes matched
+size_t readBufferedBody(FILE* stream, size_t length) {
+	char block[4096];
+	size_t matched = 0;
+	while (matched < length && fread(block, 1, sizeof(block), stream) == sizeof(block)) {
+		char expected = 'a' + (matched / sizeof(block)) % 26;
+		if (block[0] != expected || block[sizeof(block) - 1] != expected)
+			break;
+		matched += sizeof(block);
+	}
+	return matched;
+}
+
+void testBufferedResponses() {
+	if (pipe(bufferedPipe) < 0) {
+		showError();
+		return;
+	}
+
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		networking_init((struct networkingConfig) {
+			.binds = { 1, &serverdata.bind },
+			.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+			.maxConnections = DEFAULT_MAX_CONNECTIONS,
+			.responseBuffer = 256 * 1024,
+			.responseBufferTotal = DEFAULT_RESPONSE_BUFFER_TOTAL,
+			.defaultHeaders = headers_create(),
+			.getHandler = &bufferedGetter
+		});
+		printf("webserver started.\n");
+		while(true) {
+			sleep(0xffff);
+		}
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	FILE* stream = sendRequest(NULL, HTTP11, GET, "/large", headers_create());
+	fflush(stream);
+	// the client hasn't read anything yet
+	bool returned = poll(&(struct pollfd){ .fd = bufferedPipe[0], .events = POLLIN }, 1, 2000) == 1;
+	checkBool(returned, "handler returned early");
+	char byte;
+	if (returned)
+		read(bufferedPipe[0], &byte, 1);
+
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	struct headers headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, BUFFERED_LARGE), BUFFERED_LARGE, "buffered body");
+
+	stream = sendRequest(stream, HTTP11, GET, "/chunked", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Transfer-Encoding"), "chunked", "response chunked");
+	headers_free(&headers);
+	checkString(readline(stream), "8\r\n", "chunk size");
+	checkString(readBody(stream, 10), "/chunked\r\n", "chunk");
+	checkString(readline(stream), "0\r\n", "last chunk");
+	checkString(readline(stream), "\r\n", "chunked response complete");
+
+	// larger than the buffer; the handler has to wait for the client
+	headers = headers_create();
+	headers_mod(&headers, "Connection", "close");
+	stream = sendRequest(stream, HTTP11, GET, "/huge", headers);
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, BUFFERED_HUGE), BUFFERED_HUGE, "large body");
+	checkInt(fgetc(stream), EOF, "connection closed");
+	fclose(stream);
+
+	if (poll(&(struct pollfd){ .fd = bufferedPipe[0], .events = POLLIN }, 1, 2000) == 1)
+		read(bufferedPipe[0], &byte, 1);
+
+	// the client goes away in the middle of the response
+	stream = sendRequest(NULL, HTTP11, GET, "/huge", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	fclose(stream);
+	returned = poll(&(struct pollfd){ .fd = bufferedPipe[0], .events = POLLIN }, 1, 5000) == 1;
+	checkBool(returned, "handler gave up");
+	if (returned)
+		read(bufferedPipe[0], &byte, 1);
+
+	stream = sendRequest(NULL, HTTP11, GET, "/large", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, BUFFERED_LARGE), BUFFERED_LARGE, "still serving");
+	fclose(stream);
+
+	stopWebserver();
+	close(bufferedPipe[0]);
+	close(bufferedPipe[1]);
+}
+
+#define REACTOR_STREAM (1024 * 1024)
+#define REACTOR_HUGE (16 * 1024 * 1024)
+#define REACTOR_FILE (100000)
+int reactorPipe[2];
+
+struct reactorState {
+	// "/echo" collects the body; the others count what they sent
+	bool echo;
+	size_t length;
+	size_t size;
+	char data[64];
+};
+
+// "/stream" and "/huge" are sent in blocks like in bufferedHandler; "/thread" and "/slow" go to testPipelineHandler
+enum reactorResult testReactorRequest(struct request* request, struct reactorResponse response) {
+	const char* name = strrchr(request->metaData.path, '/');
+	if (strcmp(name, "/thread") == 0 || strcmp(name, "/slow") == 0)
+		return REACTOR_BLOCKING;
+
+	struct reactorState* state = calloc(1, sizeof(struct reactorState));
+	request->state = state;
+	if (strcmp(name, "/echo") == 0) {
+		state->echo = true;
+		return REACTOR_MORE;
+	}
+
+	state->size = strcmp(name, "/huge") == 0 ? REACTOR_HUGE : REACTOR_STREAM;
+	char length[16];
+	snprintf(length, sizeof(length), "%zu", state->size);
+	struct headers headers = headers_create();
+	headers_mod(&headers, "Content-Length", length);
+	int result = response.sendResponse(200, &headers, NULL, 0, request);
+	headers_free(&headers);
+
+	return result < 0 ? REACTOR_ERROR : REACTOR_MORE;
+}
+
+enum reactorResult testReactorBody(struct request* request, const char* data, size_t length, struct reactorResponse response) {
+	struct reactorState* state = (struct reactorState*) request->state;
+	if (length > 0) {
+		if (length > sizeof(state->data) - state->length)
+			length = sizeof(state->data) - state->length;
+		memcpy(state->data + state->length, data, length);
+		state->length += length;
+		return REACTOR_MORE;
+	}
+
+	struct headers headers = headers_create();
+	struct iovec body = {
+		.iov_base = state->data,
+		.iov_len = state->length
+	};
+	int result = response.sendResponse(200, &headers, &body, 1, request);
+	headers_free(&headers);
+
+	return result < 0 ? REACTOR_ERROR : REACTOR_DONE;
+}
+
+enum reactorResult testReactorWritable(struct request* request, struct reactorResponse response) {
+	struct reactorState* state = (struct reactorState*) request->state;
+
+	char block[4096];
+	memset(block, 'a' + (state->length / sizeof(block)) % 26, sizeof(block));
+	struct iovec body = {
+		.iov_base = block,
+		.iov_len = sizeof(block)
+	};
+	if (response.sendBody(&body, 1, request) < 0)
+		return REACTOR_ERROR;
+	state->length += sizeof(block);
+
+	return state->length < state->size ? REACTOR_MORE : REACTOR_DONE;
+}
+
+void testReactorComplete(struct request* request, bool sent) {
+	struct reactorState* state = (struct reactorState*) request->state;
+	if (!state->echo)
+		write(reactorPipe[1], sent ? "s" : "f", 1);
+	free(state);
+}
+
+const struct reactorHandler testReactor = {
+	.onRequest = testReactorRequest,
+	.onBody = testReactorBody,
+	.onWritable = testReactorWritable,
+	.onComplete = testReactorComplete
+};
+
+void testReactorBlocking(struct request request, struct response response) {
+	runReactorHandler(&testReactor, request, response);
+}
+
+struct fileSettings reactorFiles;
+
+// "/files/..." is the file handler, "/blocking/..." testReactor on a thread
+struct handler reactorGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	if (strncmp(metaData.path, "/files/", 7) == 0) {
+		return (struct handler) {
+			.handler = &fileHandler,
+			.reactor = &fileReactor,
+			.data.ptr = &reactorFiles
+		};
+	}
+	if (strncmp(metaData.path, "/blocking/", 10) == 0) {
+		return (struct handler) {
+			.handler = &testReactorBlocking
+		};
+	}
+	return (struct handler) {
+		.handler = &testPipelineHandler,
+		.reactor = &testReactor
+	};
+}
+
+// whether the reactor handler of the last stream reported it as sent
+char reactorCompleted() {
+	char byte = 0;
+	if (poll(&(struct pollfd){ .fd = reactorPipe[0], .events = POLLIN }, 1, 5000) == 1)
+		read(reactorPipe[0], &byte, 1);
+	return byte;
+}
+
+void testReactorHandlers() {
+	char dir[] = "/tmp/cfloor-reactor-XXXXXX";
+	if (pipe(reactorPipe) < 0 || mkdtemp(dir) == NULL) {
+		showError();
+		return;
+	}
+
+	char root[PATH_MAX];
+	realpath(dir, root);
+	char path[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/files", root);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/files/data.bin", root);
+	char* data = malloc(REACTOR_FILE);
+	for (int i = 0; i < REACTOR_FILE; i++) {
+		data[i] = i % 251;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	writeAll(fd, data, REACTOR_FILE, -1);
+	close(fd);
+
+	reactorFiles = (struct fileSettings) {
+		.documentRoot = root
+	};
+
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		networking_init((struct networkingConfig) {
+			.binds = { 1, &serverdata.bind },
+			.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+			.maxConnections = DEFAULT_MAX_CONNECTIONS,
+			.responseBufferTotal = DEFAULT_RESPONSE_BUFFER_TOTAL,
+			.defaultHeaders = headers_create(),
+			.getHandler = &reactorGetter
+		});
+		printf("webserver started.\n");
+		while(true) {
+			sleep(0xffff);
+		}
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	printf("testing a response in pieces...\n\n");
+	FILE* stream = sendRequest(NULL, HTTP11, GET, "/stream", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	struct headers headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Connection"), "keep-alive", "connection persistent");
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, REACTOR_STREAM), REACTOR_STREAM, "body complete");
+	checkInt(reactorCompleted(), 's', "completed");
+
+	printf("testing request body...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "5");
+	stream = sendRequest(stream, HTTP11, POST, "/echo", headers);
+	fprintf(stream, "hello");
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Content-Length"), "5", "body length");
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "hello", "body echoed");
+
+	printf("testing pipelining with blocking handlers...\n\n");
+	stream = sendRequest(stream, HTTP11, GET, "/slow", headers_create());
+	stream = sendRequest(stream, HTTP11, GET, "/stream", headers_create());
+	stream = sendRequest(stream, HTTP11, GET, "/thread", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "/slow", "blocking handler first");
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, REACTOR_STREAM), REACTOR_STREAM, "reactor handler second");
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 7), "/thread", "blocking handler third");
+	checkInt(reactorCompleted(), 's', "completed");
+
+	printf("testing the file handler...\n\n");
+	stream = sendRequest(stream, HTTP11, GET, "/files/data.bin", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Content-Type"), MIME_UNKNOWN, "content type");
+	headers_free(&headers);
+	char* body = malloc(REACTOR_FILE);
+	checkInt(fread(body, 1, REACTOR_FILE, stream), REACTOR_FILE, "file length");
+	checkBool(memcmp(body, data, REACTOR_FILE) == 0, "file content");
+	free(body);
+
+	stream = sendRequest(stream, HTTP11, GET, "/files/missing", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 404, "file not found");
+	headers = readHeaders(stream);
+	int length = atoi(headers_get(&headers, "Content-Length"));
+	headers_free(&headers);
+	body = readBody(stream, length);
+	checkBool(strstr(body, "/files/missing") != NULL, "status page");
+
+	headers = headers_create();
+	headers_mod(&headers, "Connection", "close");
+	stream = sendRequest(stream, HTTP11, GET, "/files/", headers);
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 403, "no listing");
+	headers = readHeaders(stream);
+	length = atoi(headers_get(&headers, "Content-Length"));
+	headers_free(&headers);
+	readBody(stream, length);
+	checkInt(fgetc(stream), EOF, "connection closed");
+	fclose(stream);
+
+	printf("testing a reactor handler on a thread...\n\n");
+	stream = sendRequest(NULL, HTTP11, GET, "/blocking/stream", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, REACTOR_STREAM), REACTOR_STREAM, "body complete");
+	checkInt(reactorCompleted(), 's', "completed");
+
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "5");
+	stream = sendRequest(stream, HTTP11, POST, "/blocking/echo", headers);
+	fprintf(stream, "hello");
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "hello", "body echoed");
+	fclose(stream);
+
+	printf("testing a client that goes away...\n\n");
+	stream = sendRequest(NULL, HTTP11, GET, "/huge", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	fclose(stream);
+	checkInt(reactorCompleted(), 'f', "handler gave up");
+
+	stream = sendRequest(NULL, HTTP11, GET, "/stream", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, REACTOR_STREAM), REACTOR_STREAM, "still serving");
+	checkInt(reactorCompleted(), 's', "completed");
+	fclose(stream);
+
+	stopWebserver();
+	close(reactorPipe[0]);
+	close(reactorPipe[1]);
+	free(data);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/files", root);
+	rmdir(path);
+	rmdir(root);
+}
+
+#define COROUTINE_WAITS (20)
+#define COROUTINE_WAIT_MS (200)
+
+// "/echo" reads the body in small pieces, "/stream" writes blocks, "/chunked" has no length and "/wait" waits for a timer
+void testCoroutine(struct request request, struct coroutineResponse response) {
+	const char* name = strrchr(request.metaData.path, '/');
+
+	struct headers headers = headers_create();
+	headers_mod(&headers, "X-Coroutine", coroutine_current() != NULL ? "yes" : "no");
+
+	if (strcmp(name, "/echo") == 0) {
+		char body[64];
+		size_t length = 0;
+		ssize_t tmp;
+		while (length + 3 <= sizeof(body) && (tmp = response.read(body + length, 3, &request)) > 0)
+			length += tmp;
+
+		struct iovec iov = {
+			.iov_base = body,
+			.iov_len = length
+		};
+		response.sendResponse(200, &headers, &iov, 1, &request);
+	} else if (strcmp(name, "/stream") == 0) {
+		char length[16];
+		snprintf(length, sizeof(length), "%d", REACTOR_STREAM);
+		headers_mod(&headers, "Content-Length", length);
+		if (response.sendHeader(200, &headers, &request) == 0) {
+			char block[4096];
+			for (size_t sent = 0; sent < REACTOR_STREAM; sent += sizeof(block)) {
+				memset(block, 'a' + (sent / sizeof(block)) % 26, sizeof(block));
+				struct iovec iov = {
+					.iov_base = block,
+					.iov_len = sizeof(block)
+				};
+				if (response.write(&iov, 1, &request) < 0)
+					break;
+			}
+		}
+	} else if (strcmp(name, "/chunked") == 0) {
+		if (response.sendHeader(200, &headers, &request) == 0) {
+			response.write(&(struct iovec) { .iov_base = "hello ", .iov_len = 6 }, 1, &request);
+			response.write(&(struct iovec) { .iov_base = "world", .iov_len = 5 }, 1, &request);
+		}
+	} else {
+		int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		timerfd_settime(fd, 0, &(struct itimerspec) {
+			.it_value = { .tv_nsec = COROUTINE_WAIT_MS * 1000000 }
+		}, NULL);
+		bool waited = response.wait(fd, POLLIN, &request) == 0;
+		close(fd);
+
+		struct iovec iov = {
+			.iov_base = waited ? "waited" : "failed",
+			.iov_len = 6
+		};
+		response.sendResponse(200, &headers, &iov, 1, &request);
+	}
+
+	headers_free(&headers);
+}
+
+void testCoroutineBlocking(struct request request, struct response response) {
+	runCoroutineHandler(&testCoroutine, request, response);
+}
+
+struct cgiSettings coroutineCGI;
+
+// "/cgi/..." is the CGI handler, "/blocking/..." testCoroutine on a thread
+struct handler coroutineGetter(struct metaData metaData, const char* host, struct bind* bind) {
+	if (strncmp(metaData.path, "/cgi/", 5) == 0) {
+		return (struct handler) {
+			.handler = &cgiHandler,
+			.coroutine = &cgiCoroutine,
+			.data.ptr = &coroutineCGI
+		};
+	}
+	if (strncmp(metaData.path, "/blocking/", 10) == 0) {
+		return (struct handler) {
+			.handler = &testCoroutineBlocking
+		};
+	}
+	return (struct handler) {
+		.handler = &testCoroutineBlocking,
+		.coroutine = &testCoroutine
+	};
+}
+
+// the chunks of a chunked body put together
+char* readChunkedBody(FILE* stream) {
+	static char body[BUFFER_SIZE];
+	size_t length = 0;
+
+	while (true) {
+		size_t size = strtol(readline(stream), NULL, 16);
+		if (size == 0 || length + size >= sizeof(body))
+			break;
+		memcpy(body + length, readBody(stream, size), size);
+		length += size;
+		readline(stream);
+	}
+	readline(stream);
+
+	body[length] = '\0';
+	return body;
+}
+
+#define CGI_IGNORED_BODY (256 * 1024)
+#define CGI_IGNORED_OUTPUT (128 * 1024)
+
+// sends a body the script doesn't read; stops once the connection is shut down
+void* ignoredBodyThread(void* data) {
+	int fd = *((int*) data);
+
+	char block[4096];
+	memset(block, 'x', sizeof(block));
+	for (size_t sent = 0; sent < CGI_IGNORED_BODY; sent += sizeof(block)) {
+		if (send(fd, block, sizeof(block), MSG_NOSIGNAL) < 0)
+			break;
+	}
+
+	return NULL;
+}
+
+void testCoroutineHandlers() {
+	char dir[] = "/tmp/cfloor-coroutine-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		showError();
+		return;
+	}
+
+	char root[PATH_MAX];
+	realpath(dir, root);
+	char path[PATH_MAX + 32];
+	snprintf(path, sizeof(path), "%s/cgi", root);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/cgi/echo.sh", root);
+	FILE* script = fopen(path, "w");
+	fprintf(script, "#!/bin/sh\nprintf 'Status: 201\\r\\nContent-Type: text/plain\\r\\n\\r\\n'\ncat\n");
+	fclose(script);
+	chmod(path, 0755);
+	// both pipes are full long before the output is complete
+	char ignorePath[PATH_MAX + 32];
+	snprintf(ignorePath, sizeof(ignorePath), "%s/cgi/ignore.sh", root);
+	script = fopen(ignorePath, "w");
+	fprintf(script, "#!/bin/sh\nprintf 'Content-Type: text/plain\\r\\n\\r\\n'\nhead -c %d /dev/zero\n", CGI_IGNORED_OUTPUT);
+	fclose(script);
+	chmod(ignorePath, 0755);
+	// keeps writing until it is killed
+	char stubbornPath[PATH_MAX + 32];
+	snprintf(stubbornPath, sizeof(stubbornPath), "%s/cgi/stubborn.sh", root);
+	char pidPath[PATH_MAX + 32];
+	snprintf(pidPath, sizeof(pidPath), "%s/stubborn.pid", root);
+	script = fopen(stubbornPath, "w");
+	fprintf(script, "#!/bin/sh\ntrap '' TERM PIPE\necho $$ > %s\nprintf 'Content-Type: text/plain\\r\\n\\r\\n'\nwhile true; do echo running 2>/dev/null; sleep 0.05; done\n", pidPath);
+	fclose(script);
+	chmod(stubbornPath, 0755);
+	char hostPath[PATH_MAX + 32];
+	snprintf(hostPath, sizeof(hostPath), "%s/cgi/host.sh", root);
+	script = fopen(hostPath, "w");
+	fprintf(script, "#!/bin/sh\nprintf 'Content-Type: text/plain\\r\\n\\r\\n%%s' \"$REMOTE_HOST\"\n");
+	fclose(script);
+	chmod(hostPath, 0755);
+
+	coroutineCGI = (struct cgiSettings) {
+		.documentRoot = root
+	};
+
+	printf("starting webserver...\n");
+	serverdata.pid = fork();
+	if (serverdata.pid == 0) {
+		resolver_setBackend(&stubResolver);
+		resolver_flush();
+		serverdata.bind.resolvePeers = true;
+		serverdata.bind.resolveTimeout = RESOLVER_DEFAULT_WAIT;
+		networking_init((struct networkingConfig) {
+			.binds = { 1, &serverdata.bind },
+			.connectionTimeout = DEFAULT_CONNECTION_TIMEOUT,
+			.maxConnections = DEFAULT_MAX_CONNECTIONS,
+			.maxHandlers = 1,
+			.responseBufferTotal = DEFAULT_RESPONSE_BUFFER_TOTAL,
+			.defaultHeaders = headers_create(),
+			.getHandler = &coroutineGetter
+		});
+		printf("webserver started.\n");
+		while(true) {
+			sleep(0xffff);
+		}
+	} else if (serverdata.pid < 0) {
+		printf("PANIC!\n");
+		exit(1);
+	}
+	usleep(200000);
+
+	printf("testing the peer name of a script...\n\n");
+	// the lookup is still running; the script is started on a thread that waits for it
+	FILE* stream = sendRequest(NULL, HTTP10, GET, "/cgi/host.sh", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status of the script");
+	struct headers headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 13), "stub-loopback", "name after lookup");
+	fclose(stream);
+	// now the name is cached
+	stream = sendRequest(NULL, HTTP10, GET, "/cgi/host.sh", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status of the script");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readBody(stream, 13), "stub-loopback", "cached name");
+	fclose(stream);
+
+	printf("testing request body in small reads...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "15");
+	stream = sendRequest(NULL, HTTP11, POST, "/echo", headers);
+	fprintf(stream, "hello coroutine");
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "X-Coroutine"), "yes", "handler is a coroutine");
+	checkString(headers_get(&headers, "Content-Length"), "15", "body length");
+	headers_free(&headers);
+	checkString(readBody(stream, 15), "hello coroutine", "body echoed");
+
+	printf("testing a response in pieces...\n\n");
+	stream = sendRequest(stream, HTTP11, GET, "/stream", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkInt(readBufferedBody(stream, REACTOR_STREAM), REACTOR_STREAM, "body complete");
+
+	stream = sendRequest(stream, HTTP11, GET, "/chunked", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Transfer-Encoding"), "chunked", "response chunked");
+	headers_free(&headers);
+	checkString(readChunkedBody(stream), "hello world", "chunks complete");
+	fclose(stream);
+
+	printf("testing waiting handlers...\n\n");
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	FILE* streams[COROUTINE_WAITS];
+	for (int i = 0; i < COROUTINE_WAITS; i++) {
+		streams[i] = sendRequest(NULL, HTTP10, GET, "/wait", headers_create());
+		fflush(streams[i]);
+	}
+	int waited = 0;
+	for (int i = 0; i < COROUTINE_WAITS; i++) {
+		if (readStatus(streams[i], NULL) == 200) {
+			headers = readHeaders(streams[i]);
+			headers_free(&headers);
+			if (strcmp(readBody(streams[i], 6), "waited") == 0)
+				waited++;
+		}
+		fclose(streams[i]);
+	}
+	checkInt(waited, COROUTINE_WAITS, "all waited");
+	checkBool(elapsedMs(start) < COROUTINE_WAITS * COROUTINE_WAIT_MS / 2, "waits don't take a handler thread");
+
+	printf("testing a coroutine handler on a thread...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "5");
+	stream = sendRequest(NULL, HTTP11, POST, "/blocking/echo", headers);
+	fprintf(stream, "hello");
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status code okay");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "X-Coroutine"), "no", "handler on a thread");
+	headers_free(&headers);
+	checkString(readBody(stream, 5), "hello", "body echoed");
+
+	printf("testing a CGI script...\n\n");
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", "9");
+	stream = sendRequest(stream, HTTP11, POST, "/cgi/echo.sh", headers);
+	fprintf(stream, "hello cgi");
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 201, "status of the script");
+	headers = readHeaders(stream);
+	checkString(headers_get(&headers, "Content-Type"), "text/plain", "header of the script");
+	headers_free(&headers);
+	checkString(readChunkedBody(stream), "hello cgi", "body through the script");
+
+	stream = sendRequest(stream, HTTP11, GET, "/cgi/missing.sh", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 404, "script not found");
+	headers = readHeaders(stream);
+	int length = atoi(headers_get(&headers, "Content-Length"));
+	headers_free(&headers);
+	readBody(stream, length);
+
+	// chunked request bodies aren't decoded on the reactor
+	headers = headers_create();
+	headers_mod(&headers, "Transfer-Encoding", "chunked");
+	stream = sendRequest(stream, HTTP11, POST, "/cgi/echo.sh", headers);
+	fprintf(stream, "5\r\nhello\r\n0\r\n\r\n");
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 201, "status of the script on a thread");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	checkString(readChunkedBody(stream), "hello", "body through the script on a thread");
+	fclose(stream);
+
+	printf("testing a script that doesn't read the request body...\n\n");
+	char bodyLength[16];
+	snprintf(bodyLength, sizeof(bodyLength), "%d", CGI_IGNORED_BODY);
+	headers = headers_create();
+	headers_mod(&headers, "Content-Length", bodyLength);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stream = sendRequest(NULL, HTTP10, POST, "/cgi/ignore.sh", headers);
+	fflush(stream);
+	int fd = fileno(stream);
+	pthread_t writer;
+	pthread_create(&writer, NULL, &ignoredBodyThread, &fd);
+	checkInt(readStatus(stream, NULL), 200, "status of the script");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	char block[4096];
+	size_t received = 0;
+	size_t tmp;
+	while ((tmp = fread(block, 1, sizeof(block), stream)) > 0)
+		received += tmp;
+	checkInt(received, CGI_IGNORED_OUTPUT, "whole output");
+	checkBool(elapsedMs(start) < 5000, "body didn't block output");
+	shutdown(fd, SHUT_RDWR);
+	pthread_join(writer, NULL);
+	fclose(stream);
+
+	// without a body the output is spliced to the socket
+	stream = sendRequest(NULL, HTTP10, GET, "/cgi/ignore.sh", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status of the script");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	received = 0;
+	while ((tmp = fread(block, 1, sizeof(block), stream)) > 0)
+		received += tmp;
+	checkInt(received, CGI_IGNORED_OUTPUT, "whole output relayed");
+	fclose(stream);
+
+	printf("testing a script that ignores SIGTERM...\n\n");
+	stream = sendRequest(NULL, HTTP10, GET, "/cgi/stubborn.sh", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "status of the script");
+	headers = readHeaders(stream);
+	headers_free(&headers);
+	fclose(stream);
+	usleep(200000);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stream = sendRequest(NULL, HTTP10, GET, "/stream", headers_create());
+	fflush(stream);
+	checkInt(readStatus(stream, NULL), 200, "server still responds");
+	checkBool(elapsedMs(start) < 500, "reactor not blocked");
+	fclose(stream);
+	usleep((CGI_KILL_GRACE + 500) * 1000);
+	FILE* pidFile = fopen(pidPath, "r");
+	int scriptPid = 0;
+	if (pidFile != NULL) {
+		if (fscanf(pidFile, "%d", &scriptPid) != 1)
+			scriptPid = 0;
+		fclose(pidFile);
+	}
+	checkBool(scriptPid > 0 && kill(scriptPid, 0) < 0 && errno == ESRCH, "script killed and collected");
+
+	stopWebserver();
+	unlink(pidPath);
+	unlink(stubbornPath);
+	unlink(hostPath);
+	unlink(ignorePath);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/cgi", root);
+	rmdir(path);
+	rmdir(root);
+}
+
+void test(const char* name, void (*testFunction)()) {
+	printf("%s\n", name);
+	printf("%.*s\n", (int) strlen(name), 
+		"===================================");
+	testFunction();
+	if (!global)
+		overall = false;
+	printf("%s: %s\n\n", name, global ? "OK" : "FAILED");
+	global = true;
+}
+
+void header(const char* text) {
+	printf("\n");
+	printf("=======================================\n");
+	printf("== %s\n", text);
+	printf("=======================================\n");
+}
+
+int main(int argc, char** argv) {
+	if (getenv(HANDOVER_LISTENERS_ENV) != NULL) {
+		// started by testHandOver
+		startHandOverServer();
+		while(true) {
+			sleep(0xffff);
+		}
+	}
+
 	atexit(stopWebserver);
 
 	header("Unit Tests");
 
 	test("config", &testConfig);
 	test("util", &testUtil);
+	test("event loop", &testEventLoop);
+	test("resolver", &testResolver);
 	test("linked lists", &testLinkedList);
 	test("signals", &testTimers);
 	test("headers", &testHeaders);
+	test("hpack", &testHpack);
+	test("cgi", &testCGI);
+	test("coroutines", &testCoroutines);
+	test("access log", &testAccessLog);
+	test("metrics", &testMetrics);
+	test("admission", &testAdmission);
+	test("rate limit", &testRateLimit);
+	test("routing", &testRouting);
+	test("listing", &testListing);
+	test("mime", &testMime);
+	test("status", &testStatus);
 	test("logging", &testLogging);
 	
 	header("Integeration Tests");
 	
 	test("persistent connections", &testPersistence);
+	test("request body", &testRequestBody);
+	test("pipelining", &testPipelining);
+	test("http2", &testHttp2);
+	test("fastcgi", &testFastCGI);
+	test("reload", &testReload);
+	test("hand over", &testHandOver);
+	test("drain", &testDrain);
+	test("admission control", &testAdmissionControl);
+	test("rate limiting", &testRateLimiting);
+	test("slow clients", &testSlowClients);
+	test("buffered responses", &testBufferedResponses);
+	test("reactor handlers", &testReactorHandlers);
+	test("coroutine handlers", &testCoroutineHandlers);
 
 
 	printf("\nOverall: %s\n", overall ? "OK" : "FAILED");
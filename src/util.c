@@ -5,13 +5,17 @@
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 
 #include <pthread.h>
 
 #include "util.h"
 #include "logging.h"
+#include "eventloop.h"
 
 void strremove(char* string, int index, int number) {
 	int length = strlen(string);
@@ -137,40 +141,193 @@ int startCopyThread(int from, int to, bool closeWriteFd, pthread_t* thread) {
 	return pthread_create(thread, NULL, &fileCopyThread, files);
 }
 
-#define FILE_COPY_BUFFER_SIZE (1024)
+#define FILE_COPY_BUFFER_SIZE (8192)
+// one full pipe buffer per call
+#define FILE_COPY_SPLICE_SIZE (65536)
 
-size_t fileCopyThreadFallback(struct fileCopy* files) {
+/*
+ * Waits until the fd is ready; sockets might be non-blocking.
+ * Returns -1 on error or timeout (errno is ETIMEDOUT); timeout in ms, -1 for none.
+ */
+int waitForFd(int fd, short events, int timeout) {
+	struct pollfd pollfd = {
+		.fd = fd,
+		.events = events
+	};
+
+	int tmp;
+	do {
+		tmp = poll(&pollfd, 1, timeout);
+	} while (tmp < 0 && errno == EINTR);
+
+	if (tmp == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return tmp < 0 ? -1 : 0;
+}
+
+/*
+ * Writes the whole buffer; waits at most timeout ms whenever the fd is not ready.
+ */
+int writeAll(int fd, const char* buffer, size_t length, int timeout) {
+	while (length > 0) {
+		ssize_t tmp = write(fd, buffer, length);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			if (waitForFd(fd, POLLOUT, timeout) < 0)
+				return -1;
+			continue;
+		}
+
+		buffer += tmp;
+		length -= tmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Like writeAll for several buffers; returns the number of bytes written or -1.
+ */
+ssize_t writevAll(int fd, const struct iovec* iov, int count, int timeout) {
+	struct iovec vector[IOV_MAX_COUNT];
+	if (count > IOV_MAX_COUNT) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(vector, iov, count * sizeof(struct iovec));
+
+	ssize_t total = 0;
+	int index = 0;
+	while (index < count) {
+		ssize_t tmp = writev(fd, vector + index, count - index);
+		if (tmp < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitForFd(fd, POLLOUT, timeout) == 0)
+				continue;
+			return -1;
+		}
+
+		total += tmp;
+		while (index < count && tmp >= vector[index].iov_len) {
+			tmp -= vector[index].iov_len;
+			index++;
+		}
+		if (index < count) {
+			vector[index].iov_base = (char*) vector[index].iov_base + tmp;
+			vector[index].iov_len -= tmp;
+		}
+	}
+
+	return total;
+}
+
+/*
+ * Moves up to length bytes; in or out has to be a pipe.
+ * Returns 0 on EOF and -1 on error (or timeout).
+ */
+ssize_t spliceSome(int in, int out, size_t length, int timeout) {
+	while (true) {
+		ssize_t tmp = splice(in, NULL, out, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (tmp >= 0)
+			return tmp;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+
+		// either side might not be ready
+		if (waitForFd(in, POLLIN, timeout) < 0 || waitForFd(out, POLLOUT, timeout) < 0)
+			return -1;
+	}
+}
+
+// returns less than length only on EOF or error
+ssize_t spliceAll(int in, int out, size_t length, int timeout) {
+	size_t total = 0;
+	while (total < length) {
+		ssize_t tmp = spliceSome(in, out, length - total, timeout);
+		if (tmp < 0)
+			return total > 0 ? total : -1;
+		if (tmp == 0)
+			break;
+		total += tmp;
+	}
+
+	return total;
+}
+
+bool isPipe(int fd) {
+	struct stat stat;
+	return fstat(fd, &stat) == 0 && S_ISFIFO(stat.st_mode);
+}
+
+size_t fileCopyFallback(int readFd, int writeFd) {
 
 	char c[FILE_COPY_BUFFER_SIZE];
 
 	size_t total = 0;
 	int tmp;
-	while((tmp = read(files->readFd, c, FILE_COPY_BUFFER_SIZE)) > 0) {
-		write(files->writeFd, c, tmp);
+	while(true) {
+		tmp = read(readFd, c, FILE_COPY_BUFFER_SIZE);
+		if (tmp < 0 && errno == EINTR)
+			continue;
+		if (tmp < 0 && errno == EAGAIN && waitForFd(readFd, POLLIN, -1) == 0)
+			continue;
+		if (tmp <= 0)
+			break;
+
+		if (writeAll(writeFd, c, tmp, -1) < 0)
+			return total;
 		total += tmp;
 	}
-	
+
 	return total;
 }
 
-void* fileCopyThread(void* data) {
-	struct fileCopy* files = (struct fileCopy*) data;
+size_t fileCopy(int readFd, int writeFd) {
+	// splice needs a pipe on one side; files go to sockets through one of our own
+	int pipefd[2] = { -1, -1 };
+	if (!isPipe(readFd) && !isPipe(writeFd)) {
+		if (pipe2(pipefd, O_CLOEXEC) < 0) {
+			debug("util: pipe: %s", strerror(errno));
+			debug("util: falling back to userland copy");
+			return fileCopyFallback(readFd, writeFd);
+		}
+	}
 
-	errno = EACCES;
-	
 	size_t total = 0;
-	int tmp;
-	while((tmp = splice(files->readFd, NULL, files->writeFd, NULL, FILE_COPY_BUFFER_SIZE, 0)) > 0) {
+	ssize_t tmp;
+	while ((tmp = eventloop_splice(readFd, writeFd, pipefd[0] < 0 ? NULL : pipefd, FILE_COPY_SPLICE_SIZE, -1)) > 0) {
 		total += tmp;
 	}
 
-	if (errno != EACCES) {
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+
+	if (tmp < 0 && total == 0 && errno == EINVAL) {
 		debug("util: splice: %s", strerror(errno));
 		debug("util: falling back to userland copy");
-		total = fileCopyThreadFallback(files);
+		total += fileCopyFallback(readFd, writeFd);
 	}
-	
-	debug("util: filecopy: %d bytes copied", total);
+
+	debug("util: filecopy: %zu bytes copied", total);
+
+	return total;
+}
+
+void* fileCopyThread(void* data) {
+	struct fileCopy* files = (struct fileCopy*) data;
+
+	fileCopy(files->readFd, files->writeFd);
 
 	if (files->closeWriteFd)
 		close(files->writeFd);
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 void strremove(char* string, int index, int number);
 
@@ -17,6 +19,16 @@ struct fileCopy {
 };
 int startCopyThread(int from, int to, bool closeWriteFd, pthread_t* thread);
 void* fileCopyThread(void* data);
+size_t fileCopy(int readFd, int writeFd);
+
+int waitForFd(int fd, short events, int timeout);
+int writeAll(int fd, const char* buffer, size_t length, int timeout);
+// max number of buffers for writevAll
+#define IOV_MAX_COUNT (8)
+ssize_t writevAll(int fd, const struct iovec* iov, int count, int timeout);
+ssize_t spliceSome(int in, int out, size_t length, int timeout);
+ssize_t spliceAll(int in, int out, size_t length, int timeout);
+bool isPipe(int fd);
 
 int strlenOfNumber(long long number);
 
@@ -0,0 +1,141 @@
+/*
+ * Benchmark for config_getHandler.
+ *
+ * Builds a config with SITES virtual hosts (an exact hostname and an alias
+ * each, every tenth site is a wildcard as well) and HANDLERS handler
+ * directories per site, then routes requests for random hosts and paths.
+ * Prints lookups per second.
+ *
+ * usage: bench-routing [-s sites] [-n handlers] [-l lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "config.h"
+#include "misc.h"
+
+#define MAX_LENGTH (256)
+
+static long nowNs() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000L + time.tv_nsec;
+}
+
+int main(int argc, char** argv) {
+	int sites = 500;
+	int handlers = 8;
+	long lookups = 5000000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:l:")) != -1) {
+		switch(opt) {
+			case 's':
+				sites = atoi(optarg);
+				break;
+			case 'n':
+				handlers = atoi(optarg);
+				break;
+			case 'l':
+				lookups = atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-s sites] [-n handlers] [-l lookups]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (sites < 1 || handlers < 1 || lookups < 1) {
+		fprintf(stderr, "usage: %s [-s sites] [-n handlers] [-l lookups]\n", argv[0]);
+		return 1;
+	}
+
+	char* text;
+	size_t textLength;
+	FILE* file = open_memstream(&text, &textLength);
+	fprintf(file, "bind 127.0.0.1:8080 {\n");
+	for (int i = 0; i < sites; i++) {
+		fprintf(file, "site {\nhostname = site%d.example.com\nalias = www.site%d.example.com\n", i, i);
+		if (i % 10 == 0)
+			fprintf(file, "alias = *.site%d.example.org\n", i);
+		fprintf(file, "root = /\nhandler / {\ntype = file\n}\n");
+		for (int j = 1; j < handlers; j++) {
+			fprintf(file, "handler /section%d/part%d {\ntype = %s\n}\n", j, j, j % 2 == 0 ? "file" : "cgi");
+		}
+		fprintf(file, "}\n");
+	}
+	fprintf(file, "site {\nroot = /\nhandler / {\ntype = file\n}\n}\n}\n");
+	fclose(file);
+
+	file = fmemopen(text, textLength, "r");
+	struct config* config = config_parse(file);
+	fclose(file);
+	if (config == NULL) {
+		fprintf(stderr, "couldn't parse generated config\n");
+		return 1;
+	}
+
+	struct networkingConfig networkingConfig;
+	long start = nowNs();
+	if (config_getNetworkingConfig(config, &networkingConfig) == NULL) {
+		fprintf(stderr, "couldn't compile routes\n");
+		return 1;
+	}
+	printf("%d sites, %d handlers each; compiled in %.2f ms\n", sites, handlers, (nowNs() - start) / 1000000.0);
+
+	// requests are prepared up front; only routing is measured
+	#define NR_REQUESTS (1024)
+	static char hosts[NR_REQUESTS][MAX_LENGTH];
+	static char paths[NR_REQUESTS][MAX_LENGTH];
+	srand(42);
+	for (int i = 0; i < NR_REQUESTS; i++) {
+		int site = rand() % sites;
+		switch (rand() % 4) {
+			case 0:
+				snprintf(hosts[i], MAX_LENGTH, "www.site%d.example.com", site);
+				break;
+			case 1:
+				snprintf(hosts[i], MAX_LENGTH, "a.site%d.example.org", site - site % 10);
+				break;
+			case 2:
+				snprintf(hosts[i], MAX_LENGTH, "unknown%d.example.net", site);
+				break;
+			default:
+				snprintf(hosts[i], MAX_LENGTH, "site%d.example.com:8080", site);
+				break;
+		}
+		int handler = rand() % handlers;
+		if (handler == 0)
+			snprintf(paths[i], MAX_LENGTH, "/images/logo%d.png", i);
+		else
+			snprintf(paths[i], MAX_LENGTH, "/section%d/part%d/page%d.html", handler, handler, i);
+	}
+
+	struct bind* bind = &(networkingConfig.binds.binds[0]);
+	long found = 0;
+	start = nowNs();
+	for (long i = 0; i < lookups; i++) {
+		struct metaData metaData = {
+			.path = paths[i % NR_REQUESTS],
+			.uri = paths[i % NR_REQUESTS]
+		};
+		struct handler handler = config_getHandler(metaData, hosts[i % NR_REQUESTS], bind);
+		if (handler.handler != NULL)
+			found++;
+	}
+	double elapsed = (nowNs() - start) / 1000000000.0;
+
+	printf("lookups:     %ld in %.2f s; %.0f lookups/s, %.0f ns each\n", lookups, elapsed, lookups / elapsed, elapsed * 1000000000.0 / lookups);
+	if (found != lookups)
+		printf("unrouted:    %ld\n", lookups - found);
+
+	free(networkingConfig.binds.binds);
+	headers_free(&(networkingConfig.defaultHeaders));
+	config_destroy(config);
+	free(text);
+
+	return 0;
+}
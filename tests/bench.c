@@ -0,0 +1,257 @@
+/*
+ * Load generator for the reactor.
+ *
+ * Opens CONNECTIONS keep-alive connections; ACTIVE of them send GET requests
+ * back to back for SECONDS, the others stay idle (the reactor still has to
+ * watch them). Prints requests per second and latency percentiles.
+ *
+ * usage: bench [-c connections] [-a active] [-d seconds] host port path
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_EVENTS (256)
+#define RESPONSE_BUFFER (16384)
+#define MAX_SAMPLES (1 << 22)
+
+struct client {
+	int fd;
+	bool active;
+	bool connected;
+	// bytes of the current response that are still missing; -1 while the header is incomplete
+	long remaining;
+	char header[RESPONSE_BUFFER];
+	size_t headerLength;
+	struct timespec sent;
+};
+
+static char request[1024];
+static size_t requestLength;
+
+static long* samples;
+static size_t numberOfSamples = 0;
+static long requests = 0;
+static long errors = 0;
+
+static long nowUs() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000L + time.tv_nsec / 1000;
+}
+
+static int compareLong(const void* a, const void* b) {
+	long x = *(const long*) a;
+	long y = *(const long*) b;
+	return (x > y) - (x < y);
+}
+
+static int sendRequest(struct client* client) {
+	clock_gettime(CLOCK_MONOTONIC, &(client->sent));
+	client->remaining = -1;
+	client->headerLength = 0;
+
+	// small enough to never be short
+	return write(client->fd, request, requestLength) == (ssize_t) requestLength ? 0 : -1;
+}
+
+/*
+ * Consumes response data; returns 1 once the response is complete, 0 if more is needed and -1 on error.
+ */
+static int consume(struct client* client, const char* data, size_t length) {
+	if (client->remaining < 0) {
+		size_t room = sizeof(client->header) - client->headerLength - 1;
+		size_t copy = length < room ? length : room;
+		memcpy(client->header + client->headerLength, data, copy);
+		client->headerLength += copy;
+		client->header[client->headerLength] = '\0';
+
+		char* end = strstr(client->header, "\r\n\r\n");
+		if (end == NULL)
+			return client->headerLength + 1 >= sizeof(client->header) ? -1 : 0;
+
+		char* contentLength = strcasestr(client->header, "\r\nContent-Length:");
+		if (contentLength == NULL || contentLength > end)
+			return -1;
+
+		size_t headerSize = end + 4 - client->header;
+		long bodyInBuffer = client->headerLength - headerSize;
+		client->remaining = strtol(contentLength + 17, NULL, 10) - bodyInBuffer;
+		// the rest of this read that didn't fit into the header buffer
+		client->remaining -= length - copy;
+	} else {
+		client->remaining -= length;
+	}
+
+	if (client->remaining > 0)
+		return 0;
+
+	return client->remaining == 0 ? 1 : -1;
+}
+
+static void finish(struct client* client) {
+	long latency = nowUs() - (client->sent.tv_sec * 1000000L + client->sent.tv_nsec / 1000);
+	if (numberOfSamples < MAX_SAMPLES)
+		samples[numberOfSamples++] = latency;
+	requests++;
+}
+
+int main(int argc, char** argv) {
+	int connections = 1000;
+	int active = -1;
+	int seconds = 10;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:a:d:")) != -1) {
+		switch(opt) {
+			case 'c':
+				connections = atoi(optarg);
+				break;
+			case 'a':
+				active = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-c connections] [-a active] [-d seconds] host port path\n", argv[0]);
+				return 1;
+		}
+	}
+	if (argc - optind != 3) {
+		fprintf(stderr, "usage: %s [-c connections] [-a active] [-d seconds] host port path\n", argv[0]);
+		return 1;
+	}
+	if (active < 0 || active > connections)
+		active = connections;
+
+	const char* host = argv[optind];
+	const char* port = argv[optind + 1];
+	const char* path = argv[optind + 2];
+
+	requestLength = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host);
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct addrinfo* address;
+	int tmp = getaddrinfo(host, port, &hints, &address);
+	if (tmp != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(tmp));
+		return 1;
+	}
+
+	samples = malloc(MAX_SAMPLES * sizeof(long));
+	struct client* clients = calloc(connections, sizeof(struct client));
+	int epollfd = epoll_create1(0);
+	if (samples == NULL || clients == NULL || epollfd < 0) {
+		perror("setup");
+		return 1;
+	}
+
+	// connect one by one; the listen backlog is limited
+	long start = nowUs();
+	int established = 0;
+	for (int i = 0; i < connections; i++) {
+		struct client* client = &(clients[i]);
+		client->fd = socket(address->ai_family, SOCK_STREAM, 0);
+		if (client->fd < 0 || connect(client->fd, address->ai_addr, address->ai_addrlen) < 0) {
+			fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+			if (client->fd >= 0)
+				close(client->fd);
+			client->fd = -1;
+			break;
+		}
+		setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+		fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+
+		client->connected = true;
+		client->active = i < active;
+		established++;
+
+		struct epoll_event event = {
+			.events = EPOLLIN,
+			.data.ptr = client
+		};
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, client->fd, &event);
+	}
+	printf("%d connections established in %.2f s\n", established, (nowUs() - start) / 1000000.0);
+
+	for (int i = 0; i < established; i++) {
+		if (clients[i].active && sendRequest(&(clients[i])) < 0)
+			errors++;
+	}
+
+	start = nowUs();
+	long end = start + seconds * 1000000L;
+	char buffer[RESPONSE_BUFFER];
+	struct epoll_event events[MAX_EVENTS];
+
+	while (nowUs() < end) {
+		int number = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+		for (int i = 0; i < number; i++) {
+			struct client* client = (struct client*) events[i].data.ptr;
+
+			ssize_t length = read(client->fd, buffer, sizeof(buffer));
+			if (length < 0 && errno == EAGAIN)
+				continue;
+
+			int result = length <= 0 ? -1 : consume(client, buffer, length);
+			if (result < 0 || !client->active) {
+				// idle connections are not supposed to get anything
+				errors++;
+				epoll_ctl(epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+				close(client->fd);
+				client->connected = false;
+				continue;
+			}
+			if (result == 0)
+				continue;
+
+			finish(client);
+			if (sendRequest(client) < 0)
+				errors++;
+		}
+	}
+
+	double elapsed = (nowUs() - start) / 1000000.0;
+
+	int alive = 0;
+	for (int i = 0; i < established; i++) {
+		if (clients[i].connected) {
+			alive++;
+			close(clients[i].fd);
+		}
+	}
+
+	qsort(samples, numberOfSamples, sizeof(long), compareLong);
+
+	printf("connections: %d (%d active, %d still open)\n", established, active < established ? active : established, alive);
+	printf("requests:    %ld in %.2f s; %.0f req/s\n", requests, elapsed, requests / elapsed);
+	printf("errors:      %ld\n", errors);
+	if (numberOfSamples > 0) {
+		printf("latency:     p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+			samples[numberOfSamples / 2] / 1000.0,
+			samples[numberOfSamples * 99 / 100] / 1000.0,
+			samples[numberOfSamples - 1] / 1000.0);
+	}
+
+	freeaddrinfo(address);
+	free(clients);
+	free(samples);
+	close(epollfd);
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * Minimal FastCGI responder for the tests.
+ *
+ * Accepts one connection on fd 0 and serves up to MAX_REQUESTS interleaved
+ * requests on it. The query string "sleep=<ms>" delays the response without
+ * blocking the other requests; "flood=<bytes>" sends that many bytes of output
+ * before the request body is read. The response echoes the request id, the
+ * query string and the request body.
+ *
+ * Exits when the server closes the connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "fastcgi.h"
+
+#define MAX_REQUESTS (2)
+#define MAX_BODY (4096)
+#define MAX_QUERY (256)
+
+struct pending {
+	bool active;
+	bool paramsDone;
+	bool stdinDone;
+	long sleep;
+	long flood;
+	struct timespec due;
+	char query[MAX_QUERY];
+	char body[MAX_BODY];
+	size_t bodyLength;
+};
+
+struct pending requests[MAX_REQUESTS + 1];
+
+int readAll(int fd, void* buffer, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t tmp = read(fd, ((char*) buffer) + done, length - done);
+		if (tmp <= 0)
+			return -1;
+		done += tmp;
+	}
+	return 0;
+}
+
+void writeRecord(int fd, int type, int requestId, const void* content, size_t length) {
+	struct fastcgiHeader header = {
+		.version = FCGI_VERSION_1,
+		.type = type,
+		.requestIdB1 = (requestId >> 8) & 0xff,
+		.requestIdB0 = requestId & 0xff,
+		.contentLengthB1 = (length >> 8) & 0xff,
+		.contentLengthB0 = length & 0xff
+	};
+	if (write(fd, &header, FCGI_HEADER_LEN) < 0 || (length > 0 && write(fd, content, length) < 0))
+		exit(1);
+}
+
+size_t readLength(const unsigned char* buffer, size_t* index) {
+	if (buffer[*index] < 0x80)
+		return buffer[(*index)++];
+
+	size_t length = ((buffer[*index] & 0x7f) << 24) | (buffer[*index + 1] << 16) | (buffer[*index + 2] << 8) | buffer[*index + 3];
+	*index += 4;
+	return length;
+}
+
+void appendPair(unsigned char* buffer, size_t* length, const char* name, const char* value) {
+	buffer[(*length)++] = strlen(name);
+	buffer[(*length)++] = strlen(value);
+	memcpy(buffer + *length, name, strlen(name));
+	*length += strlen(name);
+	memcpy(buffer + *length, value, strlen(value));
+	*length += strlen(value);
+}
+
+void endRequest(int fd, int requestId, int protocolStatus) {
+	unsigned char body[8] = { 0, 0, 0, 0, protocolStatus, 0, 0, 0 };
+	writeRecord(fd, FCGI_END_REQUEST, requestId, body, sizeof(body));
+	if (requestId >= 1 && requestId <= MAX_REQUESTS && protocolStatus == FCGI_REQUEST_COMPLETE)
+		requests[requestId].active = false;
+}
+
+void respond(int fd, int requestId) {
+	struct pending* request = &(requests[requestId]);
+
+	char response[MAX_BODY + 512];
+	int length = 0;
+	if (request->flood == 0)
+		length = snprintf(response, sizeof(response), "Content-Type: text/plain\r\nX-Request-Id: %d\r\n\r\n", requestId);
+	length += snprintf(response + length, sizeof(response) - length,
+		"hello from fastcgi\nquery: %s\nbody: %.*s\n",
+		request->query, (int) request->bodyLength, request->body);
+
+	writeRecord(fd, FCGI_STDOUT, requestId, response, length);
+	writeRecord(fd, FCGI_STDOUT, requestId, NULL, 0);
+	endRequest(fd, requestId, FCGI_REQUEST_COMPLETE);
+}
+
+// the headers and the output of a flood request; blocks until the server took it
+void flood(int fd, int requestId, long length) {
+	const char* header = "Content-Type: text/plain\r\n\r\n";
+	writeRecord(fd, FCGI_STDOUT, requestId, header, strlen(header));
+
+	char block[FCGI_MAX_CONTENT_LEN];
+	memset(block, 'x', sizeof(block));
+	while (length > 0) {
+		size_t chunk = length > (long) sizeof(block) ? sizeof(block) : (size_t) length;
+		writeRecord(fd, FCGI_STDOUT, requestId, block, chunk);
+		length -= chunk;
+	}
+}
+
+void handleRecord(int fd, struct fastcgiHeader* header, unsigned char* content, size_t length) {
+	int requestId = (header->requestIdB1 << 8) | header->requestIdB0;
+
+	if (header->type == FCGI_GET_VALUES) {
+		unsigned char result[128];
+		size_t resultLength = 0;
+		appendPair(result, &resultLength, FCGI_MAX_CONNS, "1");
+		appendPair(result, &resultLength, FCGI_MAX_REQS, "2");
+		appendPair(result, &resultLength, FCGI_MPXS_CONNS, "1");
+		writeRecord(fd, FCGI_GET_VALUES_RESULT, FCGI_NULL_REQUEST_ID, result, resultLength);
+		return;
+	}
+
+	if (header->type == FCGI_BEGIN_REQUEST) {
+		if (requestId < 1 || requestId > MAX_REQUESTS || requests[requestId].active) {
+			endRequest(fd, requestId, FCGI_OVERLOADED);
+			return;
+		}
+		memset(&(requests[requestId]), 0, sizeof(struct pending));
+		requests[requestId].active = true;
+		return;
+	}
+
+	if (requestId < 1 || requestId > MAX_REQUESTS || !requests[requestId].active)
+		return;
+
+	struct pending* request = &(requests[requestId]);
+
+	switch(header->type) {
+		case FCGI_ABORT_REQUEST:
+			endRequest(fd, requestId, FCGI_REQUEST_COMPLETE);
+			break;
+		case FCGI_PARAMS:
+			if (length == 0) {
+				request->paramsDone = true;
+				if (request->flood > 0)
+					flood(fd, requestId, request->flood);
+				break;
+			}
+			for (size_t index = 0; index < length;) {
+				size_t nameLength = readLength(content, &index);
+				size_t valueLength = readLength(content, &index);
+				const char* name = (const char*) content + index;
+				const char* value = name + nameLength;
+				index += nameLength + valueLength;
+
+				if (nameLength == strlen("QUERY_STRING") && strncmp(name, "QUERY_STRING", nameLength) == 0) {
+					snprintf(request->query, MAX_QUERY, "%.*s", (int) valueLength, value);
+					if (strncmp(request->query, "sleep=", 6) == 0)
+						request->sleep = strtol(request->query + 6, NULL, 10);
+					if (strncmp(request->query, "flood=", 6) == 0)
+						request->flood = strtol(request->query + 6, NULL, 10);
+				}
+			}
+			break;
+		case FCGI_STDIN:
+			if (length == 0) {
+				request->stdinDone = true;
+				clock_gettime(CLOCK_MONOTONIC, &(request->due));
+				request->due.tv_sec += request->sleep / 1000;
+				request->due.tv_nsec += (request->sleep % 1000) * 1000000;
+				if (request->due.tv_nsec >= 1000000000) {
+					request->due.tv_sec++;
+					request->due.tv_nsec -= 1000000000;
+				}
+				break;
+			}
+			if (request->bodyLength + length > MAX_BODY)
+				length = MAX_BODY - request->bodyLength;
+			memcpy(request->body + request->bodyLength, content, length);
+			request->bodyLength += length;
+			break;
+		default:
+			break;
+	}
+}
+
+int main() {
+	int fd = accept(0, NULL, NULL);
+	if (fd < 0) {
+		perror("accept");
+		return 1;
+	}
+
+	unsigned char content[FCGI_MAX_CONTENT_LEN + 0xff];
+
+	while (true) {
+		// respond to everything that is due; find the next deadline
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		int timeout = -1;
+		for (int i = 1; i <= MAX_REQUESTS; i++) {
+			struct pending* request = &(requests[i]);
+			if (!request->active || !request->paramsDone || !request->stdinDone)
+				continue;
+
+			long remaining = (request->due.tv_sec - now.tv_sec) * 1000 + (request->due.tv_nsec - now.tv_nsec) / 1000000;
+			if (remaining <= 0) {
+				respond(fd, i);
+			} else if (timeout < 0 || remaining < timeout) {
+				timeout = remaining;
+			}
+		}
+
+		struct pollfd pollfd = {
+			.fd = fd,
+			.events = POLLIN
+		};
+		if (poll(&pollfd, 1, timeout) <= 0)
+			continue;
+
+		struct fastcgiHeader header;
+		if (readAll(fd, &header, FCGI_HEADER_LEN) < 0)
+			break;
+
+		size_t length = (header.contentLengthB1 << 8) | header.contentLengthB0;
+		if (readAll(fd, content, length + header.paddingLength) < 0)
+			break;
+
+		handleRecord(fd, &header, content, length);
+	}
+
+	return 0;
+}